@@ -2,6 +2,13 @@
 #include "stm32f10x.h"
 #include "stm32f10x_gpio.h"
 #include "stm32f10x_rcc.h"
+#include "itm-out.h"
+
+// define USE_BINLOG to send the messages as binary log records - run stlink-trace with
+// --elf and --binlog 1 to see the text (see target/binlog.h)
+#ifdef USE_BINLOG
+#include "binlog.h"
+#endif
 
 volatile uint32_t msTicks;                      /* counts 1ms timeTicks       */
 volatile uint32_t msDelayCount;
@@ -18,7 +25,6 @@ void SysTick_Handler(void) {
 	if (msDelayCount > 0) msDelayCount--;
 }
 
-#define ITM_PORT *(volatile unsigned *)0xE0000000
 
 static void msDelay(uint32_t ms) {
 	msDelayCount = ms;
@@ -38,16 +44,10 @@ void GPIO_Configuration()
   GPIO_Init(GPIOB, &GPIO_InitStructure);
 }
 
+// 4 characters per ITM write (see target/itm-out.h)
 void SendMsgViaITM(char* msg)
 {
-  int pos = 0;
-	char ch;
-
-	while (msg[pos] != '\0') {
-		ch = msg[pos++];
-    while (ITM_PORT == 0);       // Wait while Fifo full
-		ITM->PORT[0].u8 = ch;
-	}
+	ItmPrint(0, msg);
 }
 
 int main(void)
@@ -65,13 +65,21 @@ int main(void)
 
   while (1) {
 		GPIO_SetBits(GPIOB , GPIO_Pin_0);
+#ifdef USE_BINLOG
+		BINLOG("Switched the LED on. Counter: %d\n", i);
+#else
 		sprintf(&buffer[0], "Switched the LED on. Counter: %d\n", i);
 		SendMsgViaITM(buffer);
+#endif
 //		msDelay(1);
 
 		GPIO_ResetBits(GPIOB , GPIO_Pin_0);
+#ifdef USE_BINLOG
+		BINLOG("Switched the LED off. Counter: %d\n", i);
+#else
 		sprintf(&buffer[0], "Switched the LED off. Counter: %d\n", i);
 		SendMsgViaITM(buffer);
+#endif
 //    msDelay(1);
     i++;
   }
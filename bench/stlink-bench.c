@@ -0,0 +1,603 @@
+/*
+ * stlink-bench.c
+ *
+ * Benchmarks for the trace decode, per-port demux and output sinks.
+ * Synthetic SWO streams are generated from a fixed seed so every run processes the
+ * same bytes; recorded raw captures (e.g. trace-full.txt) can be added with --input.
+ *
+ * Build:
+ *   gcc -O2 -I. bench/stlink-bench.c itm-decode.c trace-sink.c binlog.c -o stlink-bench
+ *
+ * Usage:
+ *   stlink-bench [--input capture.bin] [--save-baseline bench.json] [--baseline bench.json] [--tolerance 15]
+ *
+ * With --baseline the run fails (exit code 1) if any case is slower than the baseline by more
+ * than the tolerance, or allocates more.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "itm-decode.h"
+#include "trace-sink.h"
+#include "binlog.h"
+
+#define STREAM_SIZE         (8 * 1024 * 1024)
+#define CHUNK_SIZE          2048	// largest trace read in stlink-trace
+#define MIN_BYTES           (64 * 1024 * 1024)
+#define RUNS                3
+#define MAX_STREAMS         16
+#define MAX_RESULTS         128
+#define NAME_LENGTH         128
+
+// allocation counting - the glibc entry points are called directly
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void __libc_free(void* pointer);
+
+static unsigned long long allocations = 0;
+
+void* malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+	allocations++;
+	return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer)
+{
+	__libc_free(pointer);
+}
+
+typedef struct {
+	char name[NAME_LENGTH];
+	unsigned char* data;
+	size_t length;
+} Stream;
+
+typedef struct {
+	char name[NAME_LENGTH];
+	double mbPerSecond;
+	double nsPerByte;
+	double allocationsPerMb;
+} Result;
+
+static Stream streams[MAX_STREAMS];
+static int streamCount = 0;
+static Result results[MAX_RESULTS];
+static int resultCount = 0;
+
+static uint32_t seed = 0x2013CAFE;
+
+static uint32_t Random()
+{
+	// xorshift32
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static unsigned long long GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//============================
+// synthetic streams
+//============================
+
+static Stream* NewStream(const char* name)
+{
+	Stream* stream = &streams[streamCount++];
+	snprintf(stream->name, NAME_LENGTH, "%s", name);
+	stream->data = malloc(STREAM_SIZE + 64);
+	stream->length = 0;
+	return stream;
+}
+
+static void Put(Stream* stream, unsigned char ch)
+{
+	stream->data[stream->length++] = ch;
+}
+
+static void PutStimulus(Stream* stream, int port, int size, uint32_t value)
+{
+	int i;
+
+	Put(stream, (port << 3) | (size == 4 ? 3 : size));
+	for (i = 0; i < size; i++) Put(stream, (value >> (8 * i)) & 0xFF);
+}
+
+static void PutText(Stream* stream, int port, const char* text)
+{
+	while ((*text != '\0') && (stream->length < STREAM_SIZE)) PutStimulus(stream, port, 1, (unsigned char) *text++);
+}
+
+static void PutSync(Stream* stream)
+{
+	int i;
+
+	for (i = 0; i < 5; i++) Put(stream, 0x00);
+	Put(stream, 0x80);
+}
+
+static void PutTimestamp(Stream* stream)
+{
+	if (Random() & 1) {
+		Put(stream, 0x10 * (1 + Random() % 6));		// single byte
+	}
+	else {
+		int bytes = 1 + Random() % 3;
+		Put(stream, 0xC0);
+		while (--bytes > 0) Put(stream, 0x80 | (Random() & 0x7F));
+		Put(stream, Random() & 0x7F);
+	}
+}
+
+// the example firmware output: 1 byte writes of text on port 0
+static void MakeTextStream()
+{
+	Stream* stream = NewStream("text-port0");
+	char line[64];
+	long counter = 0;
+
+	while (stream->length < STREAM_SIZE) {
+		snprintf(line, sizeof(line), "Switched the LED %s. Counter: %ld\n", (counter & 1) ? "off" : "on", counter / 2);
+		PutText(stream, 0, line);
+		counter++;
+	}
+}
+
+// the same text with 4 byte writes, and 2 and 1 byte writes for the tail (target/itm-out.h)
+static void MakeTextWordStream()
+{
+	Stream* stream = NewStream("text-words");
+	char line[64];
+	long counter = 0;
+
+	while (stream->length < STREAM_SIZE - 64) {
+		int length = snprintf(line, sizeof(line), "Switched the LED %s. Counter: %ld\n", (counter & 1) ? "off" : "on", counter / 2);
+		int i;
+		for (i = 0; i + 4 <= length; i += 4) {
+			PutStimulus(stream, 0, 4, (unsigned char) line[i] | ((unsigned char) line[i + 1] << 8) | ((unsigned char) line[i + 2] << 16) | ((uint32_t)(unsigned char) line[i + 3] << 24));
+		}
+		if (length - i >= 2) {
+			PutStimulus(stream, 0, 2, (unsigned char) line[i] | ((unsigned char) line[i + 1] << 8));
+			i += 2;
+		}
+		if (i < length) PutStimulus(stream, 0, 1, (unsigned char) line[i]);
+		counter++;
+	}
+}
+
+// random ports with 1, 2 and 4 byte payloads
+static void MakeMixedStream()
+{
+	Stream* stream = NewStream("mixed-ports");
+	static const int sizes[] = {1, 2, 4, 4};
+
+	while (stream->length < STREAM_SIZE) PutStimulus(stream, Random() % ITM_PORTS, sizes[Random() % 4], Random());
+}
+
+// stimulus packets with local timestamps, and a sync every 4KB
+static void MakeTimestampStream()
+{
+	Stream* stream = NewStream("timestamps");
+	size_t nextSync = 0;
+
+	while (stream->length < STREAM_SIZE) {
+		if (stream->length >= nextSync) {
+			PutSync(stream);
+			nextSync += 4096;
+		}
+		PutStimulus(stream, Random() % 4, 1 << (Random() % 3), Random());
+		PutTimestamp(stream);
+	}
+}
+
+// text with overflow packets and the syncs that follow them
+static void MakeOverflowStream()
+{
+	Stream* stream = NewStream("overflow");
+
+	while (stream->length < STREAM_SIZE) {
+		PutText(stream, 0, "Sensor reading overflowed the FIFO\n");
+		if (Random() % 4 == 0) {
+			Put(stream, 0x70);
+			PutSync(stream);
+		}
+	}
+}
+
+// text interrupted by runs of junk, as seen with the 0xF8xx byte counts
+static void MakeJunkStream()
+{
+	Stream* stream = NewStream("junk");
+
+	while (stream->length < STREAM_SIZE) {
+		PutText(stream, 0, "Switched the LED on. Counter: 1234\n");
+		if (Random() % 8 == 0) {
+			int run = 32 + Random() % 224;
+			while ((run-- > 0) && (stream->length < STREAM_SIZE)) Put(stream, (run & 1) ? 0xF8 : Random() & 0xFF);
+		}
+	}
+}
+
+// binary log messages (target/binlog.h) on port 1, with the format strings of binlogSection
+static const char binlogSection[] =
+		"Switched the LED on. Counter: %d\n\0"
+		"Switched the LED off. Counter: %d\n\0"
+		"ADC %u: %5d mV, %.1f C\n\0"
+		"state %s -> %s at 0x%08x\n\0"
+		"on\0off\0";
+
+static uint32_t BinlogOffset(int index)
+{
+	uint32_t offset = 0;
+
+	while (index-- > 0) offset += strlen(&binlogSection[offset]) + 1;
+	return offset;
+}
+
+static void PutBinlog(Stream* stream, int format, int count, const uint32_t* args)
+{
+	int i;
+
+	PutStimulus(stream, 1, 4, (count << 24) | BinlogOffset(format));
+	for (i = 0; i < count; i++) PutStimulus(stream, 1, 4, args[i]);
+}
+
+static void MakeBinlogStream()
+{
+	Stream* stream = NewStream("binlog-port1");
+	union { float number; uint32_t bits; } temperature;
+	uint32_t counter = 0;
+
+	while (stream->length < STREAM_SIZE - 64) {
+		uint32_t args[3] = {counter, 0, 0};
+		PutBinlog(stream, 0, 1, args);
+		PutBinlog(stream, 1, 1, args);
+		if ((counter & 3) == 0) {
+			temperature.number = 20.0f + (Random() % 100) / 10.0f;
+			args[0] = Random() % 8;
+			args[1] = Random() % 3300;
+			args[2] = temperature.bits;
+			PutBinlog(stream, 2, 3, args);
+		}
+		if ((counter & 15) == 0) {
+			args[0] = BinlogOffset(4);
+			args[1] = BinlogOffset(5);
+			args[2] = Random();
+			PutBinlog(stream, 3, 3, args);
+		}
+		counter++;
+	}
+}
+
+static int LoadStream(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	const char* name = strrchr(filename, '/');
+
+	if (file == NULL) {
+		printf("Unable to open %s\n", filename);
+		return -1;
+	}
+
+	Stream* stream = &streams[streamCount++];
+	snprintf(stream->name, NAME_LENGTH, "recorded-%s", (name != NULL) ? name + 1 : filename);
+	stream->data = malloc(STREAM_SIZE);
+	stream->length = fread(stream->data, 1, STREAM_SIZE, file);
+	fclose(file);
+
+	if (stream->length == 0) {
+		printf("%s is empty\n", filename);
+		return -1;
+	}
+	return 0;
+}
+
+//============================
+// pipelines
+//============================
+
+static unsigned long long recordCount = 0;
+
+static void CountRecord(void* context, const ItmRecord* record)
+{
+	recordCount++;
+}
+
+typedef struct {
+	const char* name;
+	void (*setup)();
+	void (*run)(const unsigned char* data, size_t length);
+	void (*teardown)();
+} Pipeline;
+
+static ItmDecoder decoder;
+static TraceDemux demux;
+static TraceSink allSink;
+static TraceSink screenSink;
+static TraceSink portSinks[4];
+static FILE* outputFile = NULL;
+static Binlog binlog;
+
+static void SetupDecode()
+{
+	ItmDecoderInit(&decoder, CountRecord, NULL);
+}
+
+static void SetupDemux()
+{
+	int port;
+
+	memset(&demux, 0, sizeof(demux));
+	NullSinkOpen(&allSink);
+	demux.all = &allSink;
+	for (port = 0; port < 4; port++) {
+		NullSinkOpen(&portSinks[port]);
+		demux.ports[port] = &portSinks[port];
+	}
+	ItmDecoderInit(&decoder, TraceDemuxRecord, &demux);
+}
+
+static void SetupFileSink()
+{
+	memset(&demux, 0, sizeof(demux));
+	outputFile = tmpfile();
+	StreamSinkOpen(&allSink, outputFile, 0);
+	demux.all = &allSink;
+	ItmDecoderInit(&decoder, TraceDemuxRecord, &demux);
+}
+
+static void SetupScreenSink()
+{
+	memset(&demux, 0, sizeof(demux));
+	outputFile = fopen("/dev/null", "w");
+	StreamSinkOpen(&screenSink, outputFile, 1);
+	demux.screen = &screenSink;
+	ItmDecoderInit(&decoder, TraceDemuxRecord, &demux);
+}
+
+static void SetupRawSink()
+{
+	outputFile = tmpfile();
+	StreamSinkOpen(&allSink, outputFile, 0);
+}
+
+static void BinlogTap(void* context, int port, const unsigned char* data, size_t length)
+{
+	if (port == binlog.port) BinlogDecode(&binlog, data, length);
+}
+
+static void SetupBinlog()
+{
+	memset(&demux, 0, sizeof(demux));
+	NullSinkOpen(&allSink);
+	demux.all = &allSink;
+	demux.tap = BinlogTap;
+	demux.binaryPorts = 1U << 1;
+	if (binlog.formatIndex == NULL) BinlogOpen(&binlog, 1, (const unsigned char*)binlogSection, sizeof(binlogSection), 0, &demux);
+	binlog.wordCount = 0;
+	binlog.partialLength = 0;
+	ItmDecoderInit(&decoder, TraceDemuxRecord, &demux);
+}
+
+static void RunDecode(const unsigned char* data, size_t length)
+{
+	ItmDecode(&decoder, data, length);
+}
+
+static void RunDecodeFlush(const unsigned char* data, size_t length)
+{
+	ItmDecode(&decoder, data, length);
+	TraceDemuxFlush(&demux);
+}
+
+static void RunRawSink(const unsigned char* data, size_t length)
+{
+	allSink.write(&allSink, data, length);
+	allSink.flush(&allSink);
+}
+
+static void TeardownFile()
+{
+	if (outputFile != NULL) fclose(outputFile);
+	outputFile = NULL;
+}
+
+static void TeardownNone()
+{
+}
+
+static const Pipeline pipelines[] = {
+	{"decode",      SetupDecode,     RunDecode,      TeardownNone},
+	{"demux",       SetupDemux,      RunDecodeFlush, TeardownNone},
+	{"sink-file",   SetupFileSink,   RunDecodeFlush, TeardownFile},
+	{"sink-screen", SetupScreenSink, RunDecodeFlush, TeardownFile},
+	{"sink-raw",    SetupRawSink,    RunRawSink,     TeardownFile},
+	{"binlog",      SetupBinlog,     RunDecodeFlush, TeardownNone},
+};
+
+/*
+ * Best of RUNS runs, each passing at least MIN_BYTES through the pipeline in trace read sized chunks
+ */
+static void RunCase(const Pipeline* pipeline, const Stream* stream)
+{
+	double bestNsPerByte = 0;
+	double bestAllocations = 0;
+	int run;
+
+	for (run = 0; run < RUNS; run++) {
+		size_t processed = 0;
+
+		pipeline->setup();
+		unsigned long long startAllocations = allocations;
+		unsigned long long start = GetTimeNs();
+
+		while (processed < MIN_BYTES) {
+			size_t pos;
+			for (pos = 0; pos < stream->length; pos += CHUNK_SIZE) {
+				size_t length = (stream->length - pos < CHUNK_SIZE) ? stream->length - pos : CHUNK_SIZE;
+				pipeline->run(&stream->data[pos], length);
+			}
+			processed += stream->length;
+		}
+
+		double nsPerByte = (double)(GetTimeNs() - start) / processed;
+		double allocationsPerMb = (allocations - startAllocations) / (processed / 1e6);
+		pipeline->teardown();
+
+		if ((run == 0) || (nsPerByte < bestNsPerByte)) bestNsPerByte = nsPerByte;
+		if ((run == 0) || (allocationsPerMb < bestAllocations)) bestAllocations = allocationsPerMb;
+	}
+
+	Result* result = &results[resultCount++];
+	snprintf(result->name, NAME_LENGTH, "%.15s/%.100s", pipeline->name, stream->name);
+	result->nsPerByte = bestNsPerByte;
+	result->mbPerSecond = 1e3 / bestNsPerByte;
+	result->allocationsPerMb = bestAllocations;
+	printf("%-40s %10.1f MB/s %8.3f ns/byte %8.2f allocs/MB\n", result->name, result->mbPerSecond, result->nsPerByte, result->allocationsPerMb);
+}
+
+//============================
+// baseline
+//============================
+
+static int SaveBaseline(const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	int i;
+
+	if (file == NULL) {
+		printf("Unable to write %s\n", filename);
+		return -1;
+	}
+
+	fprintf(file, "{\n\"cases\": [\n");
+	for (i = 0; i < resultCount; i++) {
+		fprintf(file, "{\"name\": \"%s\", \"mb_per_s\": %.3f, \"ns_per_byte\": %.4f, \"allocs_per_mb\": %.3f}%s\n", results[i].name,
+				results[i].mbPerSecond, results[i].nsPerByte, results[i].allocationsPerMb, (i + 1 < resultCount) ? "," : "");
+	}
+	fprintf(file, "]\n}\n");
+	fclose(file);
+	return 0;
+}
+
+/*
+ * Returns the number of cases that regressed against the baseline
+ */
+static int CompareBaseline(const char* filename, double tolerance)
+{
+	FILE* file = fopen(filename, "r");
+	char line[512];
+	int regressions = 0;
+	int i;
+
+	if (file == NULL) {
+		printf("Unable to read baseline %s\n", filename);
+		return 1;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		Result baseline;
+		if (sscanf(line, " {\"name\": \"%127[^\"]\", \"mb_per_s\": %lf, \"ns_per_byte\": %lf, \"allocs_per_mb\": %lf",
+				baseline.name, &baseline.mbPerSecond, &baseline.nsPerByte, &baseline.allocationsPerMb) != 4) continue;
+
+		for (i = 0; i < resultCount; i++) {
+			if (strcmp(results[i].name, baseline.name) != 0) continue;
+
+			if (results[i].mbPerSecond < baseline.mbPerSecond * (1.0 - tolerance / 100.0)) {
+				printf("REGRESSION %s: %.1f MB/s, baseline %.1f MB/s\n", baseline.name, results[i].mbPerSecond, baseline.mbPerSecond);
+				regressions++;
+			}
+			if (results[i].allocationsPerMb > baseline.allocationsPerMb * 1.1 + 0.01) {
+				printf("REGRESSION %s: %.2f allocs/MB, baseline %.2f allocs/MB\n", baseline.name, results[i].allocationsPerMb, baseline.allocationsPerMb);
+				regressions++;
+			}
+		}
+	}
+
+	fclose(file);
+	return regressions;
+}
+
+static struct option longOptions[] = {
+	{"input",         required_argument, 0, 'i'},
+	{"save-baseline", required_argument, 0, 's'},
+	{"baseline",      required_argument, 0, 'b'},
+	{"tolerance",     required_argument, 0, 't'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char** argv)
+{
+	char* saveFilename = NULL;
+	char* baselineFilename = NULL;
+	double tolerance = 15;
+	int opt, s;
+	size_t p;
+
+	MakeTextStream();
+	MakeTextWordStream();
+	MakeMixedStream();
+	MakeTimestampStream();
+	MakeOverflowStream();
+	MakeJunkStream();
+	MakeBinlogStream();
+
+	while ((opt = getopt_long(argc, argv, "i:s:b:t:", longOptions, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			if ((streamCount >= MAX_STREAMS) || (LoadStream(optarg) != 0)) return 2;
+			break;
+		case 's':
+			saveFilename = optarg;
+			break;
+		case 'b':
+			baselineFilename = optarg;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		default:
+			return 2;
+		}
+	}
+
+	for (p = 0; p < sizeof(pipelines) / sizeof(pipelines[0]); p++) {
+		for (s = 0; s < streamCount; s++) RunCase(&pipelines[p], &streams[s]);
+	}
+
+	if ((saveFilename != NULL) && (SaveBaseline(saveFilename) != 0)) return 2;
+
+	if (baselineFilename != NULL) {
+		int regressions = CompareBaseline(baselineFilename, tolerance);
+		if (regressions > 0) {
+			printf("%d regression(s) against %s\n", regressions, baselineFilename);
+			return 1;
+		}
+		printf("No regressions against %s\n", baselineFilename);
+	}
+
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * binlog.c
+ *
+ * Binary log expansion (see binlog.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binlog.h"
+
+#define BINLOG_TYPE_NONE        0
+#define BINLOG_TYPE_SIGNED      1	// d i
+#define BINLOG_TYPE_UNSIGNED    2	// u
+#define BINLOG_TYPE_HEX         3	// x
+#define BINLOG_TYPE_HEX_UPPER   4	// X
+#define BINLOG_TYPE_OCTAL       5	// o
+#define BINLOG_TYPE_CHAR        6	// c
+#define BINLOG_TYPE_STRING      7	// s - address of a string in the section
+#define BINLOG_TYPE_FLOAT       8	// f F e E g G - bits of a float
+#define BINLOG_TYPE_POINTER     9	// p
+#define BINLOG_TYPE_WIDE        0x80	// ll - two argument words
+
+static const char lowerDigits[] = "0123456789abcdef";
+static const char upperDigits[] = "0123456789ABCDEF";
+
+/*
+ * Parse the conversion at text ('%') into segment - returns its length, 0 if not supported
+ */
+static int ParseConversion(const char* text, BinlogSegment* segment)
+{
+	const char* pos = text + 1;
+	int simple = 1, wide = 0, type;
+
+	while ((*pos != '\0') && (strchr("-+ #0", *pos) != NULL)) {
+		pos++;
+		simple = 0;
+	}
+	while ((*pos >= '0') && (*pos <= '9')) {
+		pos++;
+		simple = 0;
+	}
+	if (*pos == '.') {
+		pos++;
+		simple = 0;
+		while ((*pos >= '0') && (*pos <= '9')) pos++;
+	}
+
+	// length modifiers - the arguments are 32 bits unless ll or j
+	const char* modifier = pos;
+	while ((*pos != '\0') && (strchr("hlLzjt", *pos) != NULL)) pos++;
+	if (((pos - modifier == 2) && (modifier[0] == 'l') && (modifier[1] == 'l')) || ((pos - modifier == 1) && (*modifier == 'j'))) wide = 1;
+
+	switch (*pos) {
+	case 'd':
+	case 'i': type = BINLOG_TYPE_SIGNED; break;
+	case 'u': type = BINLOG_TYPE_UNSIGNED; break;
+	case 'x': type = BINLOG_TYPE_HEX; break;
+	case 'X': type = BINLOG_TYPE_HEX_UPPER; break;
+	case 'o': type = BINLOG_TYPE_OCTAL; break;
+	case 'c': type = BINLOG_TYPE_CHAR; break;
+	case 's': type = BINLOG_TYPE_STRING; break;
+	case 'p': type = BINLOG_TYPE_POINTER; break;
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G': type = BINLOG_TYPE_FLOAT; break;
+	default: return 0;
+	}
+	if (wide && (type > BINLOG_TYPE_OCTAL)) return 0;
+
+	// the printf conversion used for anything that is not simple
+	size_t length = modifier - text;
+	if (length + 4 > BINLOG_SPEC_SIZE) return 0;
+	memcpy(segment->spec, text, length);
+	if (wide) {
+		memcpy(&segment->spec[length], "ll", 2);
+		length += 2;
+	}
+	segment->spec[length++] = *pos;
+	segment->spec[length] = '\0';
+
+	segment->type = type | (wide ? BINLOG_TYPE_WIDE : 0);
+	segment->simple = simple;
+	return pos + 1 - text;
+}
+
+static BinlogSegment* NewSegment(Binlog* binlog)
+{
+	if (binlog->segmentCount == binlog->segmentCapacity) {
+		binlog->segmentCapacity = binlog->segmentCapacity ? binlog->segmentCapacity * 2 : 256;
+		binlog->segments = realloc(binlog->segments, binlog->segmentCapacity * sizeof(BinlogSegment));
+		if (binlog->segments == NULL) return NULL;
+	}
+	BinlogSegment* segment = &binlog->segments[binlog->segmentCount++];
+	memset(segment, 0, sizeof(BinlogSegment));
+	return segment;
+}
+
+/*
+ * Split the format string at offset start into literal text and conversions
+ */
+static int ParseFormat(Binlog* binlog, uint32_t start)
+{
+	const char* text = &binlog->section[start];
+	uint32_t pos = 0;
+	int words = 0;
+
+	if (binlog->formatCount == binlog->formatCapacity) {
+		binlog->formatCapacity = binlog->formatCapacity ? binlog->formatCapacity * 2 : 64;
+		binlog->formats = realloc(binlog->formats, binlog->formatCapacity * sizeof(BinlogFormat));
+		if (binlog->formats == NULL) return -1;
+	}
+	BinlogFormat* format = &binlog->formats[binlog->formatCount];
+	format->firstSegment = binlog->segmentCount;
+
+	while (text[pos] != '\0') {
+		BinlogSegment* segment = NewSegment(binlog);
+		uint32_t begin = pos;
+		int conversion = 0;
+
+		if (segment == NULL) return -1;
+		while (text[pos] != '\0') {
+			if (text[pos] == '%') {
+				if (text[pos + 1] == '%') {
+					pos++;		// literal text up to and including the first %
+					break;
+				}
+				conversion = ParseConversion(&text[pos], segment);
+				if (conversion > 0) break;
+			}
+			pos++;
+		}
+
+		segment->literal = start + begin;
+		segment->literalLength = pos - begin;
+		if (conversion > 0) {
+			pos += conversion;
+			words += (segment->type & BINLOG_TYPE_WIDE) ? 2 : 1;
+		}
+		else if (text[pos] == '%') {
+			pos++;
+		}
+	}
+
+	format->segmentCount = binlog->segmentCount - format->firstSegment;
+	format->words = (words > BINLOG_MAX_WORDS) ? 0xFF : words;
+	binlog->formatIndex[start] = binlog->formatCount++;
+	return 0;
+}
+
+static size_t FormatUnsigned(char* out, uint64_t value, unsigned int base, const char* digits)
+{
+	char buffer[24];
+	size_t count = 0, index;
+
+	do {
+		buffer[count++] = digits[value % base];
+		value /= base;
+	} while (value != 0);
+
+	for (index = 0; index < count; index++) out[index] = buffer[count - 1 - index];
+	return count;
+}
+
+/*
+ * The string a %s argument points to, NULL if it is not in the section
+ */
+static const char* SectionString(Binlog* binlog, uint32_t address)
+{
+	uint32_t offset = address - binlog->sectionAddress;
+
+	if ((offset >= binlog->sectionSize) || (memchr(&binlog->section[offset], '\0', binlog->sectionSize - offset) == NULL)) return NULL;
+	return &binlog->section[offset];
+}
+
+static void Write(Binlog* binlog, const char* text, size_t length)
+{
+	TraceDemux* demux = binlog->demux;
+
+	if (demux->all != NULL) demux->all->write(demux->all, (const unsigned char*)text, length);
+	if (demux->screen != NULL) demux->screen->write(demux->screen, (const unsigned char*)text, length);
+}
+
+static void Expand(Binlog* binlog, const BinlogFormat* format, const uint32_t* args)
+{
+	char line[BINLOG_LINE_SIZE];
+	size_t length = 0;
+	int index;
+
+	for (index = 0; index < format->segmentCount; index++) {
+		const BinlogSegment* segment = &binlog->segments[format->firstSegment + index];
+		size_t room = sizeof(line) - length;
+		size_t literal = (segment->literalLength < room) ? segment->literalLength : room;
+
+		memcpy(&line[length], &binlog->section[segment->literal], literal);
+		length += literal;
+		if (segment->type == BINLOG_TYPE_NONE) continue;
+
+		uint64_t value = *args++;
+		if (segment->type & BINLOG_TYPE_WIDE) value |= (uint64_t)(*args++) << 32;
+
+		// room for any number without flags or width
+		room = sizeof(line) - length;
+		if (room < 32) break;
+
+		int type = segment->type & ~BINLOG_TYPE_WIDE;
+		int wide = segment->type & BINLOG_TYPE_WIDE;
+		int written = 0;
+		if (segment->simple && (type <= BINLOG_TYPE_OCTAL)) {
+			if (type == BINLOG_TYPE_SIGNED) {
+				int64_t number = wide ? (int64_t)value : (int64_t)(int32_t)value;
+				if (number < 0) {
+					line[length++] = '-';
+					value = -(uint64_t)number;
+				}
+				else {
+					value = number;
+				}
+			}
+			unsigned int base = (type == BINLOG_TYPE_OCTAL) ? 8 : ((type >= BINLOG_TYPE_HEX) ? 16 : 10);
+			length += FormatUnsigned(&line[length], value, base, (type == BINLOG_TYPE_HEX_UPPER) ? upperDigits : lowerDigits);
+			continue;
+		}
+
+		switch (type) {
+		case BINLOG_TYPE_SIGNED:
+			written = wide ? snprintf(&line[length], room, segment->spec, (long long)value) : snprintf(&line[length], room, segment->spec, (int32_t)value);
+			break;
+		case BINLOG_TYPE_UNSIGNED:
+		case BINLOG_TYPE_HEX:
+		case BINLOG_TYPE_HEX_UPPER:
+		case BINLOG_TYPE_OCTAL:
+			written = wide ? snprintf(&line[length], room, segment->spec, (unsigned long long)value) : snprintf(&line[length], room, segment->spec, (uint32_t)value);
+			break;
+		case BINLOG_TYPE_CHAR:
+			written = snprintf(&line[length], room, segment->spec, (int)(value & 0xFF));
+			break;
+		case BINLOG_TYPE_STRING: {
+			const char* string = SectionString(binlog, value);
+			if (string != NULL) written = snprintf(&line[length], room, segment->spec, string);
+			else written = snprintf(&line[length], room, "(0x%08x)", (uint32_t)value);
+			break;
+		}
+		case BINLOG_TYPE_FLOAT: {
+			union { uint32_t bits; float number; } converted;
+			converted.bits = value;
+			written = snprintf(&line[length], room, segment->spec, (double)converted.number);
+			break;
+		}
+		case BINLOG_TYPE_POINTER:
+			written = snprintf(&line[length], room, "0x%08x", (uint32_t)value);
+			break;
+		}
+		length += ((size_t)written < room) ? (size_t)written : room - 1;
+	}
+
+	Write(binlog, line, length);
+}
+
+static void Message(Binlog* binlog)
+{
+	uint32_t offset = (binlog->words[0] - binlog->sectionAddress) & 0x00FFFFFF;
+	int words = binlog->expected - 1;
+
+	binlog->messages++;
+	if ((offset < binlog->sectionSize) && (binlog->formatIndex[offset] >= 0)) {
+		const BinlogFormat* format = &binlog->formats[binlog->formatIndex[offset]];
+		if (format->words == words) {
+			Expand(binlog, format, &binlog->words[1]);
+			return;
+		}
+	}
+
+	char text[64];
+	int length = snprintf(text, sizeof(text), "[binlog: unknown format 0x%06x, %d words]\n", offset, words);
+	binlog->unknown++;
+	Write(binlog, text, length);
+}
+
+int BinlogOpen(Binlog* binlog, int port, const unsigned char* section, uint32_t size, uint32_t address, TraceDemux* demux)
+{
+	uint32_t offset = 0;
+
+	memset(binlog, 0, sizeof(Binlog));
+	binlog->port = port;
+	binlog->demux = demux;
+	binlog->section = (const char*)section;
+	binlog->sectionSize = size;
+	binlog->sectionAddress = address;
+	binlog->formatIndex = malloc((size + 1) * sizeof(int32_t));
+	if (binlog->formatIndex == NULL) return -1;
+	memset(binlog->formatIndex, 0xFF, (size + 1) * sizeof(int32_t));
+
+	// every NUL terminated string in the section is a format
+	while (offset < size) {
+		const char* end = memchr(&binlog->section[offset], '\0', size - offset);
+		if (end == NULL) break;
+		if (end != &binlog->section[offset]) {
+			if (ParseFormat(binlog, offset) != 0) {
+				printf("Out of memory parsing the binlog formats\n");
+				BinlogClose(binlog);
+				return -1;
+			}
+		}
+		offset = end + 1 - binlog->section;
+	}
+
+	printf("Binlog on port %d: %d format strings\n", port, binlog->formatCount);
+	return 0;
+}
+
+/*
+ * Demux tap data of the binlog port - the target writes whole words, but the bytes are
+ * collected in case a packet is split
+ */
+void BinlogDecode(Binlog* binlog, const unsigned char* data, size_t length)
+{
+	while (length-- > 0) {
+		binlog->partial[binlog->partialLength++] = *data++;
+		if (binlog->partialLength < 4) continue;
+		binlog->partialLength = 0;
+
+		uint32_t word = binlog->partial[0] | (binlog->partial[1] << 8) | (binlog->partial[2] << 16) | ((uint32_t)binlog->partial[3] << 24);
+		if (binlog->wordCount == 0) {
+			binlog->expected = 1 + (word >> 24);
+			if (binlog->expected > BINLOG_MAX_WORDS + 1) {
+				// not a header - try the next word
+				binlog->unknown++;
+				continue;
+			}
+		}
+		binlog->words[binlog->wordCount++] = word;
+		if (binlog->wordCount == binlog->expected) {
+			Message(binlog);
+			binlog->wordCount = 0;
+		}
+	}
+}
+
+void BinlogClose(Binlog* binlog)
+{
+	if (binlog->formatIndex == NULL) return;
+
+	printf("Binlog: %llu messages, %llu unknown\n", binlog->messages, binlog->unknown);
+	free(binlog->formatIndex);
+	free(binlog->formats);
+	free(binlog->segments);
+	binlog->formatIndex = NULL;
+	binlog->formats = NULL;
+	binlog->segments = NULL;
+}
@@ -0,0 +1,72 @@
+/*
+ * binlog.h
+ *
+ * Binary logging (--binlog): the target sends the address of a format string and the raw
+ * arguments instead of the formatted text (see target/binlog.h), and the text is built here
+ * from the format strings in the .binlog section of the ELF file.
+ *
+ * Each message is a sequence of 32-bit words on one stimulus port:
+ *   argument words << 24 | format address (low 24 bits), then the argument words
+ * Arguments are one word each, two for %ll conversions (low word first). %f/%e/%g take
+ * the bits of a float and %s the address of a string in the .binlog section.
+ *
+ * All the format strings are parsed when the section is loaded into lists of literal text
+ * and conversions, indexed by their offset in the section, so expanding a message is a
+ * table lookup and a few copies - integer conversions without flags or width do not go
+ * through snprintf.
+ */
+
+#ifndef BINLOG_H_
+#define BINLOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "trace-sink.h"
+
+#define BINLOG_SECTION          ".binlog"
+#define BINLOG_MAX_WORDS        32
+#define BINLOG_LINE_SIZE        1024
+#define BINLOG_SPEC_SIZE        16
+
+typedef struct {
+	uint32_t literal;			// offset of the text before the conversion
+	uint32_t literalLength;
+	uint8_t type;				// BINLOG_TYPE_... in binlog.c, 0 = no conversion
+	uint8_t simple;				// no flags, width or precision
+	char spec[BINLOG_SPEC_SIZE];	// printf conversion for the others
+} BinlogSegment;
+
+typedef struct {
+	uint32_t firstSegment;
+	uint16_t segmentCount;
+	uint8_t words;				// argument words
+} BinlogFormat;
+
+typedef struct {
+	int port;
+	TraceDemux* demux;			// the text goes to its all and screen outputs
+	const char* section;
+	uint32_t sectionSize;
+	uint32_t sectionAddress;
+	int32_t* formatIndex;		// per section offset, -1 if no format string starts there
+	BinlogFormat* formats;
+	int formatCount;
+	int formatCapacity;
+	BinlogSegment* segments;
+	int segmentCount;
+	int segmentCapacity;
+	// message being received
+	uint32_t words[BINLOG_MAX_WORDS + 1];
+	int wordCount;
+	int expected;				// words of the message, 0 while waiting for a header
+	unsigned char partial[4];
+	int partialLength;
+	unsigned long long messages;
+	unsigned long long unknown;	// headers not matching a format string
+} Binlog;
+
+int BinlogOpen(Binlog* binlog, int port, const unsigned char* section, uint32_t size, uint32_t address, TraceDemux* demux);
+void BinlogDecode(Binlog* binlog, const unsigned char* data, size_t length);
+void BinlogClose(Binlog* binlog);
+
+#endif /* BINLOG_H_ */
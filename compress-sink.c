@@ -0,0 +1,228 @@
+/*
+ * compress-sink.c
+ *
+ * LZ4 compressed trace output (see compress-sink.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "compress-sink.h"
+#include "lz4-frame.h"
+
+typedef struct {
+	FILE* file;
+	char filename[256];
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		// a block was queued, or stopping
+	pthread_cond_t freed;		// the compressor finished a block
+	size_t blockSize;
+	unsigned char* blocks[COMPRESS_BLOCKS];
+	size_t lengths[COMPRESS_BLOCKS];
+	unsigned char* frame;		// used by the compressor thread only
+	uint32_t* hashTable;
+	int head;					// oldest queued block
+	int count;					// queued blocks
+	int filling;				// block being filled by the capture thread
+	int stopping;
+	unsigned long long lastQueued;
+	unsigned long long nextReport;
+	// updated by the compressor thread under lock
+	unsigned long long inBytes;
+	unsigned long long outBytes;
+	unsigned long long compressNs;
+	unsigned long long frames;
+	unsigned long long stalls;	// times the capture thread waited for a free block
+} Compressor;
+
+static unsigned long long GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void* CompressThread(void* argument)
+{
+	Compressor* compressor = argument;
+	unsigned char* frame = compressor->frame;
+	uint32_t* hashTable = compressor->hashTable;
+
+	pthread_mutex_lock(&compressor->lock);
+	while (1) {
+		while ((compressor->count == 0) && !compressor->stopping) pthread_cond_wait(&compressor->queued, &compressor->lock);
+		if (compressor->count == 0) break;
+
+		int index = compressor->head;
+		pthread_mutex_unlock(&compressor->lock);
+
+		// the block is not touched by the capture thread until it is freed below
+		unsigned long long start = GetTimeNs();
+		size_t length = Lz4WriteFrame(compressor->blocks[index], compressor->lengths[index], frame, hashTable);
+		unsigned long long elapsed = GetTimeNs() - start;
+		fwrite(frame, 1, length, compressor->file);
+		fflush(compressor->file);
+
+		pthread_mutex_lock(&compressor->lock);
+		compressor->inBytes += compressor->lengths[index];
+		compressor->outBytes += length;
+		compressor->compressNs += elapsed;
+		compressor->frames++;
+		compressor->head = (compressor->head + 1) % COMPRESS_BLOCKS;
+		compressor->count--;
+		pthread_cond_signal(&compressor->freed);
+	}
+	pthread_mutex_unlock(&compressor->lock);
+	return NULL;
+}
+
+/*
+ * Queue the block being filled and wait for a free one if the compressor is behind
+ */
+static void QueueBlock(Compressor* compressor)
+{
+	pthread_mutex_lock(&compressor->lock);
+	compressor->count++;
+	pthread_cond_signal(&compressor->queued);
+	if (compressor->count == COMPRESS_BLOCKS) compressor->stalls++;
+	while (compressor->count == COMPRESS_BLOCKS) pthread_cond_wait(&compressor->freed, &compressor->lock);
+	compressor->filling = (compressor->head + compressor->count) % COMPRESS_BLOCKS;
+	pthread_mutex_unlock(&compressor->lock);
+
+	compressor->lengths[compressor->filling] = 0;
+	compressor->lastQueued = GetTimeNs();
+}
+
+static void Report(Compressor* compressor, const char* label)
+{
+	pthread_mutex_lock(&compressor->lock);
+	unsigned long long in = compressor->inBytes, out = compressor->outBytes, ns = compressor->compressNs;
+	unsigned long long frames = compressor->frames, stalls = compressor->stalls;
+	pthread_mutex_unlock(&compressor->lock);
+
+	printf("%s %s: %llu bytes in, %llu bytes out, ratio %.2f, %.1f MB/s, %llu frames, %llu stalls\n", compressor->filename, label,
+			in, out, out ? (double)in / out : 0.0, ns ? in * 1e3 / ns : 0.0, frames, stalls);
+}
+
+static void CompressWrite(TraceSink* sink, const unsigned char* data, size_t length)
+{
+	Compressor* compressor = sink->context;
+
+	while (length > 0) {
+		int index = compressor->filling;
+		size_t chunk = compressor->blockSize - compressor->lengths[index];
+		if (chunk > length) chunk = length;
+
+		memcpy(&compressor->blocks[index][compressor->lengths[index]], data, chunk);
+		compressor->lengths[index] += chunk;
+		data += chunk;
+		length -= chunk;
+
+		if (compressor->lengths[index] == compressor->blockSize) QueueBlock(compressor);
+	}
+}
+
+/*
+ * Called after every trace read - only queues a partial block once it is COMPRESS_FLUSH_MS old
+ */
+static void CompressFlush(TraceSink* sink)
+{
+	Compressor* compressor = sink->context;
+	unsigned long long now = GetTimeNs();
+
+	if ((compressor->lengths[compressor->filling] > 0) && (now - compressor->lastQueued >= COMPRESS_FLUSH_MS * 1000000ULL)) {
+		QueueBlock(compressor);
+	}
+
+	if (now >= compressor->nextReport) {
+		if (compressor->nextReport != 0) Report(compressor, "compressed");
+		compressor->nextReport = now + COMPRESS_REPORT_MS * 1000000ULL;
+	}
+}
+
+static void FreeCompressor(Compressor* compressor)
+{
+	int index;
+
+	if (compressor->file != NULL) fclose(compressor->file);
+	for (index = 0; index < COMPRESS_BLOCKS; index++) free(compressor->blocks[index]);
+	free(compressor->frame);
+	free(compressor->hashTable);
+	free(compressor);
+}
+
+static void CompressClose(TraceSink* sink)
+{
+	Compressor* compressor = sink->context;
+
+	if (compressor->lengths[compressor->filling] > 0) QueueBlock(compressor);
+
+	pthread_mutex_lock(&compressor->lock);
+	compressor->stopping = 1;
+	pthread_cond_signal(&compressor->queued);
+	pthread_mutex_unlock(&compressor->lock);
+	pthread_join(compressor->thread, NULL);
+
+	Report(compressor, "closed");
+	pthread_mutex_destroy(&compressor->lock);
+	pthread_cond_destroy(&compressor->queued);
+	pthread_cond_destroy(&compressor->freed);
+	FreeCompressor(compressor);
+	sink->context = NULL;
+}
+
+int CompressSinkOpen(TraceSink* sink, const char* filename, size_t blockSize)
+{
+	Compressor* compressor = calloc(1, sizeof(Compressor));
+	int index;
+
+	if (compressor == NULL) return -1;
+	if ((blockSize == 0) || (blockSize > LZ4_MAX_BLOCK_SIZE)) blockSize = COMPRESS_BLOCK_SIZE;
+
+	compressor->file = fopen(filename, "wb");
+	if (compressor->file == NULL) {
+		printf("Unable to open %s\n", filename);
+		free(compressor);
+		return -1;
+	}
+
+	snprintf(compressor->filename, sizeof(compressor->filename), "%s", filename);
+	compressor->blockSize = blockSize;
+	for (index = 0; index < COMPRESS_BLOCKS; index++) {
+		compressor->blocks[index] = malloc(blockSize);
+		if (compressor->blocks[index] == NULL) break;
+	}
+	compressor->frame = malloc(LZ4_FRAME_BOUND(blockSize));
+	compressor->hashTable = malloc(LZ4_HASH_SIZE * sizeof(uint32_t));
+	if ((index < COMPRESS_BLOCKS) || (compressor->frame == NULL) || (compressor->hashTable == NULL)) {
+		printf("Out of memory for the compressor of %s\n", filename);
+		FreeCompressor(compressor);
+		return -1;
+	}
+	compressor->lastQueued = GetTimeNs();
+	pthread_mutex_init(&compressor->lock, NULL);
+	pthread_cond_init(&compressor->queued, NULL);
+	pthread_cond_init(&compressor->freed, NULL);
+
+	if (pthread_create(&compressor->thread, NULL, CompressThread, compressor) != 0) {
+		printf("Unable to start the compressor for %s\n", filename);
+		pthread_mutex_destroy(&compressor->lock);
+		pthread_cond_destroy(&compressor->queued);
+		pthread_cond_destroy(&compressor->freed);
+		FreeCompressor(compressor);
+		return -1;
+	}
+
+	sink->write = CompressWrite;
+	sink->flush = CompressFlush;
+	sink->close = CompressClose;
+	sink->file = NULL;
+	sink->printable = 0;
+	sink->length = 0;
+	sink->context = compressor;
+	return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * compress-sink.h
+ *
+ * Trace sink writing LZ4 frames (see lz4-frame.h), compressed in a background thread.
+ *
+ * Data is collected into blocks of blockSize bytes; full blocks are queued for the
+ * compressor thread, which writes each one as an independent frame. A partly filled
+ * block is queued after COMPRESS_FLUSH_MS so that at most that much trace is held back.
+ * The capture thread only waits if all COMPRESS_BLOCKS blocks are queued.
+ */
+
+#ifndef COMPRESS_SINK_H_
+#define COMPRESS_SINK_H_
+
+#include <stddef.h>
+#include "trace-sink.h"
+
+#define COMPRESS_BLOCK_SIZE     (256 * 1024)
+#define COMPRESS_BLOCKS         4
+#define COMPRESS_FLUSH_MS       1000
+#define COMPRESS_REPORT_MS      60000
+#define COMPRESS_EXTENSION      ".lz4"
+
+int CompressSinkOpen(TraceSink* sink, const char* filename, size_t blockSize);
+
+#endif /* COMPRESS_SINK_H_ */
@@ -0,0 +1,476 @@
+/*
+ * stlink-decode.c
+ *
+ * Offline decoder for raw SWO captures (trace-full.txt, or trace-full.txt.lz4 written with
+ * --compress), decoding in parallel on all cores.
+ *
+ * Build:
+ *   gcc -O2 -I. decode/stlink-decode.c itm-decode.c trace-sink.c lz4-frame.c -lpthread -o stlink-decode
+ *
+ * Usage:
+ *   stlink-decode [--threads N] [--chunk-size BYTES] [--port-file PORT:FILE] [--serial] capture [output]
+ *
+ * The stimulus port payloads are written to output (stdout by default) as stlink-trace
+ * writes trace.txt, and to the port files.
+ *
+ * The capture is read in batches of a few chunks per thread. Each batch is split into chunks
+ * that start just after an ITM synchronisation packet, where the decoder is between packets,
+ * and the chunks are decoded at the same time, each with a fresh decoder and into its own
+ * buffers. Idle threads take the next undecoded chunk. The threads are started once and wait
+ * for each batch. The buffers are then written out in order. A chunk is only used if the
+ * decoder of the chunk before it ended between packets. That is not certain: a packet cut
+ * short by bytes lost in the probe takes the zeros of the sync after it as payload, and a
+ * chunk without any sync ends where the batch ends. Then the chunk is decoded again,
+ * serially, continuing from the state of the chunk before. The output is the same as a
+ * serial decode (--serial), which also gives the reference speed.
+ *
+ * LZ4 input is read a block at a time, so frames of any size work, including those of the
+ * lz4 tool (lz4 capture.txt). Its checksums are not checked, and frames with linked blocks
+ * (lz4 -BD) or a dictionary are not supported - decoding stops there with a message.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <getopt.h>
+#include "itm-decode.h"
+#include "trace-sink.h"
+#include "lz4-frame.h"
+
+#define CHUNK_SIZE          (4 * 1024 * 1024)
+#define CHUNKS_PER_THREAD   4
+#define MAX_THREADS         256
+#define OUTPUT_MIN_SIZE     65536
+
+typedef struct {
+	unsigned char* data;
+	size_t length;
+	size_t capacity;
+} Output;
+
+typedef struct {
+	size_t start;
+	size_t end;
+	ItmDecoder decoder;				// state at the end of the chunk
+	TraceDemux demux;
+	TraceSink all;
+	TraceSink* ports[ITM_PORTS];
+	Output outputs[ITM_PORTS + 1];	// per port, and all ports last
+} Chunk;
+
+typedef struct {
+	FILE* file;
+	int lz4;
+	Lz4Reader reader;
+	unsigned char* compressed;
+	size_t compressedLength;
+	size_t compressedSize;
+	int eof;
+} Input;
+
+static struct option longOptions[] = {
+	{"threads",    required_argument, 0, 't'},
+	{"chunk-size", required_argument, 0, 'c'},
+	{"port-file",  required_argument, 0, 'p'},
+	{"serial",     no_argument,       0, 's'},
+	{0, 0, 0, 0}
+};
+
+static Chunk* chunks = NULL;
+static int chunkCount = 0;
+static int nextChunk = 0;
+static int threadCount = 1;
+static pthread_mutex_t batchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batchReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batchDone = PTHREAD_COND_INITIALIZER;
+static int batchNumber = 0;		// counts the batches, -1 stops the workers
+static int workersBusy = 0;
+static const unsigned char* batchData = NULL;
+static FILE* portFiles[ITM_PORTS];
+
+static double GetTime()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//============================
+// input - raw or LZ4 frames
+//============================
+
+static int InputOpen(Input* input, const char* filename)
+{
+	size_t length = strlen(filename);
+
+	memset(input, 0, sizeof(Input));
+	input->file = fopen(filename, "rb");
+	if (input->file == NULL) {
+		printf("Unable to open %s\n", filename);
+		return -1;
+	}
+	input->lz4 = (length > 4) && (strcmp(&filename[length - 4], ".lz4") == 0);
+	if (input->lz4) {
+		input->compressedSize = 2 * LZ4_FRAME_BOUND(LZ4_COMPRESS_BOUND(LZ4_MAX_BLOCK_SIZE));
+		input->compressed = malloc(input->compressedSize);
+		if (input->compressed == NULL) return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fill up to capacity bytes - returns the bytes read, 0 at the end of the capture
+ */
+static size_t InputRead(Input* input, unsigned char* data, size_t capacity)
+{
+	size_t total = 0;
+
+	if (!input->lz4) return fread(data, 1, capacity, input->file);
+
+	// a block at a time, while one more always fits
+	while (capacity - total >= LZ4_MAX_BLOCK_SIZE) {
+		size_t consumed;
+		int length = Lz4ReadBlock(&input->reader, input->compressed, input->compressedLength, data + total, capacity - total, &consumed);
+		if (length < 0) {
+			printf("%s - the rest of the capture is not decoded\n", input->reader.error);
+			input->compressedLength = 0;
+			input->reader.inFrame = 0;
+			input->eof = 1;
+			break;
+		}
+		if (consumed == 0) {
+			if (input->eof) {
+				if ((input->compressedLength > 0) || input->reader.inFrame) printf("Incomplete LZ4 frame at the end of the capture\n");
+				input->compressedLength = 0;
+				input->reader.inFrame = 0;
+				break;
+			}
+			size_t count = fread(input->compressed + input->compressedLength, 1, input->compressedSize - input->compressedLength, input->file);
+			input->compressedLength += count;
+			if (count == 0) input->eof = 1;
+			continue;
+		}
+		memmove(input->compressed, input->compressed + consumed, input->compressedLength - consumed);
+		input->compressedLength -= consumed;
+		total += length;
+	}
+	return total;
+}
+
+//============================
+// chunks
+//============================
+
+static void OutputWrite(TraceSink* sink, const unsigned char* data, size_t length)
+{
+	Output* output = sink->context;
+
+	if (output->length + length > output->capacity) {
+		size_t capacity = (output->capacity < OUTPUT_MIN_SIZE) ? OUTPUT_MIN_SIZE : output->capacity;
+		while (capacity < output->length + length) capacity *= 2;
+		unsigned char* grown = realloc(output->data, capacity);
+		if (grown == NULL) {
+			printf("Out of memory for the decoded output\n");
+			exit(2);
+		}
+		output->data = grown;
+		output->capacity = capacity;
+	}
+	memcpy(output->data + output->length, data, length);
+	output->length += length;
+}
+
+static void OutputFlush(TraceSink* sink)
+{
+}
+
+static void OutputSinkOpen(TraceSink* sink, Output* output)
+{
+	memset(sink, 0, sizeof(TraceSink));
+	sink->write = OutputWrite;
+	sink->flush = OutputFlush;
+	sink->context = output;
+}
+
+static int ChunksCreate(int count)
+{
+	int i, port;
+
+	chunks = calloc(count, sizeof(Chunk));
+	if (chunks == NULL) return -1;
+	for (i = 0; i < count; i++) {
+		OutputSinkOpen(&chunks[i].all, &chunks[i].outputs[ITM_PORTS]);
+		chunks[i].demux.all = &chunks[i].all;
+		for (port = 0; port < ITM_PORTS; port++) {
+			if (portFiles[port] == NULL) continue;
+			chunks[i].ports[port] = malloc(sizeof(TraceSink));
+			if (chunks[i].ports[port] == NULL) return -1;
+			OutputSinkOpen(chunks[i].ports[port], &chunks[i].outputs[port]);
+			chunks[i].demux.ports[port] = chunks[i].ports[port];
+		}
+	}
+	return 0;
+}
+
+static void ChunkReset(Chunk* chunk)
+{
+	int i;
+
+	for (i = 0; i <= ITM_PORTS; i++) chunk->outputs[i].length = 0;
+	memset(chunk->demux.portBytes, 0, sizeof(chunk->demux.portBytes));
+	memset(chunk->demux.portPackets, 0, sizeof(chunk->demux.portPackets));
+}
+
+/*
+ * Position just after the first sync packet (at least 5 zeros and 0x80) in [from, to), or 0
+ */
+static size_t FindSync(const unsigned char* data, size_t from, size_t to)
+{
+	size_t zeros = 0;
+	size_t pos;
+
+	for (pos = from; pos < to; pos++) {
+		if (data[pos] == 0x00) {
+			zeros++;
+		}
+		else {
+			if ((data[pos] == 0x80) && (zeros >= 5)) return pos + 1;
+			zeros = 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Split data into chunks of about chunkSize starting at sync packets - returns the bytes used.
+ * Before the end of the capture the rest after the last sync is left for the next batch.
+ */
+static size_t Split(const unsigned char* data, size_t length, size_t chunkSize, int maxChunks, int last)
+{
+	size_t pos = 0;
+
+	chunkCount = 0;
+	while ((pos < length) && (chunkCount < maxChunks)) {
+		size_t end = (pos + chunkSize < length) ? FindSync(data, pos + chunkSize, length) : 0;
+		if (end == 0) {
+			// no sync in the rest - it goes in a chunk at the end of the capture, or if nothing else would
+			if (!last && (chunkCount > 0)) break;
+			end = length;
+		}
+		chunks[chunkCount].start = pos;
+		chunks[chunkCount].end = end;
+		chunkCount++;
+		pos = end;
+	}
+	return pos;
+}
+
+/*
+ * The workers live for the whole run and decode the chunks of each batch as it is started
+ */
+static void* Worker(void* context)
+{
+	int seen = 0;
+
+	while (1) {
+		pthread_mutex_lock(&batchLock);
+		while (batchNumber == seen) pthread_cond_wait(&batchReady, &batchLock);
+		seen = batchNumber;
+		pthread_mutex_unlock(&batchLock);
+		if (seen < 0) break;
+
+		while (1) {
+			int index = __atomic_fetch_add(&nextChunk, 1, __ATOMIC_RELAXED);
+			if (index >= chunkCount) break;
+
+			Chunk* chunk = &chunks[index];
+			ChunkReset(chunk);
+			ItmDecoderInit(&chunk->decoder, TraceDemuxRecord, &chunk->demux);
+			ItmDecode(&chunk->decoder, batchData + chunk->start, chunk->end - chunk->start);
+		}
+
+		pthread_mutex_lock(&batchLock);
+		if (--workersBusy == 0) pthread_cond_signal(&batchDone);
+		pthread_mutex_unlock(&batchLock);
+	}
+	return NULL;
+}
+
+/*
+ * Decode the chunks of the batch on the workers and wait until all are done
+ */
+static void DecodeBatch()
+{
+	pthread_mutex_lock(&batchLock);
+	nextChunk = 0;
+	workersBusy = threadCount;
+	batchNumber++;
+	pthread_cond_broadcast(&batchReady);
+	while (workersBusy > 0) pthread_cond_wait(&batchDone, &batchLock);
+	pthread_mutex_unlock(&batchLock);
+}
+
+static void WorkersStop(pthread_t* threads)
+{
+	int i;
+
+	pthread_mutex_lock(&batchLock);
+	batchNumber = -1;
+	pthread_cond_broadcast(&batchReady);
+	pthread_mutex_unlock(&batchLock);
+	for (i = 0; i < threadCount; i++) pthread_join(threads[i], NULL);
+}
+
+static void WriteChunk(Chunk* chunk, FILE* output)
+{
+	int port;
+
+	fwrite(chunk->outputs[ITM_PORTS].data, 1, chunk->outputs[ITM_PORTS].length, output);
+	for (port = 0; port < ITM_PORTS; port++) {
+		if (portFiles[port] != NULL) fwrite(chunk->outputs[port].data, 1, chunk->outputs[port].length, portFiles[port]);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	size_t chunkSize = CHUNK_SIZE;
+	int serial = 0;
+	int opt, i, port;
+	Input input;
+	FILE* output = stdout;
+	ItmDecoder carry;
+	pthread_t threads[MAX_THREADS];
+	unsigned long long total = 0, records = 0, syncs = 0, overflows = 0, junk = 0, chunksTotal = 0, redecoded = 0;
+	unsigned long long portBytes[ITM_PORTS];
+
+	threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt_long(argc, argv, "t:c:p:s", longOptions, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			threadCount = atoi(optarg);
+			break;
+		case 'c':
+			chunkSize = strtoul(optarg, NULL, 0);
+			break;
+		case 'p': {
+			// port:filename
+			char* portFilename = NULL;
+			port = strtoul(optarg, &portFilename, 0);
+			if ((*portFilename != ':') || (port < 0) || (port >= ITM_PORTS)) {
+				printf("Invalid port file %s\n", optarg);
+				return 2;
+			}
+			portFiles[port] = fopen(portFilename + 1, "wb");
+			if (portFiles[port] == NULL) {
+				printf("Unable to open %s\n", portFilename + 1);
+				return 2;
+			}
+			break;
+		}
+		case 's':
+			serial = 1;
+			break;
+		default:
+			return 2;
+		}
+	}
+	if (optind >= argc) {
+		printf("Usage: stlink-decode [--threads N] [--chunk-size BYTES] [--port-file PORT:FILE] [--serial] capture [output]\n");
+		return 2;
+	}
+	if (threadCount < 1) threadCount = 1;
+	if (threadCount > MAX_THREADS) threadCount = MAX_THREADS;
+	if (chunkSize < 1024) chunkSize = 1024;
+	if (serial) threadCount = 1;
+
+	if (InputOpen(&input, argv[optind]) != 0) return 2;
+	if ((optind + 1 < argc) && (strcmp(argv[optind + 1], "-") != 0)) {
+		output = fopen(argv[optind + 1], "wb");
+		if (output == NULL) {
+			printf("Unable to open %s\n", argv[optind + 1]);
+			return 2;
+		}
+	}
+
+	// a batch holds a few chunks per thread, and at least a whole LZ4 block
+	int maxChunks = threadCount * CHUNKS_PER_THREAD;
+	size_t batchSize = maxChunks * chunkSize;
+	if (batchSize < 2 * LZ4_MAX_BLOCK_SIZE) batchSize = 2 * LZ4_MAX_BLOCK_SIZE;
+	unsigned char* batch = malloc(batchSize);
+	if ((batch == NULL) || (ChunksCreate(maxChunks) != 0)) {
+		printf("Unable to allocate the decode buffers\n");
+		return 2;
+	}
+	batchData = batch;
+	if (!serial) {
+		for (i = 0; i < threadCount; i++) {
+			if (pthread_create(&threads[i], NULL, Worker, NULL) != 0) {
+				printf("Unable to start the decode threads\n");
+				return 2;
+			}
+		}
+	}
+
+	ItmDecoderInit(&carry, TraceDemuxRecord, NULL);
+	memset(portBytes, 0, sizeof(portBytes));
+	double start = GetTime();
+	size_t length = 0;
+	int last = 0;
+
+	while (1) {
+		length += InputRead(&input, batch + length, batchSize - length);
+		last = input.lz4 ? (input.eof && (input.compressedLength == 0)) : feof(input.file);
+		if (length == 0) break;
+
+		size_t used = Split(batch, length, serial ? length : chunkSize, maxChunks, last);
+
+		// decode the chunks at the same time
+		if (!serial) DecodeBatch();
+
+		// and merge them in order, decoding a chunk again if the one before did not end between packets
+		for (i = 0; i < chunkCount; i++) {
+			Chunk* chunk = &chunks[i];
+			if (serial || !ItmDecoderIdle(&carry)) {
+				if (!serial) redecoded++;
+				ChunkReset(chunk);
+				carry.context = &chunk->demux;
+				carry.records = carry.syncs = carry.overflows = carry.junk = 0;
+				ItmDecode(&carry, batch + chunk->start, chunk->end - chunk->start);
+			}
+			else {
+				carry = chunk->decoder;
+			}
+			records += carry.records;
+			syncs += carry.syncs;
+			overflows += carry.overflows;
+			junk += carry.junk;
+			for (port = 0; port < ITM_PORTS; port++) portBytes[port] += chunk->demux.portBytes[port];
+			WriteChunk(chunk, output);
+		}
+		chunksTotal += chunkCount;
+		total += used;
+
+		// the rest after the last sync starts the next batch
+		memmove(batch, batch + used, length - used);
+		length -= used;
+	}
+
+	if (!serial) WorkersStop(threads);
+	double elapsed = GetTime() - start;
+	if (output != stdout) fclose(output);
+	for (port = 0; port < ITM_PORTS; port++) {
+		if (portFiles[port] != NULL) fclose(portFiles[port]);
+	}
+
+	fprintf(stderr, "%llu bytes in %.3f s (%.1f MB/s) on %d thread(s): %llu chunks, %llu decoded again\n",
+			total, elapsed, (elapsed > 0) ? total / elapsed / 1e6 : 0, threadCount, chunksTotal, redecoded);
+	fprintf(stderr, "%llu records, %llu syncs, %llu overflows, %llu junk\n", records, syncs, overflows, junk);
+	for (port = 0; port < ITM_PORTS; port++) {
+		if (portBytes[port] > 0) fprintf(stderr, "port %2d: %llu bytes\n", port, portBytes[port]);
+	}
+	return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * down-channel.c
+ *
+ * Host side of the down-channel ring (see down-channel.h).
+ * Data is read from a file, FIFO or stdin and pushed into the target ring. Each service
+ * call writes as much as fits in one or two batched WriteMemory() calls (two if the ring
+ * wraps) and then updates the target's writeOffset once.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "stlink-trace.h"
+#include "down-channel.h"
+#include "stats.h"
+
+int DownChannelOpen(DownChannel* dc, uint32_t address, const char* source)
+{
+	uint32_t header[DOWN_CHANNEL_HEADER_SIZE / 4];
+
+	memset(dc, 0, sizeof(DownChannel));
+	dc->sourceFd = -1;
+
+	// the whole control block in one read (target is little endian, as is the host)
+	if ((ReadMemory(address, (unsigned char*) &header[0], DOWN_CHANNEL_HEADER_SIZE) != 0) || (header[0] != DOWN_CHANNEL_MAGIC)) {
+		printf("No down-channel control block found at 0x%08x\n", address);
+		return -1;
+	}
+
+	dc->size = header[1];
+	dc->writeOffset = header[2];
+	dc->readOffset = header[3];
+	if ((dc->size == 0) || (dc->writeOffset >= dc->size) || (dc->readOffset >= dc->size)) {
+		printf("Invalid down-channel control block at 0x%08x\n", address);
+		return -1;
+	}
+
+	if ((source == NULL) || (strcmp(source, "-") == 0)) {
+		dc->sourceFd = STDIN_FILENO;
+		fcntl(dc->sourceFd, F_SETFL, fcntl(dc->sourceFd, F_GETFL) | O_NONBLOCK);
+	}
+	else {
+		// non-blocking so that a FIFO can be opened before the writer connects
+		dc->sourceFd = open(source, O_RDONLY | O_NONBLOCK);
+		if (dc->sourceFd < 0) {
+			printf("Unable to open down-channel source %s\n", source);
+			return -1;
+		}
+	}
+
+	dc->address = address;
+	printf("Down-channel at 0x%08x, %u bytes\n", address, dc->size);
+	return 0;
+}
+
+/*
+ * Push pending data to the target, writing at most budget bytes.
+ * Returns the number of bytes written to the target ring.
+ */
+int DownChannelService(DownChannel* dc, size_t budget)
+{
+	if (dc->address == 0) return 0;
+
+	// top up the pending data from the source
+	if ((dc->sourceFd >= 0) && (dc->pendingLength < DOWN_CHANNEL_PENDING_SIZE)) {
+		ssize_t count = read(dc->sourceFd, &dc->pending[dc->pendingLength], DOWN_CHANNEL_PENDING_SIZE - dc->pendingLength);
+		if (count > 0) {
+			dc->pendingLength += count;
+			STATS_HIGH_WATER(downChannelHighWater, dc->pendingLength);
+		}
+		// Note: 0 is not treated as the end - a FIFO reports 0 until a writer connects
+		else if ((count < 0) && (errno != EAGAIN)) {
+			printf("Down-channel source read failed\n");
+			if (dc->sourceFd != STDIN_FILENO) close(dc->sourceFd);
+			dc->sourceFd = -1;
+		}
+	}
+
+	if (dc->pendingLength == 0) return 0;
+
+	// free space from the cached read offset - only re-read the target's offset when that is not enough
+	size_t length = dc->pendingLength < budget ? dc->pendingLength : budget;
+	uint32_t used = (dc->writeOffset + dc->size - dc->readOffset) % dc->size;
+	if (dc->size - 1 - used < length) {
+		dc->readOffset = Read32Bit(dc->address + 12);
+		if (dc->readOffset >= dc->size) return 0;
+		used = (dc->writeOffset + dc->size - dc->readOffset) % dc->size;
+	}
+	if (length > dc->size - 1 - used) length = dc->size - 1 - used;
+	if (length == 0) return 0;
+
+	// data first, in at most two batched writes...
+	size_t first = dc->size - dc->writeOffset;
+	if (first > length) first = length;
+	WriteMemory(dc->address + DOWN_CHANNEL_HEADER_SIZE + dc->writeOffset, &dc->pending[0], first);
+	if (length > first) {
+		WriteMemory(dc->address + DOWN_CHANNEL_HEADER_SIZE, &dc->pending[first], length - first);
+	}
+
+	// ...then publish it with a single write offset update
+	dc->writeOffset = (dc->writeOffset + length) % dc->size;
+	Write32Bit(dc->address + 8, dc->writeOffset);
+	dc->pointerWrites++;
+	dc->bytesSent += length;
+
+	memmove(&dc->pending[0], &dc->pending[length], dc->pendingLength - length);
+	dc->pendingLength -= length;
+
+	if (debugEnabled) printf("Down-channel: %d bytes sent, %d pending\n", (int)length, (int)dc->pendingLength);
+	return length;
+}
+
+void DownChannelClose(DownChannel* dc)
+{
+	if ((dc->sourceFd >= 0) && (dc->sourceFd != STDIN_FILENO)) close(dc->sourceFd);
+	dc->sourceFd = -1;
+	dc->address = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * down-channel.h
+ *
+ * Host to target down-channel: a byte ring in target RAM that the host fills
+ * with batched memory writes between trace polls.
+ *
+ * Target control block (see target/down-channel.h):
+ *   +0x00 magic       DOWN_CHANNEL_MAGIC
+ *   +0x04 size        ring size in bytes
+ *   +0x08 writeOffset written by the host only
+ *   +0x0C readOffset  written by the target only
+ *   +0x10 buffer[size]
+ */
+
+#ifndef DOWN_CHANNEL_H_
+#define DOWN_CHANNEL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DOWN_CHANNEL_MAGIC          0x48434E44	// "DNCH"
+#define DOWN_CHANNEL_HEADER_SIZE    16
+
+// bytes buffered on the host from the source
+#define DOWN_CHANNEL_PENDING_SIZE   4096
+// maximum bytes written to the target per service call
+#define DOWN_CHANNEL_BUDGET         256
+
+typedef struct {
+	uint32_t address;		// control block address, 0 = disabled
+	uint32_t size;
+	uint32_t writeOffset;	// shadow of the target's writeOffset
+	uint32_t readOffset;	// last readOffset read from the target
+	int sourceFd;
+	unsigned char pending[DOWN_CHANNEL_PENDING_SIZE];
+	size_t pendingLength;
+	unsigned long bytesSent;
+	unsigned long pointerWrites;
+} DownChannel;
+
+int DownChannelOpen(DownChannel* dc, uint32_t address, const char* source);
+int DownChannelService(DownChannel* dc, size_t budget);
+void DownChannelClose(DownChannel* dc);
+
+#endif /* DOWN_CHANNEL_H_ */
@@ -0,0 +1,242 @@
+/*
+ * dwt-window.c
+ *
+ * Comparator-gated DWT trace (see dwt-window.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stlink-trace.h"
+#include "dwt-window.h"
+
+#define DWT_CTRL                0xE0001000
+#define DWT_COMP(n)             (0xE0001020 + 16 * (n))
+#define DWT_MASK(n)             (0xE0001024 + 16 * (n))
+#define DWT_FUNCTION(n)         (0xE0001028 + 16 * (n))
+#define DWT_MATCHED             (1 << 24)
+#define ITM_TCR                 0xE0000E80
+
+// DWT_CTRL as set up by EnableTrace(): PC sample every 16 * 1024 cycles
+#define DWT_CTRL_BASE           0x400003FE
+#define DWT_CTRL_CYCCNTENA      (1 << 0)
+#define DWT_CTRL_PCSAMPLENA     (1 << 12)
+
+#define ITM_TCR_DWTENA          (1 << 3)
+
+// DWT_FUNCTION values
+#define FUNCTION_ETM_PC         0x8
+#define FUNCTION_ETM_READ       0x9
+#define FUNCTION_ETM_WRITE      0xA
+#define FUNCTION_ETM_ACCESS     0xB
+#define FUNCTION_DATA_VALUE     0x2
+
+// hardware source discriminators
+#define HARDWARE_PC_SAMPLE      2
+
+static uint32_t Get32(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+/*
+ * Address from a symbol of the given type or a number
+ */
+static int FindAddress(const char* name, int type, ElfFile* elf, uint32_t* address, uint32_t* size)
+{
+	*size = 4;
+	if ((name[0] >= '0') && (name[0] <= '9')) {
+		*address = strtoul(name, NULL, 0);
+		return 0;
+	}
+	if ((elf != NULL) && (elf->data != NULL) && (ElfFindSymbol(elf, name, type, address, size) == 0)) return 0;
+	printf("Unable to find %s - symbols need an --elf file\n", name);
+	return -1;
+}
+
+/*
+ * "symbol" or "address" for a PC match, "read:", "write:" or "access:" before it for a data address
+ */
+int DwtWindowTrigger(DwtTrigger* trigger, const char* spec, ElfFile* elf)
+{
+	static const struct { const char* prefix; uint32_t function; } kinds[] = {
+		{"read:", FUNCTION_ETM_READ}, {"write:", FUNCTION_ETM_WRITE}, {"access:", FUNCTION_ETM_ACCESS}
+	};
+	uint32_t size;
+	size_t i;
+
+	trigger->function = FUNCTION_ETM_PC;
+	for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+		if (strncmp(spec, kinds[i].prefix, strlen(kinds[i].prefix)) == 0) {
+			trigger->function = kinds[i].function;
+			break;
+		}
+	}
+	snprintf(trigger->name, sizeof(trigger->name), "%s", spec);
+	if (i < sizeof(kinds) / sizeof(kinds[0])) {
+		if (FindAddress(strchr(spec, ':') + 1, ELF_STT_OBJECT, elf, &trigger->address, &size) != 0) return -1;
+	}
+	else if (FindAddress(spec, ELF_STT_FUNC, elf, &trigger->address, &size) != 0) {
+		return -1;
+	}
+
+	// the Thumb bit of a function symbol is not part of the address
+	if (trigger->function == FUNCTION_ETM_PC) trigger->address &= ~1U;
+	return 0;
+}
+
+/*
+ * A variable traced with its value on every access while a window is open
+ */
+int DwtWindowAddData(DwtWindow* window, const char* spec, ElfFile* elf)
+{
+	DwtTrigger* data = &window->data[window->dataCount];
+	uint32_t size;
+
+	if (window->dataCount >= DWT_WINDOW_DATA_MAX) {
+		printf("Too many --dwt-data variables (max %d)\n", DWT_WINDOW_DATA_MAX);
+		return -1;
+	}
+	if (FindAddress(spec, ELF_STT_OBJECT, elf, &data->address, &size) != 0) return -1;
+	data->function = FUNCTION_DATA_VALUE;
+	snprintf(data->name, sizeof(data->name), "%s", spec);
+	window->dataCount++;
+	return 0;
+}
+
+int DwtWindowOpen(DwtWindow* window, const char* filename, TraceSink* marks, SymbolIndex* symbols)
+{
+	if (FileSinkOpen(&window->output, filename) != 0) return -1;
+	window->marks = marks;
+	window->symbols = symbols;
+	window->enabled = 1;
+	return 0;
+}
+
+static void Mark(DwtWindow* window, const char* text)
+{
+	window->output.write(&window->output, (const unsigned char*) text, strlen(text));
+	if (window->marks != NULL) window->marks->write(window->marks, (const unsigned char*) text, strlen(text));
+}
+
+static void Program(int comparator, const DwtTrigger* trigger, uint32_t mask)
+{
+	Write32Bit(DWT_COMP(comparator), trigger->address);
+	Write32Bit(DWT_MASK(comparator), mask);
+	Write32Bit(DWT_FUNCTION(comparator), trigger->function);
+}
+
+/*
+ * Program the comparators once EnableTrace() has cleared them - the window starts closed
+ */
+void DwtWindowSetup(DwtWindow* window)
+{
+	int i;
+
+	if (!window->enabled) return;
+
+	// data addresses match the word they are in
+	Program(0, &window->start, (window->start.function == FUNCTION_ETM_PC) ? 0 : 2);
+	if (window->stop.function != 0) Program(1, &window->stop, (window->stop.function == FUNCTION_ETM_PC) ? 0 : 2);
+	for (i = 0; i < window->dataCount; i++) Program(2 + i, &window->data[i], 2);
+
+	Write32Bit(DWT_CTRL, DWT_CTRL_BASE | DWT_CTRL_CYCCNTENA | (window->pcSample ? DWT_CTRL_PCSAMPLENA : 0));
+	// ITM_TCR as set up by EnableTrace(), without DWTENA while the window is closed
+	window->tcr = Read32Bit(ITM_TCR) | ITM_TCR_DWTENA;
+	Write32Bit(ITM_TCR, window->tcr & ~ITM_TCR_DWTENA);
+	printf("DWT window: start %s at 0x%08x, stop %s\n", window->start.name, window->start.address,
+			(window->stop.function != 0) ? window->stop.name : "never");
+}
+
+/*
+ * Capture loop: check the trigger comparators and open or close the window.
+ * The window stays open while the start trigger keeps matching.
+ */
+void DwtWindowService(DwtWindow* window)
+{
+	unsigned char functions[DWT_FUNCTION(1) + 4 - DWT_FUNCTION(0)];
+	char text[DWT_WINDOW_LINE_SIZE];
+
+	if (!window->enabled) return;
+	window->output.flush(&window->output);
+
+	// reading DWT_FUNCTION clears MATCHED
+	if (ReadMemory(DWT_FUNCTION(0), functions, sizeof(functions)) != 0) return;
+	int started = (Get32(&functions[0]) & DWT_MATCHED) != 0;
+	int stopped = (window->stop.function != 0) && ((Get32(&functions[DWT_FUNCTION(1) - DWT_FUNCTION(0)]) & DWT_MATCHED) != 0);
+
+	if (!window->open && started) {
+		Write32Bit(ITM_TCR, window->tcr);
+		window->open = 1;
+		window->windows++;
+		snprintf(text, sizeof(text), "\n>>> DWT WINDOW %llu OPEN: %s <<<\n", window->windows, window->start.name);
+		Mark(window, text);
+	}
+	else if (window->open && stopped && !started) {
+		Write32Bit(ITM_TCR, window->tcr & ~ITM_TCR_DWTENA);
+		window->open = 0;
+		snprintf(text, sizeof(text), "\n>>> DWT WINDOW %llu CLOSE: %s <<<\n", window->windows, window->stop.name);
+		Mark(window, text);
+	}
+}
+
+static int Symbol(DwtWindow* window, uint32_t address, char* text, size_t size)
+{
+	SymbolInfo info;
+
+	if ((window->symbols == NULL) || (SymbolIndexLookup(window->symbols, address, &info) != 0) || (info.name == NULL)) return 0;
+	return snprintf(text, size, " %s+0x%x", info.name, info.offset);
+}
+
+/*
+ * TraceDemux hardware callback - one line per PC sample or data trace packet
+ */
+void DwtWindowRecord(void* context, const ItmRecord* record)
+{
+	DwtWindow* window = context;
+	char text[DWT_WINDOW_LINE_SIZE];
+	int length = 0;
+
+	if (record->port == HARDWARE_PC_SAMPLE) {
+		window->pcSamples++;
+		if (record->size == 1) {
+			length = snprintf(text, sizeof(text), "pc sleep");
+		}
+		else {
+			length = snprintf(text, sizeof(text), "pc 0x%08x", record->value);
+			length += Symbol(window, record->value, &text[length], sizeof(text) - length);
+		}
+	}
+	else if ((record->port >= 8) && (record->port < 24)) {
+		// data trace: 01nn0 PC value, 01nn1 address offset, 10nnw data value of comparator nn
+		int comparator = (record->port >> 1) & 3;
+		const char* name = (comparator >= 2) ? window->data[comparator - 2].name : "";
+		window->dataValues++;
+		if (record->port >= 16) {
+			length = snprintf(text, sizeof(text), "data %s %s 0x%0*x", name, (record->port & 1) ? "write" : "read", record->size * 2, record->value);
+		}
+		else if (record->port & 1) {
+			length = snprintf(text, sizeof(text), "data %s address offset 0x%04x", name, record->value);
+		}
+		else {
+			length = snprintf(text, sizeof(text), "data %s pc 0x%08x", name, record->value);
+			length += Symbol(window, record->value, &text[length], sizeof(text) - length);
+		}
+	}
+	else {
+		return;
+	}
+
+	if (length > (int) sizeof(text) - 2) length = sizeof(text) - 2;
+	text[length++] = '\n';
+	window->output.write(&window->output, (unsigned char*) text, length);
+}
+
+void DwtWindowClose(DwtWindow* window)
+{
+	if (!window->enabled) return;
+
+	printf("DWT window: %llu windows, %llu PC samples, %llu data trace packets\n", window->windows, window->pcSamples, window->dataValues);
+	window->output.close(&window->output);
+	window->enabled = 0;
+}
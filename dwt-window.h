@@ -0,0 +1,67 @@
+/*
+ * dwt-window.h
+ *
+ * Comparator-gated DWT trace (--dwt-start): PC sampling and data trace are only sent while
+ * the code under investigation runs, instead of streaming them all the time.
+ *
+ * DWT comparator 0 is the start trigger and comparator 1 the optional stop trigger, each a
+ * PC address (a symbol or a number) or a data address (read:X, write:X or access:X).
+ * Comparators 2 and 3 trace the values of up to two variables (--dwt-data). The host
+ * polls the MATCHED flags of the trigger comparators between trace reads and sets ITM_TCR
+ * DWTENA when the start trigger fires and clears it at the stop trigger, so the PC samples
+ * (--dwt-pc-sample) and data trace packets only reach SWO inside a window.
+ *
+ * On the Cortex-M3 (ARMv7-M) a comparator can not emit an ITM packet on an instruction
+ * address, so the triggers use the ETM trigger functions - which also do not halt the
+ * core as a watchpoint would - and their CMPMATCH events are seen through MATCHED. A
+ * window opens up to one capture loop after the match; packets already queued in the
+ * ITM when it closes arrive after the closing marker.
+ *
+ * The decoded DWT packets are written as text to the DWT file, one line each, with the
+ * window boundaries marked there and in the trace file.
+ */
+
+#ifndef DWT_WINDOW_H_
+#define DWT_WINDOW_H_
+
+#include <stdint.h>
+#include "itm-decode.h"
+#include "trace-sink.h"
+#include "elf-symbols.h"
+#include "symbol-index.h"
+
+#define DWT_WINDOW_DATA_MAX     2
+#define DWT_WINDOW_LINE_SIZE    256
+
+typedef struct {
+	uint32_t address;
+	uint32_t function;		// DWT_FUNCTION value
+	char name[64];
+} DwtTrigger;
+
+typedef struct {
+	int enabled;
+	DwtTrigger start;
+	DwtTrigger stop;		// function 0 if the window stays open
+	DwtTrigger data[DWT_WINDOW_DATA_MAX];
+	int dataCount;
+	int pcSample;
+	int open;
+	uint32_t tcr;			// ITM_TCR with the window open
+	TraceSink output;
+	TraceSink* marks;		// the trace file, for the window markers
+	SymbolIndex* symbols;	// NULL without an ELF file
+	unsigned long long windows;
+	unsigned long long pcSamples;
+	unsigned long long dataValues;
+} DwtWindow;
+
+int DwtWindowTrigger(DwtTrigger* trigger, const char* spec, ElfFile* elf);
+int DwtWindowAddData(DwtWindow* window, const char* spec, ElfFile* elf);
+int DwtWindowOpen(DwtWindow* window, const char* filename, TraceSink* marks, SymbolIndex* symbols);
+void DwtWindowSetup(DwtWindow* window);
+void DwtWindowService(DwtWindow* window);
+void DwtWindowRecord(void* context, const ItmRecord* record);
+void DwtWindowClose(DwtWindow* window);
+
+#endif /* DWT_WINDOW_H_ */
@@ -0,0 +1,168 @@
+/*
+ * elf-symbols.c
+ *
+ * Minimal ELF32 reader - only the section headers and the symbol table are used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "elf-symbols.h"
+
+// offsets into the ELF32 file, section and symbol headers
+#define ELF_SHOFF        0x20
+#define ELF_SHENTSIZE    0x2E
+#define ELF_SHNUM        0x30
+#define ELF_SHSTRNDX     0x32
+#define SH_NAME          0x00
+#define SH_TYPE          0x04
+#define SH_ADDR          0x0C
+#define SH_OFFSET        0x10
+#define SH_SIZE          0x14
+#define SH_LINK          0x18
+#define SHT_SYMTAB       2
+#define SHT_NOBITS       8
+
+static uint32_t GetUint32(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint16_t GetUint16(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8);
+}
+
+int ElfOpen(ElfFile* elf, const char* filename)
+{
+	FILE* file = NULL;
+	long length = 0;
+	uint32_t i;
+
+	memset(elf, 0, sizeof(ElfFile));
+
+	file = fopen(filename, "rb");
+	if (file == NULL) {
+		printf("Unable to open ELF file %s\n", filename);
+		return -1;
+	}
+
+	fseek(file, 0, SEEK_END);
+	length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	elf->data = malloc(length > 0 ? length : 1);
+	if ((elf->data == NULL) || (fread(elf->data, 1, length, file) != (size_t)length)) {
+		printf("Unable to read ELF file %s\n", filename);
+		fclose(file);
+		ElfClose(elf);
+		return -1;
+	}
+	fclose(file);
+	elf->size = length;
+
+	// ELF, 32-bit, little endian
+	if ((elf->size < 0x34) || memcmp(elf->data, "\177ELF", 4) || (elf->data[4] != 1) || (elf->data[5] != 1)) {
+		printf("%s is not a 32-bit little endian ELF file\n", filename);
+		ElfClose(elf);
+		return -1;
+	}
+
+	uint32_t sectionOffset = GetUint32(&elf->data[ELF_SHOFF]);
+	uint32_t sectionSize = GetUint16(&elf->data[ELF_SHENTSIZE]);
+	uint32_t sectionCount = GetUint16(&elf->data[ELF_SHNUM]);
+	if ((uint64_t)sectionOffset + (uint64_t)sectionSize * sectionCount > elf->size) {
+		printf("Invalid section headers in %s\n", filename);
+		ElfClose(elf);
+		return -1;
+	}
+
+	for (i = 0; i < sectionCount; i++) {
+		const unsigned char* section = &elf->data[sectionOffset + i * sectionSize];
+		if (GetUint32(&section[SH_TYPE]) != SHT_SYMTAB) continue;
+
+		uint32_t link = GetUint32(&section[SH_LINK]);
+		if (link >= sectionCount) break;
+		const unsigned char* strtab = &elf->data[sectionOffset + link * sectionSize];
+
+		uint32_t offset = GetUint32(&section[SH_OFFSET]);
+		uint32_t size = GetUint32(&section[SH_SIZE]);
+		uint32_t stringsOffset = GetUint32(&strtab[SH_OFFSET]);
+		uint32_t stringsSize = GetUint32(&strtab[SH_SIZE]);
+		if (((uint64_t)offset + size > elf->size) || ((uint64_t)stringsOffset + stringsSize > elf->size)) break;
+
+		elf->symbols = &elf->data[offset];
+		elf->symbolCount = size / ELF_SYMBOL_SIZE;
+		elf->strings = (const char*) &elf->data[stringsOffset];
+		elf->stringsSize = stringsSize;
+		break;
+	}
+
+	if (elf->symbols == NULL) {
+		printf("No symbol table in %s\n", filename);
+		ElfClose(elf);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Address and size of a symbol of the given type (ELF_STT_OBJECT or ELF_STT_FUNC)
+ */
+int ElfFindSymbol(ElfFile* elf, const char* name, int type, uint32_t* address, uint32_t* size)
+{
+	uint32_t i;
+
+	for (i = 0; i < elf->symbolCount; i++) {
+		const unsigned char* symbol = &elf->symbols[i * ELF_SYMBOL_SIZE];
+		uint32_t nameOffset = GetUint32(&symbol[ELF_SYMBOL_NAME]);
+		if ((symbol[ELF_SYMBOL_INFO] & 0x0F) != type) continue;
+		if (nameOffset >= elf->stringsSize) continue;
+		if (strncmp(&elf->strings[nameOffset], name, elf->stringsSize - nameOffset) != 0) continue;
+
+		*address = GetUint32(&symbol[ELF_SYMBOL_VALUE]);
+		*size = GetUint32(&symbol[ELF_SYMBOL_SIZEFIELD]);
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the contents of the named section, or NULL if there is no such section in the file
+ */
+const unsigned char* ElfFindSection(ElfFile* elf, const char* name, uint32_t* size, uint32_t* address)
+{
+	uint32_t sectionOffset = GetUint32(&elf->data[ELF_SHOFF]);
+	uint32_t sectionSize = GetUint16(&elf->data[ELF_SHENTSIZE]);
+	uint32_t sectionCount = GetUint16(&elf->data[ELF_SHNUM]);
+	uint32_t namesIndex = GetUint16(&elf->data[ELF_SHSTRNDX]);
+	uint32_t i;
+
+	if (namesIndex >= sectionCount) return NULL;
+	const unsigned char* names = &elf->data[sectionOffset + namesIndex * sectionSize];
+	uint32_t namesOffset = GetUint32(&names[SH_OFFSET]);
+	uint32_t namesSize = GetUint32(&names[SH_SIZE]);
+	if ((uint64_t)namesOffset + namesSize > elf->size) return NULL;
+
+	for (i = 0; i < sectionCount; i++) {
+		const unsigned char* section = &elf->data[sectionOffset + i * sectionSize];
+		uint32_t nameOffset = GetUint32(&section[SH_NAME]);
+		if (nameOffset >= namesSize) continue;
+		if (strncmp((const char*) &elf->data[namesOffset + nameOffset], name, namesSize - nameOffset) != 0) continue;
+
+		uint32_t offset = GetUint32(&section[SH_OFFSET]);
+		*size = GetUint32(&section[SH_SIZE]);
+		if (address != NULL) *address = GetUint32(&section[SH_ADDR]);
+		if ((GetUint32(&section[SH_TYPE]) == SHT_NOBITS) || ((uint64_t)offset + *size > elf->size)) return NULL;
+		return &elf->data[offset];
+	}
+
+	return NULL;
+}
+
+void ElfClose(ElfFile* elf)
+{
+	free(elf->data);
+	memset(elf, 0, sizeof(ElfFile));
+}
@@ -0,0 +1,37 @@
+/*
+ * elf-symbols.h
+ *
+ * Symbols from the firmware ELF file (32-bit little endian, as built for Cortex-M).
+ */
+
+#ifndef ELF_SYMBOLS_H_
+#define ELF_SYMBOLS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// symbol table entry fields
+#define ELF_SYMBOL_SIZE      16
+#define ELF_SYMBOL_NAME      0x00
+#define ELF_SYMBOL_VALUE     0x04
+#define ELF_SYMBOL_SIZEFIELD 0x08
+#define ELF_SYMBOL_INFO      0x0C
+#define ELF_SYMBOL_SHNDX     0x0E
+#define ELF_STT_OBJECT       1
+#define ELF_STT_FUNC         2
+
+typedef struct {
+	unsigned char* data;	// whole file
+	size_t size;
+	const unsigned char* symbols;	// .symtab entries
+	uint32_t symbolCount;
+	const char* strings;	// .strtab
+	uint32_t stringsSize;
+} ElfFile;
+
+int ElfOpen(ElfFile* elf, const char* filename);
+int ElfFindSymbol(ElfFile* elf, const char* name, int type, uint32_t* address, uint32_t* size);
+const unsigned char* ElfFindSection(ElfFile* elf, const char* name, uint32_t* size, uint32_t* address);
+void ElfClose(ElfFile* elf);
+
+#endif /* ELF_SYMBOLS_H_ */
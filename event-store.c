@@ -0,0 +1,340 @@
+/*
+ * event-store.c
+ *
+ * Columnar, block compressed store of the decoded events (see event-store.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "event-store.h"
+#include "lz4-frame.h"
+
+// largest value of each column in bytes
+static const int columnWidths[EVENT_COLUMNS] = {10, 1, 1, 1, 4, 1};
+static const char* recordTypes[] = {"port", "dwt ", "ts  ", "ovf ", "sync", "junk"};
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void Put32(unsigned char* data, uint32_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+}
+
+static uint32_t Get32(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static void ArenaReset(EventArena* arena)
+{
+	memset(arena->portCounts, 0, sizeof(arena->portCounts));
+	arena->count = 0;
+	arena->timeLength = 0;
+	arena->portMask = 0;
+}
+
+static uint32_t ColumnLength(const EventArena* arena, int column)
+{
+	return (column == EVENT_COLUMN_TIME) ? arena->timeLength : arena->count * columnWidths[column];
+}
+
+/*
+ * Compress the columns of a block and write it
+ */
+static size_t WriteArena(EventStore* store, EventArena* arena, unsigned char* body, uint32_t* hashTable)
+{
+	unsigned char header[EVENT_STORE_BLOCK_HEADER];
+	unsigned char* directory = body;
+	size_t length = EVENT_COLUMNS * 8;
+	int column, port;
+
+	for (column = 0; column < EVENT_COLUMNS; column++) {
+		size_t stored = Lz4WriteFrame(arena->columns[column], ColumnLength(arena, column), &body[length], hashTable);
+		Put32(&directory[column * 8], ColumnLength(arena, column));
+		Put32(&directory[column * 8 + 4], stored);
+		length += stored;
+	}
+
+	memcpy(&header[0], EVENT_STORE_BLOCK_MAGIC, 4);
+	Put32(&header[4], arena->count);
+	Put32(&header[8], (uint32_t) arena->firstNs);
+	Put32(&header[12], (uint32_t)(arena->firstNs >> 32));
+	Put32(&header[16], (uint32_t) arena->lastNs);
+	Put32(&header[20], (uint32_t)(arena->lastNs >> 32));
+	Put32(&header[24], arena->portMask);
+	Put32(&header[28], length);
+	for (port = 0; port < ITM_PORTS; port++) Put32(&header[32 + 4 * port], arena->portCounts[port]);
+
+	fwrite(header, 1, sizeof(header), store->file);
+	fwrite(body, 1, length, store->file);
+	fflush(store->file);
+	return sizeof(header) + length;
+}
+
+static void* WriterThread(void* argument)
+{
+	EventStore* store = argument;
+	size_t bodySize = EVENT_COLUMNS * 8;
+	int column;
+
+	for (column = 0; column < EVENT_COLUMNS; column++) bodySize += LZ4_FRAME_BOUND(LZ4_COMPRESS_BOUND(EVENT_STORE_BLOCK * columnWidths[column]));
+	unsigned char* body = malloc(bodySize);
+	uint32_t* hashTable = malloc(LZ4_HASH_SIZE * sizeof(uint32_t));
+
+	pthread_mutex_lock(&store->lock);
+	while (1) {
+		while ((store->queued == 0) && !store->stopping) pthread_cond_wait(&store->queuedCondition, &store->lock);
+		if (store->queued == 0) break;
+
+		EventArena* arena = &store->arenas[store->head];
+		pthread_mutex_unlock(&store->lock);
+
+		// the arena is not touched by the capture thread until it is freed below
+		size_t stored = ((body != NULL) && (hashTable != NULL)) ? WriteArena(store, arena, body, hashTable) : 0;
+		uint32_t raw = 0;
+		for (column = 0; column < EVENT_COLUMNS; column++) raw += ColumnLength(arena, column);
+
+		pthread_mutex_lock(&store->lock);
+		store->events += arena->count;
+		store->blocks++;
+		store->rawBytes += raw;
+		store->storedBytes += stored;
+		store->head = (store->head + 1) % EVENT_STORE_ARENAS;
+		store->queued--;
+		pthread_cond_signal(&store->freedCondition);
+	}
+	pthread_mutex_unlock(&store->lock);
+
+	free(hashTable);
+	free(body);
+	return NULL;
+}
+
+int EventStoreOpen(EventStore* store, const char* filename, uint8_t source)
+{
+	unsigned char header[EVENT_STORE_HEADER_SIZE];
+	int index, column;
+
+	store->file = fopen(filename, "wb");
+	if (store->file == NULL) {
+		printf("Unable to open %s\n", filename);
+		return -1;
+	}
+	store->source = source;
+
+	for (index = 0; index < EVENT_STORE_ARENAS; index++) {
+		EventArena* arena = &store->arenas[index];
+		size_t offset = 0;
+		for (column = 0; column < EVENT_COLUMNS; column++) offset += EVENT_STORE_BLOCK * columnWidths[column];
+		arena->memory = malloc(offset);
+		if (arena->memory == NULL) {
+			printf("Out of memory for the event store\n");
+			return -1;
+		}
+		offset = 0;
+		for (column = 0; column < EVENT_COLUMNS; column++) {
+			arena->columns[column] = &arena->memory[offset];
+			offset += EVENT_STORE_BLOCK * columnWidths[column];
+		}
+		ArenaReset(arena);
+	}
+
+	memcpy(&header[0], EVENT_STORE_MAGIC, 4);
+	Put32(&header[4], EVENT_STORE_VERSION);
+	Put32(&header[8], EVENT_COLUMNS);
+	fwrite(header, 1, sizeof(header), store->file);
+
+	store->lastQueuedNs = GetTimeNs();
+	pthread_mutex_init(&store->lock, NULL);
+	pthread_cond_init(&store->queuedCondition, NULL);
+	pthread_cond_init(&store->freedCondition, NULL);
+	if (pthread_create(&store->thread, NULL, WriterThread, store) != 0) {
+		printf("Unable to start the event store writer\n");
+		fclose(store->file);
+		store->file = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queue the arena being filled and wait for a free one if the writer is behind
+ */
+static void QueueArena(EventStore* store)
+{
+	pthread_mutex_lock(&store->lock);
+	store->queued++;
+	pthread_cond_signal(&store->queuedCondition);
+	if (store->queued == EVENT_STORE_ARENAS) store->stalls++;
+	while (store->queued == EVENT_STORE_ARENAS) pthread_cond_wait(&store->freedCondition, &store->lock);
+	store->filling = (store->head + store->queued) % EVENT_STORE_ARENAS;
+	pthread_mutex_unlock(&store->lock);
+
+	ArenaReset(&store->arenas[store->filling]);
+	store->lastQueuedNs = GetTimeNs();
+}
+
+void EventStoreAdd(EventStore* store, uint64_t timeNs, const ItmRecord* record)
+{
+	if ((store->file == NULL) || (record->type == ITM_RECORD_SYNC)) return;
+
+	EventArena* arena = &store->arenas[store->filling];
+	unsigned char* time = &arena->columns[EVENT_COLUMN_TIME][arena->timeLength];
+	uint64_t delta;
+
+	if (arena->count == 0) arena->firstNs = arena->lastNs = timeNs;
+	if (timeNs < arena->lastNs) timeNs = arena->lastNs;
+	delta = timeNs - arena->lastNs;
+	arena->lastNs = timeNs;
+	while (delta >= 0x80) {
+		*time++ = (delta & 0x7F) | 0x80;
+		delta >>= 7;
+	}
+	*time++ = delta;
+	arena->timeLength = time - arena->columns[EVENT_COLUMN_TIME];
+
+	arena->columns[EVENT_COLUMN_PORT][arena->count] = record->port;
+	arena->columns[EVENT_COLUMN_TYPE][arena->count] = record->type;
+	arena->columns[EVENT_COLUMN_SIZE][arena->count] = record->size;
+	Put32(&arena->columns[EVENT_COLUMN_PAYLOAD][4 * arena->count], record->value);
+	arena->columns[EVENT_COLUMN_SOURCE][arena->count] = store->source;
+	arena->count++;
+
+	if (record->type == ITM_RECORD_STIMULUS) {
+		arena->portMask |= 1U << record->port;
+		arena->portCounts[record->port]++;
+	}
+	if (arena->count == EVENT_STORE_BLOCK) QueueArena(store);
+}
+
+/*
+ * Called after every trace read - a partly filled block is written once it is EVENT_STORE_FLUSH_MS old
+ */
+void EventStoreFlush(EventStore* store)
+{
+	if ((store->file == NULL) || (store->arenas[store->filling].count == 0)) return;
+	if (GetTimeNs() - store->lastQueuedNs >= EVENT_STORE_FLUSH_MS * 1000000ULL) QueueArena(store);
+}
+
+void EventStoreClose(EventStore* store)
+{
+	int index;
+
+	if (store->file == NULL) return;
+	if (store->arenas[store->filling].count > 0) QueueArena(store);
+
+	pthread_mutex_lock(&store->lock);
+	store->stopping = 1;
+	pthread_cond_signal(&store->queuedCondition);
+	pthread_mutex_unlock(&store->lock);
+	pthread_join(store->thread, NULL);
+
+	printf("Event store: %llu events in %llu blocks, %llu bytes of columns stored in %llu, %llu stalls\n",
+			store->events, store->blocks, store->rawBytes, store->storedBytes, store->stalls);
+	fclose(store->file);
+	store->file = NULL;
+	for (index = 0; index < EVENT_STORE_ARENAS; index++) free(store->arenas[index].memory);
+	pthread_mutex_destroy(&store->lock);
+	pthread_cond_destroy(&store->queuedCondition);
+	pthread_cond_destroy(&store->freedCondition);
+}
+
+/*
+ * Decompress one column of a block - the frames follow the directory in column order
+ */
+static int ReadColumn(const unsigned char* body, uint32_t bodySize, int column, unsigned char* destination)
+{
+	uint32_t offset = EVENT_COLUMNS * 8;
+	size_t consumed;
+	int i;
+
+	for (i = 0; i < column; i++) offset += Get32(&body[i * 8 + 4]);
+	uint32_t raw = Get32(&body[column * 8]);
+	uint32_t stored = Get32(&body[column * 8 + 4]);
+	if ((offset + stored > bodySize) || (raw > (uint32_t)(EVENT_STORE_BLOCK * columnWidths[column]))) return -1;
+	if (raw == 0) return 0;
+	return (Lz4ReadFrame(&body[offset], stored, destination, raw, &consumed) == raw) ? 0 : -1;
+}
+
+int EventStoreDump(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	unsigned char header[EVENT_STORE_BLOCK_HEADER];
+	unsigned char* columns[EVENT_COLUMNS];
+	unsigned char* body = NULL;
+	unsigned long long blocks = 0;
+	uint64_t start = 0;
+	int column, result = 0;
+	uint32_t i;
+
+	if (file == NULL) {
+		printf("Unable to open %s\n", filename);
+		return -1;
+	}
+	if ((fread(header, 1, EVENT_STORE_HEADER_SIZE, file) != EVENT_STORE_HEADER_SIZE) || (memcmp(header, EVENT_STORE_MAGIC, 4) != 0)) {
+		printf("%s is not an event store\n", filename);
+		fclose(file);
+		return -1;
+	}
+	for (column = 0; column < EVENT_COLUMNS; column++) columns[column] = malloc(EVENT_STORE_BLOCK * columnWidths[column]);
+
+	printf("#%13s %10s %4s %2s %4s %10s %3s\n", "time us", "delta ns", "type", "pt", "size", "payload", "src");
+	while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+		uint32_t count = Get32(&header[4]);
+		uint64_t time = Get32(&header[8]) | ((uint64_t) Get32(&header[12]) << 32);
+		uint64_t last = Get32(&header[16]) | ((uint64_t) Get32(&header[20]) << 32);
+		uint32_t bodySize = Get32(&header[28]);
+
+		free(body);
+		body = malloc(bodySize);
+		if ((memcmp(header, EVENT_STORE_BLOCK_MAGIC, 4) != 0) || (count > EVENT_STORE_BLOCK) || (body == NULL) ||
+				(bodySize < EVENT_COLUMNS * 8) || (fread(body, 1, bodySize, file) != bodySize)) {
+			printf("# truncated block\n");
+			break;
+		}
+		for (column = 0; column < EVENT_COLUMNS; column++) {
+			if ((columns[column] == NULL) || (ReadColumn(body, bodySize, column, columns[column]) != 0)) break;
+		}
+		if (column < EVENT_COLUMNS) {
+			printf("# corrupt block\n");
+			result = -1;
+			break;
+		}
+
+		if (blocks == 0) start = time;
+		printf("# block %llu: %u events, %llu to %llu ns, ports 0x%08x\n", blocks++, count,
+				(unsigned long long) time, (unsigned long long) last, Get32(&header[24]));
+		const unsigned char* pos = columns[EVENT_COLUMN_TIME];
+		const unsigned char* end = pos + Get32(&body[EVENT_COLUMN_TIME * 8]);
+		for (i = 0; i < count; i++) {
+			uint64_t delta = 0;
+			int shift = 0;
+			while ((pos < end) && (*pos & 0x80)) {
+				delta |= (uint64_t)(*pos++ & 0x7F) << shift;
+				shift += 7;
+			}
+			if (pos < end) delta |= (uint64_t)(*pos++) << shift;
+			time += delta;
+			uint8_t type = columns[EVENT_COLUMN_TYPE][i];
+			printf("%14.3f %10llu %s %2d %4d 0x%08x %3d\n", (time - start) / 1000.0, (unsigned long long) delta,
+					(type <= ITM_RECORD_JUNK) ? recordTypes[type] : "?   ", columns[EVENT_COLUMN_PORT][i], columns[EVENT_COLUMN_SIZE][i],
+					Get32(&columns[EVENT_COLUMN_PAYLOAD][4 * i]), columns[EVENT_COLUMN_SOURCE][i]);
+		}
+	}
+
+	free(body);
+	for (column = 0; column < EVENT_COLUMNS; column++) free(columns[column]);
+	fclose(file);
+	return result;
+}
@@ -0,0 +1,97 @@
+/*
+ * event-store.h
+ *
+ * Columnar store of the decoded events (--events FILE), for analysis without parsing the
+ * text trace. Every decoded packet but the syncs is an event: its host time (as for
+ * --timestamps), port, record type, payload size, payload and the probe it came from.
+ *
+ * Events are appended to the columns of an in-memory arena of EVENT_STORE_BLOCK events. A
+ * full arena (or one EVENT_STORE_FLUSH_MS old) is handed whole to a writer thread, which
+ * compresses each column as an LZ4 frame (lz4-frame.h) and writes the block, so adding an
+ * event is a few stores. The capture waits only if all EVENT_STORE_ARENAS are queued.
+ *
+ * File format (little endian):
+ *   header:     "STEV", u32 version, u32 column count
+ *   per block:  "STEB", u32 events, u64 first and last time (ns, CLOCK_MONOTONIC_RAW),
+ *               u32 mask of the stimulus ports present, u32 body size, u32 events per port[32]
+ *               (stimulus packets), then for each column u32 raw size and u32 stored size,
+ *               then each column as one LZ4 frame
+ * A reader can skip a block by its times or ports from the header alone, and decompress only
+ * the columns it needs. Columns, one value per event:
+ *   time        unsigned LEB128 varint of the ns since the previous event (the first since
+ *               the block's first time)
+ *   port        u8 stimulus port or DWT discriminator
+ *   type        u8 ITM_RECORD_* type
+ *   size        u8 payload bytes
+ *   payload     u32 payload, or the value of a local timestamp
+ *   source      u8 probe
+ * stlink-trace --events-dump FILE prints a store as text.
+ */
+
+#ifndef EVENT_STORE_H_
+#define EVENT_STORE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "itm-decode.h"
+
+#define EVENT_STORE_MAGIC           "STEV"
+#define EVENT_STORE_BLOCK_MAGIC     "STEB"
+#define EVENT_STORE_VERSION         1
+#define EVENT_STORE_BLOCK           65536	// events per block
+#define EVENT_STORE_ARENAS          4
+#define EVENT_STORE_FLUSH_MS        1000
+#define EVENT_STORE_HEADER_SIZE     12
+#define EVENT_STORE_BLOCK_HEADER    (32 + 4 * ITM_PORTS)
+
+#define EVENT_COLUMN_TIME           0
+#define EVENT_COLUMN_PORT           1
+#define EVENT_COLUMN_TYPE           2
+#define EVENT_COLUMN_SIZE           3
+#define EVENT_COLUMN_PAYLOAD        4
+#define EVENT_COLUMN_SOURCE         5
+#define EVENT_COLUMNS               6
+
+/*
+ * One block being filled or written: the columns are slices of one allocation
+ */
+typedef struct {
+	unsigned char* memory;
+	unsigned char* columns[EVENT_COLUMNS];
+	uint32_t timeLength;	// the other columns are count values long
+	uint32_t count;
+	uint64_t firstNs;
+	uint64_t lastNs;
+	uint32_t portMask;
+	uint32_t portCounts[ITM_PORTS];
+} EventArena;
+
+typedef struct {
+	FILE* file;
+	uint8_t source;
+	EventArena arenas[EVENT_STORE_ARENAS];
+	int head;				// oldest queued arena
+	int queued;
+	int filling;
+	int stopping;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queuedCondition;
+	pthread_cond_t freedCondition;
+	uint64_t lastQueuedNs;
+	// updated by the writer thread under lock
+	unsigned long long events;
+	unsigned long long blocks;
+	unsigned long long rawBytes;
+	unsigned long long storedBytes;
+	unsigned long long stalls;
+} EventStore;
+
+int EventStoreOpen(EventStore* store, const char* filename, uint8_t source);
+void EventStoreAdd(EventStore* store, uint64_t timeNs, const ItmRecord* record);
+void EventStoreFlush(EventStore* store);
+void EventStoreClose(EventStore* store);
+int EventStoreDump(const char* filename);
+
+#endif /* EVENT_STORE_H_ */
@@ -0,0 +1,296 @@
+/*
+ * func-trace.c
+ *
+ * Call stacks and Chrome trace events from function entry/exit markers (see func-trace.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "func-trace.h"
+
+#define EVENT_SIZE      512
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void Write(FuncTrace* trace, const char* text, int length)
+{
+	if ((length <= 0) || (length >= EVENT_SIZE)) return;
+	trace->output.write(&trace->output, (const unsigned char*) text, length);
+}
+
+int FuncTraceOpen(FuncTrace* trace, int port, const char* filename, unsigned long clockHz, SymbolIndex* symbols)
+{
+	if ((port < 0) || (port >= ITM_PORTS)) {
+		printf("Invalid function trace port %d\n", port);
+		return -1;
+	}
+	if (FileSinkOpen(&trace->output, filename) != 0) return -1;
+	trace->port = port;
+	trace->tickUs = 1e6 / ((clockHz > 0) ? clockHz : FUNC_TRACE_CLOCK);
+	trace->symbols = symbols;
+	trace->untracked.name = "(untracked)";
+	trace->enabled = 1;
+	Write(trace, "{\"traceEvents\":[\n", 17);
+	return 0;
+}
+
+/*
+ * Statistics entry of a function, the symbol looked up on its first call
+ */
+static FuncTraceFunction* Function(FuncTrace* trace, uint32_t address)
+{
+	uint32_t slot = (address >> 1) * 2654435761U;
+	int probe;
+
+	for (probe = 0; probe < FUNC_TRACE_FUNCTIONS; probe++) {
+		FuncTraceFunction* function = &trace->functions[(slot + probe) & (FUNC_TRACE_FUNCTIONS - 1)];
+		if (function->used && (function->address == address)) return function;
+		if (!function->used) {
+			// keep a quarter free so that the probes stay short
+			if (trace->functionCount >= FUNC_TRACE_FUNCTIONS * 3 / 4) break;
+			trace->functionCount++;
+			function->used = 1;
+			function->address = address;
+			if (trace->symbols != NULL) {
+				SymbolInfo info;
+				SymbolIndexLookup(trace->symbols, address, &info);
+				function->name = info.name;
+			}
+			return function;
+		}
+	}
+	return &trace->untracked;
+}
+
+static FuncTraceStack* Stack(FuncTrace* trace, int context)
+{
+	char text[EVENT_SIZE];
+
+	if (trace->stacks[context] == NULL) {
+		trace->stacks[context] = calloc(1, sizeof(FuncTraceStack));
+		if (trace->stacks[context] == NULL) {
+			printf("Out of memory for the function trace\n");
+			exit(-1);
+		}
+		// one thread per context in the viewer
+		if (context == 0) {
+			Write(trace, text, snprintf(text, sizeof(text), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"thread mode\"}}",
+					(trace->events++ > 0) ? ",\n" : ""));
+		}
+		else {
+			Write(trace, text, snprintf(text, sizeof(text), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"exception %d\"}}",
+					(trace->events++ > 0) ? ",\n" : "", context, context));
+		}
+	}
+	return trace->stacks[context];
+}
+
+static int Current(FuncTrace* trace)
+{
+	if (trace->nesting == 0) {
+		trace->contexts[0] = 0;
+		trace->nesting = 1;
+	}
+	return trace->contexts[trace->nesting - 1];
+}
+
+/*
+ * Return from a preemption to the context at the given level - the time it was preempted is
+ * not exclusive time of its running function
+ */
+static void Resume(FuncTrace* trace, int level)
+{
+	FuncTraceStack* stack = Stack(trace, trace->contexts[level]);
+
+	trace->nesting = level + 1;
+	if (stack->depth > 0) stack->frames[stack->depth - 1].excluded += trace->now - trace->preempted[level];
+}
+
+static void SwitchContext(FuncTrace* trace, int context)
+{
+	int level;
+
+	if (context == Current(trace)) return;
+	for (level = trace->nesting - 2; level >= 0; level--) {
+		if (trace->contexts[level] == context) {
+			// the handler exits were lost
+			Resume(trace, level);
+			return;
+		}
+	}
+	if (trace->nesting == FUNC_TRACE_NESTING) trace->nesting--;
+	trace->preempted[trace->nesting - 1] = trace->now;
+	trace->contexts[trace->nesting++] = context;
+}
+
+/*
+ * A call returned - write its event and add its time to the statistics
+ */
+static void Return(FuncTrace* trace, int context, FuncTraceStack* stack)
+{
+	FuncTraceFrame* frame = &stack->frames[--stack->depth];
+	FuncTraceFunction* function = frame->function;
+	uint64_t inclusive = trace->now - frame->start;
+	uint64_t exclusive = (inclusive > frame->excluded) ? inclusive - frame->excluded : 0;
+	char name[16];
+	char text[EVENT_SIZE];
+
+	if (stack->depth > 0) stack->frames[stack->depth - 1].excluded += inclusive;
+	function->calls++;
+	function->inclusive += inclusive;
+	function->exclusive += exclusive;
+
+	if (function->name == NULL) snprintf(name, sizeof(name), "0x%08x", frame->address);
+	Write(trace, text, snprintf(text, sizeof(text), "%s{\"name\":\"%.200s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{\"self_us\":%.3f}}",
+			(trace->events++ > 0) ? ",\n" : "", (function->name != NULL) ? function->name : name,
+			frame->start * trace->tickUs, inclusive * trace->tickUs, context, exclusive * trace->tickUs));
+}
+
+static void Marker(FuncTrace* trace, uint32_t value, int size)
+{
+	if (size == 2) {
+		SwitchContext(trace, value & (FUNC_TRACE_CONTEXTS - 1));
+		return;
+	}
+	if (size != 4) return;
+
+	int context = Current(trace);
+	FuncTraceStack* stack = Stack(trace, context);
+	uint32_t address = value & ~1U;
+	int depth;
+
+	if ((value & 1) == 0) {
+		if (stack->depth == FUNC_TRACE_DEPTH) {
+			stack->lost++;
+			return;
+		}
+		stack->frames[stack->depth].address = address;
+		stack->frames[stack->depth].function = Function(trace, address);
+		stack->frames[stack->depth].start = trace->now;
+		stack->frames[stack->depth].excluded = 0;
+		stack->depth++;
+		return;
+	}
+
+	if (stack->lost > 0) {
+		stack->lost--;
+		return;
+	}
+	// an exit without its entry (lost to an overflow) is skipped, and the frames above
+	// a matching entry are closed with it
+	for (depth = stack->depth - 1; depth >= 0; depth--) {
+		if (stack->frames[depth].address == address) break;
+	}
+	if (depth < 0) {
+		trace->mismatches++;
+		return;
+	}
+	if (depth < stack->depth - 1) trace->mismatches++;
+	while (stack->depth > depth) Return(trace, context, stack);
+
+	// the handler has returned to the context it preempted
+	if ((stack->depth == 0) && (trace->nesting > 1)) Resume(trace, trace->nesting - 2);
+}
+
+static void ProcessPending(FuncTrace* trace)
+{
+	int i;
+
+	for (i = 0; i < trace->pendingCount; i++) Marker(trace, trace->pending[i], trace->pendingSize[i]);
+	trace->pendingCount = 0;
+}
+
+/*
+ * ItmDecoder records: the markers on the port, and the local timestamps that time them
+ */
+void FuncTraceRecord(FuncTrace* trace, const ItmRecord* record)
+{
+	if (!trace->enabled) return;
+
+	switch (record->type) {
+	case ITM_RECORD_STIMULUS:
+		if (record->port != trace->port) return;
+		if (trace->hostTime) {
+			trace->now = (GetTimeNs() - trace->hostStartNs);
+			Marker(trace, record->value, record->size);
+			return;
+		}
+		if ((trace->pendingCount == FUNC_TRACE_PENDING) && (trace->now > 0)) {
+			// timestamps were seen - these markers share the last one
+			ProcessPending(trace);
+		}
+		if (trace->pendingCount == FUNC_TRACE_PENDING) {
+			printf("Function trace: no ITM timestamps - using the host time\n");
+			trace->hostTime = 1;
+			trace->hostStartNs = GetTimeNs();
+			trace->tickUs = 1e-3;
+			trace->now = 0;
+			ProcessPending(trace);
+			Marker(trace, record->value, record->size);
+			return;
+		}
+		trace->pending[trace->pendingCount] = record->value;
+		trace->pendingSize[trace->pendingCount] = record->size;
+		trace->pendingCount++;
+		break;
+
+	case ITM_RECORD_TIMESTAMP:
+		if (trace->hostTime) return;
+		trace->now += record->value;
+		ProcessPending(trace);
+		break;
+
+	case ITM_RECORD_OVERFLOW:
+		// markers were lost - the stacks are unwound by the exits that follow
+		trace->overflows++;
+		break;
+	}
+}
+
+static int CompareExclusive(const void* a, const void* b)
+{
+	const FuncTraceFunction* left = a;
+	const FuncTraceFunction* right = b;
+	return (left->exclusive < right->exclusive) - (left->exclusive > right->exclusive);
+}
+
+void FuncTraceClose(FuncTrace* trace)
+{
+	unsigned long long calls = 0;
+	int context, i;
+	char name[16];
+
+	if (!trace->enabled) return;
+	trace->enabled = 0;
+	ProcessPending(trace);
+
+	// the calls still open end at the last marker
+	for (context = 0; context < FUNC_TRACE_CONTEXTS; context++) {
+		FuncTraceStack* stack = trace->stacks[context];
+		if (stack == NULL) continue;
+		while (stack->depth > 0) Return(trace, context, stack);
+		free(stack);
+		trace->stacks[context] = NULL;
+	}
+	Write(trace, "\n]}\n", 4);
+	trace->output.close(&trace->output);
+
+	qsort(trace->functions, FUNC_TRACE_FUNCTIONS, sizeof(FuncTraceFunction), CompareExclusive);
+	for (i = 0; i < FUNC_TRACE_FUNCTIONS; i++) calls += trace->functions[i].calls;
+	printf("Function trace: %llu calls of %d functions, %llu untracked, %llu mismatched exits, %llu overflows\n",
+			calls, trace->functionCount, trace->untracked.calls, trace->mismatches, trace->overflows);
+	for (i = 0; (i < FUNC_TRACE_REPORT) && (trace->functions[i].calls > 0); i++) {
+		FuncTraceFunction* function = &trace->functions[i];
+		if (function->name == NULL) snprintf(name, sizeof(name), "0x%08x", function->address);
+		printf("  %12.1f us self %12.1f us total %10llu calls  %s\n", function->exclusive * trace->tickUs, function->inclusive * trace->tickUs,
+				function->calls, (function->name != NULL) ? function->name : name);
+	}
+}
@@ -0,0 +1,87 @@
+/*
+ * func-trace.h
+ *
+ * Function entry/exit tracing (--func-trace PORT) from the -finstrument-functions hooks of
+ * target/func-trace.h. The markers on the port rebuild a call stack per context (thread
+ * mode and each exception number). A context that preempts another stays on top until the
+ * stack of its handler is empty again.
+ *
+ * Markers are timed by the ITM local timestamps (CPU cycles, --func-trace-clock Hz): the
+ * timestamp packet after a marker gives its time. Without timestamps the host time of the
+ * trace read is used, which only separates calls more than a read apart.
+ *
+ * Each call is written when it returns as a Chrome trace complete event ("ph":"X", one
+ * thread per context) with its exclusive time in the args - load the file in Perfetto or
+ * chrome://tracing for a flame chart. Events go out through a file sink as they complete,
+ * so only the open frames are held. Exclusive time leaves out the callees and the time the
+ * context was preempted. The functions with the most exclusive time are printed at the end.
+ */
+
+#ifndef FUNC_TRACE_H_
+#define FUNC_TRACE_H_
+
+#include <stdint.h>
+#include "itm-decode.h"
+#include "trace-sink.h"
+#include "symbol-index.h"
+
+#define FUNC_TRACE_PORT             30
+#define FUNC_TRACE_CLOCK            72000000
+#define FUNC_TRACE_DEPTH            256		// frames per context
+#define FUNC_TRACE_CONTEXTS         512		// IPSR exception numbers
+#define FUNC_TRACE_NESTING          16		// preempted contexts
+#define FUNC_TRACE_PENDING          64		// markers waiting for a timestamp
+#define FUNC_TRACE_FUNCTIONS        4096	// power of 2
+#define FUNC_TRACE_REPORT           20		// functions in the summary
+
+typedef struct {
+	uint32_t address;
+	int used;
+	unsigned long long calls;
+	uint64_t inclusive;
+	uint64_t exclusive;
+	const char* name;		// NULL without a symbol
+} FuncTraceFunction;
+
+typedef struct {
+	uint32_t address;
+	FuncTraceFunction* function;
+	uint64_t start;
+	uint64_t excluded;		// callees and preemption
+} FuncTraceFrame;
+
+typedef struct {
+	FuncTraceFrame frames[FUNC_TRACE_DEPTH];
+	int depth;
+	int lost;				// frames deeper than FUNC_TRACE_DEPTH
+} FuncTraceStack;
+
+typedef struct {
+	int enabled;
+	int port;
+	double tickUs;			// time unit in microseconds
+	SymbolIndex* symbols;	// NULL without an ELF file
+	TraceSink output;
+	unsigned long long events;
+	FuncTraceStack* stacks[FUNC_TRACE_CONTEXTS];
+	uint16_t contexts[FUNC_TRACE_NESTING];	// contexts[nesting - 1] is running
+	uint64_t preempted[FUNC_TRACE_NESTING];
+	int nesting;
+	uint64_t now;			// cycles from the local timestamps, or host ns
+	int hostTime;
+	uint64_t hostStartNs;
+	uint32_t pending[FUNC_TRACE_PENDING];
+	uint8_t pendingSize[FUNC_TRACE_PENDING];
+	int pendingCount;
+	FuncTraceFunction functions[FUNC_TRACE_FUNCTIONS];
+	int functionCount;
+	FuncTraceFunction untracked;	// calls of functions beyond FUNC_TRACE_FUNCTIONS
+	unsigned long long mismatches;
+	unsigned long long overflows;
+} FuncTrace;
+
+int FuncTraceOpen(FuncTrace* trace, int port, const char* filename, unsigned long clockHz, SymbolIndex* symbols);
+void FuncTraceRecord(FuncTrace* trace, const ItmRecord* record);
+void FuncTraceClose(FuncTrace* trace);
+
+#endif /* FUNC_TRACE_H_ */
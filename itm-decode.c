@@ -0,0 +1,131 @@
+/*
+ * itm-decode.c
+ *
+ * ITM/DWT packet decoder (see itm-decode.h).
+ */
+
+#include <string.h>
+#include "itm-decode.h"
+
+#define STATE_HEADER        0
+#define STATE_PAYLOAD       1
+#define STATE_SYNC          2
+#define STATE_TIMESTAMP     3
+#define STATE_CONTINUATION  4	// bytes of packets that are skipped
+
+void ItmDecoderInit(ItmDecoder* decoder, ItmRecordCallback callback, void* context)
+{
+	memset(decoder, 0, sizeof(ItmDecoder));
+	decoder->callback = callback;
+	decoder->context = context;
+}
+
+/*
+ * 1 between packets - decoding can restart here with a fresh decoder and give the same records
+ */
+int ItmDecoderIdle(const ItmDecoder* decoder)
+{
+	return decoder->state == STATE_HEADER;
+}
+
+static inline void Emit(ItmDecoder* decoder, uint8_t type, size_t offset)
+{
+	decoder->record.type = type;
+	decoder->record.offset = offset;
+	decoder->records++;
+	decoder->callback(decoder->context, &decoder->record);
+}
+
+void ItmDecode(ItmDecoder* decoder, const unsigned char* data, size_t length)
+{
+	ItmRecord* record = &decoder->record;
+	size_t pos;
+
+	for (pos = 0; pos < length; pos++) {
+		unsigned char ch = data[pos];
+
+		switch (decoder->state) {
+		case STATE_PAYLOAD:
+			record->payload[record->size] = ch;
+			record->value |= (uint32_t)ch << (8 * record->size);
+			record->size++;
+			if (--decoder->remaining == 0) {
+				decoder->state = STATE_HEADER;
+				Emit(decoder, record->type, pos);
+			}
+			continue;
+
+		case STATE_SYNC:
+			if (ch == 0x00) {
+				decoder->zeros++;
+				continue;
+			}
+			decoder->state = STATE_HEADER;
+			if ((ch == 0x80) && (decoder->zeros >= 5)) {
+				decoder->syncs++;
+				record->size = 0;
+				Emit(decoder, ITM_RECORD_SYNC, pos);
+				continue;
+			}
+			// not a sync - the zeros were junk, try the byte as a header
+			decoder->junk += decoder->zeros;
+			break;
+
+		case STATE_TIMESTAMP:
+			record->value |= (uint32_t)(ch & 0x7F) << (7 * decoder->remaining);
+			decoder->remaining++;
+			if (((ch & 0x80) == 0) || (decoder->remaining == 4)) {
+				decoder->state = (ch & 0x80) ? STATE_CONTINUATION : STATE_HEADER;
+				Emit(decoder, ITM_RECORD_TIMESTAMP, pos);
+			}
+			continue;
+
+		case STATE_CONTINUATION:
+			if ((ch & 0x80) == 0) decoder->state = STATE_HEADER;
+			continue;
+		}
+
+		// header byte
+		if (ch & 0x03) {
+			record->port = ch >> 3;
+			record->type = (ch & 0x04) ? ITM_RECORD_HARDWARE : ITM_RECORD_STIMULUS;
+			record->size = 0;
+			record->value = 0;
+			decoder->remaining = ((ch & 0x03) == 3) ? 4 : (ch & 0x03);
+			decoder->state = STATE_PAYLOAD;
+		}
+		else if (ch == 0x00) {
+			decoder->zeros = 1;
+			decoder->state = STATE_SYNC;
+		}
+		else if (ch == 0x70) {
+			decoder->overflows++;
+			record->size = 0;
+			Emit(decoder, ITM_RECORD_OVERFLOW, pos);
+		}
+		else if ((ch & 0x0F) == 0x00) {
+			// local timestamp, either in the header or in up to 4 continuation bytes
+			record->size = 0;
+			if (ch & 0x80) {
+				record->value = 0;
+				decoder->remaining = 0;
+				decoder->state = STATE_TIMESTAMP;
+			}
+			else {
+				record->value = (ch >> 4) & 0x07;
+				Emit(decoder, ITM_RECORD_TIMESTAMP, pos);
+			}
+		}
+		else if ((ch == 0x94) || (ch == 0xB4) || (((ch & 0x0B) == 0x08) && (ch & 0x80))) {
+			// global timestamps and extensions are not used - skip them
+			decoder->state = STATE_CONTINUATION;
+		}
+		else if ((ch & 0x0B) != 0x08) {
+			decoder->junk++;
+			record->size = 1;
+			record->payload[0] = ch;
+			record->value = ch;
+			Emit(decoder, ITM_RECORD_JUNK, pos);
+		}
+	}
+}
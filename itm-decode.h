@@ -0,0 +1,59 @@
+/*
+ * itm-decode.h
+ *
+ * Streaming decoder for the ITM/DWT packet protocol as received on SWO.
+ * Packets may be split across reads - the decoder keeps its state between calls.
+ *
+ * Header bytes:
+ *   0x00 ...0x00 0x80           synchronisation (at least 5 zero bytes)
+ *   0x70                        overflow
+ *   pppppSss (ss != 0)          stimulus port (S = 0) or hardware (S = 1) source, 1/2/4 payload bytes
+ *   cddd0000                    local timestamp, c = continuation bytes follow
+ *   0x94 / 0xB4                 global timestamp 1 / 2, continuation bytes follow
+ *   cxxx1s00                    extension, c = continuation bytes follow
+ */
+
+#ifndef ITM_DECODE_H_
+#define ITM_DECODE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ITM_PORTS                   32
+
+#define ITM_RECORD_STIMULUS         0	// software source - port is the stimulus port
+#define ITM_RECORD_HARDWARE         1	// DWT source - port is the discriminator
+#define ITM_RECORD_TIMESTAMP        2	// value is the local timestamp delta
+#define ITM_RECORD_OVERFLOW         3
+#define ITM_RECORD_SYNC             4
+#define ITM_RECORD_JUNK             5	// a byte that is not a valid header
+
+typedef struct {
+	uint8_t type;
+	uint8_t port;
+	uint8_t size;			// payload bytes
+	uint8_t payload[4];
+	uint32_t value;			// payload or timestamp, little endian
+	uint32_t offset;		// offset of the last byte of the packet in the data passed to ItmDecode()
+} ItmRecord;
+
+typedef void (*ItmRecordCallback)(void* context, const ItmRecord* record);
+
+typedef struct {
+	int state;
+	int remaining;
+	int zeros;
+	ItmRecord record;
+	ItmRecordCallback callback;
+	void* context;
+	unsigned long long records;
+	unsigned long long overflows;
+	unsigned long long syncs;
+	unsigned long long junk;
+} ItmDecoder;
+
+void ItmDecoderInit(ItmDecoder* decoder, ItmRecordCallback callback, void* context);
+void ItmDecode(ItmDecoder* decoder, const unsigned char* data, size_t length);
+int ItmDecoderIdle(const ItmDecoder* decoder);
+
+#endif /* ITM_DECODE_H_ */
@@ -0,0 +1,47 @@
+/*
+ * low-latency.c
+ *
+ * CPU pinning and real-time scheduling for the capture thread (see low-latency.h).
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "low-latency.h"
+
+/*
+ * Each step needs privileges (CAP_SYS_NICE, CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK):
+ * a failed step is reported and the capture carries on without it. Returns -1 if any failed.
+ */
+int LowLatencyEnter(int cpu)
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+	int ret = 0;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+		printf("Unable to pin the capture to CPU %d: %s\n", cpu, strerror(errno));
+		ret = -1;
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = LOW_LATENCY_PRIORITY;
+	if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+		printf("Unable to set SCHED_FIFO priority %d: %s\n", LOW_LATENCY_PRIORITY, strerror(errno));
+		ret = -1;
+	}
+
+	// no page faults on the capture path
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		printf("Unable to lock the memory: %s\n", strerror(errno));
+		ret = -1;
+	}
+
+	printf("Low-latency capture on CPU %d%s\n", cpu, (ret == 0) ? "" : " (partly applied)");
+	return ret;
+}
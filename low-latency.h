@@ -0,0 +1,17 @@
+/*
+ * low-latency.h
+ *
+ * Low-latency capture (--low-latency CPU): the capture thread is pinned to one CPU, runs
+ * under SCHED_FIFO with all its memory locked, and polls the probe without sleeping.
+ * Threads started before LowLatencyEnter() (the compression threads) keep the normal
+ * scheduling, those started later inherit it.
+ */
+
+#ifndef LOW_LATENCY_H_
+#define LOW_LATENCY_H_
+
+#define LOW_LATENCY_PRIORITY    80
+
+int LowLatencyEnter(int cpu);
+
+#endif /* LOW_LATENCY_H_ */
@@ -0,0 +1,403 @@
+/*
+ * lz4-frame.c
+ *
+ * LZ4 block and frame format (see lz4-frame.h).
+ *
+ * Block format: sequences of
+ *   token (literal length << 4 | match length - 4), [literal length bytes], literals,
+ *   match offset (16 bit), [match length bytes]
+ * with 15 in a token nibble meaning further length bytes follow (255 = more). The last
+ * sequence is literals only; the last 5 bytes are always literals and the last match
+ * starts at least 12 bytes before the end of the block.
+ *
+ * The compressor is greedy with a single hash table of 4 byte sequences, which is what
+ * gives LZ4 its speed. Incompressible input is stored as an uncompressed block.
+ */
+
+#include <string.h>
+#include "lz4-frame.h"
+
+#define MIN_MATCH       4
+#define LAST_LITERALS   5
+#define MF_LIMIT        12
+#define MAX_OFFSET      65535
+
+#define PRIME32_1       2654435761U
+#define PRIME32_2       2246822519U
+#define PRIME32_3       3266489917U
+#define PRIME32_4       668265263U
+#define PRIME32_5       374761393U
+
+static uint32_t Read32(const unsigned char* data)
+{
+	uint32_t value;
+	memcpy(&value, data, 4);	// unaligned, host is little endian
+	return value;
+}
+
+static void Write32(unsigned char* data, uint32_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+}
+
+static uint32_t RotateLeft(uint32_t value, int count)
+{
+	return (value << count) | (value >> (32 - count));
+}
+
+static uint32_t XxhRound(uint32_t accumulator, uint32_t input)
+{
+	accumulator += input * PRIME32_2;
+	return RotateLeft(accumulator, 13) * PRIME32_1;
+}
+
+uint32_t Xxh32(const void* data, size_t length, uint32_t seed)
+{
+	const unsigned char* pos = data;
+	const unsigned char* end = pos + length;
+	uint32_t hash;
+
+	if (length >= 16) {
+		uint32_t v1 = seed + PRIME32_1 + PRIME32_2;
+		uint32_t v2 = seed + PRIME32_2;
+		uint32_t v3 = seed;
+		uint32_t v4 = seed - PRIME32_1;
+
+		do {
+			v1 = XxhRound(v1, Read32(pos));
+			v2 = XxhRound(v2, Read32(pos + 4));
+			v3 = XxhRound(v3, Read32(pos + 8));
+			v4 = XxhRound(v4, Read32(pos + 12));
+			pos += 16;
+		} while (pos <= end - 16);
+
+		hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+	}
+	else {
+		hash = seed + PRIME32_5;
+	}
+
+	hash += (uint32_t)length;
+	for (; pos + 4 <= end; pos += 4) hash = RotateLeft(hash + Read32(pos) * PRIME32_3, 17) * PRIME32_4;
+	for (; pos < end; pos++) hash = RotateLeft(hash + (*pos) * PRIME32_5, 11) * PRIME32_1;
+
+	hash ^= hash >> 15;
+	hash *= PRIME32_2;
+	hash ^= hash >> 13;
+	hash *= PRIME32_3;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static uint32_t Hash(uint32_t sequence)
+{
+	return (sequence * PRIME32_1) >> (32 - LZ4_HASH_LOG);
+}
+
+static unsigned char* WriteLength(unsigned char* out, size_t length)
+{
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+}
+
+/*
+ * Returns the compressed size, or 0 if the output does not fit in capacity.
+ * hashTable must hold LZ4_HASH_SIZE entries; it is cleared here.
+ */
+int Lz4CompressBlock(const unsigned char* source, int sourceSize, unsigned char* destination, int capacity, uint32_t* hashTable)
+{
+	const unsigned char* in = source;
+	const unsigned char* anchor = source;
+	const unsigned char* end = source + sourceSize;
+	const unsigned char* matchLimit = end - LAST_LITERALS;
+	const unsigned char* mfLimit = end - MF_LIMIT;
+	unsigned char* out = destination;
+	unsigned char* outEnd = destination + capacity;
+	unsigned int misses = 0;
+
+	memset(hashTable, 0, LZ4_HASH_SIZE * sizeof(uint32_t));
+
+	if (sourceSize >= MF_LIMIT + 1) {
+		while (in < mfLimit) {
+			uint32_t sequence = Read32(in);
+			uint32_t hash = Hash(sequence);
+			const unsigned char* match = source + hashTable[hash];
+			hashTable[hash] = in - source;
+
+			if ((match >= in) || (in - match > MAX_OFFSET) || (Read32(match) != sequence)) {
+				// skip faster through data that does not compress
+				in += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+
+			// extend the match backwards over the pending literals, then forwards
+			while ((in > anchor) && (match > source) && (in[-1] == match[-1])) {
+				in--;
+				match--;
+			}
+			const unsigned char* matchEnd = in + MIN_MATCH;
+			const unsigned char* reference = match + MIN_MATCH;
+			while ((matchEnd < matchLimit) && (*matchEnd == *reference)) {
+				matchEnd++;
+				reference++;
+			}
+
+			size_t literals = in - anchor;
+			size_t matchLength = matchEnd - in - MIN_MATCH;
+			if (out + 1 + literals / 255 + 1 + literals + 2 + matchLength / 255 + 1 > outEnd) return 0;
+
+			unsigned char* token = out++;
+			*token = ((literals >= 15) ? 15 : literals) << 4;
+			if (literals >= 15) out = WriteLength(out, literals - 15);
+			memcpy(out, anchor, literals);
+			out += literals;
+
+			*out++ = (in - match) & 0xFF;
+			*out++ = (in - match) >> 8;
+
+			*token |= (matchLength >= 15) ? 15 : matchLength;
+			if (matchLength >= 15) out = WriteLength(out, matchLength - 15);
+
+			in = anchor = matchEnd;
+			if (in < mfLimit) hashTable[Hash(Read32(in - 2))] = in - 2 - source;
+		}
+	}
+
+	// last literals
+	size_t literals = end - anchor;
+	if (out + 1 + literals / 255 + 1 + literals > outEnd) return 0;
+	*out++ = ((literals >= 15) ? 15 : literals) << 4;
+	if (literals >= 15) out = WriteLength(out, literals - 15);
+	memcpy(out, anchor, literals);
+	out += literals;
+
+	return out - destination;
+}
+
+/*
+ * Returns the decompressed size, or -1 if the block is invalid or does not fit in capacity
+ */
+int Lz4DecompressBlock(const unsigned char* source, int sourceSize, unsigned char* destination, int capacity)
+{
+	const unsigned char* in = source;
+	const unsigned char* inEnd = source + sourceSize;
+	unsigned char* out = destination;
+	unsigned char* outEnd = destination + capacity;
+
+	while (in < inEnd) {
+		unsigned int token = *in++;
+		size_t literals = token >> 4;
+		if (literals == 15) {
+			unsigned char extra;
+			do {
+				if (in >= inEnd) return -1;
+				extra = *in++;
+				literals += extra;
+			} while (extra == 255);
+		}
+		if (((size_t)(inEnd - in) < literals) || ((size_t)(outEnd - out) < literals)) return -1;
+		memcpy(out, in, literals);
+		in += literals;
+		out += literals;
+
+		// the last sequence has no match
+		if (in == inEnd) break;
+
+		if (inEnd - in < 2) return -1;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		if ((offset == 0) || (offset > (size_t)(out - destination))) return -1;
+
+		size_t matchLength = token & 15;
+		if (matchLength == 15) {
+			unsigned char extra;
+			do {
+				if (in >= inEnd) return -1;
+				extra = *in++;
+				matchLength += extra;
+			} while (extra == 255);
+		}
+		matchLength += MIN_MATCH;
+		if ((size_t)(outEnd - out) < matchLength) return -1;
+
+		// byte by byte as the match may overlap the output
+		const unsigned char* match = out - offset;
+		while (matchLength-- > 0) *out++ = *match++;
+	}
+
+	return out - destination;
+}
+
+static int BlockSizeCode(size_t length)
+{
+	if (length <= 64 * 1024) return 4;
+	if (length <= 256 * 1024) return 5;
+	if (length <= 1024 * 1024) return 6;
+	return 7;
+}
+
+static size_t BlockSize(int code)
+{
+	return (size_t)1 << (8 + 2 * code);
+}
+
+/*
+ * Writes one frame holding length bytes (at most LZ4_MAX_BLOCK_SIZE) - destination must
+ * hold LZ4_FRAME_BOUND(length) bytes. Returns the frame size.
+ */
+size_t Lz4WriteFrame(const unsigned char* source, size_t length, unsigned char* destination, uint32_t* hashTable)
+{
+	unsigned char* out = destination;
+
+	Write32(out, LZ4_FRAME_MAGIC);
+	out[4] = 0x60;		// version 01, independent blocks, no checksums, no content size
+	out[5] = BlockSizeCode(length) << 4;
+	out[6] = (Xxh32(&out[4], 2, 0) >> 8) & 0xFF;
+	out += LZ4_FRAME_HEADER_SIZE;
+
+	int compressed = Lz4CompressBlock(source, length, out + 4, length, hashTable);
+	if (compressed > 0) {
+		Write32(out, compressed);
+		out += 4 + compressed;
+	}
+	else {
+		// stored - the high bit marks an uncompressed block
+		Write32(out, length | 0x80000000U);
+		memcpy(out + 4, source, length);
+		out += 4 + length;
+	}
+
+	Write32(out, 0);	// end mark
+	return out + 4 - destination;
+}
+
+/*
+ * Reads one frame written by Lz4WriteFrame() (or any frame without checksums or dictionary).
+ * Returns the decompressed size and sets consumed to the frame size, or returns 0 with
+ * consumed = 0 if the frame is invalid or incomplete.
+ */
+size_t Lz4ReadFrame(const unsigned char* source, size_t sourceSize, unsigned char* destination, size_t capacity, size_t* consumed)
+{
+	const unsigned char* in = source;
+	const unsigned char* inEnd = source + sourceSize;
+	size_t total = 0;
+
+	*consumed = 0;
+	if ((sourceSize < LZ4_FRAME_HEADER_SIZE + 4) || (Read32(in) != LZ4_FRAME_MAGIC)) return 0;
+	if ((in[4] & 0xDF) != 0x40) return 0;	// version 01, no checksums, no content size, no dictionary
+	size_t maxBlock = BlockSize((in[5] >> 4) & 7);
+	in += LZ4_FRAME_HEADER_SIZE;
+
+	while (1) {
+		if (inEnd - in < 4) return 0;
+		uint32_t blockSize = Read32(in);
+		in += 4;
+		if (blockSize == 0) break;
+
+		size_t size = blockSize & 0x7FFFFFFF;
+		if ((size > maxBlock) || ((size_t)(inEnd - in) < size)) return 0;
+
+		if (blockSize & 0x80000000U) {
+			if (capacity - total < size) return 0;
+			memcpy(destination + total, in, size);
+			total += size;
+		}
+		else {
+			int decompressed = Lz4DecompressBlock(in, size, destination + total, capacity - total);
+			if (decompressed < 0) return 0;
+			total += decompressed;
+		}
+		in += size;
+	}
+
+	*consumed = in - source;
+	return total;
+}
+
+/*
+ * Reads the next frame header, block or end mark from source. Returns the bytes written to
+ * destination and sets consumed to the bytes read from source, with consumed = 0 if source
+ * does not hold all of the next part yet. Returns -1 with reader->error set if the data is
+ * not a frame that can be read.
+ */
+int Lz4ReadBlock(Lz4Reader* reader, const unsigned char* source, size_t sourceSize, unsigned char* destination, size_t capacity, size_t* consumed)
+{
+	*consumed = 0;
+
+	if (!reader->inFrame) {
+		if (sourceSize < 8) return 0;
+		uint32_t magic = Read32(source);
+		if ((magic & 0xFFFFFFF0U) == LZ4_SKIPPABLE_MAGIC) {
+			size_t size = (size_t)8 + Read32(source + 4);
+			if (sourceSize >= size) *consumed = size;
+			return 0;
+		}
+		if (magic != LZ4_FRAME_MAGIC) {
+			reader->error = "Not an LZ4 frame";
+			return -1;
+		}
+
+		unsigned char flags = source[4];
+		size_t headerSize = LZ4_FRAME_HEADER_SIZE + ((flags & 0x08) ? 8 : 0) + ((flags & 0x01) ? 4 : 0);
+		if (sourceSize < headerSize) return 0;
+		if (((flags >> 6) != 1) || (((source[5] >> 4) & 7) < 4) || (source[headerSize - 1] != ((Xxh32(&source[4], headerSize - 5, 0) >> 8) & 0xFF))) {
+			reader->error = "Invalid LZ4 frame header";
+			return -1;
+		}
+		if ((flags & 0x20) == 0) {
+			reader->error = "LZ4 frames with linked blocks (lz4 -BD) are not supported";
+			return -1;
+		}
+		if (flags & 0x01) {
+			reader->error = "LZ4 frames with a dictionary are not supported";
+			return -1;
+		}
+		reader->maxBlock = BlockSize((source[5] >> 4) & 7);
+		reader->blockChecksum = (flags & 0x10) != 0;
+		reader->contentChecksum = (flags & 0x04) != 0;
+		reader->inFrame = 1;
+		*consumed = headerSize;
+		return 0;
+	}
+
+	if (sourceSize < 4) return 0;
+	uint32_t blockSize = Read32(source);
+	if (blockSize == 0) {
+		size_t size = 4 + (reader->contentChecksum ? 4 : 0);
+		if (sourceSize < size) return 0;
+		reader->inFrame = 0;
+		*consumed = size;
+		return 0;
+	}
+
+	size_t size = blockSize & 0x7FFFFFFF;
+	size_t blockEnd = 4 + size + (reader->blockChecksum ? 4 : 0);
+	if (size > reader->maxBlock) {
+		reader->error = "Invalid LZ4 block size";
+		return -1;
+	}
+	if (sourceSize < blockEnd) return 0;
+
+	int length;
+	if (blockSize & 0x80000000U) {
+		length = (capacity < size) ? -1 : (int)size;
+		if (length >= 0) memcpy(destination, source + 4, size);
+	}
+	else {
+		length = Lz4DecompressBlock(source + 4, size, destination, (capacity < reader->maxBlock) ? capacity : reader->maxBlock);
+	}
+	if (length < 0) {
+		reader->error = "Invalid LZ4 block";
+		return -1;
+	}
+	*consumed = blockEnd;
+	return length;
+}
@@ -0,0 +1,50 @@
+/*
+ * lz4-frame.h
+ *
+ * Dependency free LZ4 block compressor/decompressor and LZ4 frame writer.
+ * The output can be read with the standard lz4 tools (lz4 -d capture.txt.lz4).
+ *
+ * Each call to Lz4WriteFrame() produces a complete, independent frame holding one
+ * block: magic, frame descriptor (block independence, no checksums), the block and
+ * the end mark. Frames can be concatenated, and each can be decompressed on its own,
+ * so a capture can be read from any frame boundary.
+ *
+ * Lz4ReadBlock() reads concatenated frames a block at a time, so a frame may be larger than
+ * the output buffer. It also takes frames from the lz4 tool: block and content checksums are
+ * skipped without being checked, and frames with linked blocks (lz4 -BD) or a dictionary
+ * are rejected.
+ */
+
+#ifndef LZ4_FRAME_H_
+#define LZ4_FRAME_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZ4_FRAME_MAGIC         0x184D2204
+#define LZ4_FRAME_HEADER_SIZE   7
+#define LZ4_SKIPPABLE_MAGIC     0x184D2A50
+#define LZ4_HASH_LOG            14
+#define LZ4_HASH_SIZE           (1 << LZ4_HASH_LOG)
+#define LZ4_MAX_BLOCK_SIZE      (4 * 1024 * 1024)
+
+// worst case size of a compressed block, and of a frame holding one block
+#define LZ4_COMPRESS_BOUND(size)    ((size) + (size) / 255 + 16)
+#define LZ4_FRAME_BOUND(size)       (LZ4_FRAME_HEADER_SIZE + 4 + (size) + 4)
+
+typedef struct {
+	int inFrame;			// between a frame header and its end mark
+	size_t maxBlock;
+	int blockChecksum;
+	int contentChecksum;
+	const char* error;		// set when Lz4ReadBlock() fails
+} Lz4Reader;
+
+uint32_t Xxh32(const void* data, size_t length, uint32_t seed);
+int Lz4CompressBlock(const unsigned char* source, int sourceSize, unsigned char* destination, int capacity, uint32_t* hashTable);
+int Lz4DecompressBlock(const unsigned char* source, int sourceSize, unsigned char* destination, int capacity);
+size_t Lz4WriteFrame(const unsigned char* source, size_t length, unsigned char* destination, uint32_t* hashTable);
+size_t Lz4ReadFrame(const unsigned char* source, size_t sourceSize, unsigned char* destination, size_t capacity, size_t* consumed);
+int Lz4ReadBlock(Lz4Reader* reader, const unsigned char* source, size_t sourceSize, unsigned char* destination, size_t capacity, size_t* consumed);
+
+#endif /* LZ4_FRAME_H_ */
@@ -0,0 +1,151 @@
+/*
+ * ping.c
+ *
+ * End-to-end latency measurement (see ping.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stlink-trace.h"
+#include "ping.h"
+
+static unsigned long long GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int CompareSamples(const void* a, const void* b)
+{
+	uint32_t left = *(const uint32_t*) a;
+	uint32_t right = *(const uint32_t*) b;
+	return (left > right) - (left < right);
+}
+
+static void PingReport(Ping* ping, const char* label)
+{
+	size_t count = (ping->sampleCount < PING_SAMPLES) ? ping->sampleCount : PING_SAMPLES;
+	uint32_t* sorted;
+
+	if (count == 0) {
+		printf("Ping%s: %llu sent, no echo received\n", label, ping->sent);
+		return;
+	}
+
+	sorted = malloc(count * sizeof(uint32_t));
+	if (sorted == NULL) return;
+	memcpy(sorted, ping->samples, count * sizeof(uint32_t));
+	qsort(sorted, count, sizeof(uint32_t), CompareSamples);
+	printf("Ping%s: %llu sent, %llu received, %llu lost, %llu late - p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			label, ping->sent, ping->sampleCount, ping->lost, ping->stale,
+			sorted[count / 2] / 1000.0, sorted[count * 99 / 100] / 1000.0, sorted[count - 1] / 1000.0);
+	free(sorted);
+}
+
+/*
+ * spec is "address[:port]" or "symbol[:port]" - the symbol needs the --elf file
+ */
+int PingOpen(Ping* ping, const char* spec, ElfFile* elf, unsigned int intervalMs)
+{
+	char name[128];
+	const char* colon = strchr(spec, ':');
+	size_t length = (colon != NULL) ? (size_t)(colon - spec) : strlen(spec);
+	uint32_t size;
+
+	if (length >= sizeof(name)) length = sizeof(name) - 1;
+	memcpy(name, spec, length);
+	name[length] = '\0';
+
+	ping->port = (colon != NULL) ? (int) strtoul(colon + 1, NULL, 0) : PING_PORT;
+	if ((name[0] >= '0') && (name[0] <= '9')) {
+		ping->address = strtoul(name, NULL, 0);
+	}
+	else if ((elf == NULL) || (elf->data == NULL) || (ElfFindSymbol(elf, name, ELF_STT_OBJECT, &ping->address, &size) != 0)) {
+		printf("Unable to find the ping variable %s - needs an --elf file\n", name);
+		return -1;
+	}
+	if ((ping->address == 0) || (ping->address & 3) || (ping->port < 0) || (ping->port >= 32)) {
+		printf("Invalid ping %s - needs a word aligned address and a port below 32\n", spec);
+		return -1;
+	}
+
+	ping->samples = calloc(PING_SAMPLES, sizeof(uint32_t));
+	if (ping->samples == NULL) {
+		ping->address = 0;
+		return -1;
+	}
+	ping->intervalNs = (unsigned long long) intervalMs * 1000000ULL;
+	ping->nextToken = 1;
+	ping->nextNs = ping->reportNs = GetTimeNs();
+	ping->reportNs += PING_REPORT_INTERVAL * 1000000000ULL;
+
+	printf("Ping: token at 0x%08x, echo on port %d every %u ms\n", ping->address, ping->port, intervalMs);
+	return 0;
+}
+
+/*
+ * Write the next token when the last one has been echoed (or lost) and the interval is up
+ */
+void PingService(Ping* ping)
+{
+	if (ping->address == 0) return;
+
+	unsigned long long now = GetTimeNs();
+	if (ping->token != 0) {
+		if (now - ping->sentNs < PING_TIMEOUT_MS * 1000000ULL) return;
+		ping->token = 0;
+		ping->lost++;
+	}
+
+	if (now >= ping->reportNs) {
+		PingReport(ping, "");
+		ping->reportNs = now + PING_REPORT_INTERVAL * 1000000000ULL;
+	}
+
+	if (now < ping->nextNs) return;
+
+	ping->token = ping->nextToken;
+	if (++ping->nextToken == 0) ping->nextToken = 1;	// 0 means no request for the firmware
+	ping->sent++;
+	ping->sentNs = GetTimeNs();
+	ping->nextNs = ping->sentNs + ping->intervalNs;
+	Write32Bit(ping->address, ping->token);
+}
+
+/*
+ * Stimulus data from the ping port - the echoed tokens
+ */
+void PingTap(Ping* ping, const unsigned char* data, size_t length)
+{
+	unsigned long long now = GetTimeNs();
+
+	while (length-- > 0) {
+		ping->partial[ping->partialLength++] = *data++;
+		if (ping->partialLength < 4) continue;
+		ping->partialLength = 0;
+
+		uint32_t token = ping->partial[0] | (ping->partial[1] << 8) | (ping->partial[2] << 16) | ((uint32_t) ping->partial[3] << 24);
+		if ((ping->token != 0) && (token == ping->token)) {
+			ping->samples[ping->sampleCount % PING_SAMPLES] = (uint32_t)(now - ping->sentNs);
+			ping->sampleCount++;
+			ping->token = 0;
+		}
+		else {
+			ping->stale++;
+		}
+	}
+}
+
+void PingClose(Ping* ping)
+{
+	if (ping->address == 0) return;
+
+	PingReport(ping, " total");
+	free(ping->samples);
+	ping->samples = NULL;
+	ping->address = 0;
+}
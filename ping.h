@@ -0,0 +1,51 @@
+/*
+ * ping.h
+ *
+ * End-to-end latency measurement (--ping): a token is written into a word of target RAM,
+ * the firmware echoes it as a 32-bit write on the ping stimulus port (target/ping.h), and
+ * the time from the write to the echo arriving in the trace is recorded. This covers the
+ * memory write, the firmware poll, the SWO transfer, the probe buffer and the host poll,
+ * so it is an upper bound on the delay of any ITM write.
+ *
+ * One token is outstanding at a time; an echo not seen within PING_TIMEOUT_MS is lost.
+ * p50/p99/max of the most recent PING_SAMPLES round trips are printed every
+ * PING_REPORT_INTERVAL seconds and at the end of the capture.
+ */
+
+#ifndef PING_H_
+#define PING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "elf-symbols.h"
+
+#define PING_PORT               31
+#define PING_INTERVAL_MS        10
+#define PING_TIMEOUT_MS         1000
+#define PING_SAMPLES            65536
+#define PING_REPORT_INTERVAL    5
+
+typedef struct {
+	uint32_t address;			// 0 if not in use
+	int port;
+	unsigned long long intervalNs;
+	uint32_t token;				// last token written, 0 once echoed or lost
+	uint32_t nextToken;
+	unsigned long long sentNs;
+	unsigned long long nextNs;
+	unsigned long long reportNs;
+	unsigned char partial[4];	// echo being received
+	int partialLength;
+	uint32_t* samples;			// round trips in ns, a ring of PING_SAMPLES
+	unsigned long long sampleCount;
+	unsigned long long sent;
+	unsigned long long lost;
+	unsigned long long stale;	// echoes arriving after their timeout
+} Ping;
+
+int PingOpen(Ping* ping, const char* spec, ElfFile* elf, unsigned int intervalMs);
+void PingService(Ping* ping);
+void PingTap(Ping* ping, const unsigned char* data, size_t length);
+void PingClose(Ping* ping);
+
+#endif /* PING_H_ */
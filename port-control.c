@@ -0,0 +1,172 @@
+/*
+ * port-control.c
+ *
+ * Runtime ITM port masking (see port-control.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "stlink-trace.h"
+#include "port-control.h"
+
+#define ITM_TER     0xE0000E00
+#define ITM_TPR     0xE0000E40
+
+static unsigned long long GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int WriteRegister(uint32_t address, uint32_t value)
+{
+	unsigned char data[4] = {value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF};
+
+	return WriteMemory(address, &data[0], 4);
+}
+
+/*
+ * Parse "all", "none", a 0x mask or a list of numbers and ranges below limit ("0,2-5")
+ */
+int PortControlParse(const char* list, int limit, uint32_t* mask)
+{
+	const char* pos = list;
+
+	*mask = 0;
+	if (strcmp(list, "all") == 0) {
+		*mask = (limit >= 32) ? 0xFFFFFFFF : (1U << limit) - 1;
+		return 0;
+	}
+	if (strcmp(list, "none") == 0) return 0;
+	if (strncmp(list, "0x", 2) == 0) {
+		// hex digits only - strtoul would also take a sign or spaces
+		char* end = (char*) &list[2];
+		unsigned long value = isxdigit((unsigned char) list[2]) ? strtoul(&list[2], &end, 16) : 0;
+		if ((end == &list[2]) || (*end != '\0') || ((limit < 32) && ((value >> limit) != 0)) || (value > 0xFFFFFFFF)) {
+			printf("Invalid port list %s\n", list);
+			return -1;
+		}
+		*mask = value;
+		return 0;
+	}
+
+	while (*pos != '\0') {
+		char* end;
+		unsigned long first = strtoul(pos, &end, 10);
+		unsigned long last = first;
+		if (end == pos) break;
+		if (*end == '-') {
+			pos = end + 1;
+			last = strtoul(pos, &end, 10);
+			if (end == pos) break;
+		}
+		if ((first > last) || (last >= (unsigned long) limit)) break;
+		while (first <= last) *mask |= 1U << first++;
+		pos = end;
+		if (*pos == ',') pos++;
+		else if (*pos != '\0') break;
+	}
+	if ((*pos != '\0') || (*list == '\0')) {
+		printf("Invalid port list %s\n", list);
+		return -1;
+	}
+	return 0;
+}
+
+void PortControlInit(PortControl* control, uint32_t enabled, uint32_t privileged)
+{
+	memset(control, 0, sizeof(PortControl));
+	control->requestedEnabled = control->enabled = enabled;
+	control->requestedPrivileged = control->privileged = privileged & 0x0F;
+	control->lastNs = GetTimeNs();
+}
+
+/*
+ * Called from the dashboard thread
+ */
+void PortControlToggle(PortControl* control, int port)
+{
+	__atomic_fetch_xor(&control->requestedEnabled, 1U << port, __ATOMIC_RELAXED);
+}
+
+void PortControlTogglePrivileged(PortControl* control, int group)
+{
+	__atomic_fetch_xor(&control->requestedPrivileged, 1U << group, __ATOMIC_RELAXED);
+}
+
+static int Rejected(char* reply, size_t replySize, const char* list)
+{
+	snprintf(reply, replySize, "error invalid port list %s\n", list);
+	return 0;
+}
+
+/*
+ * Trace server control callback - returns -1 if the command is not a port command
+ */
+int PortControlCommand(void* context, const char* command, char* reply, size_t replySize)
+{
+	PortControl* control = context;
+	uint32_t mask;
+	int port;
+
+	if (strncmp(command, "enable ", 7) == 0) {
+		if (PortControlParse(command + 7, ITM_PORTS, &mask) != 0) return Rejected(reply, replySize, command + 7);
+		__atomic_fetch_or(&control->requestedEnabled, mask, __ATOMIC_RELAXED);
+	}
+	else if (strncmp(command, "disable ", 8) == 0) {
+		if (PortControlParse(command + 8, ITM_PORTS, &mask) != 0) return Rejected(reply, replySize, command + 8);
+		__atomic_fetch_and(&control->requestedEnabled, ~mask, __ATOMIC_RELAXED);
+	}
+	else if (strncmp(command, "privileged ", 11) == 0) {
+		if (PortControlParse(command + 11, 4, &mask) != 0) return Rejected(reply, replySize, command + 11);
+		__atomic_store_n(&control->requestedPrivileged, mask, __ATOMIC_RELAXED);
+	}
+	else if (strcmp(command, "ports") != 0) {
+		return -1;
+	}
+
+	// the masks as requested - they reach the target on the next capture loop
+	int length = snprintf(reply, replySize, "ports 0x%08x privileged 0x%x",
+			__atomic_load_n(&control->requestedEnabled, __ATOMIC_RELAXED), __atomic_load_n(&control->requestedPrivileged, __ATOMIC_RELAXED));
+	for (port = 0; port < ITM_PORTS; port++) {
+		if ((control->rate[port] <= 0) || (length >= (int) replySize)) continue;
+		length += snprintf(&reply[length], replySize - length, " %d:%.0f", port, control->rate[port]);
+	}
+	if (length < (int) replySize - 1) strcpy(&reply[length], "\n");
+	return 0;
+}
+
+/*
+ * Capture loop: write ITM_TER and ITM_TPR when a change was requested, and update the bandwidth
+ */
+void PortControlService(PortControl* control, const unsigned long long* portBytes, const unsigned long long* portPackets)
+{
+	uint32_t enabled = __atomic_load_n(&control->requestedEnabled, __ATOMIC_RELAXED);
+	uint32_t privileged = __atomic_load_n(&control->requestedPrivileged, __ATOMIC_RELAXED) & 0x0F;
+	int port;
+
+	// the masks only change once the target has them - a failed write is tried again
+	if ((enabled != control->enabled) && (WriteRegister(ITM_TER, enabled) == 0)) {
+		control->enabled = enabled;
+		printf("ITM_TER = 0x%08x\n", enabled);
+	}
+	if ((privileged != control->privileged) && (WriteRegister(ITM_TPR, privileged) == 0)) {
+		control->privileged = privileged;
+		printf("ITM_TPR = 0x%x\n", privileged);
+	}
+
+	unsigned long long now = GetTimeNs();
+	if (now - control->lastNs < PORT_CONTROL_RATE_INTERVAL * 1000000ULL) return;
+	for (port = 0; port < ITM_PORTS; port++) {
+		// a header byte per packet
+		unsigned long long bytes = portBytes[port] + portPackets[port];
+		control->rate[port] = (bytes - control->lastBytes[port]) * 1e9 / (now - control->lastNs);
+		control->lastBytes[port] = bytes;
+	}
+	control->lastNs = now;
+}
@@ -0,0 +1,47 @@
+/*
+ * port-control.h
+ *
+ * Runtime control of the ITM stimulus ports: ports are enabled and disabled in ITM_TER,
+ * and groups of 8 ports restricted to privileged code in ITM_TPR, while the trace runs.
+ * A disabled port costs no SWO bandwidth - the firmware writes to it are discarded (or
+ * skipped, with the ItmPortEnabled() check of target/itm-out.h).
+ *
+ * Changes come from the command line (--ports, --privileged), the dashboard and the
+ * trace server control commands:
+ *   enable LIST      LIST is e.g. 0,2-5 or all
+ *   disable LIST
+ *   privileged LIST  the privileged-only groups (0 = ports 0-7 ... 3 = ports 24-31), or none
+ *   ports            reply with the masks and the SWO bandwidth of each active port
+ * A command with an invalid LIST changes nothing and gets an "error ..." reply.
+ * Requests are only recorded, with atomic updates as the dashboard runs in its own
+ * thread, and PortControlService() writes the registers from the capture loop.
+ */
+
+#ifndef PORT_CONTROL_H_
+#define PORT_CONTROL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "itm-decode.h"
+
+#define PORT_CONTROL_RATE_INTERVAL  1000	// ms between bandwidth updates
+
+typedef struct {
+	uint32_t requestedEnabled;		// ITM_TER wanted, updated atomically
+	uint32_t requestedPrivileged;	// ITM_TPR wanted
+	uint32_t enabled;				// as written to the target (by EnableTrace() at the start)
+	uint32_t privileged;
+	// SWO bytes per second of each port, from the demux counters
+	double rate[ITM_PORTS];
+	unsigned long long lastBytes[ITM_PORTS];
+	unsigned long long lastNs;
+} PortControl;
+
+int PortControlParse(const char* list, int limit, uint32_t* mask);
+void PortControlInit(PortControl* control, uint32_t enabled, uint32_t privileged);
+void PortControlToggle(PortControl* control, int port);
+void PortControlTogglePrivileged(PortControl* control, int group);
+int PortControlCommand(void* context, const char* command, char* reply, size_t replySize);
+void PortControlService(PortControl* control, const unsigned long long* portBytes, const unsigned long long* portPackets);
+
+#endif /* PORT_CONTROL_H_ */
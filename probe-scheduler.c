@@ -0,0 +1,134 @@
+/*
+ * probe-scheduler.c
+ *
+ * Priority scheduling of the probe commands (see probe-scheduler.h).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "probe-scheduler.h"
+
+// the trace rate is sampled over this period
+#define PROBE_RATE_PERIOD_NS        10000000ULL
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Time for the probe buffer to fill from the given level
+ */
+static uint64_t FillTimeNs(ProbeScheduler* scheduler, unsigned int backlog)
+{
+	double rate = scheduler->rate;
+
+	if (backlog >= PROBE_BUFFER_SIZE) return 0;
+	if (rate < PROBE_SWO_RATE * PROBE_RATE_FLOOR) rate = PROBE_SWO_RATE * PROBE_RATE_FLOOR;
+	return (uint64_t)((PROBE_BUFFER_SIZE - backlog) * 1e9 / rate);
+}
+
+void ProbeSchedulerInit(ProbeScheduler* scheduler)
+{
+	static const char* names[PROBE_CLASSES] = {"trace", "interactive", "health"};
+	static const double shares[PROBE_CLASSES] = {0, PROBE_INTERACTIVE_SHARE, PROBE_HEALTH_SHARE};
+	int i;
+
+	memset(scheduler, 0, sizeof(ProbeScheduler));
+	for (i = 0; i < PROBE_CLASSES; i++) {
+		scheduler->classes[i].name = names[i];
+		scheduler->classes[i].share = shares[i];
+	}
+	scheduler->startNs = scheduler->refillNs = scheduler->rateStartNs = scheduler->pollNs = GetTimeNs();
+	scheduler->deadlineNs = scheduler->pollNs + FillTimeNs(scheduler, 0);
+}
+
+/*
+ * A trace byte count was read - update the trace rate and the deadline for the next drain
+ */
+void ProbeSchedulerPoll(ProbeScheduler* scheduler, unsigned int backlog)
+{
+	uint64_t now = GetTimeNs();
+
+	// larger counts are overruns, not trace
+	if (backlog <= PROBE_BUFFER_SIZE) scheduler->rateBytes += backlog;
+	if (now - scheduler->rateStartNs >= PROBE_RATE_PERIOD_NS) {
+		double rate = scheduler->rateBytes * 1e9 / (now - scheduler->rateStartNs);
+		// follow increases at once and decreases slowly
+		scheduler->rate = (rate > scheduler->rate) ? rate : scheduler->rate + (rate - scheduler->rate) / 16;
+		scheduler->rateStartNs = now;
+		scheduler->rateBytes = 0;
+	}
+
+	scheduler->pollNs = now;
+	scheduler->deadlineNs = now + FillTimeNs(scheduler, backlog);
+}
+
+/*
+ * Returns 1 if work of the class can use the link now. Every 1 must be followed by ProbeSchedulerEnd().
+ */
+int ProbeSchedulerBegin(ProbeScheduler* scheduler, int probeClass)
+{
+	ProbeClass* work = &scheduler->classes[probeClass];
+	uint64_t now = GetTimeNs();
+	int i;
+
+	// refill the budgets
+	for (i = 0; i < PROBE_CLASSES; i++) {
+		ProbeClass* refill = &scheduler->classes[i];
+		int64_t limit = (int64_t)(PROBE_BUDGET_WINDOW_NS * refill->share);
+		refill->budgetNs += (int64_t)((now - scheduler->refillNs) * refill->share);
+		if (refill->budgetNs > limit) refill->budgetNs = limit;
+	}
+	scheduler->refillNs = now;
+
+	if (probeClass != PROBE_CLASS_TRACE) {
+		if (work->budgetNs <= 0) {
+			work->deferredBudget++;
+			return 0;
+		}
+		// the work and the next drain have to be done before the buffer is full
+		if (now + work->costNs + scheduler->classes[PROBE_CLASS_TRACE].costNs > scheduler->deadlineNs) {
+			// the expected duration is only measured when the work runs - let one slow
+			// run age out, or a class expected to take longer than the fill time never runs
+			work->deferredDeadline++;
+			work->costNs -= work->costNs / 8;
+			return 0;
+		}
+	}
+
+	work->startNs = now;
+	return 1;
+}
+
+void ProbeSchedulerEnd(ProbeScheduler* scheduler, int probeClass)
+{
+	ProbeClass* work = &scheduler->classes[probeClass];
+	uint64_t now = GetTimeNs();
+	uint64_t duration = now - work->startNs;
+
+	work->runs++;
+	work->busyNs += duration;
+	if (work->share > 0) work->budgetNs -= duration;
+	work->costNs = (duration > work->costNs) ? duration : work->costNs - (work->costNs - duration) / 8;
+
+	// the polled bytes are drained, anything since the poll is still waiting
+	if (probeClass == PROBE_CLASS_TRACE) scheduler->deadlineNs = scheduler->pollNs + FillTimeNs(scheduler, 0);
+}
+
+void ProbeSchedulerReport(ProbeScheduler* scheduler)
+{
+	uint64_t elapsed = GetTimeNs() - scheduler->startNs;
+	int i;
+
+	if (elapsed == 0) return;
+	for (i = 0; i < PROBE_CLASSES; i++) {
+		ProbeClass* work = &scheduler->classes[i];
+		printf("Probe %s: %llu runs, %.1f%% of the time, deferred %llu by budget and %llu by deadline, expected %.1f us\n",
+				work->name, work->runs, work->busyNs * 100.0 / elapsed, work->deferredBudget, work->deferredDeadline, work->costNs / 1000.0);
+	}
+}
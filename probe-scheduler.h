@@ -0,0 +1,67 @@
+/*
+ * probe-scheduler.h
+ *
+ * Decides what gets the USB link to the ST-Link between trace polls. Every command is
+ * blocking, so time spent on housekeeping is time the probe trace buffer keeps filling.
+ *
+ * Work is in three priority classes:
+ *   PROBE_CLASS_TRACE        trace drains - always run, and first
+ *   PROBE_CLASS_INTERACTIVE  memory access: down-channel, snapshots, live watch, ping
+ *   PROBE_CLASS_HEALTH       core status checks (DHCSR)
+ * The lower classes each have a share of the link time, refilled continuously and
+ * charged with the measured duration of their work, and only run when their expected
+ * duration plus a trace drain fits before the probe buffer would fill. The fill time is
+ * estimated from the recent trace rate (held at its peak, with a floor so that a burst
+ * from an idle target is not a surprise) and the probe buffer size.
+ */
+
+#ifndef PROBE_SCHEDULER_H_
+#define PROBE_SCHEDULER_H_
+
+#include <stdint.h>
+
+#define PROBE_CLASS_TRACE           0
+#define PROBE_CLASS_INTERACTIVE     1
+#define PROBE_CLASS_HEALTH          2
+#define PROBE_CLASSES               3
+
+// trace buffer and SWO rate requested by EnableTrace(): 4KB at 2 Mbaud
+#define PROBE_BUFFER_SIZE           4096
+#define PROBE_SWO_RATE              200000
+// the fill rate is assumed to be at least this fraction of the SWO rate
+#define PROBE_RATE_FLOOR            0.1
+// share of the link time per class, and how much unused time can be saved up
+#define PROBE_INTERACTIVE_SHARE     0.5
+#define PROBE_HEALTH_SHARE          0.05
+#define PROBE_BUDGET_WINDOW_NS      100000000ULL
+
+typedef struct {
+	const char* name;
+	double share;				// of the link time, 0 = unlimited
+	int64_t budgetNs;
+	uint64_t costNs;			// expected duration, follows increases at once, decays while deferred
+	uint64_t startNs;
+	unsigned long long runs;
+	unsigned long long deferredBudget;
+	unsigned long long deferredDeadline;
+	unsigned long long busyNs;
+} ProbeClass;
+
+typedef struct {
+	ProbeClass classes[PROBE_CLASSES];
+	uint64_t pollNs;			// time of the last trace byte count
+	uint64_t deadlineNs;		// estimated time the probe buffer is full
+	uint64_t refillNs;
+	uint64_t startNs;
+	double rate;				// trace bytes/s
+	uint64_t rateStartNs;
+	unsigned long long rateBytes;
+} ProbeScheduler;
+
+void ProbeSchedulerInit(ProbeScheduler* scheduler);
+void ProbeSchedulerPoll(ProbeScheduler* scheduler, unsigned int backlog);
+int ProbeSchedulerBegin(ProbeScheduler* scheduler, int probeClass);
+void ProbeSchedulerEnd(ProbeScheduler* scheduler, int probeClass);
+void ProbeSchedulerReport(ProbeScheduler* scheduler);
+
+#endif /* PROBE_SCHEDULER_H_ */
@@ -0,0 +1,297 @@
+/*
+ * rtos-trace.c
+ *
+ * Per-task CPU time and scheduling latency from RTOS trace events (see rtos-trace.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "rtos-trace.h"
+
+#define EVENT_SIZE      256
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int RtosTraceOpen(RtosTrace* trace, int port, unsigned long clockHz, unsigned int intervalMs, const char* timelineFilename)
+{
+	if ((port < 0) || (port >= ITM_PORTS)) {
+		printf("Invalid RTOS trace port %d\n", port);
+		return -1;
+	}
+	if (timelineFilename != NULL) {
+		if (FileSinkOpen(&trace->timeline, timelineFilename) != 0) return -1;
+		trace->timelineOpen = 1;
+		trace->timeline.write(&trace->timeline, (const unsigned char*) "{\"traceEvents\":[\n", 17);
+	}
+	trace->port = port;
+	trace->cycleUs = 1e6 / ((clockHz > 0) ? clockHz : RTOS_TRACE_CLOCK);
+	trace->intervalNs = (uint64_t)((intervalMs > 0) ? intervalMs : RTOS_TRACE_INTERVAL_MS) * 1000000ULL;
+	trace->startNs = trace->intervalStartNs = GetTimeNs();
+	trace->enabled = 1;
+	return 0;
+}
+
+static void Timeline(RtosTrace* trace, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+static void Timeline(RtosTrace* trace, const char* format, ...)
+{
+	char text[EVENT_SIZE];
+	va_list args;
+	int length;
+
+	if (!trace->timelineOpen) return;
+	length = snprintf(text, sizeof(text), "%s", (trace->timelineEvents++ > 0) ? ",\n" : "");
+	va_start(args, format);
+	length += vsnprintf(&text[length], sizeof(text) - length, format, args);
+	va_end(args);
+	if (length < (int) sizeof(text)) trace->timeline.write(&trace->timeline, (const unsigned char*) text, length);
+}
+
+static RtosTask* Task(RtosTrace* trace, uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < trace->taskCount; i++) {
+		if (trace->tasks[i].id == id) return &trace->tasks[i];
+	}
+	if (trace->taskCount == RTOS_TRACE_TASKS) {
+		trace->unknownTasks++;
+		return NULL;
+	}
+
+	RtosTask* task = &trace->tasks[trace->taskCount++];
+	task->id = id;
+	snprintf(task->name, sizeof(task->name), "task %u", id);
+	Timeline(trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", id, task->name);
+	return task;
+}
+
+/*
+ * Add the time since runningSince to the running task
+ */
+static void Account(RtosTrace* trace)
+{
+	if (trace->running != NULL) {
+		trace->running->runCycles += trace->now - trace->runningSince;
+		trace->running->intervalCycles += trace->now - trace->runningSince;
+	}
+	trace->runningSince = trace->now;
+}
+
+static void EndSlice(RtosTrace* trace)
+{
+	if (trace->running == NULL) return;
+	Account(trace);
+	Timeline(trace, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}", trace->running->name,
+			trace->sliceStart * trace->cycleUs, (trace->now - trace->sliceStart) * trace->cycleUs, trace->running->id);
+	trace->running = NULL;
+}
+
+static void Switch(RtosTrace* trace, RtosTask* task)
+{
+	if (task == trace->running) return;
+	EndSlice(trace);
+	trace->running = task;
+	trace->runningSince = trace->sliceStart = trace->now;
+	if (task == NULL) return;
+
+	task->switches++;
+	if (task->ready) {
+		uint64_t latency = trace->now - task->readyAt;
+		double us = latency * trace->cycleUs;
+		int bucket = 0;
+		while ((bucket < RTOS_LATENCY_BUCKETS - 1) && (us >= (double)(1ULL << bucket))) bucket++;
+		task->latency[bucket]++;
+		task->latencyCount++;
+		if (latency > task->latencyMax) task->latencyMax = latency;
+		task->ready = 0;
+	}
+}
+
+static void Ready(RtosTrace* trace, RtosTask* task)
+{
+	if ((task == NULL) || (task == trace->running) || task->ready) return;
+	task->ready = 1;
+	task->readyAt = trace->now;
+	Timeline(trace, "{\"name\":\"ready\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", trace->now * trace->cycleUs, task->id);
+}
+
+static void Event(RtosTrace* trace, uint32_t header, uint32_t cycles)
+{
+	RtosTask* task = Task(trace, header & 0xFFFFFF);
+
+	// the counter wraps every 2^32 cycles - events are more frequent than that
+	if (trace->synced) trace->now += (uint32_t)(cycles - trace->lastCycles);
+	trace->lastCycles = cycles;
+	if (!trace->synced) trace->intervalStart = trace->now;
+	trace->synced = 1;
+	trace->events++;
+
+	if ((header >> 24) == RTOS_TRACE_SWITCH) Switch(trace, task);
+	else Ready(trace, task);
+}
+
+/*
+ * A word of a task name - nameWords is 1 after the header and counts the words received
+ */
+static void Name(RtosTrace* trace, const unsigned char* bytes)
+{
+	RtosTask* task = Task(trace, trace->header & 0xFFFFFF);
+	int end = 0;
+	int i;
+
+	if ((task != NULL) && (trace->nameWords == 1)) task->name[0] = '\0';
+	for (i = 0; (i < 4) && !end; i++) {
+		end = (bytes[i] == '\0');
+		if (end || (task == NULL)) continue;
+		size_t length = strlen(task->name);
+		// the name goes into the timeline JSON as it is
+		if ((length < sizeof(task->name) - 1) && (bytes[i] >= ' ') && (bytes[i] != '"') && (bytes[i] != '\\')) {
+			task->name[length] = bytes[i];
+			task->name[length + 1] = '\0';
+		}
+	}
+	if (!end && (trace->nameWords++ < RTOS_TRACE_NAME_WORDS)) return;
+
+	trace->nameWords = 0;
+	if (task != NULL) {
+		Timeline(trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", task->id, task->name);
+	}
+}
+
+/*
+ * ItmDecoder records: the 32-bit words on the port, and the overflows that lose events
+ */
+void RtosTraceRecord(RtosTrace* trace, const ItmRecord* record)
+{
+	if (!trace->enabled) return;
+
+	if (record->type == ITM_RECORD_OVERFLOW) {
+		// switches may have been lost - the running task is not known until the next one
+		int i;
+		trace->overflows++;
+		trace->words = 0;
+		trace->nameWords = 0;
+		EndSlice(trace);
+		for (i = 0; i < trace->taskCount; i++) trace->tasks[i].ready = 0;
+		return;
+	}
+	if ((record->type != ITM_RECORD_STIMULUS) || (record->port != trace->port)) return;
+	if (record->size != 4) {
+		trace->words = 0;
+		trace->nameWords = 0;
+		return;
+	}
+
+	if (trace->nameWords > 0) {
+		Name(trace, record->payload);
+	}
+	else if (trace->words == 1) {
+		Event(trace, trace->header, record->value);
+		trace->words = 0;
+	}
+	else {
+		trace->header = record->value;
+		switch (record->value >> 24) {
+		case RTOS_TRACE_SWITCH:
+		case RTOS_TRACE_READY:
+			trace->words = 1;
+			break;
+		case RTOS_TRACE_NAME:
+			trace->nameWords = 1;
+			break;
+		}
+	}
+}
+
+static void PrintLoad(RtosTrace* trace)
+{
+	uint64_t cycles = trace->now - trace->intervalStart;
+	int i;
+
+	if (cycles == 0) return;
+	printf("RTOS load:");
+	for (i = 0; i < trace->taskCount; i++) {
+		if (trace->tasks[i].intervalCycles == 0) continue;
+		printf(" %s %.1f%%", trace->tasks[i].name, 100.0 * trace->tasks[i].intervalCycles / cycles);
+		trace->tasks[i].intervalCycles = 0;
+	}
+	printf("\n");
+	trace->intervalStart = trace->now;
+}
+
+/*
+ * Capture loop: the load of each task over the interval, in target time up to the last event
+ */
+void RtosTraceService(RtosTrace* trace)
+{
+	uint64_t now;
+
+	if (!trace->enabled) return;
+	now = GetTimeNs();
+	if (now - trace->intervalStartNs < trace->intervalNs) return;
+	trace->intervalStartNs = now;
+
+	Account(trace);
+	PrintLoad(trace);
+	if (trace->timelineOpen) trace->timeline.flush(&trace->timeline);
+}
+
+/*
+ * A percentile as its latency bucket: "<2^n us", ">=2^22 us" in the open-ended last bucket,
+ * or the largest latency when that is below the bucket bound
+ */
+static void FormatPercentile(const RtosTrace* trace, const RtosTask* task, double fraction, char* text, size_t size)
+{
+	unsigned long long target = (unsigned long long)(task->latencyCount * fraction);
+	unsigned long long seen = 0;
+	double max = task->latencyMax * trace->cycleUs;
+	int bucket;
+
+	for (bucket = 0; bucket < RTOS_LATENCY_BUCKETS - 1; bucket++) {
+		seen += task->latency[bucket];
+		if (seen > target) break;
+	}
+	if (bucket == RTOS_LATENCY_BUCKETS - 1) snprintf(text, size, ">=%llu us", 1ULL << (bucket - 1));
+	else if (max < (double)(1ULL << bucket)) snprintf(text, size, "<=%.1f us", max);
+	else snprintf(text, size, "<%llu us", 1ULL << bucket);
+}
+
+void RtosTraceClose(RtosTrace* trace)
+{
+	int i;
+
+	if (!trace->enabled) return;
+	trace->enabled = 0;
+	EndSlice(trace);
+
+	if (trace->timelineOpen) {
+		trace->timeline.write(&trace->timeline, (const unsigned char*) "\n]}\n", 4);
+		trace->timeline.close(&trace->timeline);
+		trace->timelineOpen = 0;
+	}
+
+	double total = (trace->now > 0) ? (double) trace->now : 1;
+	printf("RTOS trace: %llu events, %.1f ms of target time, %d tasks, %llu overflows, %llu events of tasks beyond %d\n",
+			trace->events, trace->now * trace->cycleUs / 1000, trace->taskCount, trace->overflows, trace->unknownTasks, RTOS_TRACE_TASKS);
+	for (i = 0; i < trace->taskCount; i++) {
+		RtosTask* task = &trace->tasks[i];
+		printf("  %-16s %6.2f%% CPU, %llu switches", task->name, 100.0 * task->runCycles / total, task->switches);
+		if (task->latencyCount > 0) {
+			char p50[32], p99[32];
+			FormatPercentile(trace, task, 0.5, p50, sizeof(p50));
+			FormatPercentile(trace, task, 0.99, p99, sizeof(p99));
+			printf(", ready latency p50 %s, p99 %s, max %.1f us", p50, p99, task->latencyMax * trace->cycleUs);
+		}
+		printf("\n");
+	}
+}
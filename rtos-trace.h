@@ -0,0 +1,84 @@
+/*
+ * rtos-trace.h
+ *
+ * RTOS scheduling from the task switch and ready events of target/rtos-trace.h
+ * (--rtos PORT). The events carry the DWT cycle counter, extended here to 64 bits.
+ *
+ * Updated per event in the capture loop: the CPU time of each task (the time from its switch
+ * in to the next switch), its switch count, and the ready-to-run latency - from the first
+ * ready event of a task to its next switch in - as a histogram of power of 2 microsecond
+ * buckets. Every --rtos-interval the CPU load of each task over the interval is printed;
+ * the totals and the latency percentiles at the end.
+ *
+ * With --rtos-timeline the run slices of the tasks and the ready events are written as a
+ * Chrome trace, one track per task, as they happen.
+ */
+
+#ifndef RTOS_TRACE_H_
+#define RTOS_TRACE_H_
+
+#include <stdint.h>
+#include "itm-decode.h"
+#include "trace-sink.h"
+
+#define RTOS_TRACE_PORT             29
+#define RTOS_TRACE_CLOCK            72000000
+#define RTOS_TRACE_INTERVAL_MS      1000
+#define RTOS_TRACE_TASKS            64
+#define RTOS_TRACE_NAME_SIZE        17
+#define RTOS_LATENCY_BUCKETS        24		// bucket n counts latencies below 2^n microseconds
+
+// event types, as in target/rtos-trace.h
+#define RTOS_TRACE_SWITCH           1
+#define RTOS_TRACE_READY            2
+#define RTOS_TRACE_NAME             3
+#define RTOS_TRACE_NAME_WORDS       4
+
+typedef struct {
+	uint32_t id;
+	char name[RTOS_TRACE_NAME_SIZE];
+	uint64_t runCycles;
+	uint64_t intervalCycles;
+	unsigned long long switches;
+	int ready;
+	uint64_t readyAt;		// first ready event not yet followed by a switch in
+	unsigned long long latency[RTOS_LATENCY_BUCKETS];
+	unsigned long long latencyCount;
+	uint64_t latencyMax;
+} RtosTask;
+
+typedef struct {
+	int enabled;
+	int port;
+	double cycleUs;
+	RtosTask tasks[RTOS_TRACE_TASKS];
+	int taskCount;
+	// event being received
+	int words;
+	uint32_t header;
+	int nameWords;
+	// scheduler state
+	int synced;				// a cycle count has been seen
+	uint32_t lastCycles;
+	uint64_t now;
+	RtosTask* running;		// NULL until the first switch
+	uint64_t runningSince;	// of the time not yet added to the task
+	uint64_t sliceStart;	// of the run slice in the timeline
+	uint64_t intervalStart;
+	uint64_t startNs;
+	uint64_t intervalNs;
+	uint64_t intervalStartNs;
+	TraceSink timeline;
+	int timelineOpen;
+	unsigned long long timelineEvents;
+	unsigned long long events;
+	unsigned long long unknownTasks;	// events for tasks beyond RTOS_TRACE_TASKS
+	unsigned long long overflows;
+} RtosTrace;
+
+int RtosTraceOpen(RtosTrace* trace, int port, unsigned long clockHz, unsigned int intervalMs, const char* timelineFilename);
+void RtosTraceRecord(RtosTrace* trace, const ItmRecord* record);
+void RtosTraceService(RtosTrace* trace);
+void RtosTraceClose(RtosTrace* trace);
+
+#endif /* RTOS_TRACE_H_ */
@@ -0,0 +1,314 @@
+/*
+ * shm-ring.c
+ *
+ * Shared memory trace ring, writer and reader sides (see shm-ring.h).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shm-ring.h"
+
+#define REPORT_INTERVAL_MS  5000
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void ShmName(char* shmName, size_t size, const char* name)
+{
+	snprintf(shmName, size, "%s%s", (name[0] == '/') ? "" : "/", name);
+}
+
+int ShmRingCreate(ShmRing* ring, const char* name, size_t size)
+{
+	char shmName[80];
+	size_t dataSize = SHM_RING_ALIGN * 8;
+
+	memset(ring, 0, sizeof(ShmRing));
+
+	// power of 2 so that positions wrap cleanly
+	while (dataSize < (size ? size : SHM_RING_SIZE)) dataSize <<= 1;
+	ring->mappedSize = sizeof(ShmRingHeader) + dataSize;
+
+	ShmName(shmName, sizeof(shmName), name);
+	int fd = shm_open(shmName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if ((fd < 0) || (ftruncate(fd, ring->mappedSize) != 0)) {
+		printf("Unable to create shared memory %s\n", shmName);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	void* memory = mmap(NULL, ring->mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED) {
+		printf("Unable to map shared memory %s\n", shmName);
+		shm_unlink(shmName);
+		return -1;
+	}
+
+	ring->header = memory;
+	ring->data = (unsigned char*) memory + sizeof(ShmRingHeader);
+	ring->header->size = dataSize;
+	ring->header->version = SHM_RING_VERSION;
+	snprintf(ring->name, sizeof(ring->name), "%s", shmName);
+
+	// readers check the magic, so it goes in last
+	atomic_thread_fence(memory_order_release);
+	ring->header->magic = SHM_RING_MAGIC;
+
+	printf("Shared memory ring %s, %u bytes\n", shmName, (unsigned int)dataSize);
+	return 0;
+}
+
+static void WriteRecord(ShmRing* ring, int type, int port, const unsigned char* data, size_t length)
+{
+	ShmRingHeader* header = ring->header;
+	uint64_t size = header->size;
+	uint64_t write = atomic_load_explicit(&header->write, memory_order_relaxed);
+	size_t recordSize = (sizeof(ShmRingRecord) + length + SHM_RING_ALIGN - 1) & ~(size_t)(SHM_RING_ALIGN - 1);
+	size_t offset = write & (size - 1);
+	size_t pad = (offset + recordSize > size) ? size - offset : 0;
+
+	atomic_store_explicit(&header->reserve, write + pad + recordSize, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	if (pad > 0) {
+		ShmRingRecord* padding = (ShmRingRecord*) &ring->data[offset];
+		__atomic_store_n(&padding->length, pad - sizeof(ShmRingRecord), __ATOMIC_RELAXED);
+		padding->type = SHM_RING_PAD;
+		offset = 0;
+	}
+
+	ShmRingRecord* record = (ShmRingRecord*) &ring->data[offset];
+	__atomic_store_n(&record->length, length, __ATOMIC_RELAXED);
+	record->type = type;
+	record->port = port;
+	record->reserved = 0;
+	if (ring->time == 0) ring->time = GetTimeNs();
+	record->time = ring->time;
+	memcpy((unsigned char*) record + sizeof(ShmRingRecord), data, length);
+
+	atomic_store_explicit(&header->write, write + pad + recordSize, memory_order_release);
+}
+
+/*
+ * Append data as records of at most half the ring - never blocks, readers that are too far
+ * behind are overwritten
+ */
+void ShmRingWrite(ShmRing* ring, int type, int port, const unsigned char* data, size_t length)
+{
+	if (ring->header == NULL) return;
+
+	size_t maxLength = ring->header->size / 2 - sizeof(ShmRingRecord);
+	do {
+		size_t chunk = (length < maxLength) ? length : maxLength;
+		WriteRecord(ring, type, port, data, chunk);
+		data += chunk;
+		length -= chunk;
+	} while (length > 0);
+}
+
+/*
+ * TraceDemux tap - stimulus data is staged per port and written as one record per port
+ * per trace read by ShmRingFlush()
+ */
+void ShmRingTap(void* context, int port, const unsigned char* data, size_t length)
+{
+	ShmRing* ring = context;
+
+	if (ring->stageLength[port] + length > SHM_RING_STAGE_SIZE) {
+		ShmRingWrite(ring, SHM_RING_PORT, port, &ring->stage[port][0], ring->stageLength[port]);
+		ring->stageLength[port] = 0;
+	}
+	memcpy(&ring->stage[port][ring->stageLength[port]], data, length);
+	ring->stageLength[port] += length;
+}
+
+void ShmRingFlush(ShmRing* ring)
+{
+	int port;
+
+	if (ring->header == NULL) return;
+
+	for (port = 0; port < ITM_PORTS; port++) {
+		if (ring->stageLength[port] == 0) continue;
+		ShmRingWrite(ring, SHM_RING_PORT, port, &ring->stage[port][0], ring->stageLength[port]);
+		ring->stageLength[port] = 0;
+	}
+	ring->time = 0;
+}
+
+/*
+ * Print the lag of each reader every few seconds, and free the slots of readers that have exited
+ */
+void ShmRingReport(ShmRing* ring)
+{
+	unsigned long long now = GetTimeNs() / 1000000;
+	int slot;
+
+	if ((ring->header == NULL) || (now < ring->nextReport)) return;
+	ring->nextReport = now + REPORT_INTERVAL_MS;
+
+	uint64_t write = atomic_load_explicit(&ring->header->write, memory_order_acquire);
+	for (slot = 0; slot < SHM_RING_READERS; slot++) {
+		ShmRingSlot* reader = &ring->header->readers[slot];
+		uint32_t pid = atomic_load(&reader->pid);
+		if (pid == 0) continue;
+
+		if ((kill(pid, 0) != 0) && (errno == ESRCH)) {
+			atomic_store(&reader->pid, 0);
+			continue;
+		}
+
+		uint64_t lag = write - atomic_load(&reader->position);
+		printf("Shared memory reader %u: %llu bytes behind (%.1f%% of the ring), %llu overruns\n", pid,
+				(unsigned long long)lag, 100.0 * lag / ring->header->size, (unsigned long long)atomic_load(&reader->overruns));
+	}
+}
+
+void ShmRingDestroy(ShmRing* ring)
+{
+	if (ring->header == NULL) return;
+
+	munmap(ring->header, ring->mappedSize);
+	shm_unlink(ring->name);
+	ring->header = NULL;
+}
+
+//============================
+// reader
+//============================
+
+int ShmRingOpen(ShmReader* reader, const char* name)
+{
+	char shmName[80];
+	struct stat status;
+	int slot;
+
+	memset(reader, 0, sizeof(ShmReader));
+	ShmName(shmName, sizeof(shmName), name);
+
+	int fd = shm_open(shmName, O_RDWR, 0);
+	if ((fd < 0) || (fstat(fd, &status) != 0) || ((size_t)status.st_size < sizeof(ShmRingHeader))) {
+		printf("Unable to open shared memory %s\n", shmName);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	void* memory = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (memory == MAP_FAILED) return -1;
+
+	reader->header = memory;
+	reader->data = (unsigned char*) memory + sizeof(ShmRingHeader);
+	reader->mappedSize = status.st_size;
+
+	if ((reader->header->magic != SHM_RING_MAGIC) || (reader->header->version != SHM_RING_VERSION)
+			|| (sizeof(ShmRingHeader) + reader->header->size > reader->mappedSize)) {
+		printf("%s is not a trace ring\n", shmName);
+		ShmRingClose(reader);
+		return -1;
+	}
+	atomic_thread_fence(memory_order_acquire);
+
+	// claim a slot so the writer can report the lag
+	for (slot = 0; slot < SHM_RING_READERS; slot++) {
+		uint32_t expected = 0;
+		if (atomic_compare_exchange_strong(&reader->header->readers[slot].pid, &expected, (uint32_t)getpid())) {
+			reader->slot = &reader->header->readers[slot];
+			break;
+		}
+	}
+
+	// start with the newest data
+	reader->position = atomic_load_explicit(&reader->header->write, memory_order_acquire);
+	if (reader->slot != NULL) {
+		atomic_store(&reader->slot->position, reader->position);
+		atomic_store(&reader->slot->overruns, 0);
+	}
+	return 0;
+}
+
+static void Resync(ShmReader* reader)
+{
+	uint64_t write = atomic_load_explicit(&reader->header->write, memory_order_acquire);
+
+	reader->lostBytes += write - reader->position;
+	reader->position = write;
+	if (reader->slot != NULL) {
+		atomic_fetch_add(&reader->slot->overruns, 1);
+		atomic_store_explicit(&reader->slot->position, reader->position, memory_order_release);
+	}
+}
+
+/*
+ * The next record, in place in the ring, or NULL if there is nothing new.
+ * The record stays valid until ShmRingRelease() confirms it was not overwritten.
+ */
+const ShmRingRecord* ShmRingNext(ShmReader* reader)
+{
+	uint64_t size = reader->header->size;
+
+	while (1) {
+		uint64_t write = atomic_load_explicit(&reader->header->write, memory_order_acquire);
+		if (reader->position == write) return NULL;
+
+		const ShmRingRecord* record = (const ShmRingRecord*) &reader->data[reader->position & (size - 1)];
+		// the writer may be overwriting the record if it has lapped this reader
+		uint32_t length = __atomic_load_n(&record->length, __ATOMIC_ACQUIRE);
+		uint64_t recordSize = (sizeof(ShmRingRecord) + (uint64_t)length + SHM_RING_ALIGN - 1) & ~(uint64_t)(SHM_RING_ALIGN - 1);
+
+		// lapped by the writer, or a header that is being overwritten - skip to the newest data
+		if ((write - reader->position > size) || (recordSize > size - (reader->position & (size - 1)))) {
+			Resync(reader);
+			continue;
+		}
+
+		reader->recordEnd = reader->position + recordSize;
+		if (record->type == SHM_RING_PAD) {
+			ShmRingRelease(reader);
+			continue;
+		}
+		return record;
+	}
+}
+
+/*
+ * Finished with the current record - returns 0 if it was intact, -1 if the writer may have
+ * overwritten it while it was in use
+ */
+int ShmRingRelease(ShmReader* reader)
+{
+	atomic_thread_fence(memory_order_acquire);
+	uint64_t reserve = atomic_load_explicit(&reader->header->reserve, memory_order_relaxed);
+
+	if (reserve - reader->position > reader->header->size) {
+		Resync(reader);
+		return -1;
+	}
+
+	reader->position = reader->recordEnd;
+	if (reader->slot != NULL) atomic_store_explicit(&reader->slot->position, reader->position, memory_order_release);
+	return 0;
+}
+
+void ShmRingClose(ShmReader* reader)
+{
+	if (reader->header == NULL) return;
+
+	if (reader->slot != NULL) atomic_store(&reader->slot->pid, 0);
+	munmap(reader->header, reader->mappedSize);
+	reader->header = NULL;
+	reader->slot = NULL;
+}
@@ -0,0 +1,117 @@
+/*
+ * shm-ring.h
+ *
+ * Shared memory ring publishing the trace to local processes (/dev/shm/<name>).
+ *
+ * One writer (stlink-trace --shm <name>) appends records; any number of readers map the
+ * same memory and read them in place. The writer never waits for a reader - a reader that
+ * falls more than the ring size behind loses data and is moved to the newest record.
+ *
+ * Layout: ShmRingHeader, then the data area. Each record is a ShmRingRecord header and
+ * its payload, padded to 16 bytes. A record never wraps: if it does not fit before the end
+ * of the data area a SHM_RING_PAD record fills the rest and it starts at offset 0. Data
+ * longer than half the ring is split into several records.
+ *
+ * Writer protocol: reserve = end of the new record (relaxed), release fence, copy the record,
+ * write = end of the record (release). A reader loads write (acquire), uses the record, then
+ * after an acquire fence checks reserve: if reserve - position > size the record may have
+ * been overwritten while it was in use.
+ *
+ * Reader example:
+ *
+ *   ShmReader reader;
+ *   ShmRingOpen(&reader, "stlink");
+ *   while (1) {
+ *       const ShmRingRecord* record = ShmRingNext(&reader);
+ *       if (record == NULL) { usleep(100); continue; }
+ *       if (record->type == SHM_RING_PORT) Process(record->port, SHM_RING_PAYLOAD(record), record->length);
+ *       if (ShmRingRelease(&reader) != 0) printf("record overwritten\n");
+ *   }
+ */
+
+#ifndef SHM_RING_H_
+#define SHM_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "itm-decode.h"
+
+#define SHM_RING_MAGIC          0x47525453	// "STRG"
+#define SHM_RING_VERSION        1
+#define SHM_RING_SIZE           (4 * 1024 * 1024)
+#define SHM_RING_READERS        16
+#define SHM_RING_ALIGN          16
+#define SHM_RING_STAGE_SIZE     4096
+
+// record types
+#define SHM_RING_PAD            0	// skip to the start of the data area
+#define SHM_RING_RAW            1	// raw SWO bytes from one trace read
+#define SHM_RING_PORT           2	// stimulus data of one port from one trace read
+
+#define SHM_RING_PAYLOAD(record) ((const unsigned char*)(record) + sizeof(ShmRingRecord))
+
+typedef struct {
+	uint32_t length;		// payload bytes
+	uint8_t type;
+	uint8_t port;
+	uint16_t reserved;
+	uint64_t time;			// CLOCK_MONOTONIC ns of the trace read
+} ShmRingRecord;
+
+typedef struct {
+	_Atomic uint64_t position;
+	_Atomic uint32_t pid;		// 0 = free
+	uint32_t reserved;
+	_Atomic uint64_t overruns;
+	uint8_t padding[40];
+} ShmRingSlot;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;				// data area bytes, a power of 2
+	uint8_t padding1[48];
+	_Atomic uint64_t reserve;
+	uint8_t padding2[56];
+	_Atomic uint64_t write;
+	uint8_t padding3[56];
+	ShmRingSlot readers[SHM_RING_READERS];
+} ShmRingHeader;
+
+// writer
+typedef struct {
+	ShmRingHeader* header;
+	unsigned char* data;
+	size_t mappedSize;
+	char name[80];
+	uint64_t time;			// of the current trace read
+	unsigned char stage[ITM_PORTS][SHM_RING_STAGE_SIZE];
+	size_t stageLength[ITM_PORTS];
+	unsigned long long nextReport;
+} ShmRing;
+
+// reader
+typedef struct {
+	ShmRingHeader* header;
+	unsigned char* data;
+	size_t mappedSize;
+	ShmRingSlot* slot;
+	uint64_t position;
+	uint64_t recordEnd;			// end of the record returned by ShmRingNext()
+	unsigned long long lostBytes;
+} ShmReader;
+
+int ShmRingCreate(ShmRing* ring, const char* name, size_t size);
+void ShmRingWrite(ShmRing* ring, int type, int port, const unsigned char* data, size_t length);
+void ShmRingTap(void* context, int port, const unsigned char* data, size_t length);
+void ShmRingFlush(ShmRing* ring);
+void ShmRingReport(ShmRing* ring);
+void ShmRingDestroy(ShmRing* ring);
+
+int ShmRingOpen(ShmReader* reader, const char* name);
+const ShmRingRecord* ShmRingNext(ShmReader* reader);
+int ShmRingRelease(ShmReader* reader);
+void ShmRingClose(ShmReader* reader);
+
+#endif /* SHM_RING_H_ */
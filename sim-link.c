@@ -0,0 +1,89 @@
+/*
+ * sim-link.c
+ *
+ * Client side of the simulator socket (see sim-link.h).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sim-link.h"
+
+static int WriteAll(int simFd, const void* data, size_t length)
+{
+	const unsigned char* pos = data;
+
+	while (length > 0) {
+		ssize_t count = send(simFd, pos, length, MSG_NOSIGNAL);
+		if (count <= 0) return -1;
+		pos += count;
+		length -= count;
+	}
+	return 0;
+}
+
+static int ReadAll(int simFd, void* data, size_t length)
+{
+	unsigned char* pos = data;
+
+	while (length > 0) {
+		ssize_t count = read(simFd, pos, length);
+		if (count <= 0) return -1;
+		pos += count;
+		length -= count;
+	}
+	return 0;
+}
+
+/*
+ * Returns the socket, or -1
+ */
+int SimConnect(const char* path)
+{
+	struct sockaddr_un address;
+	int simFd;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+	simFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((simFd < 0) || (connect(simFd, (struct sockaddr*) &address, sizeof(address)) != 0)) {
+		printf("Unable to connect to the simulator at %s\n", path);
+		SimClose(simFd);
+		return -1;
+	}
+
+	printf("Connected to the simulator at %s\n", path);
+	return simFd;
+}
+
+/*
+ * Same semantics as libusb_bulk_transfer() - returns 0 on success, -1 if the simulator has gone
+ */
+int SimBulkTransfer(int simFd, unsigned char endpoint, unsigned char* data, int length, int* transferred)
+{
+	SimHeader header;
+
+	*transferred = 0;
+	if ((simFd < 0) || (length < 0) || (length > SIM_MAX_TRANSFER)) return -1;
+
+	memset(&header, 0, sizeof(header));
+	header.endpoint = endpoint;
+	header.length = length;
+	if (WriteAll(simFd, &header, sizeof(header)) != 0) return -1;
+	if (!(endpoint & SIM_ENDPOINT_IN) && (WriteAll(simFd, data, length) != 0)) return -1;
+
+	if ((ReadAll(simFd, &header, sizeof(header)) != 0) || (header.length > (uint32_t)length)) return -1;
+	if ((endpoint & SIM_ENDPOINT_IN) && (ReadAll(simFd, data, header.length) != 0)) return -1;
+
+	*transferred = header.length;
+	return 0;
+}
+
+void SimClose(int simFd)
+{
+	if (simFd >= 0) close(simFd);
+}
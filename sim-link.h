@@ -0,0 +1,31 @@
+/*
+ * sim-link.h
+ *
+ * Connection to the ST-Link simulator (sim/stlink-sim.c) over a Unix domain socket,
+ * used in place of libusb by a session opened with a simulator path (--sim).
+ *
+ * Each USB bulk transfer is one request/response exchange:
+ *   request:  SimHeader (endpoint, length) followed by length bytes for an OUT endpoint
+ *   response: SimHeader (endpoint, bytes transferred) followed by the data for an IN endpoint
+ * For an IN endpoint the request length is the size of the receive buffer.
+ */
+
+#ifndef SIM_LINK_H_
+#define SIM_LINK_H_
+
+#include <stdint.h>
+
+#define SIM_ENDPOINT_IN     0x80
+#define SIM_MAX_TRANSFER    65536
+
+typedef struct {
+	uint8_t endpoint;
+	uint8_t reserved[3];
+	uint32_t length;
+} SimHeader;
+
+int SimConnect(const char* path);
+int SimBulkTransfer(int simFd, unsigned char endpoint, unsigned char* data, int length, int* transferred);
+void SimClose(int simFd);
+
+#endif /* SIM_LINK_H_ */
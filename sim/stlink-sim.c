@@ -0,0 +1,1010 @@
+/*
+ * stlink-sim.c
+ *
+ * ST-Link V2 simulator for testing stlink-trace without a probe.
+ * Listens on a Unix domain socket (protocol in sim-link.h) and answers the commands
+ * stlink-trace uses: 0xF1 version, 0xF5 mode, 0xF7 voltage, 0xF3 DFU exit and the 0xF2
+ * debug commands (memory and debug register access, core ID, SWD, run/halt, trace).
+ *
+ * Once trace is started and the core is running, ITM data is generated in real time at
+ * the SWO baud rate into a probe buffer of the size given in the start trace command.
+ * Bytes that do not fit are lost and an overflow packet is inserted, as on the target.
+ * Every report interval the generated and delivered rates, the losses and the latency
+ * from generation to delivery on the trace endpoint are printed.
+ *
+ * With --ping the firmware of target/ping.h is modelled: a token written to the RAM word
+ * at ADDRESS is echoed on the port (31 by default) at the next packet boundary.
+ * Packets for ports disabled in ITM_TER are not sent, as the firmware writes are discarded.
+ *
+ * With --dwt-period the firmware enters a code region every MS ms for a quarter of the
+ * period: DWT comparator 0 (if programmed) reports MATCHED on entry and comparator 1 on
+ * exit. PC samples are sent while ITM_TCR DWTENA and DWT_CTRL PCSAMPLENA are set.
+ *
+ * With --telemetry an f32 sample is sent on PORT after each text line: a triangle wave
+ * between 20 and 30 with a spike to 80 every 500 lines (stlink-trace --telemetry PORT:f32).
+ *
+ * With --func-trace the markers of target/func-trace.h are sent on PORT for each text line,
+ * with a SysTick handler every 8th line (run twice every 32nd), each followed by a local
+ * timestamp. The context writes are those of the target hooks, so the handler run twice
+ * replays the return to a context that sends nothing before the next preemption.
+ *
+ * With --rtos the events of target/rtos-trace.h are sent on PORT: a logger task runs for
+ * each text line, a control task is made ready and switched to every 3rd line, and the
+ * idle task runs in between. The cycle counts continue across repeats of the pattern.
+ *
+ * Build:
+ *   gcc -O2 -I. sim/stlink-sim.c -o stlink-sim
+ *
+ * Usage:
+ *   stlink-sim [--socket PATH] [--baud N] [--load PCT] [--burst ON_MS:OFF_MS] [--pattern text|words|mixed]
+ *              [--overrun-every MS] [--report MS] [--duration S] [--max-loss PCT] [--ping ADDRESS[:PORT]]
+ *              [--dwt-period MS] [--telemetry PORT] [--func-trace PORT]
+ *              [--rtos PORT]
+ *   stlink-trace --sim PATH
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sim-link.h"
+
+#define RAM_ADDRESS         0x20000000
+#define RAM_SIZE            (128 * 1024)
+#define REGISTERS           1024		// power of 2
+#define PATTERN_SIZE        65536
+#define PROBE_BUFFER_MAX    65536
+#define LATENCY_BUCKETS     24			// bucket n counts latencies below 2^n microseconds
+
+#define CORE_ID             0x1BA01477	// Cortex-M3
+#define AIRCR               0xE000ED0C
+#define DHCSR               0xE000EDF0
+#define ITM_TER             0xE0000E00
+#define ITM_TCR             0xE0000E80
+#define DWT_CTRL            0xE0001000
+#define DWT_FUNCTION0       0xE0001028
+#define DWT_FUNCTION1       0xE0001038
+#define DWT_MATCHED         (1 << 24)
+#define PC_SAMPLE_NS        227000		// every 16 * 1024 cycles at 72MHz
+
+typedef struct {
+	uint32_t address;
+	uint32_t value;
+	int used;
+} Register;
+
+typedef struct {
+	uint64_t generated;
+	uint64_t delivered;
+	uint64_t lost;
+	uint64_t overflows;
+	uint64_t junk;
+	uint64_t polls;
+	uint64_t backlogHighWater;
+	uint64_t latencyCount;
+	uint64_t latencyMaxNs;
+	uint64_t latency[LATENCY_BUCKETS];
+} Counters;
+
+// options
+static const char* socketPath = "/tmp/stlink-sim.sock";
+static double bytesPerSecond = 200000;	// 2 Mbaud, 10 bits per byte
+static double load = 0.5;
+static uint64_t burstOnNs = 0;
+static uint64_t burstPeriodNs = 0;
+static unsigned long overrunEveryMs = 0;
+static unsigned long reportMs = 1000;
+static unsigned long durationSeconds = 0;
+static double maxLoss = -1;
+
+// target state
+static int mode = 0x0000;	// DFU
+static int halted = 1;
+static uint32_t lastStatus = 0x80;
+static unsigned char ram[RAM_SIZE];
+static Register registers[REGISTERS];
+static uint32_t writeAddress = 0;
+static uint32_t writeLength = 0;
+static unsigned char response[SIM_MAX_TRANSFER];
+static uint32_t responseLength = 0;
+
+// trace state
+static unsigned char pattern[PATTERN_SIZE];
+static size_t patternLength = 0;
+static size_t patternPos = 0;
+static int tracing = 0;
+static uint32_t probeSize = 4096;
+static unsigned char probeBuffer[PROBE_BUFFER_MAX];
+static uint64_t probeTime[PROBE_BUFFER_MAX];	// generation time of each byte
+static uint32_t probeHead = 0;
+static uint32_t probeCount = 0;
+static int overflowPending = 0;
+static uint64_t activeStart = 0;				// time the core last started running with trace on
+static uint64_t activeProduced = 0;				// bytes produced since activeStart
+static uint32_t junkRemaining = 0;
+static unsigned char patternBoundary[PATTERN_SIZE];	// a packet starts at this pattern byte
+static uint32_t pingAddress = 0;
+static int pingPort = 31;
+static int telemetryPort = -1;
+static int funcTracePort = -1;
+static int rtosPort = -1;
+static uint32_t patternCycles[PATTERN_SIZE];	// an RTOS cycle count with this delta starts at this pattern byte
+static uint32_t rtosCycles = 0;
+static uint32_t cycleWord = 0;
+static int cycleBytes = 0;
+static uint64_t dwtPeriodNs = 0;
+static int inRegion = 0;
+static uint64_t nextPcSample = 0;
+static uint64_t nextOverrun = 0;
+
+static Counters total;
+static Counters previous;
+static uint64_t sessionMaxNs = 0;
+static uint64_t sessionBacklog = 0;
+static uint64_t firstTraceNs = 0;
+static uint64_t lastReportNs = 0;
+
+static uint32_t seed = 0x2013CAFE;
+
+static uint32_t Random()
+{
+	// xorshift32
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint32_t Get32(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void Put32(unsigned char* data, uint32_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+}
+
+//============================
+// memory
+//============================
+
+static Register* FindRegister(uint32_t address, int create)
+{
+	uint32_t slot = (address >> 2) * 2654435761U;
+	int probe;
+
+	for (probe = 0; probe < REGISTERS; probe++) {
+		Register* reg = &registers[(slot + probe) & (REGISTERS - 1)];
+		if (reg->used && (reg->address == address)) return reg;
+		if (!reg->used) {
+			if (!create) return NULL;
+			reg->used = 1;
+			reg->address = address;
+			reg->value = 0;
+			return reg;
+		}
+	}
+	return NULL;
+}
+
+static uint32_t ReadWord(uint32_t address)
+{
+	address &= ~3;
+	if ((address >= RAM_ADDRESS) && (address < RAM_ADDRESS + RAM_SIZE)) return Get32(&ram[address - RAM_ADDRESS]);
+	if (address == AIRCR) return 0xFA050000;
+	if (address == DHCSR) {
+		Register* reg = FindRegister(address, 0);
+		return ((reg != NULL) ? reg->value & 0xFFFF : 0) | (halted ? 0x00030000 : 0);
+	}
+
+	Register* reg = FindRegister(address, 0);
+	return (reg != NULL) ? reg->value : 0;
+}
+
+static void WriteWord(uint32_t address, uint32_t value)
+{
+	address &= ~3;
+	if ((address >= RAM_ADDRESS) && (address < RAM_ADDRESS + RAM_SIZE)) {
+		Put32(&ram[address - RAM_ADDRESS], value);
+		return;
+	}
+
+	Register* reg = FindRegister(address, 1);
+	if (reg != NULL) reg->value = value;
+}
+
+static void ReadBytes(uint32_t address, unsigned char* data, uint32_t length)
+{
+	while (length-- > 0) {
+		*data++ = ReadWord(address) >> (8 * (address & 3));
+		address++;
+	}
+}
+
+static void WriteBytes(uint32_t address, const unsigned char* data, uint32_t length)
+{
+	while (length-- > 0) {
+		uint32_t shift = 8 * (address & 3);
+		WriteWord(address, (ReadWord(address) & ~(0xFFU << shift)) | ((uint32_t) *data++ << shift));
+		address++;
+	}
+}
+
+//============================
+// trace generation
+//============================
+
+static void PatternPut(unsigned char ch)
+{
+	if (patternLength < PATTERN_SIZE) pattern[patternLength++] = ch;
+}
+
+static void PatternStimulus(int port, int size, uint32_t value)
+{
+	int i;
+
+	if (patternLength < PATTERN_SIZE) patternBoundary[patternLength] = 1;
+	PatternPut((port << 3) | (size == 4 ? 3 : size));
+	for (i = 0; i < size; i++) PatternPut(value >> (8 * i));
+}
+
+/*
+ * A reading for --telemetry, as float value = ...; ItmWrite(port, &value, 4)
+ */
+static void PatternTelemetry(int counter)
+{
+	int step = counter % 200;
+	float value = 20 + ((step < 100) ? step : 200 - step) / 10.0f;
+	uint32_t bits;
+
+	if (telemetryPort < 0) return;
+	if (counter % 500 == 499) value = 80;
+	memcpy(&bits, &value, sizeof(bits));
+	PatternStimulus(telemetryPort, 4, bits);
+}
+
+/*
+ * Local timestamp of the cycles since the last one, in continuation bytes
+ */
+static void PatternTimestamp(uint32_t cycles)
+{
+	PatternPut(0xC0);
+	while (cycles >= 0x80) {
+		PatternPut(0x80 | (cycles & 0x7F));
+		cycles >>= 7;
+	}
+	PatternPut(cycles);
+}
+
+static void PatternMarker(int size, uint32_t value, uint32_t cycles)
+{
+	PatternStimulus(funcTracePort, size, value);
+	PatternTimestamp(cycles);
+}
+
+/*
+ * A function marker in the given exception context, with the context writes of
+ * FuncTraceWrite in target/func-trace.h
+ */
+static void PatternCall(uint32_t context, uint32_t marker, uint32_t cycles)
+{
+	static uint32_t lastContext = 0xFFFFFFFF;
+
+	if (context != lastContext) {
+		lastContext = context;
+		PatternMarker(2, context, 4);
+	}
+	PatternMarker(4, marker, cycles);
+	if ((context != 0) && ((marker & 1) != 0)) lastContext = 0xFFFFFFFF;
+}
+
+/*
+ * SysTick_Handler -> TimerTick
+ */
+static void PatternSysTick(void)
+{
+	PatternCall(15, 0x08000500, 100);						// SysTick_Handler
+	PatternCall(15, 0x08000600, 10);						// TimerTick
+	PatternCall(15, 0x08000601, 150 + Random() % 32);
+	PatternCall(15, 0x08000501, 20);
+}
+
+/*
+ * The calls for one line: main loop -> LedToggle, then PrintLine -> FormatNumber, and
+ * SysTick_Handler -> TimerTick preempting FormatNumber - twice in a row every 32nd line, with
+ * no marker from FormatNumber in between
+ */
+static void PatternFunctions(int counter)
+{
+	if (funcTracePort < 0) return;
+	PatternCall(0, 0x08000200, 40 + Random() % 8);			// LedToggle
+	PatternCall(0, 0x08000201, 300 + Random() % 16);
+	PatternCall(0, 0x08000300, 50);							// PrintLine
+	PatternCall(0, 0x08000400, 20 + Random() % 4);			// FormatNumber
+	if (counter % 8 == 7) PatternSysTick();
+	if (counter % 32 == 31) PatternSysTick();
+	PatternCall(0, 0x08000401, 400 + Random() % 64);
+	PatternCall(0, 0x08000301, 900 + Random() % 64);
+}
+
+/*
+ * An RTOS event - the cycle count is filled in as it is sent
+ */
+static void PatternRtos(uint32_t type, uint32_t id, uint32_t cycles)
+{
+	PatternStimulus(rtosPort, 4, (type << 24) | id);
+	if (patternLength < PATTERN_SIZE) patternCycles[patternLength + 1] = cycles;
+	PatternStimulus(rtosPort, 4, 0);
+}
+
+static void PatternRtosName(uint32_t id, const char* name)
+{
+	unsigned char words[16] = {0};
+
+	strncpy((char*) words, name, sizeof(words) - 1);
+	PatternStimulus(rtosPort, 4, (3 << 24) | id);
+	PatternStimulus(rtosPort, 4, Get32(&words[0]));
+	PatternStimulus(rtosPort, 4, Get32(&words[4]));
+}
+
+/*
+ * Before a text line: idle (1) -> logger (3), and every 3rd line control (2) woken
+ */
+static void PatternTasks(int counter)
+{
+	if (rtosPort < 0) return;
+	if (counter % 3 == 2) {
+		PatternRtos(2, 2, 1500 + Random() % 500);		// ready
+		PatternRtos(1, 2, 200 + Random() % 400);		// switch to control
+		PatternRtos(1, 1, 800 + Random() % 100);
+	}
+	PatternRtos(1, 3, 2000 + Random() % 1000);
+}
+
+static void PatternTasksIdle(void)
+{
+	if (rtosPort >= 0) PatternRtos(1, 1, 3000 + Random() % 1000);
+}
+
+/*
+ * The firmware output is a repeating pattern, with a sync packet at the start of each repeat
+ */
+static void MakePattern(const char* name)
+{
+	char line[64];
+	int i, counter = 0;
+
+	for (i = 0; i < 5; i++) PatternPut(0x00);
+	PatternPut(0x80);
+	if (rtosPort >= 0) {
+		PatternRtosName(1, "idle");
+		PatternRtosName(2, "control");
+		PatternRtosName(3, "logger");
+	}
+
+	if (strcmp(name, "mixed") == 0) {
+		static const int sizes[] = {1, 2, 4, 4};
+		while (patternLength < PATTERN_SIZE - 5) PatternStimulus(Random() % 32, sizes[Random() % 4], Random());
+	}
+	else if (strcmp(name, "words") == 0) {
+		// the same text sent with target/itm-out.h: 4 byte writes, 2 and 1 byte writes for the tail
+		while (patternLength < PATTERN_SIZE - 256) {
+			int length = snprintf(line, sizeof(line), "Switched the LED %s. Counter: %d\n", (counter & 1) ? "off" : "on", counter / 2);
+			PatternTasks(counter);
+			for (i = 0; i + 4 <= length; i += 4) PatternStimulus(0, 4, Get32((unsigned char*) &line[i]));
+			if (length - i >= 2) {
+				PatternStimulus(0, 2, (unsigned char) line[i] | ((unsigned char) line[i + 1] << 8));
+				i += 2;
+			}
+			if (i < length) PatternStimulus(0, 1, (unsigned char) line[i]);
+			PatternTelemetry(counter);
+			PatternFunctions(counter);
+			PatternTasksIdle();
+			counter++;
+		}
+	}
+	else {
+		// as the Keil example: 1 byte writes on port 0
+		while (patternLength < PATTERN_SIZE - 256) {
+			snprintf(line, sizeof(line), "Switched the LED %s. Counter: %d\n", (counter & 1) ? "off" : "on", counter / 2);
+			PatternTasks(counter);
+			for (i = 0; line[i] != '\0'; i++) PatternStimulus(0, 1, (unsigned char) line[i]);
+			PatternTelemetry(counter);
+			PatternFunctions(counter);
+			PatternTasksIdle();
+			counter++;
+		}
+	}
+}
+
+/*
+ * Time (ns after activeStart) at which the given byte was produced.
+ * The firmware emits at the full SWO rate for burstOnNs of every burstPeriodNs.
+ */
+static uint64_t ProducedAt(uint64_t byte)
+{
+	uint64_t activeNs = (uint64_t)(byte * 1e9 / bytesPerSecond);
+	return (activeNs / burstOnNs) * burstPeriodNs + activeNs % burstOnNs;
+}
+
+static uint64_t ProducedBy(uint64_t elapsedNs)
+{
+	uint64_t activeNs = (elapsedNs / burstPeriodNs) * burstOnNs;
+	uint64_t partial = elapsedNs % burstPeriodNs;
+	activeNs += (partial < burstOnNs) ? partial : burstOnNs;
+	return (uint64_t)(activeNs * bytesPerSecond / 1e9);
+}
+
+static void ProbeStore(unsigned char ch, uint64_t time)
+{
+	uint32_t pos = (probeHead + probeCount) % probeSize;
+	probeBuffer[pos] = ch;
+	probeTime[pos] = time;
+	probeCount++;
+}
+
+/*
+ * Bring the probe buffer up to date
+ */
+static void Generate(uint64_t now)
+{
+	if (!tracing || halted) return;
+
+	uint64_t produced = ProducedBy(now - activeStart);
+	uint32_t enabledPorts = ReadWord(ITM_TER);
+	int pcSampling = (ReadWord(ITM_TCR) & (1 << 3)) && (ReadWord(DWT_CTRL) & (1 << 12));
+
+	// the code region watched by the DWT comparators
+	if (dwtPeriodNs > 0) {
+		int entered = ((now - activeStart) % dwtPeriodNs) < dwtPeriodNs / 4;
+		if (entered != inRegion) {
+			Register* function = FindRegister(entered ? DWT_FUNCTION0 : DWT_FUNCTION1, 0);
+			if ((function != NULL) && ((function->value & 0xF) != 0)) function->value |= DWT_MATCHED;
+			inRegion = entered;
+		}
+	}
+	size_t skipped = 0;
+	while (activeProduced < produced) {
+		// packets on disabled ports take no SWO time
+		if (patternBoundary[patternPos] && !(enabledPorts & (1U << (pattern[patternPos] >> 3)))) {
+			int size = pattern[patternPos] & 3;
+			patternPos += 1 + ((size == 3) ? 4 : size);
+			if (patternPos >= patternLength) patternPos = 0;
+			if (++skipped > patternLength) {
+				activeProduced = produced;		// every port disabled - idle
+				break;
+			}
+			continue;
+		}
+
+		uint64_t time = activeStart + ProducedAt(activeProduced);
+		activeProduced++;
+		total.generated++;
+
+		if (probeCount >= probeSize) {
+			// buffer full - the byte is lost
+			total.lost++;
+			if (!overflowPending) total.overflows++;
+			overflowPending = 1;
+			continue;
+		}
+		if (overflowPending) {
+			ProbeStore(0x70, time);
+			overflowPending = 0;
+			if (probeCount >= probeSize) {
+				total.lost++;
+				continue;
+			}
+		}
+
+		// PC samples go between two packets
+		if (patternBoundary[patternPos] && pcSampling && (time >= nextPcSample) && (probeCount + 6 <= probeSize)) {
+			uint32_t pc = inRegion ? 0x08000400 + (Random() & 0x3E) : 0x08001000 + (Random() & 0xFFE);
+			int i;
+			nextPcSample = time + PC_SAMPLE_NS;
+			ProbeStore(0x17, time);
+			for (i = 0; i < 4; i++) ProbeStore(pc >> (8 * i), time);
+		}
+
+		// a ping token is echoed between two packets
+		if (patternBoundary[patternPos] && (pingAddress != 0) && (ReadWord(pingAddress) != 0) && (probeCount + 6 <= probeSize)) {
+			uint32_t token = ReadWord(pingAddress);
+			int i;
+			WriteWord(pingAddress, 0);
+			ProbeStore((pingPort << 3) | 3, time);
+			for (i = 0; i < 4; i++) ProbeStore(token >> (8 * i), time);
+		}
+
+		// the RTOS cycle counter keeps counting when the pattern repeats
+		unsigned char ch = pattern[patternPos];
+		if (patternCycles[patternPos] != 0) {
+			rtosCycles += patternCycles[patternPos];
+			cycleWord = rtosCycles;
+			cycleBytes = 4;
+		}
+		if (cycleBytes > 0) {
+			ch = cycleWord >> (8 * (4 - cycleBytes));
+			cycleBytes--;
+		}
+		ProbeStore(ch, time);
+		if (++patternPos >= patternLength) patternPos = 0;
+	}
+	if (probeCount > total.backlogHighWater) total.backlogHighWater = probeCount;
+	if (probeCount > sessionBacklog) sessionBacklog = probeCount;
+
+	// injected overrun - the byte count has 0xF800 set and junk is read from the trace endpoint
+	if ((overrunEveryMs > 0) && (junkRemaining == 0) && (now >= nextOverrun)) {
+		if (nextOverrun != 0) junkRemaining = 0xF800 | (Random() & 0xFF);
+		nextOverrun = now + overrunEveryMs * 1000000ULL;
+	}
+}
+
+static void RecordLatency(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+	while ((bucket < LATENCY_BUCKETS - 1) && (us >= (1ULL << bucket))) bucket++;
+
+	total.latency[bucket]++;
+	total.latencyCount++;
+	if (ns > total.latencyMaxNs) total.latencyMaxNs = ns;
+	if (ns > sessionMaxNs) sessionMaxNs = ns;
+}
+
+static uint32_t ReadTrace(unsigned char* data, uint32_t length, uint64_t now)
+{
+	uint32_t count = 0;
+
+	// junk first if an overrun was injected
+	while ((junkRemaining > 0) && (count < length)) {
+		data[count] = (count & 1) ? 0xF8 : Random();
+		count++;
+		junkRemaining--;
+		total.junk++;
+	}
+
+	while ((probeCount > 0) && (count < length)) {
+		data[count++] = probeBuffer[probeHead];
+		RecordLatency(now - probeTime[probeHead]);
+		probeHead = (probeHead + 1) % probeSize;
+		probeCount--;
+		total.delivered++;
+	}
+	return count;
+}
+
+static void SetRunning(int running, uint64_t now)
+{
+	if (running && halted && tracing) {
+		activeStart = now;
+		activeProduced = 0;
+	}
+	halted = !running;
+}
+
+//============================
+// commands
+//============================
+
+static void Reply(const unsigned char* data, uint32_t length)
+{
+	memcpy(response, data, length);
+	responseLength = length;
+}
+
+static void ReplyStatus()
+{
+	unsigned char status[2] = {0x80, 0x00};
+	Reply(status, 2);
+}
+
+static void DebugCommand(const unsigned char* command, uint64_t now)
+{
+	uint32_t address = Get32(&command[2]);
+	uint32_t length = command[6] | (command[7] << 8);
+	unsigned char data[8] = {0};
+
+	switch (command[1]) {
+	case 0x07:		// read 32 bit
+	case 0x0C:		// read 8 bit
+		if (length > SIM_MAX_TRANSFER) length = SIM_MAX_TRANSFER;
+		ReadBytes(address, response, length);
+		responseLength = length;
+		// reading DWT_FUNCTION clears MATCHED
+		if ((address <= DWT_FUNCTION0) && (address + length > DWT_FUNCTION0)) WriteWord(DWT_FUNCTION0, ReadWord(DWT_FUNCTION0) & ~DWT_MATCHED);
+		if ((address <= DWT_FUNCTION1) && (address + length > DWT_FUNCTION1)) WriteWord(DWT_FUNCTION1, ReadWord(DWT_FUNCTION1) & ~DWT_MATCHED);
+		lastStatus = 0x80;
+		break;
+	case 0x08:		// write 32 bit - data follows on the next transfer
+	case 0x0D:		// write 8 bit
+		writeAddress = address;
+		writeLength = length;
+		responseLength = 0;
+		break;
+	case 0x22:		// core ID
+		Put32(data, CORE_ID);
+		Reply(data, 4);
+		break;
+	case 0x30:		// enter SWD
+		mode = 0x0002;
+		ReplyStatus();
+		break;
+	case 0x35:		// write debug register
+		WriteWord(address, Get32(&command[6]));
+		ReplyStatus();
+		break;
+	case 0x36:		// read debug register
+		data[0] = 0x80;
+		Put32(&data[4], ReadWord(address));
+		Reply(data, 8);
+		break;
+	case 0x3E:		// status of the last memory transfer
+		data[0] = lastStatus;
+		Reply(data, 2);
+		break;
+	case 0x40:		// start trace: buffer size, baud rate
+		probeSize = command[2] | (command[3] << 8);
+		if ((probeSize == 0) || (probeSize > PROBE_BUFFER_MAX)) probeSize = PROBE_BUFFER_MAX;
+		probeHead = probeCount = 0;
+		tracing = 1;
+		if (firstTraceNs == 0) firstTraceNs = lastReportNs = now;
+		if (!halted) {
+			activeStart = now;
+			activeProduced = 0;
+		}
+		ReplyStatus();
+		break;
+	case 0x41:		// stop trace
+		tracing = 0;
+		ReplyStatus();
+		break;
+	case 0x42: {	// trace byte count
+		total.polls++;
+		uint32_t count = (junkRemaining > 0) ? junkRemaining : probeCount;
+		data[0] = count;
+		data[1] = count >> 8;
+		Reply(data, 2);
+		break;
+	}
+	case 0x09:		// run
+		SetRunning(1, now);
+		ReplyStatus();
+		break;
+	case 0x02:		// force debug
+	case 0x0A:		// step
+		SetRunning(0, now);
+		ReplyStatus();
+		break;
+	case 0x03:		// reset system
+	default:
+		ReplyStatus();
+		break;
+	}
+}
+
+static void Command(const unsigned char* command, uint32_t length, uint64_t now)
+{
+	unsigned char data[8] = {0};
+
+	// data phase of a memory write
+	if (writeLength > 0) {
+		WriteBytes(writeAddress, command, length < writeLength ? length : writeLength);
+		writeLength = 0;
+		lastStatus = 0x80;
+		responseLength = 0;
+		return;
+	}
+
+	responseLength = 0;
+	if (length < 2) return;
+
+	switch (command[0]) {
+	case 0xF1:		// version V2.J17.S4, VID 0x0483, PID 0x3748
+		data[0] = 0x24;
+		data[1] = 0x44;
+		data[2] = 0x83;
+		data[3] = 0x04;
+		data[4] = 0x48;
+		data[5] = 0x37;
+		Reply(data, 6);
+		break;
+	case 0xF5:		// current mode
+		data[0] = mode;
+		data[1] = mode >> 8;
+		Reply(data, 2);
+		break;
+	case 0xF7:		// target voltage: 2 * 1.2V * 1861 / 1489 = 3.0V
+		Put32(&data[0], 1489);
+		Put32(&data[4], 1861);
+		Reply(data, 8);
+		break;
+	case 0xF3:		// DFU exit - no response
+		if (command[1] == 0x07) mode = 0x0001;
+		break;
+	case 0xF2:
+		DebugCommand(command, now);
+		break;
+	}
+}
+
+//============================
+// reporting
+//============================
+
+static uint64_t Percentile(const Counters* counters, double fraction)
+{
+	uint64_t target = (uint64_t)(counters->latencyCount * fraction);
+	uint64_t seen = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++) {
+		seen += counters->latency[bucket];
+		if (seen > target) break;
+	}
+	return 1ULL << bucket;
+}
+
+static void Report(const Counters* counters, double seconds, const char* label)
+{
+	printf("%s: generated %.0f B/s, delivered %.0f B/s, lost %llu (%.2f%%), overflows %llu, junk %llu, polls %.0f/s, backlog max %llu, "
+			"latency p50 <%llu us, p99 <%llu us, max %.0f us\n", label,
+			counters->generated / seconds, counters->delivered / seconds, (unsigned long long)counters->lost,
+			counters->generated ? 100.0 * counters->lost / counters->generated : 0.0,
+			(unsigned long long)counters->overflows, (unsigned long long)counters->junk, counters->polls / seconds,
+			(unsigned long long)counters->backlogHighWater,
+			(unsigned long long)Percentile(counters, 0.5), (unsigned long long)Percentile(counters, 0.99), counters->latencyMaxNs / 1000.0);
+	fflush(stdout);
+}
+
+static void PeriodicReport(uint64_t now)
+{
+	if ((firstTraceNs == 0) || (now - lastReportNs < reportMs * 1000000ULL)) return;
+
+	Counters interval;
+	int bucket;
+
+	interval.generated = total.generated - previous.generated;
+	interval.delivered = total.delivered - previous.delivered;
+	interval.lost = total.lost - previous.lost;
+	interval.overflows = total.overflows - previous.overflows;
+	interval.junk = total.junk - previous.junk;
+	interval.polls = total.polls - previous.polls;
+	interval.backlogHighWater = total.backlogHighWater;
+	interval.latencyCount = total.latencyCount - previous.latencyCount;
+	interval.latencyMaxNs = total.latencyMaxNs;
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) interval.latency[bucket] = total.latency[bucket] - previous.latency[bucket];
+	Report(&interval, (now - lastReportNs) / 1e9, "interval");
+
+	// high-water mark and maximum are per interval
+	total.backlogHighWater = 0;
+	total.latencyMaxNs = 0;
+	previous = total;
+	lastReportNs = now;
+}
+
+//============================
+// socket
+//============================
+
+static int ReadAll(int fd, void* data, size_t length)
+{
+	unsigned char* pos = data;
+
+	while (length > 0) {
+		ssize_t count = read(fd, pos, length);
+		if (count <= 0) return -1;
+		pos += count;
+		length -= count;
+	}
+	return 0;
+}
+
+static int WriteAll(int fd, const void* data, size_t length)
+{
+	const unsigned char* pos = data;
+
+	while (length > 0) {
+		ssize_t count = send(fd, pos, length, MSG_NOSIGNAL);
+		if (count <= 0) return -1;
+		pos += count;
+		length -= count;
+	}
+	return 0;
+}
+
+/*
+ * Serve one stlink-trace session. Returns 1 once the duration has passed.
+ */
+static int Serve(int fd)
+{
+	static unsigned char data[SIM_MAX_TRANSFER];
+	SimHeader header;
+
+	while (ReadAll(fd, &header, sizeof(header)) == 0) {
+		uint64_t now = GetTimeNs();
+		uint32_t length = (header.length > SIM_MAX_TRANSFER) ? SIM_MAX_TRANSFER : header.length;
+
+		Generate(now);
+
+		if (header.endpoint & SIM_ENDPOINT_IN) {
+			if ((header.endpoint & 0x0F) == 3) {
+				header.length = ReadTrace(data, length, now);
+			}
+			else {
+				header.length = (responseLength < length) ? responseLength : length;
+				memcpy(data, response, header.length);
+				responseLength = 0;
+			}
+			if ((WriteAll(fd, &header, sizeof(header)) != 0) || (WriteAll(fd, data, header.length) != 0)) break;
+		}
+		else {
+			if (ReadAll(fd, data, length) != 0) break;
+			Command(data, length, now);
+			if (WriteAll(fd, &header, sizeof(header)) != 0) break;
+		}
+
+		PeriodicReport(now);
+		if ((durationSeconds > 0) && (firstTraceNs != 0) && (now - firstTraceNs >= durationSeconds * 1000000000ULL)) return 1;
+	}
+	return 0;
+}
+
+static struct option longOptions[] = {
+	{"socket",        required_argument, 0, 's'},
+	{"baud",          required_argument, 0, 'b'},
+	{"load",          required_argument, 0, 'l'},
+	{"burst",         required_argument, 0, 'B'},
+	{"pattern",       required_argument, 0, 'p'},
+	{"overrun-every", required_argument, 0, 'o'},
+	{"report",        required_argument, 0, 'r'},
+	{"duration",      required_argument, 0, 'd'},
+	{"max-loss",      required_argument, 0, 'm'},
+	{"ping",          required_argument, 0, 'P'},
+	{"dwt-period",    required_argument, 0, 'D'},
+	{"telemetry",     required_argument, 0, 't'},
+	{"func-trace",    required_argument, 0, 'f'},
+	{"rtos",          required_argument, 0, 'T'},
+	{0, 0, 0, 0}
+};
+
+int main(int argc, char** argv)
+{
+	const char* patternName = "text";
+	unsigned long burstOnMs = 0, burstOffMs = 0;
+	struct sockaddr_un address;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:b:l:B:p:o:r:d:m:P:D:t:f:T:", longOptions, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			socketPath = optarg;
+			break;
+		case 'b':
+			bytesPerSecond = atof(optarg) / 10;
+			break;
+		case 'l':
+			load = atof(optarg) / 100;
+			break;
+		case 'B':
+			if (sscanf(optarg, "%lu:%lu", &burstOnMs, &burstOffMs) != 2) {
+				printf("Invalid burst %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'p':
+			patternName = optarg;
+			break;
+		case 'o':
+			overrunEveryMs = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reportMs = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			durationSeconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			maxLoss = atof(optarg);
+			break;
+		case 'T':
+			rtosPort = strtoul(optarg, NULL, 0) & 31;
+			break;
+		case 'f':
+			funcTracePort = strtoul(optarg, NULL, 0) & 31;
+			break;
+		case 't':
+			telemetryPort = strtoul(optarg, NULL, 0) & 31;
+			break;
+		case 'D':
+			dwtPeriodNs = strtoul(optarg, NULL, 0) * 1000000ULL;
+			break;
+		case 'P': {
+			char* port = NULL;
+			pingAddress = strtoul(optarg, &port, 0) & ~3U;
+			if (*port == ':') pingPort = strtoul(port + 1, NULL, 0) & 31;
+			break;
+		}
+		default:
+			return 2;
+		}
+	}
+
+	if ((bytesPerSecond <= 0) || (load <= 0) || (load > 1)) {
+		printf("Invalid baud rate or load\n");
+		return 2;
+	}
+
+	// a steady load is a burst pattern with a 1ms period
+	if (burstOnMs > 0) {
+		burstOnNs = burstOnMs * 1000000ULL;
+		burstPeriodNs = (burstOnMs + burstOffMs) * 1000000ULL;
+	}
+	else {
+		burstPeriodNs = 1000000;
+		burstOnNs = (uint64_t)(burstPeriodNs * load);
+	}
+
+	MakePattern(patternName);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+	unlink(socketPath);
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((listenFd < 0) || (bind(listenFd, (struct sockaddr*) &address, sizeof(address)) != 0) || (listen(listenFd, 1) != 0)) {
+		printf("Unable to listen on %s\n", socketPath);
+		return 2;
+	}
+
+	printf("ST-Link simulator on %s: %.0f bytes/s SWO, %.0f%% of the time in %.1fms bursts\n", socketPath, bytesPerSecond,
+			100.0 * burstOnNs / burstPeriodNs, burstOnNs / 1e6);
+	fflush(stdout);
+
+	int finished = 0;
+	while (!finished) {
+		int fd = accept(listenFd, NULL, NULL);
+		if (fd < 0) continue;
+
+		finished = Serve(fd);
+		close(fd);
+
+		if (firstTraceNs != 0) {
+			Counters summary = total;
+			summary.backlogHighWater = sessionBacklog;
+			summary.latencyMaxNs = sessionMaxNs;
+			Report(&summary, (GetTimeNs() - firstTraceNs) / 1e9, "session");
+		}
+
+		// next session starts from reset
+		mode = 0x0000;
+		halted = 1;
+		tracing = 0;
+		probeCount = junkRemaining = 0;
+	}
+
+	close(listenFd);
+	unlink(socketPath);
+
+	if ((maxLoss >= 0) && (total.generated > 0) && (100.0 * total.lost / total.generated > maxLoss)) {
+		printf("Loss %.2f%% exceeds %.2f%%\n", 100.0 * total.lost / total.generated, maxLoss);
+		return 1;
+	}
+	return 0;
+}
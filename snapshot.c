@@ -0,0 +1,215 @@
+/*
+ * snapshot.c
+ *
+ * Memory snapshots (see snapshot.h).
+ * While the core runs a snapshot is read a few KB at a time between trace polls so that
+ * a large region does not stall the capture. With --snapshot-halt the core is stopped and
+ * the regions are read in one go, and it is left as it was found.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stlink-trace.h"
+#include "snapshot.h"
+
+#define DHCSR       0xE000EDF0
+#define S_HALT      0x00020000
+
+/*
+ * Parse "address:length[,address:length...]"
+ */
+int SnapshotAddRegions(Snapshot* snapshot, const char* spec)
+{
+	const char* pos = spec;
+	char* end = NULL;
+
+	while (*pos != '\0') {
+		if (snapshot->regionCount >= SNAPSHOT_MAX_REGIONS) {
+			printf("Too many snapshot regions (max %d)\n", SNAPSHOT_MAX_REGIONS);
+			return -1;
+		}
+
+		SnapshotRegion* region = &snapshot->regions[snapshot->regionCount];
+		region->address = strtoul(pos, &end, 0);
+		if (*end != ':') {
+			printf("Invalid snapshot region: %s\n", pos);
+			return -1;
+		}
+		region->length = strtoul(end + 1, &end, 0);
+		if ((region->length == 0) || ((*end != ',') && (*end != '\0'))) {
+			printf("Invalid snapshot region: %s\n", pos);
+			return -1;
+		}
+
+		region->previous = NULL;
+		region->current = malloc(region->length);
+		if (region->current == NULL) {
+			printf("Unable to allocate snapshot region\n");
+			return -1;
+		}
+
+		snapshot->regionCount++;
+		pos = (*end == ',') ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+static void WriteUint32(FILE* file, uint32_t value)
+{
+	unsigned char data[4] = {value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF};
+	fwrite(&data[0], 1, 4, file);
+}
+
+int SnapshotOpen(Snapshot* snapshot, const char* filename, int halt)
+{
+	snapshot->file = fopen(filename, "wb");	// create or overwrite
+	if (snapshot->file == NULL) {
+		printf("Unable to open snapshot file %s\n", filename);
+		return -1;
+	}
+
+	fwrite(SNAPSHOT_MAGIC, 1, 4, snapshot->file);
+	WriteUint32(snapshot->file, SNAPSHOT_VERSION);
+	WriteUint32(snapshot->file, SNAPSHOT_PAGE_SIZE);
+	snapshot->halt = halt;
+	return 0;
+}
+
+/*
+ * Request a snapshot - ignored if one is already being read
+ */
+void SnapshotStart(Snapshot* snapshot)
+{
+	int r;
+
+	if ((snapshot->file == NULL) || snapshot->active) return;
+
+	for (r = 0; r < snapshot->regionCount; r++) snapshot->regions[r].failed = 0;
+	snapshot->active = 1;
+	snapshot->region = 0;
+	snapshot->offset = 0;
+}
+
+/*
+ * Write the pages that differ from the previous snapshot
+ */
+static void SnapshotWrite(Snapshot* snapshot)
+{
+	struct timespec now;
+	int r, regionCount = 0;
+
+	for (r = 0; r < snapshot->regionCount; r++) {
+		if (!snapshot->regions[r].failed) regionCount++;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	fwrite(SNAPSHOT_RECORD_MAGIC, 1, 4, snapshot->file);
+	WriteUint32(snapshot->file, snapshot->sequence++);
+	uint64_t time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	WriteUint32(snapshot->file, time & 0xFFFFFFFF);
+	WriteUint32(snapshot->file, time >> 32);
+	WriteUint32(snapshot->file, regionCount);
+
+	for (r = 0; r < snapshot->regionCount; r++) {
+		SnapshotRegion* region = &snapshot->regions[r];
+		uint32_t pageCount = (region->length + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE;
+		uint32_t page, changed = 0;
+
+		if (region->failed) continue;
+
+		for (page = 0; page < pageCount; page++) {
+			uint32_t offset = page * SNAPSHOT_PAGE_SIZE;
+			uint32_t size = (region->length - offset < SNAPSHOT_PAGE_SIZE) ? region->length - offset : SNAPSHOT_PAGE_SIZE;
+			if ((region->previous == NULL) || memcmp(&region->previous[offset], &region->current[offset], size)) changed++;
+		}
+
+		WriteUint32(snapshot->file, region->address);
+		WriteUint32(snapshot->file, region->length);
+		WriteUint32(snapshot->file, changed);
+
+		for (page = 0; page < pageCount; page++) {
+			uint32_t offset = page * SNAPSHOT_PAGE_SIZE;
+			uint32_t size = (region->length - offset < SNAPSHOT_PAGE_SIZE) ? region->length - offset : SNAPSHOT_PAGE_SIZE;
+			if ((region->previous == NULL) || memcmp(&region->previous[offset], &region->current[offset], size)) {
+				WriteUint32(snapshot->file, page);
+				fwrite(&region->current[offset], 1, size, snapshot->file);
+			}
+		}
+
+		snapshot->pagesWritten += changed;
+		snapshot->pagesTotal += pageCount;
+
+		// the snapshot just read becomes the reference for the next one
+		if (region->previous == NULL) region->previous = malloc(region->length);
+		if (region->previous != NULL) {
+			unsigned char* swap = region->previous;
+			region->previous = region->current;
+			region->current = swap;
+		}
+	}
+
+	fflush(snapshot->file);
+	if (debugEnabled) printf("Snapshot %u written, %lu of %lu pages stored so far\n", snapshot->sequence - 1, snapshot->pagesWritten, snapshot->pagesTotal);
+}
+
+/*
+ * Continue reading an active snapshot, at most budget bytes unless the core is halted.
+ * Returns 1 when a snapshot has been completed and written.
+ */
+int SnapshotService(Snapshot* snapshot, size_t budget)
+{
+	int resume = 0;
+
+	if (!snapshot->active) return 0;
+
+	if (snapshot->halt) {
+		// a core the user has stopped is not resumed afterwards
+		resume = (Read32Bit(DHCSR) & S_HALT) == 0;
+		if (resume) ForceDebug();
+		budget = (size_t)-1;
+	}
+
+	while ((snapshot->region < snapshot->regionCount) && (budget > 0)) {
+		SnapshotRegion* region = &snapshot->regions[snapshot->region];
+		uint32_t length = region->length - snapshot->offset;
+		if (length > budget) length = budget;
+
+		if (ReadMemory(region->address + snapshot->offset, &region->current[snapshot->offset], length) != 0) {
+			printf("Snapshot region 0x%08x not read\n", region->address);
+			region->failed = 1;
+			snapshot->offset = region->length - length;
+		}
+		snapshot->offset += length;
+		budget -= length;
+
+		if (snapshot->offset >= region->length) {
+			snapshot->region++;
+			snapshot->offset = 0;
+		}
+	}
+
+	if (resume) RunCore();
+
+	if (snapshot->region < snapshot->regionCount) return 0;
+
+	SnapshotWrite(snapshot);
+	snapshot->active = 0;
+	return 1;
+}
+
+void SnapshotClose(Snapshot* snapshot)
+{
+	int r;
+
+	if (snapshot->file != NULL) fclose(snapshot->file);
+	snapshot->file = NULL;
+
+	for (r = 0; r < snapshot->regionCount; r++) {
+		free(snapshot->regions[r].previous);
+		free(snapshot->regions[r].current);
+	}
+	snapshot->regionCount = 0;
+}
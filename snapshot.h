@@ -0,0 +1,59 @@
+/*
+ * snapshot.h
+ *
+ * Snapshots of target memory regions, delta encoded against the previous snapshot.
+ *
+ * File format (little endian):
+ *   file header:  "STSN", u32 version, u32 page size
+ *   per snapshot: "SNAP", u32 sequence, u64 time (ns since the epoch), u32 region count
+ *   per region:   u32 address, u32 length, u32 changed page count,
+ *                 then for each changed page: u32 page index, page data
+ *                 (the last page of a region may be short)
+ * The first snapshot stores every page, later ones only the pages that changed. A region
+ * that could not be read is left out of the snapshot, and the next one that is read is
+ * stored against the last one written.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define SNAPSHOT_MAGIC          "STSN"
+#define SNAPSHOT_RECORD_MAGIC   "SNAP"
+#define SNAPSHOT_VERSION        1
+#define SNAPSHOT_PAGE_SIZE      256
+#define SNAPSHOT_MAX_REGIONS    16
+// bytes read per service call while the core is running
+#define SNAPSHOT_BUDGET         4096
+
+typedef struct {
+	uint32_t address;
+	uint32_t length;
+	unsigned char* previous;	// last snapshot written, NULL before the first one
+	unsigned char* current;
+	int failed;					// a read of the active snapshot failed
+} SnapshotRegion;
+
+typedef struct {
+	SnapshotRegion regions[SNAPSHOT_MAX_REGIONS];
+	int regionCount;
+	FILE* file;
+	int halt;				// halt the core while reading
+	int active;				// a snapshot is being read
+	int region;				// read position of the active snapshot
+	uint32_t offset;
+	uint32_t sequence;
+	unsigned long pagesWritten;
+	unsigned long pagesTotal;
+} Snapshot;
+
+int SnapshotAddRegions(Snapshot* snapshot, const char* spec);
+int SnapshotOpen(Snapshot* snapshot, const char* filename, int halt);
+void SnapshotStart(Snapshot* snapshot);
+int SnapshotService(Snapshot* snapshot, size_t budget);
+void SnapshotClose(Snapshot* snapshot);
+
+#endif /* SNAPSHOT_H_ */
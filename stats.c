@@ -0,0 +1,216 @@
+/*
+ * stats.c
+ *
+ * Capture path counters (see stats.h).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+int statsEnabled = 0;
+Stats stats;
+
+static Stats previous;
+static FILE* jsonFile = NULL;
+static const char* prometheusFilename = NULL;
+static uint64_t intervalNs = 0;
+static uint64_t lastExportNs = 0;
+static uint64_t nextExportNs = 0;
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Start time for StatsLatency(), 0 when disabled
+ */
+uint64_t StatsStart()
+{
+	return statsEnabled ? GetTimeNs() : 0;
+}
+
+uint64_t StatsElapsed(uint64_t start)
+{
+	return (start == 0) ? 0 : GetTimeNs() - start;
+}
+
+void StatsLatency(int key, uint64_t start)
+{
+	if (start == 0) return;
+
+	uint64_t elapsed = GetTimeNs() - start;
+	uint64_t us = elapsed / 1000;
+	int bucket = 0;
+	while ((bucket < STATS_BUCKETS - 1) && (us >= (1ULL << bucket))) bucket++;
+
+	StatsHistogram* histogram = &stats.latency[key];
+	histogram->count++;
+	histogram->totalNs += elapsed;
+	if (elapsed > histogram->maxNs) histogram->maxNs = elapsed;
+	histogram->buckets[bucket]++;
+}
+
+static void KeyName(int key, char* name, size_t size)
+{
+	if (key < 0x100) snprintf(name, size, "F2_%02X", key);
+	else if (key < STATS_KEY_WRITE_DATA) snprintf(name, size, "%02X", key - 0x100);
+	else if (key == STATS_KEY_WRITE_DATA) snprintf(name, size, "write_data");
+	else if (key == STATS_KEY_TRACE_READ) snprintf(name, size, "trace_read");
+	else snprintf(name, size, "sink_write");
+}
+
+/*
+ * Upper bound (us) of the bucket holding the given fraction of the samples
+ */
+static uint64_t Percentile(const StatsHistogram* histogram, double fraction)
+{
+	uint64_t target = (uint64_t)(histogram->count * fraction);
+	uint64_t seen = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen > target) break;
+	}
+	return 1ULL << (bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1);
+}
+
+static void WriteJson(uint64_t now)
+{
+	double seconds = (now - lastExportNs) / 1e9;
+	uint64_t polls = stats.polls - previous.polls;
+	uint64_t decodeNs = stats.decodeNs - previous.decodeNs;
+	struct timespec wall;
+	char name[16];
+	int key, first = 1;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	fprintf(jsonFile, "{\"time\":%ld.%03ld,\"trace_bytes_per_s\":%.0f,\"polls_per_s\":%.0f,\"empty_poll_ratio\":%.3f,",
+			(long)wall.tv_sec, wall.tv_nsec / 1000000, (stats.traceBytes - previous.traceBytes) / seconds, polls / seconds,
+			polls ? (double)(stats.emptyPolls - previous.emptyPolls) / polls : 0.0);
+	fprintf(jsonFile, "\"decoder_bytes_per_s\":%.0f,\"probe_backlog_high_water\":%llu,\"down_channel_high_water\":%llu,\"latency_us\":{",
+			decodeNs ? (stats.decodedBytes - previous.decodedBytes) * 1e9 / decodeNs : 0.0,
+			(unsigned long long)stats.probeBacklogHighWater, (unsigned long long)stats.downChannelHighWater);
+
+	// latencies over the interval only
+	for (key = 0; key < STATS_KEYS; key++) {
+		StatsHistogram delta = stats.latency[key];
+		int bucket;
+		if (delta.count == previous.latency[key].count) continue;
+		delta.count -= previous.latency[key].count;
+		delta.totalNs -= previous.latency[key].totalNs;
+		for (bucket = 0; bucket < STATS_BUCKETS; bucket++) delta.buckets[bucket] -= previous.latency[key].buckets[bucket];
+
+		KeyName(key, name, sizeof(name));
+		fprintf(jsonFile, "%s\"%s\":{\"count\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p99\":%llu,\"max\":%.1f}", first ? "" : ",", name,
+				(unsigned long long)delta.count, delta.totalNs / 1000.0 / delta.count,
+				(unsigned long long)Percentile(&delta, 0.5), (unsigned long long)Percentile(&delta, 0.99), delta.maxNs / 1000.0);
+		first = 0;
+	}
+	fprintf(jsonFile, "}}\n");
+	fflush(jsonFile);
+}
+
+/*
+ * Prometheus text format, written to a temporary file and renamed so a scraper never sees half a file
+ */
+static void WritePrometheus()
+{
+	char temporary[1024];
+	char name[16];
+	int key, bucket;
+
+	snprintf(temporary, sizeof(temporary), "%s.tmp", prometheusFilename);
+	FILE* file = fopen(temporary, "w");
+	if (file == NULL) return;
+
+	fprintf(file, "# TYPE stlink_trace_bytes_total counter\nstlink_trace_bytes_total %llu\n", (unsigned long long)stats.traceBytes);
+	fprintf(file, "# TYPE stlink_trace_polls_total counter\nstlink_trace_polls_total %llu\n", (unsigned long long)stats.polls);
+	fprintf(file, "# TYPE stlink_trace_empty_polls_total counter\nstlink_trace_empty_polls_total %llu\n", (unsigned long long)stats.emptyPolls);
+	fprintf(file, "# TYPE stlink_decoder_bytes_total counter\nstlink_decoder_bytes_total %llu\n", (unsigned long long)stats.decodedBytes);
+	fprintf(file, "# TYPE stlink_decoder_seconds_total counter\nstlink_decoder_seconds_total %.6f\n", stats.decodeNs / 1e9);
+	fprintf(file, "# TYPE stlink_probe_backlog_high_water_bytes gauge\nstlink_probe_backlog_high_water_bytes %llu\n", (unsigned long long)stats.probeBacklogHighWater);
+	fprintf(file, "# TYPE stlink_down_channel_high_water_bytes gauge\nstlink_down_channel_high_water_bytes %llu\n", (unsigned long long)stats.downChannelHighWater);
+
+	fprintf(file, "# TYPE stlink_latency_seconds histogram\n");
+	for (key = 0; key < STATS_KEYS; key++) {
+		StatsHistogram* histogram = &stats.latency[key];
+		uint64_t cumulative = 0;
+		if (histogram->count == 0) continue;
+
+		KeyName(key, name, sizeof(name));
+		// the last bucket has no upper bound - it is only in +Inf
+		for (bucket = 0; bucket < STATS_BUCKETS - 1; bucket++) {
+			cumulative += histogram->buckets[bucket];
+			fprintf(file, "stlink_latency_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n", name, (1ULL << bucket) / 1e6, (unsigned long long)cumulative);
+		}
+		fprintf(file, "stlink_latency_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n", name, (unsigned long long)histogram->count);
+		fprintf(file, "stlink_latency_seconds_sum{command=\"%s\"} %.6f\n", name, histogram->totalNs / 1e9);
+		fprintf(file, "stlink_latency_seconds_count{command=\"%s\"} %llu\n", name, (unsigned long long)histogram->count);
+	}
+
+	fclose(file);
+	rename(temporary, prometheusFilename);
+}
+
+int StatsOpen(const char* jsonFilename, const char* prometheus, unsigned int intervalMs)
+{
+	if ((jsonFilename == NULL) && (prometheus == NULL)) return 0;
+
+	if (jsonFilename != NULL) {
+		jsonFile = fopen(jsonFilename, "a");
+		if (jsonFile == NULL) {
+			printf("Unable to open stats file %s\n", jsonFilename);
+			return -1;
+		}
+	}
+
+	prometheusFilename = prometheus;
+	intervalNs = (uint64_t)(intervalMs ? intervalMs : 1000) * 1000000ULL;
+	lastExportNs = GetTimeNs();
+	nextExportNs = lastExportNs + intervalNs;
+	statsEnabled = 1;
+	return 0;
+}
+
+static void Export(uint64_t now)
+{
+	if (jsonFile != NULL) WriteJson(now);
+	if (prometheusFilename != NULL) WritePrometheus();
+
+	// the maximum is per interval, the rest are running totals
+	int key;
+	for (key = 0; key < STATS_KEYS; key++) stats.latency[key].maxNs = 0;
+	memcpy(&previous, &stats, sizeof(Stats));
+	lastExportNs = now;
+	nextExportNs = now + intervalNs;
+}
+
+/*
+ * Export the counters if the interval has passed
+ */
+void StatsService()
+{
+	if (!statsEnabled) return;
+
+	uint64_t now = GetTimeNs();
+	if (now < nextExportNs) return;
+	Export(now);
+}
+
+/*
+ * Export the last, partial interval and close the JSON file
+ */
+void StatsClose()
+{
+	if (statsEnabled) Export(GetTimeNs());
+	if (jsonFile != NULL) fclose(jsonFile);
+	jsonFile = NULL;
+	statsEnabled = 0;
+}
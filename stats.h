@@ -0,0 +1,55 @@
+/*
+ * stats.h
+ *
+ * Counters for the capture path, exported as JSON lines and as a Prometheus text file.
+ * Everything is a no-op while statsEnabled is 0 - in particular no clock reads.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+
+// latency histograms: bucket n counts latencies below 2^n microseconds
+#define STATS_BUCKETS           24
+
+// histogram keys: 0x00-0xFF debug (0xF2) subcommands, 0x100 + command byte for the others,
+// as passed by the session latency callback (stlink-session.h)
+#define STATS_KEY_COMMAND(cmd)  (0x100 + (cmd))
+#define STATS_KEY_WRITE_DATA    0x200
+#define STATS_KEY_TRACE_READ    0x201
+#define STATS_KEY_SINK_WRITE    0x202
+#define STATS_KEYS              0x203
+
+typedef struct {
+	uint64_t count;
+	uint64_t totalNs;
+	uint64_t maxNs;
+	uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+typedef struct {
+	uint64_t traceBytes;
+	uint64_t polls;
+	uint64_t emptyPolls;
+	uint64_t decodedBytes;
+	uint64_t decodeNs;
+	uint64_t probeBacklogHighWater;		// bytes waiting in the ST-Link trace buffer
+	uint64_t downChannelHighWater;		// bytes pending for the down-channel
+	StatsHistogram latency[STATS_KEYS];
+} Stats;
+
+extern int statsEnabled;
+extern Stats stats;
+
+#define STATS_ADD(counter, value)        do { if (statsEnabled) stats.counter += (value); } while (0)
+#define STATS_HIGH_WATER(counter, value) do { if (statsEnabled && ((uint64_t)(value) > stats.counter)) stats.counter = (value); } while (0)
+
+uint64_t StatsStart();
+uint64_t StatsElapsed(uint64_t start);
+void StatsLatency(int key, uint64_t start);
+int StatsOpen(const char* jsonFilename, const char* prometheusFilename, unsigned int intervalMs);
+void StatsService();
+void StatsClose();
+
+#endif /* STATS_H_ */
@@ -0,0 +1,869 @@
+/*
+ * stlink-session.c
+ *
+ * ST-Link V2 capture session (see stlink-session.h).
+ * Parts of the ST-Link code comes from the stlink project:
+ * https://github.com/texane/stlink
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "stlink-trace.h"
+#include "stlink-session.h"
+#include "sim-link.h"
+#include "libusb-1.0/libusb.h"
+
+#define DHCSR       0xE000EDF0
+
+struct StlinkSession {
+	StlinkOptions options;
+	StlinkCallbacks callbacks;
+	libusb_context* ctx;
+	libusb_device_handle* handle;
+	libusb_device** deviceList;
+	int claimed;
+	int simFd;
+	int eventFd;
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int threadRunning;
+	volatile int stop;
+	volatile int closed;
+	int sendingData;			// set during the data phase of a write, so its latency is not keyed by the data bytes
+	ItmDecoder decoder;
+	unsigned long long traceBytes;
+	unsigned long long traceReads;
+	unsigned char traceBuffer[STLINK_SESSION_TRACE_READ];
+};
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void Signal(StlinkSession* session)
+{
+	uint64_t one = 1;
+
+	if (write(session->eventFd, &one, sizeof(one)) != sizeof(one)) {
+		// the counter is already non-zero
+	}
+}
+
+static uint64_t LatencyStart(StlinkSession* session)
+{
+	return (session->callbacks.latency != NULL) ? GetTimeNs() : 0;
+}
+
+static void Latency(StlinkSession* session, int key, uint64_t start)
+{
+	if (start != 0) session->callbacks.latency(session->callbacks.context, key, start);
+}
+
+/*
+ * Synchronous bulk transfer to the ST-Link, or to the simulator.
+ * Nothing more is sent once the probe or the simulator has gone.
+ */
+static int BulkTransfer(StlinkSession* session, unsigned char endpoint, unsigned char* data, int length, int* transferred)
+{
+	int ret;
+
+	*transferred = 0;
+	if (session->closed) return -1;
+
+	if (session->simFd >= 0) {
+		if (SimBulkTransfer(session->simFd, endpoint, data, length, transferred) == 0) return 0;
+		printf("Simulator connection closed\n");
+		ret = -1;
+	}
+	else {
+		ret = libusb_bulk_transfer(session->handle, endpoint, data, length, transferred, 0);
+		if (ret != LIBUSB_ERROR_NO_DEVICE) return ret;
+		printf("ST-Link V2 disconnected\n");
+	}
+
+	session->closed = 1;
+	Signal(session);
+	return ret;
+}
+
+static ssize_t TransferData(StlinkSession* session,
+         unsigned char* transmitBuffer, size_t transmitLength,
+         unsigned char* receiveBuffer, size_t receiveLength)
+{
+     int res = 0;
+     int bytesTransferred = 0;
+     int ret = 0;
+     uint64_t start = LatencyStart(session);
+
+     ret = BulkTransfer(session, 2 | LIBUSB_ENDPOINT_OUT, transmitBuffer, transmitLength, &bytesTransferred);
+
+     if (session->options.debug) printf("TransferData - request, %d of %d bytes written, ret = %d\n", bytesTransferred, (int)transmitLength, ret);
+     if (bytesTransferred != transmitLength) {
+         printf("\n\n>>>>>>>>>>>>>>>>> Not written all data. <<<<<<<<<<<<<<<<<<<<\n\n");
+     }
+
+     // response required?
+     if (receiveBuffer != NULL) {
+  		 ret = BulkTransfer(session, 1 | LIBUSB_ENDPOINT_IN, receiveBuffer, receiveLength, &bytesTransferred);
+
+		 if (session->options.debug) printf("TransferData - response, ret = %d\n", ret);
+		 res = bytesTransferred;
+	  }
+
+     // keyed by the debug (0xF2) subcommand, or 0x100 + the command byte
+     Latency(session, session->sendingData ? STLINK_SESSION_LATENCY_DATA :
+    		 (transmitBuffer[0] == DEBUG_COMMAND) ? transmitBuffer[1] : 0x100 + transmitBuffer[0], start);
+     return res;
+}
+
+static int SendAndReceive(StlinkSession* session, unsigned char* txBuffer, size_t txSize, unsigned char* rxBuffer, size_t rxSize)
+{
+    return TransferData(session, txBuffer, txSize, rxBuffer, rxSize);
+}
+
+static int IsStlink(libusb_device* dev)
+{
+     struct libusb_device_descriptor desc;
+
+     int ret = libusb_get_device_descriptor(dev, &desc);
+     if (ret < 0) {
+         printf("Unable to get device descriptor/n");
+         return 0;
+     }
+
+     if ((desc.idVendor != STLINKV2_VENDOR_ID) || (desc.idProduct != STLINKV2_PRODUCT_ID))
+         return 0;
+
+     printf("Found an ST-Link V2\n");
+     printf("NumConfigurations: %d\n", desc.bNumConfigurations);
+     printf("DeviceClass: 0x%02x\n", desc.bDeviceClass);
+     printf("VendorID: 0x%04x\n", desc.idVendor);
+     printf("ProductID: 0x%04x\n", desc.idProduct);
+
+     struct libusb_config_descriptor *config;
+     const struct libusb_interface *inter;
+     const struct libusb_interface_descriptor *interdesc;
+     const struct libusb_endpoint_descriptor *epdesc;
+
+     libusb_get_config_descriptor(dev, 0, &config);
+     printf("Interfaces: %d\n", config->bNumInterfaces);
+     int i,j,k=0;
+     for (i=0; i<(int)config->bNumInterfaces; i++) {
+         inter = &config->interface[i];
+         printf("Number of alternate settings: %d\n",
+inter->num_altsetting);
+         for (j=0; j<inter->num_altsetting; j++) {
+             interdesc = &inter->altsetting[j];
+             printf("Interface Number: %d\n", interdesc->bInterfaceNumber);
+             printf("Number of endpoints: %d\n", interdesc->bNumEndpoints);
+             for (k=0; k<interdesc->bNumEndpoints; k++) {
+                 epdesc = &interdesc->endpoint[k];
+                 printf("Descriptor Type: 0x%02x\n",
+epdesc->bDescriptorType);
+                 printf("EP Address: 0x%02x\n", epdesc->bEndpointAddress);
+             }
+         }
+     }
+     libusb_free_config_descriptor(config);
+     return 1;
+}
+
+/*
+ * Find and claim the ST-Link V2
+ */
+static int OpenStlink(StlinkSession* session)
+{
+     libusb_device* stlinkdev = NULL;
+     ssize_t listSize, pos;
+     int ret;
+
+     // initialise the USB session context
+     ret = libusb_init(&session->ctx);
+     if (ret != 0) {
+         printf("Error initialising libusb: 0x%x\n", ret);
+         session->ctx = NULL;
+         return -1;
+     }
+
+     // turn debug messages on - full logging
+     libusb_set_debug(session->ctx, DEBUG_LEVEL);
+
+     // enumerate the USB devices
+     listSize = libusb_get_device_list(session->ctx, &session->deviceList);
+     for (pos=0; pos<listSize; pos++) {
+         if (IsStlink(session->deviceList[pos])) {
+             stlinkdev = session->deviceList[pos];
+             break;
+         }
+     }
+
+     if (stlinkdev == NULL) {
+    	 printf("Unable to locate an ST-Link V2 device.\n");
+    	 return -1;
+     }
+
+     // open ST-Link V2 adapter
+     ret = libusb_open(stlinkdev, &session->handle);
+     if (ret != 0) {
+             printf("Unable to open ST-Link V2 device.\n");
+             session->handle = NULL;
+             return -1;
+     }
+
+     // detach from kernel if required
+     if (libusb_kernel_driver_active(session->handle, 0)) {
+         printf("Detaching the device from the kernel\n");
+         libusb_detach_kernel_driver(session->handle, 0);
+     }
+
+     int config = 0;
+     if (libusb_get_configuration(session->handle, &config)) {
+         printf("Unable to get configuration\n");
+     }
+
+     if (config != 1) {
+         printf("setting new configuration (%d -> 1)\n", config);
+         if (libusb_set_configuration(session->handle, 1)) {
+             printf("Unable to set configuration\n");
+         }
+     }
+
+     ret = libusb_claim_interface(session->handle, 0);
+     if (ret != 0) {
+         printf("Unable to claim interface.\n");
+         return -1;
+     }
+     session->claimed = 1;
+     return 0;
+}
+
+StlinkSession* StlinkSessionOpen(const StlinkOptions* options, const StlinkCallbacks* callbacks)
+{
+	StlinkSession* session = calloc(1, sizeof(StlinkSession));
+	pthread_mutexattr_t attributes;
+
+	if (session == NULL) {
+		printf("Unable to allocate the session\n");
+		return NULL;
+	}
+	session->options = *options;
+	if (callbacks != NULL) session->callbacks = *callbacks;
+	session->simFd = -1;
+
+	// recursive, so that the callbacks can access memory
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&session->lock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+
+	session->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (session->eventFd < 0) {
+		printf("Unable to create the session eventfd\n");
+		StlinkSessionClose(session);
+		return NULL;
+	}
+
+	if (options->simPath != NULL) {
+		session->simFd = SimConnect(options->simPath);
+		if (session->simFd < 0) {
+			StlinkSessionClose(session);
+			return NULL;
+		}
+	}
+	else if (OpenStlink(session) != 0) {
+		StlinkSessionClose(session);
+		return NULL;
+	}
+
+	if (session->callbacks.record != NULL) ItmDecoderInit(&session->decoder, session->callbacks.record, session->callbacks.context);
+	return session;
+}
+
+static void ExitDFUMode(StlinkSession* session)
+{
+    size_t txSize = 16;
+    unsigned char txBuffer[] = {STLINK_DFU_COMMAND, STLINK_DFU_EXIT, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+    // do not read anything for DFU exit command
+    TransferData(session, (unsigned char*) &txBuffer, txSize, NULL, 0);
+    printf("Exited DFU mode\n");
+}
+
+static int GetCurrentMode(StlinkSession* session)
+{
+    unsigned char rxBuffer[100];
+    size_t rxSize = 2;
+    int bytesRead = 0;
+    unsigned char txBuffer[] = {0xF5, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    size_t txSize = 16;
+
+    bytesRead = TransferData(session, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
+    if (bytesRead > 0) {
+        printf("Mode: 0x%02x 0x%02x\n",
+       		 rxBuffer[0], rxBuffer[1]);
+        return (rxBuffer[1]<<8) | rxBuffer[0];
+    }
+    else {
+        printf("Unable to read mode\n");
+    }
+    return 0;
+}
+
+static void EnterDebugState(StlinkSession* session)
+{
+	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, 0x35, 0xF0, 0xED, 0x00, 0xE0, 0x03, 0x00, 0x5F, 0xA0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer[100];
+	SendAndReceive(session, &txBuffer[0], 16, &rxBuffer[0], 64);
+}
+
+static void ResetCore(StlinkSession* session)
+{
+	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, STLINK_DEBUG_RESETSYS, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer[100];
+	SendAndReceive(session, &txBuffer[0], 16, &rxBuffer[0], 2);
+}
+
+static void HaltRunningSystem(StlinkSession* session)
+{
+	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, 0x35, 0xFC, 0xED, 0x00, 0xE0, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer[100];
+	SendAndReceive(session, &txBuffer[0], 16, &rxBuffer[0], 64);
+}
+
+static void GetTargetVoltage(StlinkSession* session)
+{
+	unsigned char txBuffer[] = {0xF7, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer[100];
+	int bytesRead = SendAndReceive(session, &txBuffer[0], 16, &rxBuffer[0],64);
+
+    if (bytesRead > 0) {
+        printf("Target Voltage: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
+       		 rxBuffer[0], rxBuffer[1], rxBuffer[2], rxBuffer[3], rxBuffer[4], rxBuffer[5], rxBuffer[6], rxBuffer[7]);
+    }
+    else {
+        printf("Unable to read target voltage\n");
+    }
+}
+
+static void GetVersion(StlinkSession* session)
+{
+     size_t txSize = 16;
+     unsigned char rxBuffer[100];
+     size_t rxSize = 6;
+     int bytesRead = 0;
+     unsigned char txBuffer[] = {0xF1, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+     bytesRead = TransferData(session, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
+     if (bytesRead > 0) {
+         printf("Version: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
+        		 rxBuffer[0], rxBuffer[1], rxBuffer[2], rxBuffer[3], rxBuffer[4], rxBuffer[5]);
+     }
+     else {
+         printf("Unable to read version\n");
+     }
+}
+
+static void GetCoreId(StlinkSession* session)
+{
+     size_t txSize = 16;
+     unsigned char rxBuffer[100];
+     size_t rxSize = 64;
+     int bytesRead = 0;
+     unsigned char txBuffer[] = {DEBUG_COMMAND, 0x22, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+     bytesRead = TransferData(session, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
+     if (bytesRead > 0) {
+         uint32_t coreid = (rxBuffer[3] << 24) | (rxBuffer[2] << 16) | (rxBuffer[1] << 8) | (rxBuffer[0] << 0);
+         printf("Core ID: 0x%08x\n", coreid);
+         if (coreid == 0x1ba01477) printf("Cortex-M3 detected\n");
+     }
+     else {
+         printf("Unable to read core ID\n");
+     }
+}
+
+static void EnterSWD(StlinkSession* session)
+{
+     size_t txSize = 16;
+     unsigned char rxBuffer[100];
+     size_t rxSize = 64;
+     int bytesRead = 0;
+     unsigned char txBuffer[] = {DEBUG_COMMAND, 0x30, 0xA3, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+     bytesRead = TransferData(session, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
+     if (bytesRead > 0) {
+         printf("Switched to SWD\n");
+     }
+     else {
+         printf("Error switching to SWD\n");
+     }
+}
+
+/*
+ * Identify the probe and the microcontroller and halt the core, ready for StlinkSessionEnableTrace()
+ */
+int StlinkSessionAttach(StlinkSession* session)
+{
+	pthread_mutex_lock(&session->lock);
+	GetCurrentMode(session);
+	GetVersion(session);
+
+	ExitDFUMode(session);
+
+	if (GetCurrentMode(session) != MODE_DBG) {
+		EnterSWD(session);
+	}
+
+	GetTargetVoltage(session);
+	EnterDebugState(session);
+	GetCoreId(session);
+
+	ResetCore(session);
+	StlinkSessionForceDebug(session);
+	pthread_mutex_unlock(&session->lock);
+	return session->closed ? -1 : 0;
+}
+
+/*
+ * Ends a memory read/write - returns the status of the last transfer (0x80 = OK)
+ */
+static int UnknownCommand(StlinkSession* session)
+{
+	unsigned char rxBuffer[100];
+
+	// end of data packet?
+	unsigned char txEndBuffer[] = {STLINK_DEBUG_COMMAND, 0x3E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	if (SendAndReceive(session, &txEndBuffer[0], 16, &rxBuffer[0], 64) <= 0) return -1;
+	return rxBuffer[0];
+}
+
+/*
+ * Write a block of target memory.
+ * Word aligned runs go out as 32-bit writes of up to STLINK_MAX_RW32 bytes, any unaligned
+ * head or tail uses 8-bit writes. The status only covers the last transfer, so it is read
+ * after every chunk: n words cost 3 commands per chunk instead of 3 commands per word.
+ */
+int StlinkSessionWriteMemory(StlinkSession* session, uint32_t address, const unsigned char* data, size_t length)
+{
+	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, WRITE32, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	size_t chunk = 0;
+	int status = 0;
+
+	pthread_mutex_lock(&session->lock);
+
+	// Note: the write commands do not return data - the status is read after each one
+	while ((length > 0) && (status == 0)) {
+		if ((address & 0x03) || (length < 4)) {
+			// 8-bit write up to the next word boundary
+			chunk = 4 - (address & 0x03);
+			if (chunk > length) chunk = length;
+			txBuffer[1] = WRITE8;
+		}
+		else {
+			chunk = length & ~0x03;
+			if (chunk > STLINK_MAX_RW32 - (address & (STLINK_MAX_RW32 - 1))) {
+				chunk = STLINK_MAX_RW32 - (address & (STLINK_MAX_RW32 - 1));
+			}
+			txBuffer[1] = WRITE32;
+		}
+
+		// address and length to write
+		txBuffer[2] = (address & 0xFF);
+		txBuffer[3] = ((address >> 8) & 0xFF);
+		txBuffer[4] = ((address >> 16) & 0xFF);
+		txBuffer[5] = ((address >> 24) & 0xFF);
+		txBuffer[6] = (chunk & 0xFF);
+		txBuffer[7] = ((chunk >> 8) & 0xFF);
+		SendAndReceive(session, &txBuffer[0], 16, NULL, 0);
+
+		// data to write
+		session->sendingData = 1;
+		SendAndReceive(session, (unsigned char*) data, chunk, NULL, 0);
+		session->sendingData = 0;
+
+		if (UnknownCommand(session) != 0x80) {
+			printf("Unable to write memory at 0x%08x\n", address);
+			status = -1;
+		}
+
+		address += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+
+	pthread_mutex_unlock(&session->lock);
+	return status;
+}
+
+/*
+ * Read a block of target memory.
+ * The same split as StlinkSessionWriteMemory(): 32-bit reads of up to STLINK_MAX_RW32 bytes inside
+ * a 1KB block, 8-bit reads for unaligned edges, and the status read after each chunk.
+ */
+int StlinkSessionReadMemory(StlinkSession* session, uint32_t address, unsigned char* data, size_t length)
+{
+	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, READ32, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer[4];
+	size_t chunk = 0;
+	int bytesRead = 0;
+	int status = 0;
+
+	pthread_mutex_lock(&session->lock);
+	while ((length > 0) && (status == 0)) {
+		if ((address & 0x03) || (length < 4)) {
+			chunk = 4 - (address & 0x03);
+			if (chunk > length) chunk = length;
+			txBuffer[1] = READ8;
+		}
+		else {
+			chunk = length & ~0x03;
+			if (chunk > STLINK_MAX_RW32 - (address & (STLINK_MAX_RW32 - 1))) {
+				chunk = STLINK_MAX_RW32 - (address & (STLINK_MAX_RW32 - 1));
+			}
+			txBuffer[1] = READ32;
+		}
+
+		// address and length to read
+		txBuffer[2] = (address & 0xFF);
+		txBuffer[3] = ((address >> 8) & 0xFF);
+		txBuffer[4] = ((address >> 16) & 0xFF);
+		txBuffer[5] = ((address >> 24) & 0xFF);
+		txBuffer[6] = (chunk & 0xFF);
+		txBuffer[7] = ((chunk >> 8) & 0xFF);
+
+		if (chunk == 1) {
+			// a single byte read returns 2 bytes
+			bytesRead = SendAndReceive(session, &txBuffer[0], 16, &rxBuffer[0], 2);
+			data[0] = rxBuffer[0];
+		}
+		else {
+			bytesRead = SendAndReceive(session, &txBuffer[0], 16, data, chunk);
+		}
+		if ((bytesRead < (int)chunk) || (UnknownCommand(session) != 0x80)) {
+			printf("Unable to read memory at 0x%08x\n", address);
+			status = -1;
+		}
+
+		address += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+
+	pthread_mutex_unlock(&session->lock);
+	return status;
+}
+
+void StlinkSessionWrite32(StlinkSession* session, uint32_t address, uint32_t value)
+{
+	unsigned char data[4];
+
+	data[0] = (value & 0xFF);
+	data[1] = ((value >> 8) & 0xFF);
+	data[2] = ((value >> 16) & 0xFF);
+	data[3] = ((value >> 24) & 0xFF);
+	StlinkSessionWriteMemory(session, address, &data[0], 4);
+}
+
+uint32_t StlinkSessionRead32(StlinkSession* session, uint32_t address)
+{
+	unsigned char rxBuffer[4] = {0x00, 0x00, 0x00, 0x00};
+
+	StlinkSessionReadMemory(session, address, &rxBuffer[0], 4);
+	return (rxBuffer[3] << 24) | (rxBuffer[2] << 16) | (rxBuffer[1] << 8) | (rxBuffer[0] << 0);
+}
+
+/*
+ * Resets the target board by setting a bit in the AIRCR
+ */
+static void LocalReset(StlinkSession* session)
+{
+	//F2 35 0C ED 00 E0 04 00 FA 05
+	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, WRITE_DATA, 0x0C, 0xED, 0x00, 0xE0, 0x04, 0x00, 0xFA, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer[100];
+	SendAndReceive(session, &txBuffer[0], 16, &rxBuffer[0], 2);
+	unsigned char txBufferWait[] = {STLINK_DEBUG_COMMAND, READ_DATA, 0x0C, 0xED, 0x00, 0xE0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	printf("Waiting for local reset\n");
+	while (!session->closed) {
+		int byteCount = SendAndReceive(session, &txBufferWait[0], 16, &rxBuffer[0], 64);
+		if (byteCount > 0) {
+			// reset successful?
+			if ((rxBuffer[0] == 0x80) && (rxBuffer[4] == 0x00) && (rxBuffer[5] == 0x00)
+					&& (rxBuffer[6] == 0x05) && (rxBuffer[7] == 0xFA)) break;
+		}
+	}
+	printf("Local reset complete\n");
+}
+
+/*
+ * Enable the ITM trace functionality
+ */
+void StlinkSessionEnableTrace(StlinkSession* session)
+{
+	uint32_t baud = session->options.baud;
+
+	pthread_mutex_lock(&session->lock);
+
+	// set up the ITM
+	EnterDebugState(session);
+	HaltRunningSystem(session);
+	LocalReset(session);
+
+	// Set DHCSR to C_HALT and C_DEBUGEN
+	StlinkSessionWrite32(session, DHCSR, 0xA05F0003);
+
+	// Set TRCENA flag to enable global DWT and ITM
+	StlinkSessionWrite32(session, 0xE000EDFC, 0x01000000);
+
+	// Set FP_CTRL to enable write
+	StlinkSessionWrite32(session, 0xE0002000, 0x00000002);
+
+	// Set DWT_FUNCTION0 to DWT_FUNCTION3 to disable sampling
+	StlinkSessionWrite32(session, 0xE0001028, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001038, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001048, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001058, 0x00000000);
+
+	// Clear DWT_CTRL and other registers
+	StlinkSessionWrite32(session, 0xE0001000, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001004, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001008, 0x00000000);
+	StlinkSessionWrite32(session, 0xE000100C, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001010, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001014, 0x00000000);
+	StlinkSessionWrite32(session, 0xE0001018, 0x00000000);
+
+	unsigned char txBuffer1[] = {STLINK_DEBUG_COMMAND, 0x33, 0x0F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer1[100];
+	SendAndReceive(session, &txBuffer1[0], 16, &rxBuffer1[0], 64);
+
+	unsigned char txBuffer2[] = {STLINK_DEBUG_COMMAND, 0x33, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer2[100];
+	SendAndReceive(session, &txBuffer2[0], 16, &rxBuffer2[0], 64);
+
+	// Set DBGMCU_CR to enable asynchronous transmission
+	StlinkSessionWrite32(session, 0xE0042004, 0x00000027);
+
+	// start trace: 4KB buffer at the SWO baud rate
+	unsigned char txBuffer3[] = {STLINK_DEBUG_COMMAND, 0x40, 0x00, 0x10, baud & 0xFF, (baud >> 8) & 0xFF, (baud >> 16) & 0xFF, (baud >> 24) & 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer3[100];
+	SendAndReceive(session, &txBuffer3[0], 16, &rxBuffer3[0], 64);
+
+	// Set TPIU_CSPSR to enable trace port width of 2
+	StlinkSessionWrite32(session, 0xE0040004, 0x00000001);
+
+	// Set TPIU_ACPR clock divisor
+	StlinkSessionWrite32(session, 0xE0040010, session->options.clockDivisor);
+
+	// Set TPIU_SPPR to Asynchronous SWO (NRZ)
+	StlinkSessionWrite32(session, 0xE00400F0, 0x00000002);
+
+	// Set TPIU_FFCR continuous formatting)
+	StlinkSessionWrite32(session, 0xE0040304, 0x00000100);
+
+	// Unlock the ITM registers for write
+	StlinkSessionWrite32(session, 0xE0000FB0, 0xC5ACCE55);
+
+	// Set ITM_TCR flags : ITMENA,SYNCENA,DWTENA, ATB=0, and TSENA for the local timestamps
+	StlinkSessionWrite32(session, 0xE0000E80, 0x0001000D | (session->options.localTimestamps ? 0x2 : 0));
+
+	// Enable the trace ports in ITM_TER
+	StlinkSessionWrite32(session, 0xE0000E00, session->options.ports);
+
+	// ITM_TPR: a set bit restricts a group of 8 ports to privileged code
+	StlinkSessionWrite32(session, 0xE0000E40, session->options.privileged);
+
+	// Set DWT_CTRL flags
+	StlinkSessionWrite32(session, 0xE0001000, 0x400003FE);		// Keil one
+
+	// Enable tracing (DEMCR - TRCENA bit)
+	StlinkSessionWrite32(session, 0xE000EDFC, 0x01000000);
+
+	pthread_mutex_unlock(&session->lock);
+}
+
+void StlinkSessionForceDebug(StlinkSession* session)
+{
+	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, STLINK_DEBUG_FORCEDEBUG, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	unsigned char rxBuffer[100];
+
+	pthread_mutex_lock(&session->lock);
+	SendAndReceive(session, &txBuffer[0], 16, &rxBuffer[0], 2);
+	pthread_mutex_unlock(&session->lock);
+}
+
+void StlinkSessionRunCore(StlinkSession* session)
+{
+     size_t txSize = 16;
+     unsigned char rxBuffer[100];
+     size_t rxSize = 64;
+     unsigned char txBuffer[] = {DEBUG_COMMAND, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+     pthread_mutex_lock(&session->lock);
+     int bytesRead = TransferData(session, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
+     pthread_mutex_unlock(&session->lock);
+     if (bytesRead > 0) {
+         printf("Running\n");
+     }
+     else {
+         printf("Error running\n");
+     }
+}
+
+/*
+ * Bytes waiting in the ST-Link trace buffer
+ */
+int StlinkSessionTraceByteCount(StlinkSession* session)
+{
+    size_t txSize = 16;
+    unsigned char rxBuffer[100];
+    size_t rxSize = 100;
+    int bytesRead = 0;
+    unsigned char txBuffer[] = {DEBUG_COMMAND, 0x42, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+    int traceByteCount = 0;
+
+    pthread_mutex_lock(&session->lock);
+    bytesRead = TransferData(session, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
+    pthread_mutex_unlock(&session->lock);
+    if (bytesRead > 0) {
+    	traceByteCount = rxBuffer[0]+(rxBuffer[1] << 8);  // original one - did not handle large packets
+    }
+    else if (!session->closed) {
+        printf("Unable to step instruction\n");
+    }
+
+    if (session->options.debug) printf("trace bytes available: %d\n", traceByteCount);
+    return traceByteCount;
+}
+
+/*
+ * Read length bytes of trace and pass them to the callbacks - returns the bytes read
+ */
+int StlinkSessionReadTrace(StlinkSession* session, int length)
+{
+	int total = 0;
+
+	if (session->options.debug) printf("Reading %d bytes\n", length);
+
+	pthread_mutex_lock(&session->lock);
+	while (length > 0) {
+		int chunk = (length > STLINK_SESSION_TRACE_READ) ? STLINK_SESSION_TRACE_READ : length;
+		int bytesRead = 0;
+
+		uint64_t start = LatencyStart(session);
+		BulkTransfer(session, 3 | LIBUSB_ENDPOINT_IN, session->traceBuffer, chunk, &bytesRead);
+		Latency(session, STLINK_SESSION_LATENCY_TRACE, start);
+		if (bytesRead <= 0) {
+			if (!session->closed) printf("Unable to read trace data\n");
+			break;
+		}
+		if (bytesRead != chunk) {
+			printf("\n\n>>>>>>>>>>>>>>>>> Not read all trace data. <<<<<<<<<<<<<<<<<<<<\n\n");
+		}
+
+		session->traceBytes += bytesRead;
+		session->traceReads++;
+		if (session->callbacks.raw != NULL) session->callbacks.raw(session->callbacks.context, session->traceBuffer, bytesRead);
+		if (session->callbacks.record != NULL) ItmDecode(&session->decoder, session->traceBuffer, bytesRead);
+		if (session->callbacks.readDone != NULL) session->callbacks.readDone(session->callbacks.context, bytesRead);
+
+		total += bytesRead;
+		length -= bytesRead;
+	}
+	pthread_mutex_unlock(&session->lock);
+
+	if (total > 0) Signal(session);
+	return total;
+}
+
+/*
+ * Capture thread: drain the probe, sleeping briefly when it is empty
+ */
+static void* CaptureThread(void* context)
+{
+	StlinkSession* session = context;
+
+	while (!session->stop && !session->closed) {
+		int byteCount = StlinkSessionTraceByteCount(session);
+		if (byteCount > 0) {
+			StlinkSessionReadTrace(session, byteCount);
+		}
+		else {
+			usleep(100);
+		}
+	}
+	Signal(session);
+	return NULL;
+}
+
+int StlinkSessionStart(StlinkSession* session)
+{
+	if (session->threadRunning) return 0;
+
+	session->stop = 0;
+	if (pthread_create(&session->thread, NULL, CaptureThread, session) != 0) {
+		printf("Unable to start the capture thread\n");
+		return -1;
+	}
+	session->threadRunning = 1;
+	return 0;
+}
+
+void StlinkSessionStop(StlinkSession* session)
+{
+	if (!session->threadRunning) return;
+
+	session->stop = 1;
+	pthread_join(session->thread, NULL);
+	session->threadRunning = 0;
+}
+
+int StlinkSessionEventFd(StlinkSession* session)
+{
+	return session->eventFd;
+}
+
+/*
+ * 1 once the probe or the simulator has gone
+ */
+int StlinkSessionClosed(StlinkSession* session)
+{
+	return session->closed;
+}
+
+void StlinkSessionCounters(StlinkSession* session, StlinkCounters* counters)
+{
+	pthread_mutex_lock(&session->lock);
+	counters->traceBytes = session->traceBytes;
+	counters->traceReads = session->traceReads;
+	counters->records = session->decoder.records;
+	counters->overflows = session->decoder.overflows;
+	counters->junk = session->decoder.junk;
+	counters->closed = session->closed;
+	pthread_mutex_unlock(&session->lock);
+}
+
+void StlinkSessionClose(StlinkSession* session)
+{
+	if (session == NULL) return;
+
+	StlinkSessionStop(session);
+	if (session->claimed && (libusb_release_interface(session->handle, 0) != 0)) {
+		printf("Unable to release interface.\n");
+	}
+	if (session->handle != NULL) libusb_close(session->handle);
+	if (session->deviceList != NULL) libusb_free_device_list(session->deviceList, 1);
+	if (session->ctx != NULL) libusb_exit(session->ctx);
+	SimClose(session->simFd);
+	if (session->eventFd >= 0) close(session->eventFd);
+	pthread_mutex_destroy(&session->lock);
+	free(session);
+}
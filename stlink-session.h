@@ -0,0 +1,98 @@
+/*
+ * stlink-session.h
+ *
+ * Capture library: an ST-Link V2 (or simulator) session with no global state, so the trace
+ * capture can be embedded in another program. stlink-trace is a client of it.
+ *
+ * All the state of a connection - the USB handle, the ITM decoder and the counters - is in
+ * the opaque StlinkSession. Trace data is delivered through callbacks without copying:
+ *   raw       each trace read, as read from the probe (the buffer is reused after the call)
+ *   record    each decoded ITM packet, only decoded when set
+ *   readDone  after the records of a read, e.g. to flush outputs
+ *   latency   start of each probe transfer, keyed as in stats.h, only timed when set
+ *
+ * The caller either drives the capture itself with StlinkSessionTraceByteCount() and
+ * StlinkSessionReadTrace(), as stlink-trace does to fit its other probe traffic in, or
+ * starts a capture thread with StlinkSessionStart() and the callbacks run on that thread.
+ * The functions lock the session, so memory can be read and written from any thread while
+ * the capture thread runs, and from inside the callbacks.
+ *
+ * StlinkSessionEventFd() is an eventfd for an epoll loop: it becomes readable when trace
+ * has been delivered since it was last read, and when the session ends (the probe or the
+ * simulator went away, or StlinkSessionStop()).
+ *
+ * Typical use:
+ *   session = StlinkSessionOpen(&options, &callbacks);
+ *   StlinkSessionAttach(session);
+ *   StlinkSessionEnableTrace(session);
+ *   StlinkSessionRunCore(session);
+ *   StlinkSessionStart(session);
+ *   ... epoll on StlinkSessionEventFd(session) ...
+ *   StlinkSessionClose(session);
+ */
+
+#ifndef STLINK_SESSION_H_
+#define STLINK_SESSION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "itm-decode.h"
+
+// largest trace read
+#define STLINK_SESSION_TRACE_READ       2048
+
+// latency keys besides the commands
+#define STLINK_SESSION_LATENCY_DATA     0x200	// data phase of a memory write
+#define STLINK_SESSION_LATENCY_TRACE    0x201	// trace read
+
+typedef struct StlinkSession StlinkSession;
+
+typedef struct {
+	const char* simPath;		// simulator socket instead of the ST-Link, or NULL
+	int debug;					// print each transfer
+	uint32_t clockDivisor;		// TPIU_ACPR: (core clock / SWO clock) - 1
+	uint32_t baud;				// SWO rate requested from the ST-Link
+	uint32_t ports;				// ITM_TER
+	uint32_t privileged;		// ITM_TPR
+	int localTimestamps;		// ITM_TCR TSENA
+} StlinkOptions;
+
+typedef struct {
+	void (*raw)(void* context, const unsigned char* data, size_t length);
+	ItmRecordCallback record;
+	void (*readDone)(void* context, size_t length);
+	void (*latency)(void* context, int key, uint64_t startNs);	// CLOCK_MONOTONIC
+	void* context;
+} StlinkCallbacks;
+
+typedef struct {
+	unsigned long long traceBytes;
+	unsigned long long traceReads;
+	unsigned long long records;
+	unsigned long long overflows;
+	unsigned long long junk;
+	int closed;
+} StlinkCounters;
+
+StlinkSession* StlinkSessionOpen(const StlinkOptions* options, const StlinkCallbacks* callbacks);
+int StlinkSessionAttach(StlinkSession* session);
+void StlinkSessionEnableTrace(StlinkSession* session);
+void StlinkSessionRunCore(StlinkSession* session);
+void StlinkSessionForceDebug(StlinkSession* session);
+
+int StlinkSessionWriteMemory(StlinkSession* session, uint32_t address, const unsigned char* data, size_t length);
+int StlinkSessionReadMemory(StlinkSession* session, uint32_t address, unsigned char* data, size_t length);
+void StlinkSessionWrite32(StlinkSession* session, uint32_t address, uint32_t value);
+uint32_t StlinkSessionRead32(StlinkSession* session, uint32_t address);
+
+int StlinkSessionTraceByteCount(StlinkSession* session);
+int StlinkSessionReadTrace(StlinkSession* session, int length);
+
+int StlinkSessionStart(StlinkSession* session);
+void StlinkSessionStop(StlinkSession* session);
+int StlinkSessionEventFd(StlinkSession* session);
+int StlinkSessionClosed(StlinkSession* session);
+void StlinkSessionCounters(StlinkSession* session, StlinkCounters* counters);
+void StlinkSessionClose(StlinkSession* session);
+
+#endif /* STLINK_SESSION_H_ */
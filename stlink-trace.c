@@ -13,7 +13,6 @@
   */
 
 #define HEXDUMP 0
-#define ASYNC	0
 
 // for the STM32F107Z, system clock is 72MHz
 // (CLK/SWO_CLK) - 1 = (72MHz/2MHz) - 1 = 35 = 0x23
@@ -21,63 +20,386 @@
 // for the STM32F207Z, system clock is 120MHz
 // (CLK/SWO_CLK) - 1 = (120MHz/2MHz) - 1 = 59 = 0x3B
 //#define CLOCK_DIVISOR 0x0000003B
+// SWO baud rate requested from the ST-Link
+#define SWO_BAUD 2000000
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
 #include "ncurses.h"
 #include "stlink-trace.h"
+#include "down-channel.h"
+#include "snapshot.h"
+#include "elf-symbols.h"
+#include "symbol-index.h"
+#include "stats.h"
+#include "itm-decode.h"
+#include "trace-sink.h"
+#include "watch.h"
+#include "sim-link.h"
+#include "trace-server.h"
+#include "shm-ring.h"
+#include "compress-sink.h"
+#include "tui.h"
+#include "trigger.h"
+#include "binlog.h"
+#include "low-latency.h"
+#include "ping.h"
+#include "probe-scheduler.h"
+#include "port-control.h"
+#include "dwt-window.h"
+#include "timestamps.h"
+#include "stlink-session.h"
+#include "telemetry.h"
+#include "func-trace.h"
+#include "rtos-trace.h"
+#include "event-store.h"
 #include "stdio.h"
-#include "libusb-1.0/libusb.h"
 #include <getopt.h>
 
-libusb_context* ctx = 0;
-libusb_device_handle* stlinkhandle = 0;
-libusb_device* stlinkdev = 0;
-libusb_device** deviceList = 0;
-ssize_t listSize = 0;
-struct libusb_transfer* responseTransfer = 0;
-struct libusb_transfer* requestTransfer = 0;
+StlinkSession* session = NULL;
 
 void Cleanup();
-int IsStlink(libusb_device* dev);
-void GetCoreId();
-void EnterSWD();
-int submit_wait(struct libusb_transfer* trans);
-ssize_t TransferData(int terminate,
-         unsigned char* transmitBuffer, size_t transmitLength,
-         unsigned char* receiveBuffer, size_t receiveLength);
-int FetchTraceByteCount();
-void EnterDebugState();
+void CloseOutputs();
+int OpenOutput(TraceSink* sink, const char* filename);
 int ReadTraceData(int toscreen, int byteCount);
-void RunCore();
-void StepCore();
-void GetVersion();
-int GetCurrentMode();
-void GetTargetVoltage();
-int SendAndReceive(unsigned char* txBuffer, size_t txSize, unsigned char* rxBuffer, size_t rxSize);
-void Write32Bit(uint32_t address, uint32_t value);
-uint32_t Read32Bit(uint32_t address);
-void ExitDFUMode();
-void HaltRunningSystem();
-void ForceDebug();
-void ResetCore();
-void LocalReset();
-void EnableTrace();
-void UnknownCommand();
 uint32_t ReadDHCSRValue();
 
-FILE* resultsFile = NULL;
-FILE* fullResultsFile = NULL;
+TraceSink traceSink;
+TraceSink fullTraceSink;
+TraceSink screenSink;
+TraceDemux demux;
 int debugEnabled = 0;
+DownChannel downChannel;
+Snapshot snapshot;
+ElfFile elfFile;
+SymbolIndex symbolIndex;
+Watch watch;
+TraceServer traceServer = {.listenFd = -1};
+ShmRing shmRing;
+Tui tui;
+Trigger trigger;
+Binlog binlog;
+Ping ping;
+ProbeScheduler probeScheduler;
+PortControl portControl;
+DwtWindow dwtWindow;
+Timestamps timestamps;
+Telemetry telemetry;
+FuncTrace funcTrace;
+RtosTrace rtosTrace;
+EventStore eventStore;
+TuiCounters tuiCounters;
+volatile sig_atomic_t snapshotRequested = 0;
+// simulator socket used instead of the ST-Link (--sim)
+char* simPath = NULL;
+// trace outputs are LZ4 compressed (--compress)
+int compressOutput = 0;
+size_t compressBlockSize = COMPRESS_BLOCK_SIZE;
+volatile sig_atomic_t stopRequested = 0;
+// start of the decode of the current trace read, for the stats
+uint64_t decodeStart = 0;
+// busy polling and no per-read output (--low-latency)
+int lowLatency = 0;
+
+// options without a single letter - they are all taken
+#define OPTION_EVENTS       0x100
+#define OPTION_EVENTS_DUMP  0x101
+
+// long options - the original single letter options are kept
+static struct option longOptions[] = {
+	{"trace-file",      required_argument, 0, 't'},
+	{"full-trace-file", required_argument, 0, 'f'},
+	{"debug",           no_argument,       0, 'd'},
+	{"down-channel",    required_argument, 0, 'D'},
+	{"down-source",     required_argument, 0, 'i'},
+	{"snapshot",          required_argument, 0, 's'},
+	{"snapshot-file",     required_argument, 0, 'S'},
+	{"snapshot-interval", required_argument, 0, 'I'},
+	{"snapshot-halt",     no_argument,       0, 'H'},
+	{"elf",               required_argument, 0, 'e'},
+	{"lookup",            required_argument, 0, 'L'},
+	{"stats-json",        required_argument, 0, 'j'},
+	{"stats-prom",        required_argument, 0, 'P'},
+	{"stats-interval",    required_argument, 0, 'T'},
+	{"port-file",         required_argument, 0, 'p'},
+	{"watch",             required_argument, 0, 'w'},
+	{"watch-rate",        required_argument, 0, 'r'},
+	{"watch-output",      required_argument, 0, 'W'},
+	{"sim",               required_argument, 0, 'X'},
+	{"serve",             required_argument, 0, 'N'},
+	{"serve-queue",       required_argument, 0, 'Q'},
+	{"serve-policy",      required_argument, 0, 'O'},
+	{"shm",               required_argument, 0, 'M'},
+	{"shm-size",          required_argument, 0, 'Z'},
+	{"compress",          no_argument,       0, 'z'},
+	{"compress-block",    required_argument, 0, 'B'},
+	{"tui",               no_argument,       0, 'u'},
+	{"trigger",           required_argument, 0, 'g'},
+	{"trigger-pre",       required_argument, 0, 'y'},
+	{"trigger-post",      required_argument, 0, 'Y'},
+	{"binlog",            required_argument, 0, 'l'},
+	{"low-latency",       required_argument, 0, 'R'},
+	{"ping",              required_argument, 0, 'k'},
+	{"ping-interval",     required_argument, 0, 'K'},
+	{"ports",             required_argument, 0, 'E'},
+	{"privileged",        required_argument, 0, 'V'},
+	{"dwt-start",         required_argument, 0, 'a'},
+	{"dwt-stop",          required_argument, 0, 'b'},
+	{"dwt-data",          required_argument, 0, 'c'},
+	{"dwt-pc-sample",     no_argument,       0, 'C'},
+	{"dwt-file",          required_argument, 0, 'F'},
+	{"timestamps",        required_argument, 0, 'A'},
+	{"timestamps-dump",   required_argument, 0, 'G'},
+	{"telemetry",          required_argument, 0, 'J'},
+	{"telemetry-interval", required_argument, 0, 'n'},
+	{"telemetry-file",     required_argument, 0, 'U'},
+	{"func-trace",         required_argument, 0, 'x'},
+	{"func-trace-file",    required_argument, 0, 'o'},
+	{"func-trace-clock",   required_argument, 0, 'q'},
+	{"rtos",               required_argument, 0, 'v'},
+	{"rtos-timeline",      required_argument, 0, 'h'},
+	{"rtos-clock",         required_argument, 0, 'm'},
+	{"events",             required_argument, 0, OPTION_EVENTS},
+	{"events-dump",        required_argument, 0, OPTION_EVENTS_DUMP},
+	{0, 0, 0, 0}
+};
+
+void OnStopSignal(int signal)
+{
+	stopRequested = 1;
+}
+
+/*
+ * Open a trace output file, LZ4 compressed with a .lz4 extension added when --compress is given
+ */
+int OpenOutput(TraceSink* sink, const char* filename)
+{
+	char compressedFilename[1024];
+
+	if (!compressOutput) return FileSinkOpen(sink, filename);
+
+	size_t length = strlen(filename);
+	size_t extension = strlen(COMPRESS_EXTENSION);
+	int hasExtension = (length >= extension) && (strcmp(&filename[length - extension], COMPRESS_EXTENSION) == 0);
+	snprintf(compressedFilename, sizeof(compressedFilename), "%s%s", filename, hasExtension ? "" : COMPRESS_EXTENSION);
+	return CompressSinkOpen(sink, compressedFilename, compressBlockSize);
+}
+
+static void CloseSink(TraceSink* sink)
+{
+	if ((sink != NULL) && (sink->close != NULL)) sink->close(sink);
+	if (sink != NULL) sink->close = NULL;
+}
+
+/*
+ * Write out and close the trace files - a compressed output holds up to a block in memory
+ */
+void CloseOutputs()
+{
+	static int closed = 0;
+	int port;
+
+	if (closed) return;
+	closed = 1;
+
+	TraceDemuxFlush(&demux);
+	DownChannelClose(&downChannel);
+	SnapshotClose(&snapshot);
+	WatchClose(&watch);
+	StatsClose();
+	BinlogClose(&binlog);
+	TriggerClose(&trigger);
+	PingClose(&ping);
+	DwtWindowClose(&dwtWindow);
+	TimestampsClose(&timestamps);
+	TelemetryClose(&telemetry);
+	FuncTraceClose(&funcTrace);
+	RtosTraceClose(&rtosTrace);
+	EventStoreClose(&eventStore);
+	if (probeScheduler.startNs != 0) ProbeSchedulerReport(&probeScheduler);
+	CloseSink(&traceSink);
+	CloseSink(&fullTraceSink);
+	for (port = 0; port < ITM_PORTS; port++) CloseSink(demux.ports[port]);
+	TraceServerClose(&traceServer);
+}
+
+/*
+ * Decoded stimulus data for the ping, the triggers, binary logging, telemetry, the trace server, the shared memory ring and the dashboard
+ */
+void TraceTap(void* context, int port, const unsigned char* data, size_t length)
+{
+	if ((ping.address != 0) && (port == ping.port)) PingTap(&ping, data, length);
+	if (trigger.next != NULL) TriggerTap(&trigger, port, data, length);
+	if ((binlog.formatIndex != NULL) && (port == binlog.port)) BinlogDecode(&binlog, data, length);
+	if (telemetry.ports & (1U << port)) TelemetryTap(&telemetry, port, data, length);
+	if (traceServer.listenFd >= 0) TraceServerTap(&traceServer, port, data, length);
+	if (shmRing.header != NULL) ShmRingTap(&shmRing, port, data, length);
+	if (tui.running) TuiTap(&tui, port, data, length);
+}
+
+/*
+ * ItmDecoder callback - the packets are timestamped before they go to the outputs
+ */
+void DecodedRecord(void* context, const ItmRecord* record)
+{
+	TimestampsRecord(&timestamps, record);
+	FuncTraceRecord(&funcTrace, record);
+	RtosTraceRecord(&rtosTrace, record);
+	if (eventStore.file != NULL) EventStoreAdd(&eventStore, TimestampsPacketTime(&timestamps, record), record);
+	TraceDemuxRecord(context, record);
+}
+
+/*
+ * Session callback for each trace read - the raw SWO stream goes to the full trace, the trace server and the shared memory ring
+ */
+void TraceRaw(void* context, const unsigned char* data, size_t length)
+{
+	TimestampsChunk(&timestamps, length);
+	if (!lowLatency) printf("Read response of %d bytes\n", (int)length);
+
+	decodeStart = StatsStart();
+	STATS_ADD(traceBytes, length);
+	tuiCounters.traceBytes += length;
+
+#if HEXDUMP
+	int pos = 0;
+	unsigned char ch = ' ';
+	printf("Trace bytes read: %d\n", (int)length);
+	int width=16; //8;
+	unsigned char line[17] = "\0";
+	for (pos=0; pos < (int)length; pos++) {
+		ch = data[pos];
+		line[pos%width] = ((ch > 31) && (ch < 128)) ? ch : '.';
+		line[(pos%width)+1] = '\0';
+		printf("%02x ", ch);
+		if (pos%width > (width-2)) printf("  %s\n", line);
+	}
+	if (pos%width != 0) {
+		int p;
+		for (p=0; p<width-(pos%width); p++) printf("   ");	//padding
+		printf("  %s\n\n", line);
+	}
+#endif
+	fullTraceSink.write(&fullTraceSink, data, length);
+	TraceServerRaw(&traceServer, data, length);
+	ShmRingWrite(&shmRing, SHM_RING_RAW, 0, data, length);
+}
+
+/*
+ * Session callback once the records of a trace read have been decoded
+ */
+void TraceReadDone(void* context, size_t length)
+{
+	STATS_ADD(decodeNs, StatsElapsed(decodeStart));
+	STATS_ADD(decodedBytes, length);
+
+	uint64_t sinkStart = StatsStart();
+	TraceDemuxFlush(&demux);
+	fullTraceSink.flush(&fullTraceSink);
+	TraceServerFlush(&traceServer);
+	ShmRingFlush(&shmRing);
+	EventStoreFlush(&eventStore);
+	StatsLatency(STATS_KEY_SINK_WRITE, sinkStart);
+}
+
+/*
+ * Session callback for the probe transfer latency - the session keys are the stats keys
+ */
+void TransferLatency(void* context, int key, uint64_t startNs)
+{
+	StatsLatency(key, startNs);
+}
+
+/*
+ * Write a text marker into a trace output
+ */
+void WriteMarker(TraceSink* sink, const char* format, ...)
+{
+	char text[256];
+	va_list args;
+
+	va_start(args, format);
+	int length = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	if (length > (int)sizeof(text) - 1) length = sizeof(text) - 1;
+	if (length > 0) sink->write(sink, (unsigned char*) text, length);
+}
+
+/*
+ * SIGUSR1 takes a snapshot on demand
+ */
+void OnSnapshotSignal(int signal)
+{
+	snapshotRequested = 1;
+}
+
+/*
+ * Milliseconds from the monotonic clock
+ */
+unsigned long long GetTimeMs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
 int main(int argc, char** argv)
 {
-     int ret, pos, opt = 0;
+     int pos, opt = 0;
      char* filename = "trace.txt";
      char* fullTraceFilename = "trace-full.txt";
-
-     while ((opt = getopt(argc, argv, "f:t:d")) != -1) {
+     uint32_t downChannelAddress = 0;
+     char* downChannelSource = "-";
+     char* snapshotFilename = "snapshot.bin";
+     unsigned long snapshotInterval = 0;
+     int snapshotHalt = 0;
+     char* elfFilename = NULL;
+     char* watchSpecs[WATCH_MAX_VARIABLES];
+     int watchSpecCount = 0;
+     double watchRate = 100;
+     char* watchFilename = "watch.csv";
+     char* lookupAddresses = NULL;
+     char* statsJsonFilename = NULL;
+     char* statsPrometheusFilename = NULL;
+     unsigned int statsInterval = 1000;
+     char* serveAddress = NULL;
+     size_t serveQueue = TRACE_SERVER_QUEUE_SIZE;
+     int servePolicy = TRACE_SERVER_DROP;
+     char* shmName = NULL;
+     size_t shmSize = SHM_RING_SIZE;
+     int tuiEnabled = 0;
+     size_t triggerPre = TRIGGER_PRE_SIZE;
+     size_t triggerPost = TRIGGER_POST_SIZE;
+     int binlogPort = -1;
+     int lowLatencyCpu = -1;
+     char* pingSpec = NULL;
+     unsigned int pingInterval = PING_INTERVAL_MS;
+     uint32_t enabledPorts = 0xFFFFFFFF;
+     uint32_t privilegedGroups = 0;
+     char* dwtStart = NULL;
+     char* dwtStop = NULL;
+     char* dwtData[DWT_WINDOW_DATA_MAX];
+     int dwtDataCount = 0;
+     char* dwtFilename = "dwt.txt";
+     char* timestampsFilename = NULL;
+     char* telemetryFilename = NULL;
+     unsigned int telemetryInterval = TELEMETRY_INTERVAL_MS;
+     int funcTracePort = -1;
+     char* funcTraceFilename = "functions.json";
+     unsigned long funcTraceClock = FUNC_TRACE_CLOCK;
+     int rtosPort = -1;
+     char* rtosTimelineFilename = NULL;
+     unsigned long rtosClock = RTOS_TRACE_CLOCK;
+     char* eventsFilename = NULL;
+     char* portFilenames[ITM_PORTS] = {NULL};
+
+     while ((opt = getopt_long(argc, argv, "f:t:dD:i:s:S:I:He:L:w:r:W:j:P:T:p:X:N:Q:O:M:Z:zB:ug:y:Y:l:R:k:K:E:V:a:b:c:CF:A:G:J:n:U:x:o:q:v:h:m:", longOptions, NULL)) != -1) {
     	 switch (opt) {
     	 case 'd':
     		 debugEnabled = 1;
@@ -88,118 +410,371 @@ int main(int argc, char** argv)
     	 case 'f':
     		 fullTraceFilename = optarg;
     		 break;
+    	 case 'D':
+    		 downChannelAddress = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'i':
+    		 downChannelSource = optarg;
+    		 break;
+    	 case 's':
+    		 if (SnapshotAddRegions(&snapshot, optarg) != 0) exit(-1);
+    		 break;
+    	 case 'S':
+    		 snapshotFilename = optarg;
+    		 break;
+    	 case 'I':
+    		 snapshotInterval = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'H':
+    		 snapshotHalt = 1;
+    		 break;
+    	 case 'e':
+    		 elfFilename = optarg;
+    		 break;
+    	 case 'L':
+    		 lookupAddresses = optarg;
+    		 break;
+    	 case 'w':
+    		 if (watchSpecCount < WATCH_MAX_VARIABLES) watchSpecs[watchSpecCount++] = optarg;
+    		 break;
+    	 case 'r':
+    		 watchRate = atof(optarg);
+    		 break;
+    	 case 'W':
+    		 watchFilename = optarg;
+    		 break;
+    	 case 'j':
+    		 statsJsonFilename = optarg;
+    		 break;
+    	 case 'P':
+    		 statsPrometheusFilename = optarg;
+    		 break;
+    	 case 'T':
+    		 statsInterval = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'N':
+    		 serveAddress = optarg;
+    		 break;
+    	 case 'Q':
+    		 serveQueue = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'O':
+    		 servePolicy = (strcmp(optarg, "disconnect") == 0) ? TRACE_SERVER_DISCONNECT : TRACE_SERVER_DROP;
+    		 break;
+    	 case 'M':
+    		 shmName = optarg;
+    		 break;
+    	 case 'Z':
+    		 shmSize = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'X':
+    		 simPath = optarg;
+    		 break;
+    	 case 'p': {
+    		 // port:filename
+    		 char* portFilename = NULL;
+    		 unsigned long port = strtoul(optarg, &portFilename, 0);
+    		 if ((*portFilename != ':') || (port >= ITM_PORTS)) {
+    			 printf("Invalid port file %s\n", optarg);
+    			 exit(-1);
+    		 }
+    		 portFilenames[port] = portFilename + 1;
+    		 break;
+    	 }
+    	 case 'z':
+    		 compressOutput = 1;
+    		 break;
+    	 case 'B':
+    		 compressBlockSize = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'u':
+    		 tuiEnabled = 1;
+    		 break;
+    	 case 'g':
+    		 if (TriggerAdd(&trigger, optarg) != 0) exit(-1);
+    		 break;
+    	 case 'y':
+    		 triggerPre = strtoul(optarg, NULL, 0) * 1024;
+    		 break;
+    	 case 'Y':
+    		 triggerPost = strtoul(optarg, NULL, 0) * 1024;
+    		 break;
+    	 case 'l':
+    		 binlogPort = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'R':
+    		 lowLatencyCpu = strtoul(optarg, NULL, 0);
+    		 lowLatency = 1;
+    		 break;
+    	 case 'k':
+    		 pingSpec = optarg;
+    		 break;
+    	 case 'K':
+    		 pingInterval = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'E':
+    		 if (PortControlParse(optarg, ITM_PORTS, &enabledPorts) != 0) exit(-1);
+    		 break;
+    	 case 'V':
+    		 if (PortControlParse(optarg, 4, &privilegedGroups) != 0) exit(-1);
+    		 break;
+    	 case 'a':
+    		 dwtStart = optarg;
+    		 break;
+    	 case 'b':
+    		 dwtStop = optarg;
+    		 break;
+    	 case 'c':
+    		 if (dwtDataCount < DWT_WINDOW_DATA_MAX) dwtData[dwtDataCount++] = optarg;
+    		 break;
+    	 case 'C':
+    		 dwtWindow.pcSample = 1;
+    		 break;
+    	 case 'F':
+    		 dwtFilename = optarg;
+    		 break;
+    	 case 'A':
+    		 timestampsFilename = optarg;
+    		 break;
+    	 case 'G':
+    		 // print a timestamp file and exit - no probe needed
+    		 exit(TimestampsDump(optarg) == 0 ? 0 : -1);
+    	 case 'J':
+    		 if (TelemetryAddChannel(&telemetry, optarg) != 0) exit(-1);
+    		 break;
+    	 case 'n':
+    		 telemetryInterval = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'U':
+    		 telemetryFilename = optarg;
+    		 break;
+    	 case 'x':
+    		 funcTracePort = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'o':
+    		 funcTraceFilename = optarg;
+    		 break;
+    	 case 'q':
+    		 funcTraceClock = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'v':
+    		 rtosPort = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case 'h':
+    		 rtosTimelineFilename = optarg;
+    		 break;
+    	 case 'm':
+    		 rtosClock = strtoul(optarg, NULL, 0);
+    		 break;
+    	 case OPTION_EVENTS:
+    		 eventsFilename = optarg;
+    		 break;
+    	 case OPTION_EVENTS_DUMP:
+    		 // print an event store and exit - no probe needed
+    		 exit(EventStoreDump(optarg) == 0 ? 0 : -1);
     	 }
      }
 
-	 resultsFile = fopen(filename, "w+");	// create or overwrite
-	 fullResultsFile = fopen(fullTraceFilename, "w+");	// create or overwrite
+     // ITM_TER and ITM_TPR as set by EnableTrace(), changed later from the dashboard or the trace server
+     PortControlInit(&portControl, enabledPorts, privilegedGroups);
+
+     if (StatsOpen(statsJsonFilename, statsPrometheusFilename, statsInterval) != 0) exit(-1);
 
-     // initialise the USB session context
-     ret = libusb_init(&ctx);
-     if (ret != 0) {
-         printf("Error initialising libusb: 0x%x\n", ret);
-         Cleanup();
-         exit(ret);
+     // the symbol index is reused from its cache file while the ELF is unchanged - the ELF
+     // itself is only read for the variables, sections and symbols looked up by name
+     if (elfFilename != NULL) {
+    	 if ((watchSpecCount > 0) || (binlogPort >= 0) || (pingSpec != NULL) || (dwtStart != NULL)) {
+    		 if (ElfOpen(&elfFile, elfFilename) != 0) exit(-1);
+    	 }
+    	 if (SymbolIndexLoad(&symbolIndex, elfFilename, &elfFile) != 0) exit(-1);
      }
 
-     // turn debug messages on - full logging
-     libusb_set_debug(ctx, DEBUG_LEVEL);
+     // symbolise a list of addresses and exit - no probe needed
+     if (lookupAddresses != NULL) {
+    	 char* address = strtok(lookupAddresses, ",");
+    	 while (address != NULL) {
+    		 SymbolInfo info;
+    		 uint32_t value = strtoul(address, NULL, 0);
+    		 SymbolIndexLookup(&symbolIndex, value, &info);
+    		 printf("0x%08x %s+0x%x %s:%u\n", value, info.name ? info.name : "??", info.offset, info.file ? info.file : "??", info.line);
+    		 address = strtok(NULL, ",");
+    	 }
+    	 exit(0);
+     }
 
-     // enumerate the USB devices
-     listSize = libusb_get_device_list(ctx, &deviceList);
-     for (pos=0; pos<listSize; pos++) {
-         if (IsStlink(deviceList[pos])) {
-             stlinkdev = deviceList[pos];
-             break;
-         }
+     if (watchSpecCount > 0) {
+    	 for (pos = 0; pos < watchSpecCount; pos++) {
+    		 if (WatchAdd(&watch, watchSpecs[pos], &elfFile) != 0) exit(-1);
+    	 }
+    	 if (WatchOpen(&watch, watchFilename, watchRate) != 0) exit(-1);
      }
 
-     if (stlinkdev == NULL) {
-    	 printf("Unable to locate an ST-Link V2 device.\n");
-    	 exit(-1);
+     if (snapshot.regionCount > 0) {
+    	 if (SnapshotOpen(&snapshot, snapshotFilename, snapshotHalt) != 0) exit(-1);
+    	 signal(SIGUSR1, OnSnapshotSignal);
+     }
+
+     if (OpenOutput(&traceSink, filename) != 0) NullSinkOpen(&traceSink);
+     if (OpenOutput(&fullTraceSink, fullTraceFilename) != 0) NullSinkOpen(&fullTraceSink);
+     for (pos = 0; pos < ITM_PORTS; pos++) {
+    	 if (portFilenames[pos] == NULL) continue;
+    	 demux.ports[pos] = malloc(sizeof(TraceSink));
+    	 if ((demux.ports[pos] == NULL) || (OpenOutput(demux.ports[pos], portFilenames[pos]) != 0)) exit(-1);
+     }
+     StreamSinkOpen(&screenSink, stdout, 1);
+     demux.all = &traceSink;
+
+     // the triggers decide what reaches the trace file
+     if (trigger.ruleCount > 0) {
+    	 if (TriggerOpen(&trigger, &traceSink, triggerPre, triggerPost) != 0) exit(-1);
+    	 demux.all = &trigger.sink;
+    	 demux.tap = TraceTap;
      }
 
-     // open ST-Link V2 adapter
-     ret = libusb_open(stlinkdev, &stlinkhandle);
-     if (ret != 0) {
-             printf("Unable to open ST-Link V2 device.\n");
-             Cleanup();
-             exit(ret);
+     // binary log messages are expanded with the format strings from the ELF file
+     if (binlogPort >= 0) {
+    	 uint32_t size, address;
+    	 const unsigned char* formats = (elfFile.data != NULL) ? ElfFindSection(&elfFile, BINLOG_SECTION, &size, &address) : NULL;
+    	 if ((binlogPort >= ITM_PORTS) || (formats == NULL)) {
+    		 printf("--binlog needs a port and an --elf file with a %s section\n", BINLOG_SECTION);
+    		 exit(-1);
+    	 }
+    	 if (BinlogOpen(&binlog, binlogPort, formats, size, address, &demux) != 0) exit(-1);
+    	 demux.binaryPorts |= 1U << binlogPort;
+    	 demux.tap = TraceTap;
      }
 
-     // detach from kernel if required
-     if (libusb_kernel_driver_active(stlinkhandle, 0)) {
-         printf("Detaching the device from the kernel\n");
-         libusb_detach_kernel_driver(stlinkhandle, 0);
+     // numeric samples are summarised instead of written as text
+     if (telemetry.ports != 0) {
+    	 if (TelemetryOpen(&telemetry, telemetryFilename, telemetryInterval) != 0) exit(-1);
+    	 demux.binaryPorts |= telemetry.ports;
+    	 demux.tap = TraceTap;
      }
 
-     int config = 0;
-     if (libusb_get_configuration(stlinkhandle, &config)) {
-         printf("Unable to get configuration\n");
+     // function entry and exit markers, timed by the ITM local timestamps
+     if (funcTracePort >= 0) {
+    	 if (FuncTraceOpen(&funcTrace, funcTracePort, funcTraceFilename, funcTraceClock, (elfFilename != NULL) ? &symbolIndex : NULL) != 0) exit(-1);
+    	 demux.binaryPorts |= 1U << funcTracePort;
      }
 
-     if (config != 1) {
-         printf("setting new configuration (%d -> 1)\n", config);
-         if (libusb_set_configuration(stlinkhandle, 1)) {
-             printf("Unable to set configuration\n");
-         }
+     // task switch and ready events from the RTOS, accounted as they arrive
+     if (rtosPort >= 0) {
+    	 if (RtosTraceOpen(&rtosTrace, rtosPort, rtosClock, RTOS_TRACE_INTERVAL_MS, rtosTimelineFilename) != 0) exit(-1);
+    	 demux.binaryPorts |= 1U << rtosPort;
      }
 
-     ret = libusb_claim_interface(stlinkhandle, 0);
-     if (ret != 0) {
-         printf("Unable to claim interface.\n");
-         Cleanup();
-         exit(ret);
+     // the echoed ping tokens are kept out of the text outputs
+     if (pingSpec != NULL) {
+    	 if (PingOpen(&ping, pingSpec, &elfFile, pingInterval) != 0) exit(-1);
+    	 demux.binaryPorts |= 1U << ping.port;
+    	 demux.tap = TraceTap;
      }
 
-     requestTransfer = libusb_alloc_transfer(0);
-     if (requestTransfer == NULL) {
-         printf("Allocation of request transfer failed.\n");
-         Cleanup();
-         exit(ret);
+     // PC sampling and data trace only inside the windows between the DWT triggers
+     if (dwtStart != NULL) {
+    	 if (DwtWindowTrigger(&dwtWindow.start, dwtStart, &elfFile) != 0) exit(-1);
+    	 if ((dwtStop != NULL) && (DwtWindowTrigger(&dwtWindow.stop, dwtStop, &elfFile) != 0)) exit(-1);
+    	 for (pos = 0; pos < dwtDataCount; pos++) {
+    		 if (DwtWindowAddData(&dwtWindow, dwtData[pos], &elfFile) != 0) exit(-1);
+    	 }
+    	 if (DwtWindowOpen(&dwtWindow, dwtFilename, demux.all, (elfFilename != NULL) ? &symbolIndex : NULL) != 0) exit(-1);
+    	 demux.hardware = DwtWindowRecord;
+    	 demux.hardwareContext = &dwtWindow;
      }
 
-     responseTransfer = libusb_alloc_transfer(0);
-     if (responseTransfer == NULL) {
-         printf("Allocation of response transfer failed.\n");
-         Cleanup();
-         exit(ret);
+     if (timestampsFilename != NULL) {
+    	 if (TimestampsOpen(&timestamps, timestampsFilename, SWO_BAUD) != 0) exit(-1);
      }
 
-     responseTransfer->flags &= ~LIBUSB_TRANSFER_SHORT_NOT_OK;
+     // decoded events with their host times, in columns
+     if (eventsFilename != NULL) {
+    	 TimestampsStart(&timestamps, SWO_BAUD);
+    	 if (EventStoreOpen(&eventStore, eventsFilename, 0) != 0) exit(-1);
+     }
+
+     if (serveAddress != NULL) {
+    	 if (TraceServerOpen(&traceServer, serveAddress, serveQueue, servePolicy) != 0) exit(-1);
+    	 traceServer.control = PortControlCommand;
+    	 traceServer.controlContext = &portControl;
+    	 demux.tap = TraceTap;
+     }
+
+     if (shmName != NULL) {
+    	 if (ShmRingCreate(&shmRing, shmName, shmSize) != 0) exit(-1);
+    	 demux.tap = TraceTap;
+     }
+
+     // the raw trace and the decoded records come back through the session callbacks
+     StlinkOptions options = {simPath, debugEnabled, CLOCK_DIVISOR, SWO_BAUD, portControl.enabled, portControl.privileged, funcTrace.enabled};
+     StlinkCallbacks callbacks = {TraceRaw, DecodedRecord, TraceReadDone, statsEnabled ? TransferLatency : NULL, &demux};
+     session = StlinkSessionOpen(&options, &callbacks);
+     if (session == NULL) {
+    	 Cleanup();
+    	 exit(-1);
+     }
 
      //============================
      // identify the microcontroller, set up the debugging and step through instructions to get the trace data
      //============================
 
-     GetCurrentMode();
-     GetVersion();
-
-     //libusb_clear_halt(stlinkhandle, 0x81);
-
-	 ExitDFUMode();
+     StlinkSessionAttach(session);
+     StlinkSessionEnableTrace(session);
+     DwtWindowSetup(&dwtWindow);
+     RunCore();
 
-     if (GetCurrentMode() != MODE_DBG) {
-    	 EnterSWD();
+     // the control block is in RAM initialised by the firmware, so open it once the core is running
+     if (downChannelAddress != 0) {
+    	 usleep(100000);
+    	 if (DownChannelOpen(&downChannel, downChannelAddress, downChannelSource) != 0) {
+    		 Cleanup();
+    		 exit(-1);
+    	 }
      }
 
-     GetTargetVoltage();
-     EnterDebugState();
-     GetCoreId();
+     // stop cleanly so that buffered and compressed output is written out
+     signal(SIGINT, OnStopSignal);
+     signal(SIGTERM, OnStopSignal);
 
-     ResetCore();
-     ForceDebug();
+     // the dashboard takes over the terminal once the target is running
+     if (tuiEnabled) {
+    	 tui.ports = &portControl;
+    	 if (TuiOpen(&tui) != 0) {
+    		 Cleanup();
+    		 exit(-1);
+    	 }
+    	 demux.tap = TraceTap;
+     }
 
-     EnableTrace();
-     RunCore();
+     // last, so that the dashboard and compression threads are not pinned to the capture CPU
+     if (lowLatency) LowLatencyEnter(lowLatencyCpu);
 
      unsigned char checkCount = 0;
-     while (1) {
-    	 usleep(100);
-
-		 unsigned int byteCount = FetchTraceByteCount();
-
-		 if (byteCount == 0) continue;
+     int statusCheckDue = 0;
+     unsigned long long nextSnapshot = GetTimeMs();
+     ProbeSchedulerInit(&probeScheduler);
+     while (!stopRequested && !tui.quit && !StlinkSessionClosed(session)) {
+    	 if (!lowLatency) usleep(100);
+
+		 unsigned int byteCount = StlinkSessionTraceByteCount(session);
+		 ProbeSchedulerPoll(&probeScheduler, byteCount);
+
+		 STATS_ADD(polls, 1);
+		 if (byteCount == 0) STATS_ADD(emptyPolls, 1);
+		 if (byteCount <= 4096) STATS_HIGH_WATER(probeBacklogHighWater, byteCount);
+		 StatsService();
+		 TelemetryService(&telemetry);
+		 RtosTraceService(&rtosTrace);
+		 TraceServerService(&traceServer);
+		 ShmRingReport(&shmRing);
+
+		 if (tui.running) {
+			 tuiCounters.backlog = (byteCount <= 4096) ? byteCount : 0;
+			 StlinkCounters counters;
+			 StlinkSessionCounters(session, &counters);
+			 tuiCounters.overflows = counters.overflows;
+			 tuiCounters.junk = counters.junk;
+			 TuiFlush(&tui, &tuiCounters);
+		 }
 
 		 if (byteCount > 2048) {
 			 int toread = 0;
@@ -213,45 +788,75 @@ int main(int argc, char** argv)
 				 //RunCore();	// run it - stalled?
 				 //continue;
 			 }
-			 if (resultsFile != NULL) fprintf(resultsFile, "\n>>> BAD PACKET START: byteCount = 0x%04x <<<\n", byteCount);
+			 WriteMarker(demux.all, "\n>>> BAD PACKET START: byteCount = 0x%04x <<<\n", byteCount);
+			 tuiCounters.badPackets++;
 
 			 while (byteCount > 0) {
 				 toread = byteCount > 2048 ? 2048 : byteCount;
 				 ReadTraceData(0, toread);
 				 byteCount -= toread;
+				 if (StlinkSessionClosed(session)) break;
 
 				 // check the register values
-				 //unsigned int value =
-				 ReadDHCSRValue();
-				 //printf("DHCSR = 0x%04x\n", value);
+				 tuiCounters.dhcsr = ReadDHCSRValue();
+				 tuiCounters.dhcsrValid = 1;
 			 }
+			 if (StlinkSessionClosed(session)) break;
 
 		     ForceDebug();
 			 RunCore();	// run it - stalled?
 
-			 if (resultsFile != NULL) fprintf(resultsFile, "\n>>> BAD PACKET END <<<\n");
+			 WriteMarker(demux.all, "\n>>> BAD PACKET END <<<\n");
 
 			 continue;
 		 }
 
-		 ReadTraceData(1, byteCount);
+		 // the trace drain goes first, the other probe traffic fits in before the probe buffer fills
+		 if (byteCount > 0) {
+			 ProbeSchedulerBegin(&probeScheduler, PROBE_CLASS_TRACE);
+			 ReadTraceData(!lowLatency, byteCount);
+			 ProbeSchedulerEnd(&probeScheduler, PROBE_CLASS_TRACE);
+
+			 // check the stall status regularly
+			 if (checkCount++ > 4) {
+				 checkCount = 0;
+				 statusCheckDue = 1;
+			 }
+		 }
+
+		 // the probe has gone - no more memory access
+		 if (StlinkSessionClosed(session)) break;
 
-		 // check the stall status regularly
-		 if (checkCount++ > 4) {
-			 checkCount = 0;
+		 // down-channel, snapshot, watch, ping, port mask and DWT trigger memory access
+		 if (ProbeSchedulerBegin(&probeScheduler, PROBE_CLASS_INTERACTIVE)) {
+			 DownChannelService(&downChannel, DOWN_CHANNEL_BUDGET);
+
+			 if (snapshotRequested || ((snapshotInterval > 0) && (GetTimeMs() >= nextSnapshot))) {
+				 snapshotRequested = 0;
+				 nextSnapshot = GetTimeMs() + snapshotInterval;
+				 SnapshotStart(&snapshot);
+			 }
+			 SnapshotService(&snapshot, SNAPSHOT_BUDGET);
+			 WatchService(&watch);
+			 PingService(&ping);
+			 PortControlService(&portControl, demux.portBytes, demux.portPackets);
+			 DwtWindowService(&dwtWindow);
+			 ProbeSchedulerEnd(&probeScheduler, PROBE_CLASS_INTERACTIVE);
+		 }
+
+		 if (statusCheckDue && ProbeSchedulerBegin(&probeScheduler, PROBE_CLASS_HEALTH)) {
+			 statusCheckDue = 0;
 			 unsigned int value = ReadDHCSRValue();
-			 printf("DHCSR = 0x%04x\n", value);
+			 if (!lowLatency) printf("DHCSR = 0x%04x\n", value);
+			 tuiCounters.dhcsr = value;
+			 tuiCounters.dhcsrValid = 1;
+			 ProbeSchedulerEnd(&probeScheduler, PROBE_CLASS_HEALTH);
 		 }
      }
 
-     //============================ will not get here, but if the code is ever changed to exit the loop, it should clean up below.
+     //============================ stopped by SIGINT/SIGTERM, q in the dashboard, or the probe has gone
 
-     ret = libusb_release_interface(stlinkhandle, 0);
-     if (ret != 0) {
-         printf("Unable to release interface.\n");
-         Cleanup();
-         exit(ret);
-     }
+     CloseOutputs();
 
      // finished - clean everything
      Cleanup();
@@ -261,648 +866,55 @@ int main(int argc, char** argv)
 
 void Cleanup()
 {
-     if (stlinkhandle != 0) libusb_close(stlinkhandle);
-     if (ctx != 0) libusb_exit(ctx);
-     if (deviceList != 0) libusb_free_device_list(deviceList, 1);
-}
-
-int IsStlink(libusb_device* dev)
-{
-     struct libusb_device_descriptor desc;
-
-     int ret = libusb_get_device_descriptor(dev, &desc);
-     if (ret < 0) {
-         printf("Unable to get device descriptor/n");
-         return 0;
-     }
-
-     if ((desc.idVendor != STLINKV2_VENDOR_ID) || (desc.idProduct != STLINKV2_PRODUCT_ID))
-         return 0;
-
-     printf("Found an ST-Link V2\n");
-     printf("NumConfigurations: %d\n", desc.bNumConfigurations);
-     printf("DeviceClass: 0x%02x\n", desc.bDeviceClass);
-     printf("VendorID: 0x%04x\n", desc.idVendor);
-     printf("ProductID: 0x%04x\n", desc.idProduct);
-
-     struct libusb_config_descriptor *config;
-     const struct libusb_interface *inter;
-     const struct libusb_interface_descriptor *interdesc;
-     const struct libusb_endpoint_descriptor *epdesc;
-
-     libusb_get_config_descriptor(dev, 0, &config);
-     printf("Interfaces: %d\n", config->bNumInterfaces);
-     int i,j,k=0;
-     for (i=0; i<(int)config->bNumInterfaces; i++) {
-         inter = &config->interface[i];
-         printf("Number of alternate settings: %d\n",
-inter->num_altsetting);
-         for (j=0; j<inter->num_altsetting; j++) {
-             interdesc = &inter->altsetting[j];
-             printf("Interface Number: %d\n", interdesc->bInterfaceNumber);
-             printf("Number of endpoints: %d\n", interdesc->bNumEndpoints);
-             for (k=0; k<interdesc->bNumEndpoints; k++) {
-                 epdesc = &interdesc->endpoint[k];
-                 printf("Descriptor Type: 0x%02x\n",
-epdesc->bDescriptorType);
-                 printf("EP Address: 0x%02x\n", epdesc->bEndpointAddress);
-             }
-         }
-     }
-     libusb_free_config_descriptor(config);
-     return 1;
-}
-
-void Write32Bit(uint32_t address, uint32_t value)
-{
-	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, WRITE32, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-	// Note: this series of commands do not return data - so send only on the first two packets
-
-	// address to write
-	txBuffer[2] = (address & 0xFF);
-	txBuffer[3] = ((address >> 8) & 0xFF);
-	txBuffer[4] = ((address >> 16) & 0xFF);
-	txBuffer[5] = ((address >> 24) & 0xFF);
-	SendAndReceive(&txBuffer[0], 16, NULL, 0);
-
-	// data to write
-	unsigned char txValueBuffer[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	txValueBuffer[0] = (value & 0xFF);
-	txValueBuffer[1] = ((value >> 8) & 0xFF);
-	txValueBuffer[2] = ((value >> 16) & 0xFF);
-	txValueBuffer[3] = ((value >> 24) & 0xFF);
-	SendAndReceive(&txValueBuffer[0], 16, NULL, 0);
-
-	UnknownCommand();
-}
-
-uint32_t Read32Bit(uint32_t address)
-{
-	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, READ32, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer[100];
-	uint32_t value = 0;
-
-	// address to read
-	txBuffer[2] = (address & 0xFF);
-	txBuffer[3] = ((address >> 8) & 0xFF);
-	txBuffer[4] = ((address >> 16) & 0xFF);
-	txBuffer[5] = ((address >> 24) & 0xFF);
-	SendAndReceive(&txBuffer[0], 16, rxBuffer, 64);
-
-	value = (rxBuffer[3] << 24) | (rxBuffer[2] << 16) | (rxBuffer[1] << 8) | (rxBuffer[0] << 0);
-
-	UnknownCommand();
-
-	return value;
-}
-
-void UnknownCommand()
-{
-	unsigned char rxBuffer[100];
-
-	// end of data packet?
-	unsigned char txEndBuffer[] = {STLINK_DEBUG_COMMAND, 0x3E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	SendAndReceive(&txEndBuffer[0], 16, &rxBuffer[0], 64);
-}
-
-uint32_t ReadDHCSRValue()
-{
-	return Read32Bit(0xE000EDF0);
-}
-
-/*
- * Enable the ITM trace functionality
- */
-void EnableTrace()
-{
-	// set up the ITM
-	EnterDebugState();
-	HaltRunningSystem();
-	LocalReset();
-
-	// Set DHCSR to C_HALT and C_DEBUGEN
-	Write32Bit(0xE000EDF0, 0xA05F0003);
-
-	// Set TRCENA flag to enable global DWT and ITM
-	Write32Bit(0xE000EDFC, 0x01000000);
-
-	// Set FP_CTRL to enable write
-	Write32Bit(0xE0002000, 0x00000002);
-
-	// Set DWT_FUNCTION0 to DWT_FUNCTION3 to disable sampling
-	Write32Bit(0xE0001028, 0x00000000);
-	Write32Bit(0xE0001038, 0x00000000);
-	Write32Bit(0xE0001048, 0x00000000);
-	Write32Bit(0xE0001058, 0x00000000);
-
-	// Clear DWT_CTRL and other registers
-	Write32Bit(0xE0001000, 0x00000000);
-	Write32Bit(0xE0001004, 0x00000000);
-	Write32Bit(0xE0001008, 0x00000000);
-	Write32Bit(0xE000100C, 0x00000000);
-	Write32Bit(0xE0001010, 0x00000000);
-	Write32Bit(0xE0001014, 0x00000000);
-	Write32Bit(0xE0001018, 0x00000000);
-
-	unsigned char txBuffer1[] = {STLINK_DEBUG_COMMAND, 0x33, 0x0F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer1[100];
-	SendAndReceive(&txBuffer1[0], 16, &rxBuffer1[0], 64);
-
-	unsigned char txBuffer2[] = {STLINK_DEBUG_COMMAND, 0x33, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer2[100];
-	SendAndReceive(&txBuffer2[0], 16, &rxBuffer2[0], 64);
-
-	// Set DBGMCU_CR to enable asynchronous transmission
-	Write32Bit(0xE0042004, 0x00000027);
-
-	unsigned char txBuffer3[] = {STLINK_DEBUG_COMMAND, 0x40, 0x00, 0x10, 0x80, 0x84, 0x1E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer3[100];
-	SendAndReceive(&txBuffer3[0], 16, &rxBuffer3[0], 64);
-
-	// Set TPIU_CSPSR to enable trace port width of 2
-	Write32Bit(0xE0040004, 0x00000001);
-
-	// Set TPIU_ACPR clock divisor
-	Write32Bit(0xE0040010, CLOCK_DIVISOR);
-
-	// Set TPIU_SPPR to Asynchronous SWO (NRZ)
-	Write32Bit(0xE00400F0, 0x00000002);
-
-	// Set TPIU_FFCR continuous formatting)
-	Write32Bit(0xE0040304, 0x00000100);
-
-	// Unlock the ITM registers for write
-	Write32Bit(0xE0000FB0, 0xC5ACCE55);
-
-	// Set ITM_TCR flags : ITMENA,SYNCENA,DWTENA, ATB=0
-	Write32Bit(0xE0000E80, 0x0001000D);
-
-	// Enable all trace ports in ITM_TER
-	Write32Bit(0xE0000E00, 0xFFFFFFFF);
-
-	// Enable trace ports 31:24 in ITM_TPR
-	//Write32Bit(0xE0000E40, 0x00000008);
-	Write32Bit(0xE0000E40, 0x0000000F);		// 8 was wrong?
-
-	// Set DWT_CTRL flags)
-	Write32Bit(0xE0000E40, 0x400003FE);		// Keil one
-
-	// Enable tracing (DEMCR - TRCENA bit)
-	Write32Bit(0xE000EDFC, 0x01000000);
+     TuiClose(&tui);
+     CloseOutputs();
+     StlinkSessionClose(session);
+     session = NULL;
+     ShmRingDestroy(&shmRing);
+     SymbolIndexClose(&symbolIndex);
+     ElfClose(&elfFile);
 }
 
 /*
- * Resets the target board by setting a bit in the AIRCR
+ * Probe access for the other modules, through the session
  */
-void LocalReset()
-{
-	//F2 35 0C ED 00 E0 04 00 FA 05
-	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, WRITE_DATA, 0x0C, 0xED, 0x00, 0xE0, 0x04, 0x00, 0xFA, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer[100];
-	SendAndReceive(&txBuffer[0], 16, &rxBuffer[0], 2);
-
-	unsigned char txBufferWait[] = {STLINK_DEBUG_COMMAND, READ_DATA, 0x0C, 0xED, 0x00, 0xE0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-	printf("Waiting for local reset\n");
-	while (1) {
-		int byteCount = SendAndReceive(&txBufferWait[0], 16, &rxBuffer[0], 64);
-		if (byteCount > 0) {
-			// reset successful?
-			if ((rxBuffer[0] == 0x80) && (rxBuffer[4] == 0x00) && (rxBuffer[5] == 0x00)
-					&& (rxBuffer[6] == 0x05) && (rxBuffer[7] == 0xFA)) break;
-		}
-	}
-
-	printf("Local reset complete\n");
-}
-
-void ExitDFUMode()
-{
-    size_t txSize = 16;
-    unsigned char txBuffer[] = {STLINK_DFU_COMMAND, STLINK_DFU_EXIT, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-    // do not read anything for DFU exit command
-    TransferData(0, (unsigned char*) &txBuffer, txSize, NULL, 0);
-    printf("Exited DFU mode\n");
-}
-
-int GetCurrentMode()
+void Write32Bit(uint32_t address, uint32_t value)
 {
-    unsigned char rxBuffer[100];
-    size_t rxSize = 2;
-    int bytesRead = 0;
-    unsigned char txBuffer[] = {0xF5, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-    size_t txSize = 16;
-
-    bytesRead = TransferData(0, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
-    if (bytesRead > 0) {
-        printf("Mode: 0x%02x 0x%02x\n",
-       		 rxBuffer[0], rxBuffer[1]);
-        return (rxBuffer[1]<<8) | rxBuffer[0];
-    }
-    else {
-        printf("Unable to read mode\n");
-    }
-
-    return 0;
+	StlinkSessionWrite32(session, address, value);
 }
 
-int SendAndReceive(unsigned char* txBuffer, size_t txSize, unsigned char* rxBuffer, size_t rxSize)
+uint32_t Read32Bit(uint32_t address)
 {
-    return TransferData(0, txBuffer, txSize, rxBuffer, rxSize);
+	return StlinkSessionRead32(session, address);
 }
 
-void EnterDebugState()
+int WriteMemory(uint32_t address, const unsigned char* data, size_t length)
 {
-	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, 0x35, 0xF0, 0xED, 0x00, 0xE0, 0x03, 0x00, 0x5F, 0xA0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer[100];
-	SendAndReceive(&txBuffer[0], 16, &rxBuffer[0], 64);
+	return StlinkSessionWriteMemory(session, address, data, length);
 }
 
-void ResetCore()
+int ReadMemory(uint32_t address, unsigned char* data, size_t length)
 {
-	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, STLINK_DEBUG_RESETSYS, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer[100];
-	SendAndReceive(&txBuffer[0], 16, &rxBuffer[0], 2);
+	return StlinkSessionReadMemory(session, address, data, length);
 }
 
 void ForceDebug()
 {
-	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, STLINK_DEBUG_FORCEDEBUG, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer[100];
-	SendAndReceive(&txBuffer[0], 16, &rxBuffer[0], 2);
-}
-
-void HaltRunningSystem()
-{
-	unsigned char txBuffer[] = {STLINK_DEBUG_COMMAND, 0x35, 0xFC, 0xED, 0x00, 0xE0, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer[100];
-	SendAndReceive(&txBuffer[0], 16, &rxBuffer[0], 64);
-}
-
-void GetTargetVoltage()
-{
-	unsigned char txBuffer[] = {0xF7, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	unsigned char rxBuffer[100];
-	int bytesRead = SendAndReceive(&txBuffer[0], 16, &rxBuffer[0],64);
-    if (bytesRead > 0) {
-        printf("Target Voltage: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
-       		 rxBuffer[0], rxBuffer[1], rxBuffer[2], rxBuffer[3], rxBuffer[4], rxBuffer[5], rxBuffer[6], rxBuffer[7]);
-    }
-    else {
-        printf("Unable to read target voltage\n");
-    }
-}
-
-void GetVersion()
-{
-     size_t txSize = 16;
-     unsigned char rxBuffer[100];
-     size_t rxSize = 6;
-     int bytesRead = 0;
-     unsigned char txBuffer[] = {0xF1, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-     bytesRead = TransferData(1, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
-     if (bytesRead > 0) {
-         printf("Version: 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n",
-        		 rxBuffer[0], rxBuffer[1], rxBuffer[2], rxBuffer[3], rxBuffer[4], rxBuffer[5]);
-     }
-     else {
-         printf("Unable to read version\n");
-     }
-}
-
-void GetCoreId()
-{
-     size_t txSize = 16;
-     unsigned char rxBuffer[100];
-     size_t rxSize = 64;
-     int bytesRead = 0;
-     unsigned char txBuffer[] = {DEBUG_COMMAND, 0x22, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-     bytesRead = TransferData(1, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
-     if (bytesRead > 0) {
-         uint32_t coreid = (rxBuffer[3] << 24) | (rxBuffer[2] << 16) | (rxBuffer[1] << 8) | (rxBuffer[0] << 0);
-         printf("Core ID: 0x%08x\n", coreid);
-         if (coreid == 0x1ba01477) printf("Cortex-M3 detected\n");
-     }
-     else {
-         printf("Unable to read core ID\n");
-     }
-}
-
-void EnterSWD()
-{
-     size_t txSize = 16;
-     unsigned char rxBuffer[100];
-     size_t rxSize = 64;
-     int bytesRead = 0;
-     unsigned char txBuffer[] = {DEBUG_COMMAND, 0x30, 0xA3, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-     bytesRead = TransferData(1, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
-     if (bytesRead > 0) {
-         printf("Switched to SWD\n");
-     }
-     else {
-         printf("Error switching to SWD\n");
-     }
-}
-
-void StepCore()
-{
-     size_t txSize = 16;
-     unsigned char rxBuffer[100];
-     size_t rxSize = 64;
-     unsigned char txBuffer[] = {DEBUG_COMMAND, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-     TransferData(1, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
+	StlinkSessionForceDebug(session);
 }
 
 void RunCore()
 {
-     size_t txSize = 16;
-     unsigned char rxBuffer[100];
-     size_t rxSize = 64;
-     unsigned char txBuffer[] = {DEBUG_COMMAND, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-
-     int bytesRead = TransferData(1, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
-     if (bytesRead > 0) {
-         printf("Running\n");
-     }
-     else {
-         printf("Error running\n");
-     }
+	StlinkSessionRunCore(session);
 }
 
-int FetchTraceByteCount()
+uint32_t ReadDHCSRValue()
 {
-    size_t txSize = 16;
-    unsigned char rxBuffer[100];
-    size_t rxSize = 100;
-    int bytesRead = 0;
-    unsigned char txBuffer[] = {DEBUG_COMMAND, 0x42, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-    int traceByteCount = 0;
-
-    bytesRead = TransferData(1, (unsigned char*) &txBuffer, txSize, (unsigned char*) &rxBuffer, rxSize);
-    if (bytesRead > 0) {
-    	traceByteCount = rxBuffer[0]+(rxBuffer[1] << 8);  // original one - did not handle large packets
-    }
-    else {
-        printf("Unable to step instruction\n");
-    }
-
-    if (debugEnabled) printf("trace bytes available: %d\n", traceByteCount);
-    return traceByteCount;
+	return Read32Bit(0xE000EDF0);
 }
 
-// for trace
-uint8_t trace_offset = 1;
-
 int ReadTraceData(int toscreen, int rxSize)
 {
-	if (debugEnabled) printf("Reading %d bytes\n", (int)rxSize);
-
-    unsigned char rxBuffer[2050];
-    int bytesRead = 0;
-
-#if ASYNC
-    libusb_fill_bulk_transfer(
-            responseTransfer,
-            stlinkhandle,
-            3 | LIBUSB_ENDPOINT_IN,
-            (unsigned char*) &rxBuffer,
-            rxSize,
-            NULL,
-            NULL,
-            0);
-
-    // no data?
-    if (submit_wait(responseTransfer)) return;
-
-    // have trace data - display it
-    bytesRead = responseTransfer->actual_length;
-    printf("Read response of %d bytes\n", bytesRead);
-#else
-    int ret = 0;
-    int totalBytes = rxSize;
-
-    while (totalBytes > 0) {
-
-		ret = libusb_bulk_transfer(
-					 stlinkhandle,
-					 3 | LIBUSB_ENDPOINT_IN,
-					 rxBuffer,
-					 totalBytes,
-					 &bytesRead,
-					 0);
-		printf("Read response %d of %d bytes. ret = %d\n", bytesRead, rxSize, ret);
-		if (bytesRead != rxSize) {
-			printf("\n\n>>>>>>>>>>>>>>>>> Not read all trace data. <<<<<<<<<<<<<<<<<<<<\n\n");
-		}
-		totalBytes -= bytesRead;
-
-	#endif
-		if (bytesRead > 0) {
-			//TODO: re-factor my following junk code :)
-			int pos = 0;
-			unsigned char ch = ' ';
-
-	#if HEXDUMP
-			printf("Trace bytes read: %d\n", bytesRead);
-			int width=16; //8;
-			unsigned char line[9] = "\0";
-			for (pos=0; pos < bytesRead; pos++) {
-				ch = rxBuffer[pos];
-				line[pos%width] = ((ch > 31) && (ch < 128)) ? ch : '.';
-				line[(pos%width)+1] = '\0';
-				if (toscreen) printf("%02x ", ch);
-				if (pos%width > (width-2)) {
-					if (toscreen) printf("  %s\n", line);
-				}
-			}
-			if (pos%width != 0) {
-				int p;
-				for (p=0; p<width-(pos%width); p++) printf("   ");	//padding
-				if (toscreen) printf("  %s\n\n", line);
-			}
-	#endif
-			pos = 0;
-			while (pos < bytesRead) {
-				// assume 1 byte trace for now - only because this is what we are testing with!
-				//packetSize = rxBuffer[pos];	// 1, 2 or 4 bytes
-				ch = rxBuffer[pos];
-				if (fullResultsFile != NULL) fprintf(fullResultsFile, "%c",ch);
-				pos += 2;
-			}
-
-			pos = 0;
-			trace_offset = 0;
-			if (rxBuffer[0] == 0x01) {
-				trace_offset = 1;
-			}
-			while (pos < bytesRead-trace_offset) {
-				// assume 1 byte trace for now - only because this is what we are testing with!
-				//packetSize = rxBuffer[pos];	// 1, 2 or 4 bytes
-				ch = rxBuffer[pos+trace_offset];
-				if (toscreen) {
-					printf("%c",((ch < 31) | (ch > 127)) ? '.' : ch);
-				}
-				if (resultsFile != NULL) fprintf(resultsFile, "%c",ch);
-				pos += 2;
-			}
-
-			//trace_offset = ((bytesRead+trace_offset) & 0x01);
-			if (resultsFile != NULL) fflush(resultsFile);
-			if (fullResultsFile != NULL) fflush(fullResultsFile);
-		}
-		else {
-			printf("Unable to read trace data\n");
-		}
-    }
-
-   	return bytesRead;
-}
-
-ssize_t TransferData(int terminate,
-         unsigned char* transmitBuffer, size_t transmitLength,
-         unsigned char* receiveBuffer, size_t receiveLength)
-{
-     int res = 0;
-
-#if ASYNC
-     libusb_fill_bulk_transfer(
-             requestTransfer,
-             stlinkhandle,
-             2 | LIBUSB_ENDPOINT_OUT,
-             transmitBuffer,
-             transmitLength,
-             NULL,
-             NULL,
-             0);
-
-     if (debugEnabled) printf("TransferData - request\n");
-
-     if (submit_wait(requestTransfer)) return -1;
-
-     // response required?
-     if (receiveBuffer != NULL) {
-		 libusb_fill_bulk_transfer(
-				 responseTransfer,
-				 stlinkhandle,
-				 1 | LIBUSB_ENDPOINT_IN,
-				 receiveBuffer,
-				 receiveLength,
-				 NULL,
-				 NULL,
-				 0);
-
-		 if (debugEnabled) printf("TransferData - response\n");
-
-		 if (submit_wait(responseTransfer)) return -1;
-		 res = responseTransfer->actual_length;
-     }
-#else
-     int bytesTransferred = 0;
-     int ret = 0;
-
-     ret = libusb_bulk_transfer(
-                  stlinkhandle,
-                  2 | LIBUSB_ENDPOINT_OUT,
-                  transmitBuffer,
-                  transmitLength,
-                  &bytesTransferred,
-                  0);
-
-     if (debugEnabled) printf("TransferData - request, %d of %d bytes written, ret = %d\n", bytesTransferred, (int)transmitLength, ret);
-     if (bytesTransferred != transmitLength) {
-         printf("\n\n>>>>>>>>>>>>>>>>> Not written all data. <<<<<<<<<<<<<<<<<<<<\n\n");
-     }
-
-     // response required?
-     if (receiveBuffer != NULL) {
-  		 ret = libusb_bulk_transfer(
-				 stlinkhandle,
-				 1 | LIBUSB_ENDPOINT_IN,
-				 receiveBuffer,
-				 receiveLength,
-                 &bytesTransferred,
-				 0);
-
-		 if (debugEnabled) printf("TransferData - response, ret = %d\n", ret);
-//	     if (bytesTransferred != receiveLength) {
-//	         printf("\n\n>>>>>>>>>>>>>>>>> Not read all data. <<<<<<<<<<<<<<<<<<<<\n\n");
-//	     }
-
-		 res = bytesTransferred;
-	  }
-#endif
-
-     return res;
-}
-
-#if ASYNC
-struct trans_ctx {
-#define TRANS_FLAGS_IS_DONE (1 << 0)
-#define TRANS_FLAGS_HAS_ERROR (1 << 1)
-     volatile unsigned long flags;
-};
-
-static void LIBUSB_CALL on_trans_done(struct libusb_transfer * trans) {
-     struct trans_ctx * const ctx = trans->user_data;
-
-     if (trans->status != LIBUSB_TRANSFER_COMPLETED) {
-    	 if (trans->status != LIBUSB_TRANSFER_STALL) {
-    		 ctx->flags |= TRANS_FLAGS_HAS_ERROR;
-    	 }
-     }
-
-     ctx->flags |= TRANS_FLAGS_IS_DONE;
-}
-
-int submit_wait(struct libusb_transfer* trans)
-{
-     struct timeval start;
-     struct timeval now;
-     struct timeval diff;
-     struct trans_ctx trans_ctx;
-     enum libusb_error error;
-
-     trans_ctx.flags = 0;
-
-     /* brief intrusion inside the libusb interface */
-     trans->callback = on_trans_done;
-     trans->user_data = &trans_ctx;
-
-     if ((error = libusb_submit_transfer(trans))) {
-         printf("libusb_submit_transfer(%d)\n", error);
-        	 return -1;
-     }
-
-     gettimeofday(&start, NULL);
-
-     while (trans_ctx.flags == 0) {
-    	 struct timeval timeout;
-         timeout.tv_sec = 10;
-         timeout.tv_usec = 0;
-         if (libusb_handle_events_timeout(ctx, &timeout)) {
-             printf("libusb_handle_events_timeout()\n");
-             return -1;
-         }
-
-         gettimeofday(&now, NULL);
-         timersub(&now, &start, &diff);
-         if (diff.tv_sec >= 10) {
-             printf("libusb_handle_events_timeout() timeout\n");
-             return -1;
-         }
-     }
-
-     if (trans_ctx.flags & TRANS_FLAGS_HAS_ERROR) {
-         printf("libusb_handle_events_timeout() | has_error\n");
-         return -1;
-     }
-
-     return 0;
+	demux.screen = (toscreen && !tui.running) ? &screenSink : NULL;
+	return StlinkSessionReadTrace(session, rxSize);
 }
-#endif
@@ -23,6 +23,8 @@
 
 #define READ32                0x07
 #define WRITE32               0x08
+#define READ8                 0x0C
+#define WRITE8                0x0D
 
 #define WRITE_DATA            0x35
 #define READ_DATA             0x36
@@ -45,4 +47,24 @@
 #define STLINK_DEBUG_FORCEDEBUG  0x02
 #define STLINK_DEBUG_RESETSYS    0x03
 
+/*
+ * Largest memory transfers accepted by the ST-Link V2 per command.
+ * 32-bit transfers must also stay inside one 1KB block as the AHB-AP
+ * TAR auto-increment does not carry across the 1KB boundary.
+ */
+#define STLINK_MAX_RW8           64
+#define STLINK_MAX_RW32          1024
+
+#include <stdint.h>
+#include <stddef.h>
+
+extern int debugEnabled;
+
+void Write32Bit(uint32_t address, uint32_t value);
+uint32_t Read32Bit(uint32_t address);
+int WriteMemory(uint32_t address, const unsigned char* data, size_t length);
+int ReadMemory(uint32_t address, unsigned char* data, size_t length);
+void ForceDebug();
+void RunCore();
+
 #endif /* STLINK_TRACE_H_ */
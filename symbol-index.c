@@ -0,0 +1,723 @@
+/*
+ * symbol-index.c
+ *
+ * Address to symbol/line index (see symbol-index.h).
+ * The DWARF line program decoder handles .debug_line versions 2 to 5 with 32-bit offsets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "stlink-trace.h"
+#include "symbol-index.h"
+
+// DWARF line program opcodes and forms used by the decoder
+#define DW_LNS_copy                 1
+#define DW_LNS_advance_pc           2
+#define DW_LNS_advance_line         3
+#define DW_LNS_set_file             4
+#define DW_LNS_const_add_pc         8
+#define DW_LNS_fixed_advance_pc     9
+#define DW_LNE_end_sequence         1
+#define DW_LNE_set_address          2
+#define DW_LNE_define_file          3
+#define DW_LNCT_path                1
+#define DW_LNCT_directory_index     2
+#define DW_FORM_block               0x09
+#define DW_FORM_data1               0x0B
+#define DW_FORM_data2               0x05
+#define DW_FORM_data4               0x06
+#define DW_FORM_data8               0x07
+#define DW_FORM_data16              0x1E
+#define DW_FORM_string              0x08
+#define DW_FORM_strp                0x0E
+#define DW_FORM_udata               0x0F
+#define DW_FORM_line_strp           0x1F
+
+#define MAX_LINE_FILES              1024
+#define MAX_LINE_FORMATS            8
+
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	uint32_t name;
+} SymbolEntry;
+
+typedef struct {
+	uint32_t address;
+	uint32_t file;
+	uint32_t line;
+	uint32_t order;
+} LineEntry;
+
+// growable arrays used while building the index
+typedef struct {
+	void* data;
+	size_t count;
+	size_t capacity;
+	size_t size;
+} Vector;
+
+static void* VectorAdd(Vector* vector)
+{
+	if (vector->count == vector->capacity) {
+		size_t capacity = vector->capacity ? vector->capacity * 2 : 256;
+		void* data = realloc(vector->data, capacity * vector->size);
+		if (data == NULL) return NULL;
+		vector->data = data;
+		vector->capacity = capacity;
+	}
+	return (char*) vector->data + vector->size * vector->count++;
+}
+
+static uint32_t AddString(Vector* strings, const char* first, const char* second)
+{
+	uint32_t offset = strings->count;
+	size_t length = strlen(first);
+
+	while (strings->count + length + strlen(second) + 2 > strings->capacity) {
+		size_t capacity = strings->capacity ? strings->capacity * 2 : 4096;
+		char* data = realloc(strings->data, capacity);
+		if (data == NULL) return 0;
+		strings->data = data;
+		strings->capacity = capacity;
+	}
+
+	memcpy((char*) strings->data + strings->count, first, length);
+	strings->count += length;
+	if (second[0] != '\0') {
+		((char*) strings->data)[strings->count++] = '/';
+		memcpy((char*) strings->data + strings->count, second, strlen(second));
+		strings->count += strlen(second);
+	}
+	((char*) strings->data)[strings->count++] = '\0';
+	return offset;
+}
+
+static uint32_t GetUint32(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint64_t ReadUleb(const unsigned char** pos, const unsigned char* end)
+{
+	uint64_t value = 0;
+	int shift = 0;
+
+	while (*pos < end) {
+		unsigned char byte = *(*pos)++;
+		if (shift < 64) value |= (uint64_t)(byte & 0x7F) << shift;
+		shift += 7;
+		if ((byte & 0x80) == 0) break;
+	}
+	return value;
+}
+
+static int64_t ReadSleb(const unsigned char** pos, const unsigned char* end)
+{
+	int64_t value = 0;
+	int shift = 0;
+	unsigned char byte = 0;
+
+	while (*pos < end) {
+		byte = *(*pos)++;
+		if (shift < 64) value |= (int64_t)(byte & 0x7F) << shift;
+		shift += 7;
+		if ((byte & 0x80) == 0) break;
+	}
+	if ((shift < 64) && (byte & 0x40)) value |= -((int64_t)1 << shift);
+	return value;
+}
+
+static const char* ReadString(const unsigned char** pos, const unsigned char* end)
+{
+	const char* string = (const char*) *pos;
+	while ((*pos < end) && (**pos != '\0')) (*pos)++;
+	if (*pos >= end) return "";
+	(*pos)++;
+	return string;
+}
+
+/*
+ * Read one DWARF 5 directory or file name entry attribute
+ */
+static int ReadLineForm(const unsigned char** pos, const unsigned char* end, uint32_t form,
+		ElfFile* elf, const char** string, uint64_t* value)
+{
+	uint32_t size = 0;
+	const unsigned char* section = NULL;
+
+	*string = NULL;
+	*value = 0;
+	switch (form) {
+	case DW_FORM_string:
+		*string = ReadString(pos, end);
+		return 0;
+	case DW_FORM_line_strp:
+	case DW_FORM_strp:
+		if (*pos + 4 > end) return -1;
+		*value = GetUint32(*pos);
+		*pos += 4;
+		section = ElfFindSection(elf, (form == DW_FORM_strp) ? ".debug_str" : ".debug_line_str", &size, NULL);
+		*string = ((section != NULL) && (*value < size)) ? (const char*) &section[*value] : "";
+		return 0;
+	case DW_FORM_udata:
+		*value = ReadUleb(pos, end);
+		return 0;
+	case DW_FORM_data1:
+		size = 1;
+		break;
+	case DW_FORM_data2:
+		size = 2;
+		break;
+	case DW_FORM_data4:
+		size = 4;
+		break;
+	case DW_FORM_data8:
+		size = 8;
+		break;
+	case DW_FORM_data16:
+		size = 16;
+		break;
+	case DW_FORM_block:
+		size = ReadUleb(pos, end);
+		break;
+	default:
+		return -1;
+	}
+
+	if (*pos + size > end) return -1;
+	if (size <= 8) {
+		uint32_t i;
+		for (i = 0; i < size; i++) *value |= (uint64_t)(*pos)[i] << (8 * i);
+	}
+	*pos += size;
+	return 0;
+}
+
+/*
+ * Decode the line number programs of all compilation units into (address, file, line) rows
+ */
+static void ReadLineTable(ElfFile* elf, Vector* lines, Vector* files, Vector* strings)
+{
+	uint32_t sectionSize = 0;
+	const unsigned char* section = ElfFindSection(elf, ".debug_line", &sectionSize, NULL);
+	const unsigned char* unit = section;
+	const unsigned char* sectionEnd = section + sectionSize;
+	uint32_t localFiles[MAX_LINE_FILES];
+	uint32_t order = 0;
+
+	if (section == NULL) return;
+
+	while (unit + 4 <= sectionEnd) {
+		uint32_t unitLength = GetUint32(unit);
+		if (unitLength >= 0xFFFFFFF0) break;	// 64-bit DWARF is not used for Cortex-M
+		const unsigned char* end = unit + 4 + unitLength;
+		const unsigned char* pos = unit + 4;
+		if ((end > sectionEnd) || (unitLength < 16)) break;
+		unit = end;
+
+		uint32_t version = pos[0] | (pos[1] << 8);
+		pos += 2;
+		if ((version < 2) || (version > 5)) continue;
+		if (version >= 5) pos += 2;		// address size, segment selector size
+		uint32_t headerLength = GetUint32(pos);
+		pos += 4;
+		const unsigned char* program = pos + headerLength;
+		if (program > end) continue;
+
+		uint32_t minimumLength = *pos++;
+		if (version >= 4) pos++;		// maximum operations per instruction
+		pos++;							// default is_stmt
+		int lineBase = (signed char) *pos++;
+		uint32_t lineRange = *pos++;
+		uint32_t opcodeBase = *pos++;
+		const unsigned char* opcodeLengths = pos;
+		if ((lineRange == 0) || (opcodeBase == 0)) continue;
+		pos += opcodeBase - 1;
+		if (pos > program) continue;
+
+		uint32_t fileCount = 0;
+		const char* directories[MAX_LINE_FILES];
+		uint32_t directoryCount = 0;
+
+		if (version < 5) {
+			// directory 0 is the compilation directory and is not listed
+			directories[directoryCount++] = "";
+			while ((pos < program) && (*pos != '\0') && (directoryCount < MAX_LINE_FILES)) {
+				directories[directoryCount++] = ReadString(&pos, program);
+			}
+			pos++;
+			while ((pos < program) && (*pos != '\0') && (fileCount < MAX_LINE_FILES)) {
+				const char* name = ReadString(&pos, program);
+				uint32_t directory = ReadUleb(&pos, program);
+				ReadUleb(&pos, program);	// modification time
+				ReadUleb(&pos, program);	// length
+				const char* path = ((directory > 0) && (directory < directoryCount) && (name[0] != '/')) ? directories[directory] : "";
+				uint32_t* file = VectorAdd(files);
+				if (file == NULL) return;
+				*file = (path[0] != '\0') ? AddString(strings, path, name) : AddString(strings, name, "");
+				localFiles[fileCount++] = files->count - 1;
+			}
+		}
+		else {
+			int pass;
+			for (pass = 0; pass < 2; pass++) {
+				uint32_t formatCount = *pos++;
+				uint32_t types[MAX_LINE_FORMATS];
+				uint32_t forms[MAX_LINE_FORMATS];
+				uint32_t i, j;
+				if (formatCount > MAX_LINE_FORMATS) break;
+				for (i = 0; i < formatCount; i++) {
+					types[i] = ReadUleb(&pos, program);
+					forms[i] = ReadUleb(&pos, program);
+				}
+
+				uint32_t count = ReadUleb(&pos, program);
+				for (i = 0; (i < count) && (pos < program); i++) {
+					const char* name = "";
+					uint64_t directory = 0;
+					for (j = 0; j < formatCount; j++) {
+						const char* string = NULL;
+						uint64_t value = 0;
+						if (ReadLineForm(&pos, program, forms[j], elf, &string, &value) != 0) break;
+						if ((types[j] == DW_LNCT_path) && (string != NULL)) name = string;
+						if (types[j] == DW_LNCT_directory_index) directory = value;
+					}
+
+					if (pass == 0) {
+						if (directoryCount < MAX_LINE_FILES) directories[directoryCount++] = name;
+					}
+					else if (fileCount < MAX_LINE_FILES) {
+						// directory 0 is the compilation directory - leave those names relative
+						const char* path = ((directory > 0) && (directory < directoryCount) && (name[0] != '/')) ? directories[directory] : "";
+						uint32_t* file = VectorAdd(files);
+						if (file == NULL) return;
+						*file = (path[0] != '\0') ? AddString(strings, path, name) : AddString(strings, name, "");
+						localFiles[fileCount++] = files->count - 1;
+					}
+				}
+			}
+		}
+
+		// run the line number program
+		uint32_t address = 0;
+		uint32_t file = 1;
+		int64_t line = 1;
+		pos = program;
+
+		while (pos < end) {
+			uint32_t opcode = *pos++;
+			int emit = 0;
+			int endSequence = 0;
+
+			if (opcode >= opcodeBase) {
+				uint32_t adjusted = opcode - opcodeBase;
+				address += (adjusted / lineRange) * minimumLength;
+				line += lineBase + (int)(adjusted % lineRange);
+				emit = 1;
+			}
+			else if (opcode == 0) {
+				uint32_t length = ReadUleb(&pos, end);
+				const unsigned char* next = pos + length;
+				if ((length == 0) || (next > end)) break;
+				uint32_t extended = *pos++;
+				if (extended == DW_LNE_end_sequence) {
+					emit = 1;
+					endSequence = 1;
+				}
+				else if ((extended == DW_LNE_set_address) && (length >= 5)) {
+					address = GetUint32(pos);
+				}
+				pos = next;
+			}
+			else {
+				switch (opcode) {
+				case DW_LNS_copy:
+					emit = 1;
+					break;
+				case DW_LNS_advance_pc:
+					address += ReadUleb(&pos, end) * minimumLength;
+					break;
+				case DW_LNS_advance_line:
+					line += ReadSleb(&pos, end);
+					break;
+				case DW_LNS_set_file:
+					file = ReadUleb(&pos, end);
+					break;
+				case DW_LNS_const_add_pc:
+					address += ((255 - opcodeBase) / lineRange) * minimumLength;
+					break;
+				case DW_LNS_fixed_advance_pc:
+					if (pos + 2 > end) break;
+					address += pos[0] | (pos[1] << 8);
+					pos += 2;
+					break;
+				default: {
+					// skip the operands of anything else
+					uint32_t i;
+					for (i = 0; i < opcodeLengths[opcode - 1]; i++) ReadUleb(&pos, end);
+					break;
+				}
+				}
+			}
+
+			if (emit) {
+				uint32_t local = (version >= 5) ? file : file - 1;
+				LineEntry* row = VectorAdd(lines);
+				if (row == NULL) return;
+				row->address = address;
+				row->file = (local < fileCount) ? localFiles[local] : 0;
+				row->line = endSequence ? 0 : (uint32_t) line;
+				row->order = order++;
+			}
+
+			if (endSequence) {
+				address = 0;
+				file = 1;
+				line = 1;
+			}
+		}
+	}
+}
+
+static int CompareSymbols(const void* a, const void* b)
+{
+	const SymbolEntry* sa = a;
+	const SymbolEntry* sb = b;
+
+	if (sa->address != sb->address) return (sa->address < sb->address) ? -1 : 1;
+	if (sa->size != sb->size) return (sa->size > sb->size) ? -1 : 1;
+	return 0;
+}
+
+static int CompareLines(const void* a, const void* b)
+{
+	const LineEntry* la = a;
+	const LineEntry* lb = b;
+
+	if (la->address != lb->address) return (la->address < lb->address) ? -1 : 1;
+	// the end of one sequence sorts before the start of the next at the same address
+	if ((la->line == 0) != (lb->line == 0)) return (la->line == 0) ? -1 : 1;
+	return (la->order < lb->order) ? -1 : 1;
+}
+
+/*
+ * Lay out the sorted start addresses in Eytzinger order
+ */
+static uint32_t FillEytzinger(AddressTable* table, uint32_t sorted, uint32_t position)
+{
+	if (position <= table->count) {
+		sorted = FillEytzinger(table, sorted, 2 * position);
+		table->eytzinger[position] = table->start[sorted];
+		table->order[position] = sorted++;
+		sorted = FillEytzinger(table, sorted, 2 * position + 1);
+	}
+	return sorted;
+}
+
+static int BuildEytzinger(AddressTable* table)
+{
+	table->eytzinger = malloc((table->count + 1) * sizeof(uint32_t));
+	table->order = malloc((table->count + 1) * sizeof(uint32_t));
+	if ((table->eytzinger == NULL) || (table->order == NULL)) return -1;
+
+	FillEytzinger(table, 0, 1);
+	return 0;
+}
+
+/*
+ * Returns the sorted index of the last start <= address, or -1
+ */
+static int32_t AddressTableFind(const AddressTable* table, uint32_t address)
+{
+	uint32_t position = 1;
+
+	while (position <= table->count) {
+		__builtin_prefetch(&table->eytzinger[16 * position]);
+		position = 2 * position + (table->eytzinger[position] <= address);
+	}
+
+	// position of the first start > address, 0 if there is none
+	position >>= __builtin_ffs(~position);
+	uint32_t next = (position == 0) ? table->count : table->order[position];
+	return (int32_t) next - 1;
+}
+
+static int SymbolIndexBuild(SymbolIndex* index, ElfFile* elf)
+{
+	Vector symbols = {NULL, 0, 0, sizeof(SymbolEntry)};
+	Vector lines = {NULL, 0, 0, sizeof(LineEntry)};
+	Vector files = {NULL, 0, 0, sizeof(uint32_t)};
+	Vector strings = {NULL, 0, 0, 1};
+	uint32_t i, count = 0;
+
+	// string 0 and file 0 are the empty name used for unknown files
+	AddString(&strings, "", "");
+	uint32_t* unknownFile = VectorAdd(&files);
+	if (unknownFile == NULL) return -1;
+	*unknownFile = 0;
+
+	for (i = 0; i < elf->symbolCount; i++) {
+		const unsigned char* symbol = &elf->symbols[i * ELF_SYMBOL_SIZE];
+		uint32_t type = symbol[ELF_SYMBOL_INFO] & 0x0F;
+		uint32_t nameOffset = GetUint32(&symbol[ELF_SYMBOL_NAME]);
+		uint32_t sectionIndex = symbol[ELF_SYMBOL_SHNDX] | (symbol[ELF_SYMBOL_SHNDX + 1] << 8);
+
+		if (((type != ELF_STT_FUNC) && (type != ELF_STT_OBJECT)) || (sectionIndex == 0)) continue;
+		if ((nameOffset == 0) || (nameOffset >= elf->stringsSize)) continue;
+
+		SymbolEntry* entry = VectorAdd(&symbols);
+		if (entry == NULL) break;
+		entry->address = GetUint32(&symbol[ELF_SYMBOL_VALUE]);
+		if (type == ELF_STT_FUNC) entry->address &= ~1;		// Thumb bit
+		entry->size = GetUint32(&symbol[ELF_SYMBOL_SIZEFIELD]);
+		entry->name = AddString(&strings, &elf->strings[nameOffset], "");
+	}
+
+	// sort, drop aliases at the same address and give size-less symbols the gap to the next one
+	qsort(symbols.data, symbols.count, sizeof(SymbolEntry), CompareSymbols);
+	SymbolEntry* symbol = symbols.data;
+	for (i = 0; i < symbols.count; i++) {
+		if ((count > 0) && (symbol[count - 1].address == symbol[i].address)) continue;
+		symbol[count++] = symbol[i];
+	}
+	for (i = 0; i < count; i++) {
+		if (symbol[i].size == 0) symbol[i].size = (i + 1 < count) ? symbol[i + 1].address - symbol[i].address : 1;
+	}
+
+	index->symbols.count = count;
+	index->symbols.start = malloc((count + 1) * sizeof(uint32_t));
+	index->symbolSize = malloc((count + 1) * sizeof(uint32_t));
+	index->symbolName = malloc((count + 1) * sizeof(uint32_t));
+	if ((index->symbols.start == NULL) || (index->symbolSize == NULL) || (index->symbolName == NULL)) return -1;
+	for (i = 0; i < count; i++) {
+		index->symbols.start[i] = symbol[i].address;
+		index->symbolSize[i] = symbol[i].size;
+		index->symbolName[i] = symbol[i].name;
+	}
+	free(symbols.data);
+
+	// line rows - keep the last row of those at the same address
+	ReadLineTable(elf, &lines, &files, &strings);
+	qsort(lines.data, lines.count, sizeof(LineEntry), CompareLines);
+	LineEntry* line = lines.data;
+	count = 0;
+	for (i = 0; i < lines.count; i++) {
+		if ((count > 0) && (line[count - 1].address == line[i].address)) count--;
+		line[count++] = line[i];
+	}
+
+	index->lines.count = count;
+	index->lines.start = malloc((count + 1) * sizeof(uint32_t));
+	index->lineFile = malloc((count + 1) * sizeof(uint32_t));
+	index->lineNumber = malloc((count + 1) * sizeof(uint32_t));
+	if ((index->lines.start == NULL) || (index->lineFile == NULL) || (index->lineNumber == NULL)) return -1;
+	for (i = 0; i < count; i++) {
+		index->lines.start[i] = line[i].address;
+		index->lineFile[i] = line[i].file;
+		index->lineNumber[i] = line[i].line;
+	}
+	free(lines.data);
+
+	index->fileCount = files.count;
+	index->fileName = files.data;
+	index->stringsSize = strings.count;
+	index->strings = strings.data;
+	return 0;
+}
+
+/*
+ * The index file holds the sorted arrays in host byte order, after a header identifying the ELF file
+ */
+static void SymbolIndexSave(SymbolIndex* index, const char* filename, const struct stat* elfStat)
+{
+	uint32_t header[10] = {0};
+	FILE* file = fopen(filename, "wb");
+
+	if (file == NULL) return;
+
+	memcpy(&header[0], SYMBOL_INDEX_MAGIC, 4);
+	header[1] = SYMBOL_INDEX_VERSION;
+	header[2] = (uint32_t) elfStat->st_size;
+	header[3] = (uint32_t) ((uint64_t) elfStat->st_size >> 32);
+	header[4] = (uint32_t) elfStat->st_mtime;
+	header[5] = (uint32_t) ((uint64_t) elfStat->st_mtime >> 32);
+	header[6] = index->symbols.count;
+	header[7] = index->lines.count;
+	header[8] = index->fileCount;
+	header[9] = index->stringsSize;
+
+	fwrite(&header[0], sizeof(header), 1, file);
+	fwrite(index->symbols.start, sizeof(uint32_t), index->symbols.count, file);
+	fwrite(index->symbolSize, sizeof(uint32_t), index->symbols.count, file);
+	fwrite(index->symbolName, sizeof(uint32_t), index->symbols.count, file);
+	fwrite(index->lines.start, sizeof(uint32_t), index->lines.count, file);
+	fwrite(index->lineFile, sizeof(uint32_t), index->lines.count, file);
+	fwrite(index->lineNumber, sizeof(uint32_t), index->lines.count, file);
+	fwrite(index->fileName, sizeof(uint32_t), index->fileCount, file);
+	fwrite(index->strings, 1, index->stringsSize, file);
+	fclose(file);
+}
+
+static uint32_t* ReadArray(FILE* file, uint32_t count)
+{
+	uint32_t* data = malloc((count + 1) * sizeof(uint32_t));
+
+	if ((data != NULL) && (fread(data, sizeof(uint32_t), count, file) != count)) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static int SymbolIndexRead(SymbolIndex* index, const char* filename, const struct stat* elfStat)
+{
+	uint32_t header[10];
+	FILE* file = fopen(filename, "rb");
+
+	if (file == NULL) return -1;
+
+	if ((fread(&header[0], sizeof(header), 1, file) != 1) || memcmp(&header[0], SYMBOL_INDEX_MAGIC, 4)
+			|| (header[1] != SYMBOL_INDEX_VERSION)
+			|| (header[2] != (uint32_t) elfStat->st_size) || (header[3] != (uint32_t) ((uint64_t) elfStat->st_size >> 32))
+			|| (header[4] != (uint32_t) elfStat->st_mtime) || (header[5] != (uint32_t) ((uint64_t) elfStat->st_mtime >> 32))) {
+		fclose(file);
+		return -1;
+	}
+
+	index->symbols.count = header[6];
+	index->lines.count = header[7];
+	index->fileCount = header[8];
+	index->stringsSize = header[9];
+
+	index->symbols.start = ReadArray(file, index->symbols.count);
+	index->symbolSize = ReadArray(file, index->symbols.count);
+	index->symbolName = ReadArray(file, index->symbols.count);
+	index->lines.start = ReadArray(file, index->lines.count);
+	index->lineFile = ReadArray(file, index->lines.count);
+	index->lineNumber = ReadArray(file, index->lines.count);
+	index->fileName = ReadArray(file, index->fileCount);
+	index->strings = malloc(index->stringsSize + 1);
+	int ok = (index->strings != NULL) && (fread(index->strings, 1, index->stringsSize, file) == index->stringsSize);
+	fclose(file);
+
+	if (!ok || (index->symbols.start == NULL) || (index->symbolSize == NULL) || (index->symbolName == NULL)
+			|| (index->lines.start == NULL) || (index->lineFile == NULL) || (index->lineNumber == NULL) || (index->fileName == NULL)) {
+		return -1;
+	}
+
+	// reject offsets outside the string pool rather than trust the file
+	uint32_t i;
+	for (i = 0; i < index->symbols.count; i++) {
+		if (index->symbolName[i] >= index->stringsSize) return -1;
+	}
+	for (i = 0; i < index->lines.count; i++) {
+		if (index->lineFile[i] >= index->fileCount) return -1;
+	}
+	for (i = 0; i < index->fileCount; i++) {
+		if (index->fileName[i] >= index->stringsSize) return -1;
+	}
+	index->strings[index->stringsSize] = '\0';
+	return 0;
+}
+
+/*
+ * Load the index for an ELF file - from the saved index if it is up to date, otherwise built
+ * from the ELF file (opened here if elf has not been opened yet) and saved for the next run.
+ */
+int SymbolIndexLoad(SymbolIndex* index, const char* elfFilename, ElfFile* elf)
+{
+	struct stat elfStat;
+	char indexFilename[1024];
+	ElfFile localElf;
+
+	memset(index, 0, sizeof(SymbolIndex));
+	memset(&index->cache[0], 0xFF, sizeof(index->cache));
+
+	if (stat(elfFilename, &elfStat) != 0) {
+		printf("Unable to open ELF file %s\n", elfFilename);
+		return -1;
+	}
+	snprintf(indexFilename, sizeof(indexFilename), "%s%s", elfFilename, SYMBOL_INDEX_EXTENSION);
+
+	if (SymbolIndexRead(index, indexFilename, &elfStat) != 0) {
+		SymbolIndexClose(index);
+
+		if ((elf == NULL) || (elf->data == NULL)) {
+			if (ElfOpen(&localElf, elfFilename) != 0) return -1;
+			elf = &localElf;
+		}
+		int ret = SymbolIndexBuild(index, elf);
+		if (elf == &localElf) ElfClose(&localElf);
+		if (ret != 0) {
+			printf("Unable to build the symbol index for %s\n", elfFilename);
+			SymbolIndexClose(index);
+			return -1;
+		}
+
+		SymbolIndexSave(index, indexFilename, &elfStat);
+	}
+
+	if ((BuildEytzinger(&index->symbols) != 0) || (BuildEytzinger(&index->lines) != 0)) {
+		SymbolIndexClose(index);
+		return -1;
+	}
+
+	if (debugEnabled) printf("Symbol index: %u symbols, %u line rows, %u files\n", index->symbols.count, index->lines.count, index->fileCount);
+	return 0;
+}
+
+/*
+ * Fill info for an address. Returns 0 if the address is inside a symbol.
+ */
+int SymbolIndexLookup(SymbolIndex* index, uint32_t address, SymbolInfo* info)
+{
+	SymbolCacheEntry* entry = &index->cache[((address >> 1) ^ (address >> 9)) & (SYMBOL_CACHE_SIZE - 1)];
+
+	index->lookups++;
+	if (entry->address == address) {
+		index->cacheHits++;
+	}
+	else {
+		entry->address = address;
+		entry->symbol = AddressTableFind(&index->symbols, address);
+		if ((entry->symbol >= 0) && (address - index->symbols.start[entry->symbol] >= index->symbolSize[entry->symbol])) entry->symbol = -1;
+		entry->line = AddressTableFind(&index->lines, address);
+		if ((entry->line >= 0) && (index->lineNumber[entry->line] == 0)) entry->line = -1;
+	}
+
+	info->name = NULL;
+	info->offset = 0;
+	info->file = NULL;
+	info->line = 0;
+	if (entry->symbol >= 0) {
+		info->name = &index->strings[index->symbolName[entry->symbol]];
+		info->offset = address - index->symbols.start[entry->symbol];
+	}
+	if (entry->line >= 0) {
+		info->file = &index->strings[index->fileName[index->lineFile[entry->line]]];
+		info->line = index->lineNumber[entry->line];
+	}
+
+	return (entry->symbol >= 0) ? 0 : -1;
+}
+
+void SymbolIndexClose(SymbolIndex* index)
+{
+	free(index->symbols.start);
+	free(index->symbols.eytzinger);
+	free(index->symbols.order);
+	free(index->symbolSize);
+	free(index->symbolName);
+	free(index->lines.start);
+	free(index->lines.eytzinger);
+	free(index->lines.order);
+	free(index->lineFile);
+	free(index->lineNumber);
+	free(index->fileName);
+	free(index->strings);
+	memset(index, 0, sizeof(SymbolIndex));
+	memset(&index->cache[0], 0xFF, sizeof(index->cache));
+}
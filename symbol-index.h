@@ -0,0 +1,63 @@
+/*
+ * symbol-index.h
+ *
+ * Address to symbol/line index built from the firmware ELF (.symtab and DWARF .debug_line).
+ *
+ * Symbols and line rows are held in flat sorted arrays, searched through an Eytzinger
+ * (breadth first) copy of the start addresses, with a small direct mapped cache of recent
+ * lookups in front. The sorted arrays are saved next to the ELF file (<elf>.stidx) and
+ * reused while the ELF file size and modification time are unchanged.
+ */
+
+#ifndef SYMBOL_INDEX_H_
+#define SYMBOL_INDEX_H_
+
+#include <stdint.h>
+#include "elf-symbols.h"
+
+#define SYMBOL_INDEX_MAGIC      "STIX"
+#define SYMBOL_INDEX_VERSION    1
+#define SYMBOL_INDEX_EXTENSION  ".stidx"
+#define SYMBOL_CACHE_SIZE       256		// power of 2
+
+typedef struct {
+	uint32_t count;
+	uint32_t* start;		// sorted
+	uint32_t* eytzinger;	// start values in Eytzinger order, 1 based
+	uint32_t* order;		// Eytzinger position -> sorted index
+} AddressTable;
+
+typedef struct {
+	uint32_t address;
+	int32_t symbol;
+	int32_t line;
+} SymbolCacheEntry;
+
+typedef struct {
+	AddressTable symbols;
+	uint32_t* symbolSize;
+	uint32_t* symbolName;	// offsets into strings
+	AddressTable lines;
+	uint32_t* lineFile;		// index into fileName
+	uint32_t* lineNumber;	// 0 = end of a sequence
+	uint32_t fileCount;
+	uint32_t* fileName;		// offsets into strings
+	char* strings;
+	uint32_t stringsSize;
+	SymbolCacheEntry cache[SYMBOL_CACHE_SIZE];
+	unsigned long lookups;
+	unsigned long cacheHits;
+} SymbolIndex;
+
+typedef struct {
+	const char* name;		// NULL if the address is not inside a symbol
+	uint32_t offset;		// from the start of the symbol
+	const char* file;		// NULL if there is no line information
+	uint32_t line;
+} SymbolInfo;
+
+int SymbolIndexLoad(SymbolIndex* index, const char* elfFilename, ElfFile* elf);
+int SymbolIndexLookup(SymbolIndex* index, uint32_t address, SymbolInfo* info);
+void SymbolIndexClose(SymbolIndex* index);
+
+#endif /* SYMBOL_INDEX_H_ */
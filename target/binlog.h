@@ -0,0 +1,74 @@
+/*
+ * binlog.h
+ *
+ * Target side of stlink-trace binary logging. Instead of formatting text on the target,
+ *
+ *   BINLOG("Switched the LED on. Counter: %d\n", i);
+ *
+ * sends the address of the format string and the arguments as 32-bit ITM writes on
+ * BINLOG_PORT, and stlink-trace --elf firmware.axf --binlog 1 formats the text on the host.
+ * A message with one argument is 10 bytes of SWO instead of 2 per character.
+ *
+ * The format strings are placed in a .binlog section. Keep it out of the flash image - with
+ * GNU ld add to the SECTIONS of the linker script:
+ *
+ *   .binlog 0 (INFO) : { KEEP(*(.binlog)) }
+ *
+ * Arguments are 32 bits: cast pointers with (uint32_t), pass floats as BINLOG_FLOAT(x),
+ * 64-bit values as BINLOG_64(x) for a %ll conversion, and constant strings for %s as
+ * BINLOG_STRING("text"). At most BINLOG_MAX_WORDS argument words.
+ *
+ * A message is several ITM writes: do not log on the same port from an interrupt that can
+ * preempt another BINLOG() - give it its own port, or disable interrupts around the call.
+ */
+
+#ifndef TARGET_BINLOG_H_
+#define TARGET_BINLOG_H_
+
+#include <stdint.h>
+
+#ifndef BINLOG_PORT
+#define BINLOG_PORT         1
+#endif
+#define BINLOG_MAX_WORDS    32
+
+#define BINLOG_ITM_PORT(port)   (*(volatile uint32_t*)(0xE0000000 + 4 * (port)))
+#define BINLOG_ITM_TER          (*(volatile uint32_t*)0xE0000E00)
+#define BINLOG_ITM_TCR          (*(volatile uint32_t*)0xE0000E80)
+
+#define BINLOG(format, ...) do { \
+	static const char binlogFormat[] __attribute__((section(".binlog"), used)) = format; \
+	const uint32_t binlogArgs[] = {0, ##__VA_ARGS__}; \
+	BinlogWrite((uint32_t)binlogFormat, &binlogArgs[1], sizeof(binlogArgs) / sizeof(uint32_t) - 1); \
+} while (0)
+
+#define BINLOG_FLOAT(x)     BinlogFloat(x)
+#define BINLOG_64(x)        (uint32_t)(uint64_t)(x), (uint32_t)((uint64_t)(x) >> 32)
+#define BINLOG_STRING(text) __extension__({ \
+	static const char binlogString[] __attribute__((section(".binlog"), used)) = text; \
+	(uint32_t)binlogString; })
+
+static inline uint32_t BinlogFloat(float value)
+{
+	union { float number; uint32_t bits; } converted;
+
+	converted.number = value;
+	return converted.bits;
+}
+
+static inline void BinlogWrite(uint32_t format, const uint32_t* args, uint32_t count)
+{
+	uint32_t i;
+
+	// nothing is sent while the debugger has not enabled the port
+	if (((BINLOG_ITM_TCR & 1) == 0) || ((BINLOG_ITM_TER & (1UL << BINLOG_PORT)) == 0)) return;
+
+	while (BINLOG_ITM_PORT(BINLOG_PORT) == 0);		// wait while the FIFO is full
+	BINLOG_ITM_PORT(BINLOG_PORT) = (count << 24) | (format & 0x00FFFFFF);
+	for (i = 0; i < count; i++) {
+		while (BINLOG_ITM_PORT(BINLOG_PORT) == 0);
+		BINLOG_ITM_PORT(BINLOG_PORT) = args[i];
+	}
+}
+
+#endif /* TARGET_BINLOG_H_ */
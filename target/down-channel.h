@@ -0,0 +1,48 @@
+/*
+ * down-channel.h
+ *
+ * Target side of the stlink-trace down-channel.
+ * Define one ring in RAM and poll it from the firmware main loop:
+ *
+ *   DOWN_CHANNEL_DEFINE(downChannel, 256);
+ *   ...
+ *   int count = DownChannelRead(&downChannel.header, buffer, sizeof(buffer));
+ *
+ * then pass the address of downChannel to stlink-trace with --down-channel.
+ * The host only writes writeOffset and the ring data, the target only writes readOffset.
+ */
+
+#ifndef TARGET_DOWN_CHANNEL_H_
+#define TARGET_DOWN_CHANNEL_H_
+
+#include <stdint.h>
+
+#define DOWN_CHANNEL_MAGIC 0x48434E44	// "DNCH"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t size;
+	volatile uint32_t writeOffset;
+	volatile uint32_t readOffset;
+} DownChannelHeader;
+
+#define DOWN_CHANNEL_DEFINE(name, bytes) \
+	struct { DownChannelHeader header; volatile uint8_t buffer[bytes]; } name = { { DOWN_CHANNEL_MAGIC, bytes, 0, 0 }, { 0 } }
+
+static inline int DownChannelRead(DownChannelHeader* dc, uint8_t* data, int maxLength)
+{
+	volatile uint8_t* buffer = (volatile uint8_t*)(dc + 1);
+	uint32_t readOffset = dc->readOffset;
+	uint32_t writeOffset = dc->writeOffset;
+	int count = 0;
+
+	while ((readOffset != writeOffset) && (count < maxLength)) {
+		data[count++] = buffer[readOffset];
+		if (++readOffset >= dc->size) readOffset = 0;
+	}
+
+	dc->readOffset = readOffset;
+	return count;
+}
+
+#endif /* TARGET_DOWN_CHANNEL_H_ */
@@ -0,0 +1,72 @@
+/*
+ * func-trace.h
+ *
+ * Target side of stlink-trace function tracing. Build the code to be traced with
+ * -finstrument-functions and include this header in one source file, so that GCC's hooks
+ * send each function entry and exit on FUNC_TRACE_PORT:
+ *
+ *   #include "func-trace.h"		// in one file only - it defines the hooks
+ *
+ *   stlink-trace --elf firmware.axf --func-trace 30
+ *
+ * A marker is one 32-bit ITM write: the function address with bit 0 clear on entry and set
+ * on exit. When the exception number in IPSR differs from that of the last marker, a 16-bit
+ * write with the new number goes first, so stlink-trace keeps a call stack per interrupt
+ * handler. Instrument the handlers too, so their entries and exits are seen. An exit in a
+ * handler forgets the number, as the handler may be returning: its next call, after the
+ * preempted code sent nothing, is then sent with its number again.
+ *
+ * stlink-trace enables the ITM local timestamps with --func-trace; they time the markers in
+ * CPU cycles. Keep the instrumentation off the hot paths that do not need it with
+ * -finstrument-functions-exclude-file-list or __attribute__((no_instrument_function)).
+ */
+
+#ifndef TARGET_FUNC_TRACE_H_
+#define TARGET_FUNC_TRACE_H_
+
+#include <stdint.h>
+
+#ifndef FUNC_TRACE_PORT
+#define FUNC_TRACE_PORT     30
+#endif
+
+#define FUNC_TRACE_ITM_PORT(port)   (*(volatile uint32_t*)(0xE0000000 + 4 * (port)))
+#define FUNC_TRACE_ITM_PORT16(port) (*(volatile uint16_t*)(0xE0000000 + 4 * (port)))
+#define FUNC_TRACE_ITM_TER          (*(volatile uint32_t*)0xE0000E00)
+#define FUNC_TRACE_ITM_TCR          (*(volatile uint32_t*)0xE0000E80)
+
+#define FUNC_TRACE_HOOK __attribute__((no_instrument_function))
+
+static volatile uint32_t funcTraceContext = 0xFFFFFFFF;
+
+FUNC_TRACE_HOOK static inline void FuncTraceWrite(uint32_t marker)
+{
+	uint32_t context;
+
+	if (((FUNC_TRACE_ITM_TCR & 1) == 0) || ((FUNC_TRACE_ITM_TER & (1UL << FUNC_TRACE_PORT)) == 0)) return;
+
+	__asm volatile ("mrs %0, ipsr" : "=r" (context));
+	context &= 0x1FF;
+	// an interrupt taken between the check and the marker writes its own context first,
+	// and stlink-trace returns to this one when the handler exits
+	if (context != funcTraceContext) {
+		funcTraceContext = context;
+		while (FUNC_TRACE_ITM_PORT(FUNC_TRACE_PORT) == 0);		// wait while the FIFO is full
+		FUNC_TRACE_ITM_PORT16(FUNC_TRACE_PORT) = context;
+	}
+	while (FUNC_TRACE_ITM_PORT(FUNC_TRACE_PORT) == 0);
+	FUNC_TRACE_ITM_PORT(FUNC_TRACE_PORT) = marker;
+	if ((context != 0) && ((marker & 1) != 0)) funcTraceContext = 0xFFFFFFFF;
+}
+
+FUNC_TRACE_HOOK void __cyg_profile_func_enter(void* function, void* callSite)
+{
+	FuncTraceWrite((uint32_t) function & ~1UL);
+}
+
+FUNC_TRACE_HOOK void __cyg_profile_func_exit(void* function, void* callSite)
+{
+	FuncTraceWrite((uint32_t) function | 1);
+}
+
+#endif /* TARGET_FUNC_TRACE_H_ */
@@ -0,0 +1,72 @@
+/*
+ * itm-out.h
+ *
+ * Target side ITM output for text and binary data.
+ *
+ *   ItmPrint(0, "Switched the LED on\n");
+ *   ItmWrite(2, data, length);
+ *
+ * The data is sent with 32-bit stimulus port writes, 4 bytes per ITM packet, and only the
+ * last 1 to 3 bytes use 16 and 8-bit writes. A 1 byte write costs a header byte per payload
+ * byte, so this takes 5 bytes of SWO per 4 characters instead of 8, and polls for a free
+ * FIFO slot once per 4 characters. stlink-trace joins the payloads of each port back into
+ * the original byte stream.
+ */
+
+#ifndef TARGET_ITM_OUT_H_
+#define TARGET_ITM_OUT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ITM_OUT_PORT32(port)    (*(volatile uint32_t*)(0xE0000000 + 4 * (port)))
+#define ITM_OUT_PORT16(port)    (*(volatile uint16_t*)(0xE0000000 + 4 * (port)))
+#define ITM_OUT_PORT8(port)     (*(volatile uint8_t*)(0xE0000000 + 4 * (port)))
+#define ITM_OUT_TER             (*(volatile uint32_t*)0xE0000E00)
+#define ITM_OUT_TCR             (*(volatile uint32_t*)0xE0000E80)
+
+/*
+ * Returns 0 if the debugger has not enabled the port - the writes would wait forever
+ */
+static inline int ItmPortEnabled(int port)
+{
+	return ((ITM_OUT_TCR & 1) != 0) && ((ITM_OUT_TER & (1UL << port)) != 0);
+}
+
+static inline void ItmWrite(int port, const void* data, size_t length)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+
+	if (!ItmPortEnabled(port)) return;
+
+	while (length >= 4) {
+		// assembled byte by byte, the data need not be aligned; little endian as the port
+		uint32_t word = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+		while (ITM_OUT_PORT32(port) == 0);		// wait while the FIFO is full
+		ITM_OUT_PORT32(port) = word;
+		bytes += 4;
+		length -= 4;
+	}
+
+	if (length >= 2) {
+		while (ITM_OUT_PORT32(port) == 0);
+		ITM_OUT_PORT16(port) = bytes[0] | (bytes[1] << 8);
+		bytes += 2;
+		length -= 2;
+	}
+
+	if (length > 0) {
+		while (ITM_OUT_PORT32(port) == 0);
+		ITM_OUT_PORT8(port) = bytes[0];
+	}
+}
+
+static inline void ItmPrint(int port, const char* text)
+{
+	size_t length = 0;
+
+	while (text[length] != '\0') length++;
+	ItmWrite(port, text, length);
+}
+
+#endif /* TARGET_ITM_OUT_H_ */
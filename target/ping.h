@@ -0,0 +1,43 @@
+/*
+ * ping.h
+ *
+ * Target side of the stlink-trace latency ping. stlink-trace --ping writes a token into a
+ * RAM word and times its echo on PING_PORT:
+ *
+ *   volatile uint32_t stlinkPing;
+ *   ...
+ *   PingService(&stlinkPing);		// from the main loop or a periodic interrupt
+ *
+ *   stlink-trace --elf firmware.axf --ping stlinkPing
+ *
+ * The measured round trip includes the time until PingService() next runs, so call it
+ * from wherever the latency of interest is - a SysTick handler gives the delay of output
+ * written from interrupts.
+ */
+
+#ifndef TARGET_PING_H_
+#define TARGET_PING_H_
+
+#include <stdint.h>
+
+#ifndef PING_PORT
+#define PING_PORT           31
+#endif
+
+#define PING_ITM_PORT(port) (*(volatile uint32_t*)(0xE0000000 + 4 * (port)))
+#define PING_ITM_TER        (*(volatile uint32_t*)0xE0000E00)
+#define PING_ITM_TCR        (*(volatile uint32_t*)0xE0000E80)
+
+static inline void PingService(volatile uint32_t* token)
+{
+	uint32_t value = *token;
+
+	if (value == 0) return;
+	*token = 0;		// the host writes the next token only after this one is echoed
+
+	if (((PING_ITM_TCR & 1) == 0) || ((PING_ITM_TER & (1UL << PING_PORT)) == 0)) return;
+	while (PING_ITM_PORT(PING_PORT) == 0);		// wait while the FIFO is full
+	PING_ITM_PORT(PING_PORT) = value;
+}
+
+#endif /* TARGET_PING_H_ */
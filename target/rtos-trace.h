@@ -0,0 +1,106 @@
+/*
+ * rtos-trace.h
+ *
+ * Target side of stlink-trace RTOS tracing. The scheduler reports task switches and tasks
+ * becoming ready on RTOS_TRACE_PORT, each with the DWT cycle counter:
+ *
+ *   RtosTraceInit();						// once, before the scheduler starts
+ *   RtosTraceName(id, "control");			// optional, when a task is created
+ *   RtosTraceSwitch(id);					// the task now running
+ *   RtosTraceReady(id);					// a task made ready to run
+ *
+ *   stlink-trace --rtos 29 --rtos-clock 72000000
+ *
+ * For FreeRTOS (configUSE_TRACE_FACILITY 1), in FreeRTOSConfig.h:
+ *
+ *   #define traceTASK_CREATE(tcb)                  RtosTraceName((tcb)->uxTCBNumber, (tcb)->pcTaskName)
+ *   #define traceTASK_SWITCHED_IN()                RtosTraceSwitch(pxCurrentTCB->uxTCBNumber)
+ *   #define traceMOVED_TASK_TO_READY_STATE(tcb)    RtosTraceReady((tcb)->uxTCBNumber)
+ *
+ * An event is two 32-bit writes, (type << 24) | id and the cycle count, with interrupts
+ * masked between them. A name is a (3 << 24) | id write and up to four words of characters.
+ * Task IDs are 24 bits. The host follows the counter through its wraps as long as an event
+ * is sent at least once per wrap (60s at 72MHz) - the idle task switching in does that.
+ */
+
+#ifndef TARGET_RTOS_TRACE_H_
+#define TARGET_RTOS_TRACE_H_
+
+#include <stdint.h>
+
+#ifndef RTOS_TRACE_PORT
+#define RTOS_TRACE_PORT         29
+#endif
+
+#define RTOS_TRACE_SWITCH       1
+#define RTOS_TRACE_READY        2
+#define RTOS_TRACE_NAME         3
+#define RTOS_TRACE_NAME_WORDS   4
+
+#define RTOS_TRACE_ITM_PORT(port)   (*(volatile uint32_t*)(0xE0000000 + 4 * (port)))
+#define RTOS_TRACE_ITM_TER          (*(volatile uint32_t*)0xE0000E00)
+#define RTOS_TRACE_ITM_TCR          (*(volatile uint32_t*)0xE0000E80)
+#define RTOS_TRACE_DWT_CTRL         (*(volatile uint32_t*)0xE0001000)
+#define RTOS_TRACE_DWT_CYCCNT       (*(volatile uint32_t*)0xE0001004)
+
+static inline int RtosTraceEnabled(void)
+{
+	return ((RTOS_TRACE_ITM_TCR & 1) != 0) && ((RTOS_TRACE_ITM_TER & (1UL << RTOS_TRACE_PORT)) != 0);
+}
+
+static inline void RtosTraceWrite(uint32_t value)
+{
+	while (RTOS_TRACE_ITM_PORT(RTOS_TRACE_PORT) == 0);		// wait while the FIFO is full
+	RTOS_TRACE_ITM_PORT(RTOS_TRACE_PORT) = value;
+}
+
+static inline void RtosTraceInit(void)
+{
+	RTOS_TRACE_DWT_CTRL |= 1;		// CYCCNTENA
+}
+
+static inline void RtosTraceEvent(uint32_t type, uint32_t id)
+{
+	uint32_t primask;
+
+	if (!RtosTraceEnabled()) return;
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) :: "memory");
+	RtosTraceWrite((type << 24) | (id & 0xFFFFFF));
+	RtosTraceWrite(RTOS_TRACE_DWT_CYCCNT);
+	__asm volatile ("msr primask, %0" :: "r" (primask) : "memory");
+}
+
+static inline void RtosTraceSwitch(uint32_t id)
+{
+	RtosTraceEvent(RTOS_TRACE_SWITCH, id);
+}
+
+static inline void RtosTraceReady(uint32_t id)
+{
+	RtosTraceEvent(RTOS_TRACE_READY, id);
+}
+
+static inline void RtosTraceName(uint32_t id, const char* name)
+{
+	uint32_t primask;
+	int i, end = 0;
+
+	if (!RtosTraceEnabled()) return;
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (primask) :: "memory");
+	RtosTraceWrite((RTOS_TRACE_NAME << 24) | (id & 0xFFFFFF));
+	for (i = 0; (i < RTOS_TRACE_NAME_WORDS * 4) && !end; i += 4) {
+		uint32_t word = 0;
+		int j;
+		for (j = 0; j < 4; j++) {
+			if (name[i + j] == '\0') {
+				end = 1;
+				break;
+			}
+			word |= (uint32_t)(unsigned char) name[i + j] << (8 * j);
+		}
+		RtosTraceWrite(word);
+	}
+	__asm volatile ("msr primask, %0" :: "r" (primask) : "memory");
+}
+
+#endif /* TARGET_RTOS_TRACE_H_ */
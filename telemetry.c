@@ -0,0 +1,400 @@
+/*
+ * telemetry.c
+ *
+ * Streaming statistics for numeric stimulus ports (see telemetry.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "telemetry.h"
+
+static const struct {
+	const char* name;
+	int size;
+} types[] = {
+	{"u8", 1}, {"s8", 1}, {"u16", 2}, {"s16", 2}, {"u32", 4}, {"s32", 4}, {"f32", 4}
+};
+
+static uint64_t GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//============================
+// t-digest
+//============================
+
+void TdigestReset(Tdigest* digest)
+{
+	digest->merged = 0;
+	digest->count = 0;
+	digest->weight = 0;
+}
+
+static int CompareCentroids(const void* a, const void* b)
+{
+	double left = ((const TdigestCentroid*) a)->mean;
+	double right = ((const TdigestCentroid*) b)->mean;
+	return (left < right) ? -1 : (left > right);
+}
+
+/*
+ * Sort the new samples in with the centroids and combine neighbours while a centroid spans
+ * at most one unit of k(q) = compression / 2pi * asin(2q - 1) - small at the tails, large at
+ * the median, and no more than about TDIGEST_COMPRESSION of them
+ */
+static double Scale(double q)
+{
+	return TDIGEST_COMPRESSION / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static void Merge(Tdigest* digest)
+{
+	TdigestCentroid* centroids = digest->centroids;
+	double before = 0;
+	double kLeft = Scale(0);
+	int i, out = 0;
+
+	if (digest->count == digest->merged) return;
+	qsort(centroids, digest->count, sizeof(TdigestCentroid), CompareCentroids);
+
+	for (i = 1; i < digest->count; i++) {
+		double weight = centroids[out].weight + centroids[i].weight;
+		double q = (before + weight) / digest->weight;
+		if (Scale(q > 1 ? 1 : q) - kLeft <= 1) {
+			centroids[out].mean += (centroids[i].mean - centroids[out].mean) * centroids[i].weight / weight;
+			centroids[out].weight = weight;
+		}
+		else {
+			before += centroids[out].weight;
+			kLeft = Scale(before / digest->weight);
+			centroids[++out] = centroids[i];
+		}
+	}
+	digest->merged = digest->count = out + 1;
+}
+
+void TdigestAdd(Tdigest* digest, double value, double weight)
+{
+	if (digest->weight == 0) {
+		digest->min = digest->max = value;
+	}
+	if (value < digest->min) digest->min = value;
+	if (value > digest->max) digest->max = value;
+
+	digest->centroids[digest->count].mean = value;
+	digest->centroids[digest->count].weight = weight;
+	digest->count++;
+	digest->weight += weight;
+	if (digest->count == (int)(sizeof(digest->centroids) / sizeof(digest->centroids[0]))) Merge(digest);
+}
+
+/*
+ * Interpolated between the centroid centres, and out to min and max at the ends
+ */
+double TdigestQuantile(Tdigest* digest, double quantile)
+{
+	TdigestCentroid* centroids = digest->centroids;
+	double target = quantile * digest->weight;
+	double before = 0;
+	int i;
+
+	if (digest->weight == 0) return 0;
+	Merge(digest);
+
+	if (target < centroids[0].weight / 2) {
+		return digest->min + (centroids[0].mean - digest->min) * target / (centroids[0].weight / 2);
+	}
+	for (i = 0; i < digest->merged - 1; i++) {
+		double left = before + centroids[i].weight / 2;
+		double right = before + centroids[i].weight + centroids[i + 1].weight / 2;
+		if (target < right) {
+			return centroids[i].mean + (centroids[i + 1].mean - centroids[i].mean) * (target - left) / (right - left);
+		}
+		before += centroids[i].weight;
+	}
+	double left = digest->weight - centroids[i].weight / 2;
+	if (target <= left) return centroids[i].mean;
+	return centroids[i].mean + (digest->max - centroids[i].mean) * (target - left) / (centroids[i].weight / 2);
+}
+
+//============================
+// channels
+//============================
+
+static void MomentsAdd(TelemetryMoments* moments, double value)
+{
+	if (moments->count == 0) {
+		moments->min = moments->max = value;
+	}
+	if (value < moments->min) moments->min = value;
+	if (value > moments->max) moments->max = value;
+
+	moments->count++;
+	double delta = value - moments->mean;
+	moments->mean += delta / moments->count;
+	moments->m2 += delta * (value - moments->mean);
+}
+
+/*
+ * Add the moments of an interval to the totals (Chan et al.)
+ */
+static void MomentsCombine(TelemetryMoments* total, const TelemetryMoments* interval)
+{
+	if (interval->count == 0) return;
+	if (total->count == 0) {
+		*total = *interval;
+		return;
+	}
+
+	unsigned long long count = total->count + interval->count;
+	double delta = interval->mean - total->mean;
+	total->mean += delta * interval->count / count;
+	total->m2 += interval->m2 + delta * delta * ((double) total->count * interval->count / count);
+	total->count = count;
+	if (interval->min < total->min) total->min = interval->min;
+	if (interval->max > total->max) total->max = interval->max;
+}
+
+/*
+ * PORT:TYPE[:NAME[:MAXRATE]]
+ */
+int TelemetryAddChannel(Telemetry* telemetry, const char* spec)
+{
+	char type[8] = "";
+	char name[32] = "";
+	double maxRate = 0;
+	int port = -1;
+	size_t i;
+
+	if ((sscanf(spec, "%d:%7[^:]:%31[^:]:%lf", &port, type, name, &maxRate) < 2) || (port < 0) || (port >= ITM_PORTS)) {
+		printf("Invalid telemetry channel %s - use PORT:TYPE[:NAME[:MAXRATE]]\n", spec);
+		return -1;
+	}
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (strcmp(type, types[i].name) == 0) break;
+	}
+	if (i == sizeof(types) / sizeof(types[0])) {
+		printf("Unknown telemetry type %s - use u8, s8, u16, s16, u32, s32 or f32\n", type);
+		return -1;
+	}
+	if (telemetry->channels[port] != NULL) {
+		printf("Port %d already has a telemetry channel\n", port);
+		return -1;
+	}
+
+	TelemetryChannel* channel = calloc(1, sizeof(TelemetryChannel));
+	if (channel == NULL) return -1;
+	channel->port = port;
+	channel->type = i;
+	channel->size = types[i].size;
+	channel->maxRate = maxRate;
+	// the name goes into the JSON lines as it is
+	char* to = channel->name;
+	const char* from;
+	for (from = name; *from != '\0'; from++) {
+		if (((unsigned char)*from >= ' ') && (*from != '"') && (*from != '\\')) *to++ = *from;
+	}
+	if (channel->name[0] == '\0') snprintf(channel->name, sizeof(channel->name), "port%d", port);
+
+	telemetry->channels[port] = channel;
+	telemetry->ports |= 1U << port;
+	return 0;
+}
+
+int TelemetryOpen(Telemetry* telemetry, const char* filename, unsigned int intervalMs)
+{
+	if (filename != NULL) {
+		telemetry->file = fopen(filename, "w");
+		if (telemetry->file == NULL) {
+			printf("Unable to open %s\n", filename);
+			return -1;
+		}
+	}
+	telemetry->intervalNs = (uint64_t)((intervalMs > 0) ? intervalMs : TELEMETRY_INTERVAL_MS) * 1000000ULL;
+	telemetry->startNs = telemetry->intervalStartNs = GetTimeNs();
+	return 0;
+}
+
+static double SampleValue(const TelemetryChannel* channel, const unsigned char* data)
+{
+	uint32_t value = data[0];
+	float f;
+
+	if (channel->size >= 2) value |= data[1] << 8;
+	if (channel->size == 4) value |= (data[2] << 16) | ((uint32_t) data[3] << 24);
+
+	switch (channel->type) {
+	case TELEMETRY_S8:
+		return (int8_t) value;
+	case TELEMETRY_S16:
+		return (int16_t) value;
+	case TELEMETRY_S32:
+		return (int32_t) value;
+	case TELEMETRY_F32:
+		memcpy(&f, &value, sizeof(f));
+		return f;
+	default:
+		return value;
+	}
+}
+
+static void CheckRate(TelemetryChannel* channel, double value)
+{
+	uint64_t now = GetTimeNs();
+
+	if (channel->rateNs == 0) {
+		channel->rateValue = value;
+		channel->rateNs = now;
+		return;
+	}
+	if (now - channel->rateNs < TELEMETRY_RATE_WINDOW_MS * 1000000ULL) return;
+
+	double rate = (value - channel->rateValue) * 1e9 / (now - channel->rateNs);
+	channel->rateValue = value;
+	channel->rateNs = now;
+	if (fabs(rate) > channel->maxSeenRate) channel->maxSeenRate = fabs(rate);
+	if (fabs(rate) <= channel->maxRate) return;
+
+	channel->alerts++;
+	channel->intervalAlerts++;
+	if (now - channel->alertPrintNs >= 1000000000ULL) {
+		channel->alertPrintNs = now;
+		printf("Telemetry alert: %s changing at %.6g/s (limit %.6g/s), now %.6g\n", channel->name, rate, channel->maxRate, value);
+	}
+}
+
+static void Sample(TelemetryChannel* channel, double value)
+{
+	MomentsAdd(&channel->interval, value);
+	TdigestAdd(&channel->intervalDigest, value, 1);
+	if (channel->maxRate > 0) CheckRate(channel, value);
+}
+
+/*
+ * TraceDemux tap for the telemetry ports
+ */
+void TelemetryTap(Telemetry* telemetry, int port, const unsigned char* data, size_t length)
+{
+	TelemetryChannel* channel = telemetry->channels[port];
+	size_t pos = 0;
+
+	if (channel == NULL) return;
+
+	// a sample split over packets
+	while ((channel->partialLength > 0) && (pos < length)) {
+		channel->partial[channel->partialLength++] = data[pos++];
+		if (channel->partialLength == channel->size) {
+			Sample(channel, SampleValue(channel, channel->partial));
+			channel->partialLength = 0;
+		}
+	}
+	for (; pos + channel->size <= length; pos += channel->size) Sample(channel, SampleValue(channel, &data[pos]));
+	while (pos < length) channel->partial[channel->partialLength++] = data[pos++];
+}
+
+static void Emit(Telemetry* telemetry, TelemetryChannel* channel, const TelemetryMoments* moments, Tdigest* digest,
+		unsigned long long alerts, double maxRate, double seconds, int total)
+{
+	// nothing to summarise - an empty interval is left out
+	if (moments->count == 0) {
+		if (total) printf("Telemetry %s total: no samples\n", channel->name);
+		return;
+	}
+
+	double stddev = (moments->count > 1) ? sqrt(moments->m2 / (moments->count - 1)) : 0;
+	double p50 = TdigestQuantile(digest, 0.5);
+	double p90 = TdigestQuantile(digest, 0.9);
+	double p99 = TdigestQuantile(digest, 0.99);
+	double rate = (seconds > 0) ? moments->count / seconds : 0;
+
+	if (telemetry->file != NULL) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		fprintf(telemetry->file, "{\"time\":%.3f,\"channel\":\"%s\",\"port\":%d,\"total\":%s,\"count\":%llu,\"samples_per_s\":%.1f,"
+				"\"min\":%.9g,\"max\":%.9g,\"mean\":%.9g,\"stddev\":%.9g,\"p50\":%.9g,\"p90\":%.9g,\"p99\":%.9g,\"max_rate\":%.9g,\"alerts\":%llu}\n",
+				now.tv_sec + now.tv_nsec / 1e9, channel->name, channel->port, total ? "true" : "false", moments->count, rate,
+				moments->min, moments->max, moments->mean, stddev, p50, p90, p99, maxRate, alerts);
+		fflush(telemetry->file);
+	}
+	if ((telemetry->file == NULL) || total) {
+		printf("Telemetry %s%s: %llu samples (%.0f/s), min %.6g max %.6g mean %.6g stddev %.6g, p50 %.6g p90 %.6g p99 %.6g, %llu alerts\n",
+				channel->name, total ? " total" : "", moments->count, rate, moments->min, moments->max, moments->mean, stddev, p50, p90, p99, alerts);
+	}
+}
+
+/*
+ * Emit the summaries of the interval and add it to the totals
+ */
+static void Summarise(Telemetry* telemetry, uint64_t now)
+{
+	int port;
+	int i;
+
+	for (port = 0; port < ITM_PORTS; port++) {
+		TelemetryChannel* channel = telemetry->channels[port];
+		if (channel == NULL) continue;
+
+		Emit(telemetry, channel, &channel->interval, &channel->intervalDigest, channel->intervalAlerts, channel->maxSeenRate,
+				(now - telemetry->intervalStartNs) / 1e9, 0);
+
+		// the interval centroids go into the digest of the whole capture
+		Merge(&channel->intervalDigest);
+		for (i = 0; i < channel->intervalDigest.merged; i++) {
+			TdigestAdd(&channel->totalDigest, channel->intervalDigest.centroids[i].mean, channel->intervalDigest.centroids[i].weight);
+		}
+		if (channel->intervalDigest.weight > 0) {
+			if (channel->intervalDigest.min < channel->totalDigest.min) channel->totalDigest.min = channel->intervalDigest.min;
+			if (channel->intervalDigest.max > channel->totalDigest.max) channel->totalDigest.max = channel->intervalDigest.max;
+		}
+		MomentsCombine(&channel->total, &channel->interval);
+		if (channel->maxSeenRate > channel->fastestRate) channel->fastestRate = channel->maxSeenRate;
+
+		memset(&channel->interval, 0, sizeof(channel->interval));
+		TdigestReset(&channel->intervalDigest);
+		channel->intervalAlerts = 0;
+		channel->maxSeenRate = 0;
+	}
+	telemetry->intervalStartNs = now;
+}
+
+/*
+ * Capture loop: a summary once per interval
+ */
+void TelemetryService(Telemetry* telemetry)
+{
+	uint64_t now;
+
+	if (telemetry->ports == 0) return;
+	now = GetTimeNs();
+	if (now - telemetry->intervalStartNs >= telemetry->intervalNs) Summarise(telemetry, now);
+}
+
+void TelemetryClose(Telemetry* telemetry)
+{
+	int port;
+
+	if (telemetry->ports == 0) return;
+
+	// the last part interval goes into the totals
+	uint64_t now = GetTimeNs();
+	Summarise(telemetry, now);
+
+	double seconds = (now - telemetry->startNs) / 1e9;
+	for (port = 0; port < ITM_PORTS; port++) {
+		TelemetryChannel* channel = telemetry->channels[port];
+		if (channel == NULL) continue;
+		Emit(telemetry, channel, &channel->total, &channel->totalDigest, channel->alerts, channel->fastestRate, seconds, 1);
+		free(channel);
+		telemetry->channels[port] = NULL;
+	}
+	telemetry->ports = 0;
+	if (telemetry->file != NULL) fclose(telemetry->file);
+	telemetry->file = NULL;
+}
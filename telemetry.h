@@ -0,0 +1,105 @@
+/*
+ * telemetry.h
+ *
+ * Numeric telemetry on stimulus ports (--telemetry PORT:TYPE[:NAME[:MAXRATE]]): the data of
+ * the port is read as a stream of samples of one type - u8, s8, u16, s16, u32, s32 or f32,
+ * little endian, as sent with ItmWrite(port, &value, sizeof(value)) - instead of text.
+ * Samples may be split over packets and several may share one.
+ *
+ * Each channel keeps constant-memory statistics updated per sample: count, min, max, the mean
+ * and standard deviation (Welford) and a t-digest for the percentiles. With MAXRATE the rate
+ * of change is checked over windows of TELEMETRY_RATE_WINDOW_MS and an alert is printed,
+ * at most once a second, when it is faster than MAXRATE units per second.
+ *
+ * A summary of every channel with samples is emitted each interval (--telemetry-interval,
+ * 1s), as text or as JSON lines to --telemetry-file, and the statistics start again; the
+ * totals for the whole capture are emitted at the end. No samples are stored. Control
+ * characters, quotes and backslashes are dropped from channel names.
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "itm-decode.h"
+
+#define TELEMETRY_INTERVAL_MS       1000
+#define TELEMETRY_RATE_WINDOW_MS    10
+#define TDIGEST_COMPRESSION         100
+#define TDIGEST_BUFFER              256		// room for samples added between merges
+
+#define TELEMETRY_U8                0
+#define TELEMETRY_S8                1
+#define TELEMETRY_U16               2
+#define TELEMETRY_S16               3
+#define TELEMETRY_U32               4
+#define TELEMETRY_S32               5
+#define TELEMETRY_F32               6
+
+typedef struct {
+	double mean;
+	double weight;
+} TdigestCentroid;
+
+/*
+ * Merging t-digest: at most about TDIGEST_COMPRESSION centroids, small ones at the tails
+ */
+typedef struct {
+	TdigestCentroid centroids[2 * TDIGEST_COMPRESSION + TDIGEST_BUFFER];
+	int merged;				// centroids[0, merged) are merged and sorted
+	int count;				// with the samples added since
+	double weight;
+	double min;
+	double max;
+} Tdigest;
+
+typedef struct {
+	unsigned long long count;
+	double mean;
+	double m2;				// sum of squared differences from the mean
+	double min;
+	double max;
+} TelemetryMoments;
+
+typedef struct {
+	int port;
+	int type;
+	int size;
+	char name[32];
+	double maxRate;			// units per second, 0 for no alert
+	unsigned char partial[4];
+	int partialLength;
+	TelemetryMoments interval;
+	TelemetryMoments total;
+	Tdigest intervalDigest;
+	Tdigest totalDigest;
+	double rateValue;		// start of the current rate window
+	uint64_t rateNs;
+	double maxSeenRate;		// fastest change in the interval
+	double fastestRate;		// and in the capture
+	unsigned long long intervalAlerts;
+	unsigned long long alerts;
+	uint64_t alertPrintNs;
+} TelemetryChannel;
+
+typedef struct {
+	TelemetryChannel* channels[ITM_PORTS];
+	uint32_t ports;			// ports with a channel
+	FILE* file;				// JSON lines, NULL to print the summaries
+	uint64_t intervalNs;
+	uint64_t intervalStartNs;
+	uint64_t startNs;
+} Telemetry;
+
+void TdigestReset(Tdigest* digest);
+void TdigestAdd(Tdigest* digest, double value, double weight);
+double TdigestQuantile(Tdigest* digest, double quantile);
+
+int TelemetryAddChannel(Telemetry* telemetry, const char* spec);
+int TelemetryOpen(Telemetry* telemetry, const char* filename, unsigned int intervalMs);
+void TelemetryTap(Telemetry* telemetry, int port, const unsigned char* data, size_t length);
+void TelemetryService(Telemetry* telemetry);
+void TelemetryClose(Telemetry* telemetry);
+
+#endif /* TELEMETRY_H_ */
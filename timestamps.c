@@ -0,0 +1,184 @@
+/*
+ * timestamps.c
+ *
+ * Host timestamps for the decoded trace (see timestamps.h).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "timestamps.h"
+
+static void Put32(unsigned char* data, uint32_t value)
+{
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+}
+
+static uint32_t Get32(const unsigned char* data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static void WriteBlock(Timestamps* timestamps)
+{
+	unsigned char header[8];
+
+	if (timestamps->count == 0) return;
+	Put32(&header[0], timestamps->count);
+	Put32(&header[4], timestamps->deltaLength);
+	fwrite(header, 1, sizeof(header), timestamps->file);
+	fwrite(timestamps->deltas, 1, timestamps->deltaLength, timestamps->file);
+	fwrite(timestamps->packets, 1, timestamps->count, timestamps->file);
+	timestamps->count = 0;
+	timestamps->deltaLength = 0;
+}
+
+int TimestampsOpen(Timestamps* timestamps, const char* filename, unsigned int baud)
+{
+	memset(timestamps, 0, sizeof(Timestamps));
+	timestamps->file = fopen(filename, "wb");
+	if (timestamps->file == NULL) {
+		printf("Unable to open %s\n", filename);
+		return -1;
+	}
+	TimestampsStart(timestamps, baud);
+
+	// the start time is filled in with the first packet
+	unsigned char header[20] = TIMESTAMPS_MAGIC;
+	Put32(&header[4], TIMESTAMPS_VERSION);
+	Put32(&header[16], baud);
+	fwrite(header, 1, sizeof(header), timestamps->file);
+	return 0;
+}
+
+/*
+ * Time the packets for the other outputs, with or without the file
+ */
+void TimestampsStart(Timestamps* timestamps, unsigned int baud)
+{
+	timestamps->byteNs = 10 * 1e9 / baud;
+}
+
+/*
+ * A trace read of length bytes has just completed
+ */
+void TimestampsChunk(Timestamps* timestamps, size_t length)
+{
+	struct timespec now;
+
+	if (timestamps->byteNs == 0) return;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+	timestamps->chunkEndNs = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+	timestamps->chunkLength = length;
+}
+
+/*
+ * Time of a packet of the current trace read, not before the packet timed last
+ */
+uint64_t TimestampsPacketTime(Timestamps* timestamps, const ItmRecord* record)
+{
+	// the last byte of the packet left the target this many byte times before the read completed
+	uint64_t before = (uint64_t)((timestamps->chunkLength - 1 - record->offset) * timestamps->byteNs);
+	uint64_t time = (timestamps->chunkEndNs > before) ? timestamps->chunkEndNs - before : 0;
+
+	if (time < timestamps->packetNs) time = timestamps->packetNs;
+	timestamps->packetNs = time;
+	return time;
+}
+
+/*
+ * ItmDecoder record of the current trace read - stimulus and DWT packets are timed
+ */
+void TimestampsRecord(Timestamps* timestamps, const ItmRecord* record)
+{
+	if ((timestamps->file == NULL) || ((record->type != ITM_RECORD_STIMULUS) && (record->type != ITM_RECORD_HARDWARE))) return;
+
+	uint64_t time = TimestampsPacketTime(timestamps, record);
+
+	if (timestamps->lastNs == 0) {
+		unsigned char start[8];
+		Put32(&start[0], (uint32_t) time);
+		Put32(&start[4], (uint32_t)(time >> 32));
+		fseek(timestamps->file, 8, SEEK_SET);
+		fwrite(start, 1, sizeof(start), timestamps->file);
+		fseek(timestamps->file, 0, SEEK_END);
+		timestamps->lastNs = time;
+	}
+	if (time < timestamps->lastNs) time = timestamps->lastNs;
+
+	uint64_t delta = time - timestamps->lastNs;
+	timestamps->lastNs = time;
+	while (delta >= 0x80) {
+		timestamps->deltas[timestamps->deltaLength++] = (delta & 0x7F) | 0x80;
+		delta >>= 7;
+	}
+	timestamps->deltas[timestamps->deltaLength++] = delta;
+	timestamps->packets[timestamps->count++] = (record->port << 3) | ((record->type == ITM_RECORD_HARDWARE) ? 0x04 : 0) | ((record->size == 4) ? 3 : record->size);
+	timestamps->total++;
+
+	if (timestamps->count == TIMESTAMPS_BLOCK) WriteBlock(timestamps);
+}
+
+void TimestampsClose(Timestamps* timestamps)
+{
+	if (timestamps->file == NULL) return;
+
+	WriteBlock(timestamps);
+	fclose(timestamps->file);
+	timestamps->file = NULL;
+	printf("Timestamps: %llu packets\n", timestamps->total);
+}
+
+/*
+ * Print a timestamp file: time since the first packet (us), delta (ns), source, port and size
+ */
+int TimestampsDump(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	static unsigned char deltas[TIMESTAMPS_BLOCK * 10];
+	unsigned char packets[TIMESTAMPS_BLOCK];
+	unsigned char header[20];
+	uint64_t time = 0;
+	uint32_t i;
+
+	if (file == NULL) {
+		printf("Unable to open %s\n", filename);
+		return -1;
+	}
+	if ((fread(header, 1, sizeof(header), file) != sizeof(header)) || (memcmp(header, TIMESTAMPS_MAGIC, 4) != 0)) {
+		printf("%s is not a timestamp file\n", filename);
+		fclose(file);
+		return -1;
+	}
+	printf("# start %llu ns CLOCK_MONOTONIC_RAW, %u baud\n",
+			(unsigned long long) Get32(&header[8]) | ((unsigned long long) Get32(&header[12]) << 32), Get32(&header[16]));
+
+	while (fread(header, 1, 8, file) == 8) {
+		uint32_t count = Get32(&header[0]);
+		uint32_t length = Get32(&header[4]);
+		if ((count > TIMESTAMPS_BLOCK) || (length > sizeof(deltas)) ||
+				(fread(deltas, 1, length, file) != length) || (fread(packets, 1, count, file) != count)) {
+			printf("# truncated block\n");
+			break;
+		}
+
+		const unsigned char* pos = deltas;
+		for (i = 0; i < count; i++) {
+			uint64_t delta = 0;
+			int shift = 0;
+			while ((pos < deltas + length) && (*pos & 0x80)) {
+				delta |= (uint64_t)(*pos++ & 0x7F) << shift;
+				shift += 7;
+			}
+			if (pos < deltas + length) delta |= (uint64_t)(*pos++) << shift;
+			time += delta;
+			printf("%14.3f %10llu %s %2d %d\n", time / 1000.0, (unsigned long long) delta,
+					(packets[i] & 0x04) ? "dwt " : "port", packets[i] >> 3, ((packets[i] & 3) == 3) ? 4 : (packets[i] & 3));
+		}
+	}
+	fclose(file);
+	return 0;
+}
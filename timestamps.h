@@ -0,0 +1,54 @@
+/*
+ * timestamps.h
+ *
+ * Host timestamps for the decoded trace (--timestamps): every stimulus and DWT packet gets
+ * the CLOCK_MONOTONIC_RAW time at which it arrived. The clock is read once per trace read,
+ * when the USB transfer completes, and the bytes of the read are spaced back from it by
+ * the time a byte takes at the SWO baud rate - so the packets of one 2KB read do not all
+ * have the same time. Times never go backwards.
+ *
+ * The times are not printed. They are stored as a column of deltas, in blocks:
+ *   header:     "STTS", u32 version, u64 time of the first packet (ns, CLOCK_MONOTONIC_RAW),
+ *               u32 SWO baud rate
+ *   per block:  u32 packet count, u32 size of the deltas, the deltas, one byte per packet
+ * A delta is the ns since the previous packet as an unsigned LEB128 varint (one or two
+ * bytes at full SWO rate). The byte per packet is the port (or DWT discriminator) << 3,
+ * 0x04 for a DWT packet and the size code 1, 2 or 3 (4 bytes) of the ITM header, so the
+ * payload of each port can be matched with its times. stlink-trace --timestamps-dump FILE
+ * prints the column as text.
+ */
+
+#ifndef TIMESTAMPS_H_
+#define TIMESTAMPS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "itm-decode.h"
+
+#define TIMESTAMPS_MAGIC        "STTS"
+#define TIMESTAMPS_VERSION      1
+#define TIMESTAMPS_BLOCK        4096	// packets per block
+
+typedef struct {
+	FILE* file;
+	double byteNs;				// SWO time of one byte (10 bits)
+	uint64_t chunkEndNs;		// completion of the current trace read
+	size_t chunkLength;
+	uint64_t lastNs;			// time of the last packet in the file, 0 before the first
+	uint64_t packetNs;			// time of the last packet timed
+	unsigned char deltas[TIMESTAMPS_BLOCK * 10];
+	size_t deltaLength;
+	unsigned char packets[TIMESTAMPS_BLOCK];
+	uint32_t count;
+	unsigned long long total;
+} Timestamps;
+
+int TimestampsOpen(Timestamps* timestamps, const char* filename, unsigned int baud);
+void TimestampsStart(Timestamps* timestamps, unsigned int baud);
+void TimestampsChunk(Timestamps* timestamps, size_t length);
+uint64_t TimestampsPacketTime(Timestamps* timestamps, const ItmRecord* record);
+void TimestampsRecord(Timestamps* timestamps, const ItmRecord* record);
+void TimestampsClose(Timestamps* timestamps);
+int TimestampsDump(const char* filename);
+
+#endif /* TIMESTAMPS_H_ */
@@ -0,0 +1,368 @@
+/*
+ * trace-server.c
+ *
+ * Live trace fan-out to local clients (see trace-server.h).
+ * Decoded data is staged per port while a trace read is decoded and handed to the client
+ * queues once per read in TraceServerFlush(), which also tries to send it straight away.
+ * Anything a client socket does not accept stays queued until epoll reports it writable.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "trace-server.h"
+
+#define LISTEN_INDEX   TRACE_SERVER_MAX_CLIENTS
+
+static int StreamIndex(int stream)
+{
+	return stream + 2;
+}
+
+static void WatchClient(TraceServer* server, int index, int writable)
+{
+	struct epoll_event event;
+
+	event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+	event.data.u32 = index;
+	epoll_ctl(server->epollFd, EPOLL_CTL_MOD, server->clients[index].fd, &event);
+	server->clients[index].waitingWrite = writable;
+}
+
+static void CloseClient(TraceServer* server, TraceClient* client)
+{
+	printf("Trace client %d disconnected: %llu bytes sent, %llu dropped\n", (int)(client - server->clients),
+			client->sentBytes, client->droppedBytes);
+
+	epoll_ctl(server->epollFd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	server->streamClients[StreamIndex(client->stream)]--;
+	free(client->queue);
+	client->queue = NULL;
+	client->fd = -1;
+}
+
+/*
+ * Send as much of the queue as the socket takes without blocking
+ */
+static void SendQueued(TraceServer* server, TraceClient* client)
+{
+	while (client->length > 0) {
+		size_t chunk = server->queueSize - client->head;
+		if (chunk > client->length) chunk = client->length;
+
+		ssize_t count = send(client->fd, &client->queue[client->head], chunk, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (count < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+			if (errno == EINTR) continue;
+			CloseClient(server, client);
+			return;
+		}
+
+		client->head = (client->head + count) % server->queueSize;
+		client->length -= count;
+		client->sentBytes += count;
+	}
+
+	// only ask for EPOLLOUT while there is something left to send
+	int waiting = (client->length > 0);
+	if (waiting != client->waitingWrite) WatchClient(server, client - server->clients, waiting);
+}
+
+static void Enqueue(TraceServer* server, TraceClient* client, const unsigned char* data, size_t length)
+{
+	if (client->length + length > server->queueSize) {
+		if (server->policy == TRACE_SERVER_DISCONNECT) {
+			printf("Trace client %d is too slow\n", (int)(client - server->clients));
+			server->disconnects++;
+			CloseClient(server, client);
+		}
+		else {
+			client->droppedBytes += length;
+			server->droppedBytes += length;
+		}
+		return;
+	}
+
+	size_t tail = (client->head + client->length) % server->queueSize;
+	size_t first = server->queueSize - tail;
+	if (first > length) first = length;
+	memcpy(&client->queue[tail], data, first);
+	memcpy(&client->queue[0], data + first, length - first);
+	client->length += length;
+}
+
+static void Distribute(TraceServer* server, int stream, const unsigned char* data, size_t length)
+{
+	int index;
+
+	for (index = 0; index < TRACE_SERVER_MAX_CLIENTS; index++) {
+		TraceClient* client = &server->clients[index];
+		if ((client->fd >= 0) && (client->stream == stream)) Enqueue(server, client, data, length);
+	}
+}
+
+static void DistributeStage(TraceServer* server, int stage)
+{
+	if (server->stageLength[stage] == 0) return;
+	Distribute(server, (stage == ITM_PORTS) ? TRACE_SERVER_ALL : stage, &server->stage[stage][0], server->stageLength[stage]);
+	server->stageLength[stage] = 0;
+}
+
+static void Stage(TraceServer* server, int stage, const unsigned char* data, size_t length)
+{
+	if (server->stageLength[stage] + length > TRACE_SERVER_STAGE_SIZE) DistributeStage(server, stage);
+	memcpy(&server->stage[stage][server->stageLength[stage]], data, length);
+	server->stageLength[stage] += length;
+}
+
+static int OpenListener(const char* address)
+{
+	int fd;
+
+	if (strchr(address, '/') != NULL) {
+		struct sockaddr_un local;
+
+		memset(&local, 0, sizeof(local));
+		local.sun_family = AF_UNIX;
+		strncpy(local.sun_path, address, sizeof(local.sun_path) - 1);
+		unlink(address);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if ((fd >= 0) && (bind(fd, (struct sockaddr*) &local, sizeof(local)) != 0)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	else {
+		// [host:]port, loopback unless a host is given
+		struct sockaddr_in inet;
+		char host[64] = "127.0.0.1";
+		const char* port = strrchr(address, ':');
+		int reuse = 1;
+
+		if (port != NULL) {
+			snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+			port++;
+		}
+		else {
+			port = address;
+		}
+
+		memset(&inet, 0, sizeof(inet));
+		inet.sin_family = AF_INET;
+		inet.sin_port = htons(atoi(port));
+		if (inet_pton(AF_INET, host, &inet.sin_addr) != 1) return -1;
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if ((fd >= 0) && (bind(fd, (struct sockaddr*) &inet, sizeof(inet)) != 0)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if ((fd >= 0) && (listen(fd, 16) != 0)) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+int TraceServerOpen(TraceServer* server, const char* address, size_t queueSize, int policy)
+{
+	struct epoll_event event;
+	int index;
+
+	memset(server, 0, sizeof(TraceServer));
+	for (index = 0; index < TRACE_SERVER_MAX_CLIENTS; index++) server->clients[index].fd = -1;
+	server->queueSize = queueSize ? queueSize : TRACE_SERVER_QUEUE_SIZE;
+	server->policy = policy;
+
+	server->listenFd = OpenListener(address);
+	if (server->listenFd < 0) {
+		printf("Unable to listen on %s\n", address);
+		return -1;
+	}
+
+	server->epollFd = epoll_create1(0);
+	event.events = EPOLLIN;
+	event.data.u32 = LISTEN_INDEX;
+	if ((server->epollFd < 0) || (epoll_ctl(server->epollFd, EPOLL_CTL_ADD, server->listenFd, &event) != 0)) {
+		printf("Unable to set up epoll\n");
+		close(server->listenFd);
+		server->listenFd = -1;
+		return -1;
+	}
+
+	printf("Trace server listening on %s\n", address);
+	return 0;
+}
+
+/*
+ * Raw SWO data - queued for the raw clients
+ */
+void TraceServerRaw(TraceServer* server, const unsigned char* data, size_t length)
+{
+	if ((server->listenFd >= 0) && (server->streamClients[StreamIndex(TRACE_SERVER_RAW)] > 0)) {
+		Distribute(server, TRACE_SERVER_RAW, data, length);
+	}
+}
+
+/*
+ * TraceDemux tap - stages stimulus data that a client has asked for
+ */
+void TraceServerTap(void* context, int port, const unsigned char* data, size_t length)
+{
+	TraceServer* server = context;
+
+	if (server->streamClients[StreamIndex(TRACE_SERVER_ALL)] > 0) Stage(server, ITM_PORTS, data, length);
+	if (server->streamClients[StreamIndex(port)] > 0) Stage(server, port, data, length);
+}
+
+/*
+ * Hand the staged data to the clients and send what their sockets will take
+ */
+void TraceServerFlush(TraceServer* server)
+{
+	int index;
+
+	if (server->listenFd < 0) return;
+
+	for (index = 0; index <= ITM_PORTS; index++) DistributeStage(server, index);
+
+	for (index = 0; index < TRACE_SERVER_MAX_CLIENTS; index++) {
+		TraceClient* client = &server->clients[index];
+		if ((client->fd >= 0) && (client->length > 0) && !client->waitingWrite) SendQueued(server, client);
+	}
+}
+
+static void Accept(TraceServer* server)
+{
+	struct epoll_event event;
+	int index;
+
+	int fd = accept4(server->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) return;
+
+	for (index = 0; index < TRACE_SERVER_MAX_CLIENTS; index++) {
+		if (server->clients[index].fd < 0) break;
+	}
+
+	unsigned char* queue = (index < TRACE_SERVER_MAX_CLIENTS) ? malloc(server->queueSize) : NULL;
+	if (queue == NULL) {
+		printf("Trace client refused\n");
+		close(fd);
+		return;
+	}
+
+	TraceClient* client = &server->clients[index];
+	memset(client, 0, sizeof(TraceClient));
+	client->fd = fd;
+	client->queue = queue;
+	client->stream = TRACE_SERVER_ALL;
+	server->streamClients[StreamIndex(client->stream)]++;
+
+	event.events = EPOLLIN;
+	event.data.u32 = index;
+	epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event);
+	printf("Trace client %d connected\n", index);
+}
+
+static void Command(TraceServer* server, TraceClient* client, const char* command)
+{
+	int stream;
+	unsigned int port;
+
+	if (strcmp(command, "all") == 0) stream = TRACE_SERVER_ALL;
+	else if (strcmp(command, "raw") == 0) stream = TRACE_SERVER_RAW;
+	else if ((sscanf(command, "port %u", &port) == 1) && (port < ITM_PORTS)) stream = port;
+	else {
+		char reply[TRACE_SERVER_REPLY_SIZE];
+		if ((server->control != NULL) && (server->control(server->controlContext, command, reply, sizeof(reply)) == 0)) {
+			Enqueue(server, client, (unsigned char*) reply, strlen(reply));
+			if ((client->fd >= 0) && !client->waitingWrite) SendQueued(server, client);
+		}
+		return;
+	}
+
+	server->streamClients[StreamIndex(client->stream)]--;
+	client->stream = stream;
+	server->streamClients[StreamIndex(client->stream)]++;
+}
+
+static void Receive(TraceServer* server, TraceClient* client)
+{
+	char data[256];
+	ssize_t count = recv(client->fd, data, sizeof(data), MSG_DONTWAIT);
+	ssize_t i;
+
+	if (count == 0 || ((count < 0) && (errno != EAGAIN) && (errno != EINTR))) {
+		CloseClient(server, client);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((data[i] == '\n') || (data[i] == '\r')) {
+			client->command[client->commandLength] = '\0';
+			if (client->commandLength > 0) Command(server, client, client->command);
+			client->commandLength = 0;
+			// the reply to the command may have failed and closed the client
+			if (client->fd < 0) return;
+		}
+		else if (client->commandLength < sizeof(client->command) - 1) {
+			client->command[client->commandLength++] = data[i];
+		}
+	}
+}
+
+/*
+ * New connections, client commands and writable sockets - never blocks
+ */
+void TraceServerService(TraceServer* server)
+{
+	struct epoll_event events[16];
+	int count, i;
+
+	if (server->listenFd < 0) return;
+
+	count = epoll_wait(server->epollFd, events, 16, 0);
+	for (i = 0; i < count; i++) {
+		if (events[i].data.u32 == LISTEN_INDEX) {
+			Accept(server);
+			continue;
+		}
+
+		TraceClient* client = &server->clients[events[i].data.u32];
+		if (client->fd < 0) continue;
+
+		if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+			CloseClient(server, client);
+			continue;
+		}
+		if (events[i].events & EPOLLIN) Receive(server, client);
+		if ((client->fd >= 0) && (events[i].events & EPOLLOUT)) SendQueued(server, client);
+	}
+}
+
+void TraceServerClose(TraceServer* server)
+{
+	int index;
+
+	if (server->listenFd < 0) return;
+
+	for (index = 0; index < TRACE_SERVER_MAX_CLIENTS; index++) {
+		if (server->clients[index].fd >= 0) CloseClient(server, &server->clients[index]);
+	}
+	close(server->epollFd);
+	close(server->listenFd);
+	server->listenFd = -1;
+}
@@ -0,0 +1,71 @@
+/*
+ * trace-server.h
+ *
+ * Streams the live trace to any number of local clients over TCP or a Unix domain socket.
+ *
+ * A client selects its stream by sending one line (it can be changed at any time):
+ *   all       stimulus port data from every port, as written to trace.txt (the default)
+ *   raw       the raw SWO bytes, as written to trace-full.txt
+ *   port N    stimulus port N only
+ * Other lines go to the control callback when one is set (the port control commands of
+ * port-control.h); its reply line is queued to the client in its stream.
+ *
+ * Sockets are non-blocking and serviced with epoll from the capture loop. Each client has
+ * a bounded queue; when a client does not keep up its new data is either dropped or the
+ * client is disconnected, so a stalled client never delays the trace reads.
+ */
+
+#ifndef TRACE_SERVER_H_
+#define TRACE_SERVER_H_
+
+#include <stddef.h>
+#include "itm-decode.h"
+
+#define TRACE_SERVER_MAX_CLIENTS    64
+#define TRACE_SERVER_QUEUE_SIZE     (256 * 1024)
+#define TRACE_SERVER_STAGE_SIZE     4096
+#define TRACE_SERVER_REPLY_SIZE     1024
+
+#define TRACE_SERVER_ALL            -1
+#define TRACE_SERVER_RAW            -2
+
+#define TRACE_SERVER_DROP           0	// slow client policy
+#define TRACE_SERVER_DISCONNECT     1
+
+typedef struct {
+	int fd;						// -1 if unused
+	int stream;					// TRACE_SERVER_ALL, TRACE_SERVER_RAW or a port
+	unsigned char* queue;
+	size_t head;
+	size_t length;
+	char command[64];
+	size_t commandLength;
+	int waitingWrite;			// EPOLLOUT registered
+	unsigned long long sentBytes;
+	unsigned long long droppedBytes;
+} TraceClient;
+
+typedef struct {
+	int listenFd;
+	int epollFd;
+	int policy;
+	size_t queueSize;
+	TraceClient clients[TRACE_SERVER_MAX_CLIENTS];
+	int streamClients[ITM_PORTS + 2];	// clients per stream, indexed by stream + 2
+	unsigned char stage[ITM_PORTS + 1][TRACE_SERVER_STAGE_SIZE];	// decoded data since the last flush, [ITM_PORTS] = all
+	size_t stageLength[ITM_PORTS + 1];
+	unsigned long long droppedBytes;
+	unsigned long long disconnects;
+	// optional, returns 0 and a reply line for a command it handles
+	int (*control)(void* context, const char* command, char* reply, size_t replySize);
+	void* controlContext;
+} TraceServer;
+
+int TraceServerOpen(TraceServer* server, const char* address, size_t queueSize, int policy);
+void TraceServerRaw(TraceServer* server, const unsigned char* data, size_t length);
+void TraceServerTap(void* context, int port, const unsigned char* data, size_t length);
+void TraceServerFlush(TraceServer* server);
+void TraceServerService(TraceServer* server);
+void TraceServerClose(TraceServer* server);
+
+#endif /* TRACE_SERVER_H_ */
@@ -0,0 +1,131 @@
+/*
+ * trace-sink.c
+ *
+ * Trace output sinks and the per-port demux (see trace-sink.h).
+ * Sinks buffer their output and only write it out when the buffer fills or on flush,
+ * so a 1 byte ITM packet costs a copy rather than a stdio call.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "trace-sink.h"
+
+static void BufferedWrite(TraceSink* sink, const unsigned char* data, size_t length)
+{
+	while (length > 0) {
+		size_t chunk = TRACE_SINK_BUFFER_SIZE - sink->length;
+		if (chunk > length) chunk = length;
+
+		if (sink->printable) {
+			size_t i;
+			for (i = 0; i < chunk; i++) {
+				unsigned char ch = data[i];
+				sink->buffer[sink->length + i] = ((ch < 32) && (ch != '\n') && (ch != '\r') && (ch != '\t')) || (ch > 126) ? '.' : ch;
+			}
+		}
+		else {
+			memcpy(&sink->buffer[sink->length], data, chunk);
+		}
+
+		sink->length += chunk;
+		data += chunk;
+		length -= chunk;
+		if (sink->length == TRACE_SINK_BUFFER_SIZE) {
+			fwrite(&sink->buffer[0], 1, sink->length, sink->file);
+			sink->length = 0;
+		}
+	}
+}
+
+static void BufferedFlush(TraceSink* sink)
+{
+	if (sink->length > 0) fwrite(&sink->buffer[0], 1, sink->length, sink->file);
+	sink->length = 0;
+	fflush(sink->file);
+}
+
+static void FileClose(TraceSink* sink)
+{
+	BufferedFlush(sink);
+	fclose(sink->file);
+	sink->file = NULL;
+}
+
+static void StreamClose(TraceSink* sink)
+{
+	BufferedFlush(sink);
+}
+
+static void NullWrite(TraceSink* sink, const unsigned char* data, size_t length)
+{
+}
+
+static void NullFlush(TraceSink* sink)
+{
+}
+
+int FileSinkOpen(TraceSink* sink, const char* filename)
+{
+	FILE* file = fopen(filename, "w+");	// create or overwrite
+
+	if (file == NULL) {
+		printf("Unable to open %s\n", filename);
+		return -1;
+	}
+
+	StreamSinkOpen(sink, file, 0);
+	sink->close = FileClose;
+	return 0;
+}
+
+void StreamSinkOpen(TraceSink* sink, FILE* file, int printable)
+{
+	sink->write = BufferedWrite;
+	sink->flush = BufferedFlush;
+	sink->close = StreamClose;
+	sink->file = file;
+	sink->printable = printable;
+	sink->length = 0;
+}
+
+void NullSinkOpen(TraceSink* sink)
+{
+	sink->write = NullWrite;
+	sink->flush = NullFlush;
+	sink->close = NullFlush;
+	sink->file = NULL;
+	sink->length = 0;
+}
+
+/*
+ * ItmDecoder callback - stimulus port payloads go to the sinks, DWT packets to the hardware callback,
+ * everything else is dropped
+ */
+void TraceDemuxRecord(void* context, const ItmRecord* record)
+{
+	TraceDemux* demux = context;
+
+	if ((record->type == ITM_RECORD_HARDWARE) && (demux->hardware != NULL)) demux->hardware(demux->hardwareContext, record);
+	if (record->type != ITM_RECORD_STIMULUS) return;
+
+	demux->portBytes[record->port] += record->size;
+	demux->portPackets[record->port]++;
+	// the tap goes first so that a trigger can act on the packet that completes its match
+	if (demux->tap != NULL) demux->tap(demux->tapContext, record->port, &record->payload[0], record->size);
+	if (!(demux->binaryPorts & (1U << record->port))) {
+		if (demux->all != NULL) demux->all->write(demux->all, &record->payload[0], record->size);
+		if (demux->screen != NULL) demux->screen->write(demux->screen, &record->payload[0], record->size);
+	}
+	if (demux->ports[record->port] != NULL) demux->ports[record->port]->write(demux->ports[record->port], &record->payload[0], record->size);
+}
+
+void TraceDemuxFlush(TraceDemux* demux)
+{
+	int port;
+
+	if (demux->all != NULL) demux->all->flush(demux->all);
+	if (demux->screen != NULL) demux->screen->flush(demux->screen);
+	for (port = 0; port < ITM_PORTS; port++) {
+		if (demux->ports[port] != NULL) demux->ports[port]->flush(demux->ports[port]);
+	}
+}
@@ -0,0 +1,50 @@
+/*
+ * trace-sink.h
+ *
+ * Output sinks for the trace data, and the per-port demux that routes decoded
+ * stimulus port payloads to them.
+ */
+
+#ifndef TRACE_SINK_H_
+#define TRACE_SINK_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include "itm-decode.h"
+
+#define TRACE_SINK_BUFFER_SIZE  65536
+
+typedef struct TraceSink {
+	void (*write)(struct TraceSink* sink, const unsigned char* data, size_t length);
+	void (*flush)(struct TraceSink* sink);
+	void (*close)(struct TraceSink* sink);
+	FILE* file;
+	int printable;			// replace non-printable characters with '.'
+	void* context;			// sink specific state
+	size_t length;
+	unsigned char buffer[TRACE_SINK_BUFFER_SIZE];
+} TraceSink;
+
+typedef struct {
+	TraceSink* all;					// payload of every stimulus port
+	TraceSink* screen;				// as all, NULL while not displayed
+	TraceSink* ports[ITM_PORTS];	// per-port outputs
+	unsigned long long portBytes[ITM_PORTS];
+	unsigned long long portPackets[ITM_PORTS];	// with portBytes, the SWO bytes used by each port
+	uint32_t binaryPorts;			// ports not written to all and screen (e.g. the binlog port)
+	// optional, called with the payload of every stimulus packet
+	void (*tap)(void* context, int port, const unsigned char* data, size_t length);
+	void* tapContext;
+	// optional, called with every hardware (DWT) packet
+	void (*hardware)(void* context, const ItmRecord* record);
+	void* hardwareContext;
+} TraceDemux;
+
+int FileSinkOpen(TraceSink* sink, const char* filename);
+void StreamSinkOpen(TraceSink* sink, FILE* file, int printable);
+void NullSinkOpen(TraceSink* sink);
+
+void TraceDemuxRecord(void* context, const ItmRecord* record);
+void TraceDemuxFlush(TraceDemux* demux);
+
+#endif /* TRACE_SINK_H_ */
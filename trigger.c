@@ -0,0 +1,502 @@
+/*
+ * trigger.c
+ *
+ * Pattern triggers (see trigger.h).
+ *
+ * Each rule is compiled into a list of items. A position is the number of items of a rule
+ * matched so far, and the set of positions that are live after a byte is a state of the
+ * matching NFA. The subset construction turns the sets reachable from the start set into
+ * DFA states, with the start set added after every byte so a match can begin anywhere.
+ * For literal patterns this gives the Aho-Corasick automaton.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "trigger.h"
+
+#define SET_WORDS       (TRIGGER_MAX_POSITIONS / 64)
+#define HASH_SIZE       (2 * TRIGGER_MAX_STATES)
+
+extern char** environ;
+
+typedef struct {
+	uint64_t bits[SET_WORDS];
+} PositionSet;
+
+static const char* actionNames[] = {"start", "stop", "window", "exec", "count"};
+
+static void AddPosition(PositionSet* set, int position)
+{
+	set->bits[position >> 6] |= 1ULL << (position & 63);
+}
+
+static int HasPosition(const PositionSet* set, int position)
+{
+	return (set->bits[position >> 6] >> (position & 63)) & 1;
+}
+
+static int HasByte(const TriggerItem* item, int byte)
+{
+	return (item->set[byte >> 3] >> (byte & 7)) & 1;
+}
+
+/*
+ * One pattern character, with escapes - returns -1 at the end of the pattern
+ */
+static int ParseChar(const char** pattern)
+{
+	const char* pos = *pattern;
+	int ch = (unsigned char)*pos++;
+
+	if (ch == '\\') {
+		ch = (unsigned char)*pos++;
+		if (ch == 'n') ch = '\n';
+		else if (ch == 't') ch = '\t';
+		else if (ch == 'r') ch = '\r';
+		else if ((ch == 'x') && pos[0] && pos[1]) {
+			char hex[3] = {pos[0], pos[1], 0};
+			ch = strtoul(hex, NULL, 16);
+			pos += 2;
+		}
+	}
+	if (ch == 0) return -1;
+
+	*pattern = pos;
+	return ch;
+}
+
+/*
+ * One item: a character, '.' or a [class] - returns the rest of the pattern, NULL if invalid
+ */
+static const char* ParseItem(const char* pos, TriggerItem* item)
+{
+	int ch, last;
+
+	memset(item, 0, sizeof(TriggerItem));
+	if (*pos == '.') {
+		memset(item->set, 0xFF, sizeof(item->set));
+		return pos + 1;
+	}
+
+	if (*pos != '[') {
+		ch = ParseChar(&pos);
+		if (ch < 0) return NULL;
+		item->set[ch >> 3] |= 1 << (ch & 7);
+		return pos;
+	}
+
+	pos++;
+	int negate = (*pos == '^');
+	if (negate) pos++;
+	int first = 1;
+	while (*pos && ((*pos != ']') || first)) {
+		ch = last = ParseChar(&pos);
+		if (ch < 0) return NULL;
+		if ((pos[0] == '-') && pos[1] && (pos[1] != ']')) {
+			pos++;
+			last = ParseChar(&pos);
+			if (last < 0) return NULL;
+		}
+		for (; ch <= last; ch++) item->set[ch >> 3] |= 1 << (ch & 7);
+		first = 0;
+	}
+	if (*pos != ']') return NULL;
+
+	if (negate) {
+		int index;
+		for (index = 0; index < (int)sizeof(item->set); index++) item->set[index] = ~item->set[index];
+	}
+	return pos + 1;
+}
+
+static int CompileRule(Trigger* trigger, TriggerRule* rule)
+{
+	const char* pos = rule->pattern;
+
+	rule->first = trigger->positionCount;
+	rule->length = 0;
+	while (*pos) {
+		TriggerItem item;
+		int copies = 1, copy;
+
+		if ((*pos == '*') || (*pos == '+') || (*pos == '?') || ((pos = ParseItem(pos, &item)) == NULL)) {
+			printf("Invalid trigger pattern %s\n", rule->pattern);
+			return -1;
+		}
+		if ((*pos == '*') || (*pos == '?')) item.repeat = *pos++;
+		else if (*pos == '+') {
+			copies = 2;
+			pos++;
+		}
+
+		for (copy = 0; copy < copies; copy++) {
+			// room for this item and the match position
+			if (trigger->positionCount + 2 > TRIGGER_MAX_POSITIONS) {
+				printf("Trigger patterns are too long\n");
+				return -1;
+			}
+			trigger->items[trigger->positionCount] = item;
+			if (copy == 1) trigger->items[trigger->positionCount].repeat = '*';
+			trigger->positionCount++;
+			rule->length++;
+		}
+	}
+
+	trigger->positionCount++;	// match position
+	return 0;
+}
+
+/*
+ * Add the positions reachable by skipping optional items
+ */
+static void Closure(const Trigger* trigger, PositionSet* set)
+{
+	int index, item;
+
+	for (index = 0; index < trigger->ruleCount; index++) {
+		const TriggerRule* rule = &trigger->rules[index];
+		for (item = rule->first; item < rule->first + rule->length; item++) {
+			if (trigger->items[item].repeat && HasPosition(set, item)) AddPosition(set, item + 1);
+		}
+	}
+}
+
+static void Step(const Trigger* trigger, const PositionSet* from, int byte, const PositionSet* start, PositionSet* to)
+{
+	int index, item;
+
+	*to = *start;
+	for (index = 0; index < trigger->ruleCount; index++) {
+		const TriggerRule* rule = &trigger->rules[index];
+		for (item = rule->first; item < rule->first + rule->length; item++) {
+			if (!HasPosition(from, item) || !HasByte(&trigger->items[item], byte)) continue;
+			AddPosition(to, item + 1);
+			if (trigger->items[item].repeat == '*') AddPosition(to, item);
+		}
+	}
+	Closure(trigger, to);
+}
+
+static unsigned int HashSet(const PositionSet* set)
+{
+	unsigned int hash = 2166136261U;
+	const unsigned char* bytes = (const unsigned char*)set;
+	size_t index;
+
+	for (index = 0; index < sizeof(PositionSet); index++) hash = (hash ^ bytes[index]) * 16777619U;
+	return hash;
+}
+
+/*
+ * Subset construction - returns -1 if the patterns need more than TRIGGER_MAX_STATES states
+ */
+static int BuildDfa(Trigger* trigger)
+{
+	PositionSet* sets = malloc(TRIGGER_MAX_STATES * sizeof(PositionSet));
+	int* table = malloc(HASH_SIZE * sizeof(int));
+	PositionSet start, next;
+	int state, byte, index, result = 0;
+
+	trigger->next = malloc(TRIGGER_MAX_STATES * sizeof(*trigger->next));
+	trigger->accept = calloc(TRIGGER_MAX_STATES, sizeof(uint32_t));
+	if ((sets == NULL) || (table == NULL) || (trigger->next == NULL) || (trigger->accept == NULL)) {
+		free(sets);
+		free(table);
+		return -1;
+	}
+	for (index = 0; index < HASH_SIZE; index++) table[index] = -1;
+
+	memset(&start, 0, sizeof(start));
+	for (index = 0; index < trigger->ruleCount; index++) AddPosition(&start, trigger->rules[index].first);
+	Closure(trigger, &start);
+
+	sets[0] = start;
+	table[HashSet(&start) % HASH_SIZE] = 0;
+	trigger->stateCount = 1;
+
+	for (state = 0; (state < trigger->stateCount) && (result == 0); state++) {
+		for (index = 0; index < trigger->ruleCount; index++) {
+			const TriggerRule* rule = &trigger->rules[index];
+			if (HasPosition(&sets[state], rule->first + rule->length)) trigger->accept[state] |= 1U << index;
+		}
+
+		for (byte = 0; byte < 256; byte++) {
+			Step(trigger, &sets[state], byte, &start, &next);
+
+			unsigned int slot = HashSet(&next) % HASH_SIZE;
+			while ((table[slot] >= 0) && (memcmp(&sets[table[slot]], &next, sizeof(next)) != 0)) slot = (slot + 1) % HASH_SIZE;
+			if (table[slot] < 0) {
+				if (trigger->stateCount == TRIGGER_MAX_STATES) {
+					printf("Trigger patterns need more than %d states\n", TRIGGER_MAX_STATES);
+					result = -1;
+					break;
+				}
+				sets[trigger->stateCount] = next;
+				table[slot] = trigger->stateCount++;
+			}
+			trigger->next[state][byte] = table[slot];
+		}
+	}
+
+	free(table);
+	free(sets);
+	return result;
+}
+
+/*
+ * Parse action[@port][=argument]:pattern
+ */
+int TriggerAdd(Trigger* trigger, char* spec)
+{
+	TriggerRule* rule = &trigger->rules[trigger->ruleCount];
+	char* colon = strchr(spec, ':');
+	int action;
+
+	if (trigger->ruleCount == TRIGGER_MAX_RULES) {
+		printf("Too many triggers (%d)\n", TRIGGER_MAX_RULES);
+		return -1;
+	}
+	if ((colon == NULL) || (colon[1] == '\0')) {
+		printf("Invalid trigger %s\n", spec);
+		return -1;
+	}
+
+	memset(rule, 0, sizeof(TriggerRule));
+	*colon = '\0';
+	rule->pattern = colon + 1;
+	rule->port = -1;
+
+	char* equals = strchr(spec, '=');
+	if (equals != NULL) {
+		*equals = '\0';
+		rule->argument = equals + 1;
+	}
+	char* at = strchr(spec, '@');
+	if (at != NULL) {
+		*at = '\0';
+		rule->port = strtoul(at + 1, NULL, 0);
+		if (rule->port >= ITM_PORTS) rule->port = -2;
+	}
+
+	for (action = 0; action <= TRIGGER_COUNT; action++) {
+		if (strcmp(spec, actionNames[action]) == 0) break;
+	}
+	if ((action > TRIGGER_COUNT) || (rule->port == -2) || ((action == TRIGGER_EXEC) && (rule->argument == NULL))) {
+		printf("Invalid trigger %s:%s\n", spec, rule->pattern);
+		return -1;
+	}
+	rule->action = action;
+	trigger->ruleCount++;
+	return 0;
+}
+
+static void Marker(Trigger* trigger, const TriggerRule* rule, int port)
+{
+	char text[256];
+	int length = snprintf(text, sizeof(text), "\n>>> TRIGGER %s '%s' on port %d <<<\n", actionNames[rule->action], rule->pattern, port);
+
+	if (length > (int)sizeof(text) - 1) length = sizeof(text) - 1;
+	trigger->output->write(trigger->output, (unsigned char*)text, length);
+}
+
+/*
+ * Write history positions [from, to) to the output
+ */
+static void WriteHistory(Trigger* trigger, unsigned long long from, unsigned long long to)
+{
+	while (from < to) {
+		size_t offset = from % trigger->preSize;
+		size_t chunk = trigger->preSize - offset;
+		if (chunk > to - from) chunk = to - from;
+		trigger->output->write(trigger->output, &trigger->history[offset], chunk);
+		from += chunk;
+	}
+	trigger->outputPosition = to;
+}
+
+static void OpenWindow(Trigger* trigger, const TriggerRule* rule, int port)
+{
+	trigger->windows++;
+
+	// the part of the pre-trigger history that has not been written yet
+	if (!trigger->writing && (trigger->history != NULL)) {
+		unsigned long long from = (trigger->historyWritten > trigger->preSize) ? trigger->historyWritten - trigger->preSize : 0;
+		if (from < trigger->outputPosition) from = trigger->outputPosition;
+		WriteHistory(trigger, from, trigger->historyWritten);
+	}
+	Marker(trigger, rule, port);
+	trigger->postRemaining = trigger->postSize;
+}
+
+static void Exec(TriggerRule* rule, int port)
+{
+	char portText[16];
+	char* argv[] = {"sh", "-c", rule->argument, NULL};
+	int status;
+
+	// one command per trigger at a time
+	if ((rule->child > 0) && (waitpid(rule->child, &status, WNOHANG) == 0)) return;
+
+	snprintf(portText, sizeof(portText), "%d", port);
+	setenv("TRIGGER_PATTERN", rule->pattern, 1);
+	setenv("TRIGGER_PORT", portText, 1);
+	if (posix_spawn(&rule->child, "/bin/sh", NULL, NULL, argv, environ) != 0) {
+		printf("Unable to run %s\n", rule->argument);
+		rule->child = 0;
+	}
+}
+
+static void Fire(Trigger* trigger, int port, uint32_t matched)
+{
+	int index;
+
+	for (index = 0; index < trigger->ruleCount; index++) {
+		TriggerRule* rule = &trigger->rules[index];
+		if (!(matched & (1U << index)) || ((rule->port >= 0) && (rule->port != port))) continue;
+
+		rule->matches++;
+		switch (rule->action) {
+		case TRIGGER_START:
+			if (!trigger->writing) Marker(trigger, rule, port);
+			trigger->writing = 1;
+			break;
+		case TRIGGER_STOP:
+			if (trigger->writing) Marker(trigger, rule, port);
+			trigger->writing = 0;
+			break;
+		case TRIGGER_WINDOW:
+			OpenWindow(trigger, rule, port);
+			break;
+		case TRIGGER_EXEC:
+			Exec(rule, port);
+			break;
+		}
+	}
+}
+
+/*
+ * Sink given to the demux in place of the trace file - passes on what the triggers allow
+ * and keeps the pre-trigger history
+ */
+static void GateWrite(TraceSink* sink, const unsigned char* data, size_t length)
+{
+	Trigger* trigger = sink->context;
+	size_t written = 0;
+
+	if (trigger->writing) written = length;
+	else if (trigger->postRemaining > 0) written = (length < trigger->postRemaining) ? length : trigger->postRemaining;
+	if (written > 0) {
+		trigger->output->write(trigger->output, data, written);
+		if (!trigger->writing) trigger->postRemaining -= written;
+		trigger->outputPosition = trigger->historyWritten + written;
+	}
+
+	if (trigger->history != NULL) {
+		const unsigned char* pos = data;
+		size_t remaining = length;
+		if (remaining > trigger->preSize) {
+			pos += remaining - trigger->preSize;
+			remaining = trigger->preSize;
+		}
+		unsigned long long position = trigger->historyWritten + length - remaining;
+		while (remaining > 0) {
+			size_t offset = position % trigger->preSize;
+			size_t chunk = trigger->preSize - offset;
+			if (chunk > remaining) chunk = remaining;
+			memcpy(&trigger->history[offset], pos, chunk);
+			pos += chunk;
+			position += chunk;
+			remaining -= chunk;
+		}
+	}
+	trigger->historyWritten += length;
+}
+
+static void GateFlush(TraceSink* sink)
+{
+	Trigger* trigger = sink->context;
+
+	trigger->output->flush(trigger->output);
+}
+
+static void GateClose(TraceSink* sink)
+{
+	// the output is closed by its owner
+}
+
+int TriggerOpen(Trigger* trigger, TraceSink* output, size_t preSize, size_t postSize)
+{
+	int index, window = 0, start = 0;
+
+	for (index = 0; index < trigger->ruleCount; index++) {
+		if (CompileRule(trigger, &trigger->rules[index]) != 0) return -1;
+		if (trigger->rules[index].action == TRIGGER_WINDOW) window = 1;
+		if (trigger->rules[index].action == TRIGGER_START) start = 1;
+	}
+	if (BuildDfa(trigger) != 0) return -1;
+
+	// a pattern that matches empty text would fire on every byte
+	if (trigger->accept[0] != 0) {
+		printf("Trigger pattern matches empty text\n");
+		return -1;
+	}
+
+	trigger->output = output;
+	trigger->writing = !(window || start);
+	trigger->preSize = preSize;
+	trigger->postSize = postSize;
+	if (window && (preSize > 0)) {
+		trigger->history = malloc(preSize);
+		if (trigger->history == NULL) return -1;
+	}
+
+	trigger->sink.write = GateWrite;
+	trigger->sink.flush = GateFlush;
+	trigger->sink.close = GateClose;
+	trigger->sink.file = NULL;
+	trigger->sink.printable = 0;
+	trigger->sink.length = 0;
+	trigger->sink.context = trigger;
+
+	printf("%d triggers, %d DFA states, trace file %s\n", trigger->ruleCount, trigger->stateCount, trigger->writing ? "open" : "closed");
+	return 0;
+}
+
+/*
+ * Demux tap - runs the DFA over the data of a port
+ */
+void TriggerTap(void* context, int port, const unsigned char* data, size_t length)
+{
+	Trigger* trigger = context;
+	unsigned int state = trigger->state[port];
+	size_t pos;
+
+	for (pos = 0; pos < length; pos++) {
+		state = trigger->next[state][data[pos]];
+		if (trigger->accept[state]) Fire(trigger, port, trigger->accept[state]);
+	}
+	trigger->state[port] = state;
+}
+
+void TriggerClose(Trigger* trigger)
+{
+	int index, status;
+
+	if (trigger->next == NULL) return;
+
+	for (index = 0; index < trigger->ruleCount; index++) {
+		TriggerRule* rule = &trigger->rules[index];
+		printf("Trigger %s '%s': %llu matches\n", actionNames[rule->action], rule->pattern, rule->matches);
+		if (rule->child > 0) waitpid(rule->child, &status, WNOHANG);
+	}
+	if (trigger->history != NULL) printf("Trigger windows written: %llu\n", trigger->windows);
+
+	free(trigger->next);
+	free(trigger->accept);
+	free(trigger->history);
+	trigger->next = NULL;
+	trigger->history = NULL;
+}
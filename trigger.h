@@ -0,0 +1,90 @@
+/*
+ * trigger.h
+ *
+ * Trigger engine: watches the decoded stimulus data of every port for a set of patterns
+ * and controls what is written to the trace file.
+ *
+ * A trigger is given as action[@port][=argument]:pattern
+ *   start:BOOT            start writing the trace file
+ *   stop:SHUTDOWN         stop writing
+ *   window@0:HardFault    write the TRIGGER_PRE_SIZE bytes before the match and the
+ *                         TRIGGER_POST_SIZE bytes after it
+ *   exec=./notify.sh:ASSERT  run a shell command (TRIGGER_PATTERN and TRIGGER_PORT are set)
+ *   count:retry           only count the matches
+ * The trace file starts closed if there is a start or window trigger, otherwise open.
+ *
+ * Patterns are literal text with
+ *   .  any byte     [a-z0-9] [^\n] byte classes     \n \t \r \. \[ ... escapes
+ *   *  +  ?         repeat the preceding item
+ * and match anywhere in the data of a port. All the patterns are compiled into one DFA,
+ * so each byte costs a table lookup whatever the number of patterns.
+ */
+
+#ifndef TRIGGER_H_
+#define TRIGGER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "itm-decode.h"
+#include "trace-sink.h"
+
+#define TRIGGER_MAX_RULES       32
+#define TRIGGER_MAX_POSITIONS   512		// pattern items of all the rules
+#define TRIGGER_MAX_STATES      4096
+#define TRIGGER_PRE_SIZE        (64 * 1024)
+#define TRIGGER_POST_SIZE       (64 * 1024)
+
+#define TRIGGER_START           0
+#define TRIGGER_STOP            1
+#define TRIGGER_WINDOW          2
+#define TRIGGER_EXEC            3
+#define TRIGGER_COUNT           4
+
+// one pattern item: the bytes it matches and its repeat (0, '*' or '?' - '+' is compiled as x x*)
+typedef struct {
+	uint8_t set[32];
+	uint8_t repeat;
+} TriggerItem;
+
+typedef struct {
+	char* pattern;
+	int action;
+	int port;					// -1 = any port
+	char* argument;				// exec command
+	unsigned long long matches;
+	pid_t child;				// running exec command
+	// compiled items
+	int first;					// position of the first item
+	int length;					// number of items - position first + length is the match
+} TriggerRule;
+
+typedef struct {
+	TriggerRule rules[TRIGGER_MAX_RULES];
+	int ruleCount;
+	TriggerItem items[TRIGGER_MAX_POSITIONS];
+	int positionCount;
+	// DFA
+	uint16_t (*next)[256];
+	uint32_t* accept;			// rules matched on entering a state
+	int stateCount;
+	uint16_t state[ITM_PORTS];
+	// trace file gate
+	TraceSink sink;				// passed to the demux in place of output
+	TraceSink* output;
+	int writing;
+	size_t preSize;
+	size_t postSize;
+	size_t postRemaining;
+	unsigned char* history;		// last preSize bytes given to sink
+	unsigned long long historyWritten;
+	unsigned long long outputPosition;	// history position written to output
+	unsigned long long windows;
+} Trigger;
+
+int TriggerAdd(Trigger* trigger, char* spec);
+int TriggerOpen(Trigger* trigger, TraceSink* output, size_t preSize, size_t postSize);
+void TriggerTap(void* context, int port, const unsigned char* data, size_t length);
+void TriggerClose(Trigger* trigger);
+
+#endif /* TRIGGER_H_ */
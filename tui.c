@@ -0,0 +1,367 @@
+/*
+ * tui.c
+ *
+ * ncurses dashboard (see tui.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ncurses.h>
+#include "tui.h"
+
+// DHCSR status bits
+#define DHCSR_S_HALT        (1 << 17)
+#define DHCSR_S_SLEEP       (1 << 18)
+#define DHCSR_S_LOCKUP      (1 << 19)
+#define DHCSR_S_RESET_ST    (1 << 25)
+
+static SCREEN* screen = NULL;
+static FILE* terminal = NULL;
+static int savedStdout = -1;
+
+// render thread state
+typedef struct {
+	int port;
+	int top;
+	int height;
+	unsigned long long lastWritten;
+	double rate;
+} Pane;
+
+static unsigned long long GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static const char* CoreState(uint32_t dhcsr)
+{
+	if (dhcsr & DHCSR_S_LOCKUP) return "LOCKED UP";
+	if (dhcsr & DHCSR_S_HALT) return "halted";
+	if (dhcsr & DHCSR_S_SLEEP) return "sleeping";
+	return "running";
+}
+
+/*
+ * Append to the history of a port - called with the lock held
+ */
+static void AddHistory(Tui* tui, int port, const unsigned char* data, size_t length)
+{
+	if (length > TUI_HISTORY_SIZE) {
+		data += length - TUI_HISTORY_SIZE;
+		tui->written[port] += length - TUI_HISTORY_SIZE;
+		length = TUI_HISTORY_SIZE;
+	}
+
+	size_t offset = tui->written[port] & (TUI_HISTORY_SIZE - 1);
+	size_t chunk = TUI_HISTORY_SIZE - offset;
+	if (chunk > length) chunk = length;
+	memcpy(&tui->history[port][offset], data, chunk);
+	memcpy(&tui->history[port][0], data + chunk, length - chunk);
+	tui->written[port] += length;
+	tui->dirty[port] = 1;
+}
+
+/*
+ * Copy the history of a port in order - returns the number of bytes
+ */
+static size_t CopyHistory(Tui* tui, int port, unsigned char* text)
+{
+	unsigned long long written = tui->written[port];
+	size_t length = (written < TUI_HISTORY_SIZE) ? written : TUI_HISTORY_SIZE;
+	size_t start = (written - length) & (TUI_HISTORY_SIZE - 1);
+	size_t chunk = TUI_HISTORY_SIZE - start;
+
+	if (chunk > length) chunk = length;
+	memcpy(text, &tui->history[port][start], chunk);
+	memcpy(text + chunk, &tui->history[port][0], length - chunk);
+	return length;
+}
+
+/*
+ * Draw the last lines of the text that fit in the pane, wrapping long lines
+ */
+static void DrawPane(const Pane* pane, const unsigned char* text, size_t length, int width)
+{
+	int first = 0, count = 0, column = 0;
+	size_t pos;
+
+	// the line buffer is sized by the pane
+	if ((pane->height <= 0) || (width <= 0)) return;
+	char lines[pane->height][width + 1];
+	for (pos = 0; pos <= length; pos++) {
+		int end = (pos == length);
+		unsigned char ch = end ? '\n' : text[pos];
+		char* line = lines[(first + count) % pane->height];
+
+		if (ch == '\r') continue;
+		if ((ch != '\n') && (column < width)) {
+			line[column++] = ((ch < 32) && (ch != '\t')) || (ch > 126) ? '.' : (ch == '\t' ? ' ' : ch);
+			if (column < width) continue;
+		}
+		if (end && (column == 0)) break;
+
+		// line complete
+		line[column] = '\0';
+		column = 0;
+		if (count < pane->height) count++;
+		else first = (first + 1) % pane->height;
+	}
+
+	int row;
+	for (row = 0; row < pane->height; row++) {
+		move(pane->top + row, 0);
+		clrtoeol();
+		if (row < count) addstr(lines[(first + row) % pane->height]);
+	}
+}
+
+/*
+ * Bottom line: the state of every port, the selected one highlighted, and its bandwidth
+ */
+static void DrawPorts(PortControl* ports, int selected)
+{
+	uint32_t enabled = __atomic_load_n(&ports->requestedEnabled, __ATOMIC_RELAXED);
+	uint32_t privileged = __atomic_load_n(&ports->requestedPrivileged, __ATOMIC_RELAXED);
+	int port;
+
+	move(LINES - 1, 0);
+	clrtoeol();
+	addstr(" ports ");
+	for (port = 0; port < ITM_PORTS; port++) {
+		if ((port % 8 == 0) && (port > 0)) addch(' ');
+		if (port == selected) attron(A_REVERSE);
+		addch(!(enabled & (1U << port)) ? '-' : (ports->rate[port] > 0) ? '#' : '+');
+		if (port == selected) attroff(A_REVERSE);
+	}
+	printw("  port %d %s%s %.1f KB/s  (<- -> select, space on/off, p privileged) ", selected,
+			(enabled & (1U << selected)) ? "on" : "off", (privileged & (1U << (selected / 8))) ? " privileged" : "",
+			ports->rate[selected] / 1024);
+}
+
+static int Layout(Pane* panes, int* ports, int portCount)
+{
+	int rows = LINES - 2;	// status line and port line
+	int count = (portCount > TUI_MAX_PANES) ? TUI_MAX_PANES : portCount;
+	int index, top = 1;
+
+	if (count == 0) return 0;
+	for (index = 0; index < count; index++) {
+		int height = rows / count + ((index < rows % count) ? 1 : 0);
+		panes[index].port = ports[index];
+		panes[index].top = top + 1;			// below the title line
+		panes[index].height = height - 1;
+		panes[index].lastWritten = 0;
+		panes[index].rate = 0;
+		top += height;
+	}
+	return count;
+}
+
+static void* RenderThread(void* argument)
+{
+	Tui* tui = argument;
+	unsigned char* text = malloc(TUI_MAX_PANES * TUI_HISTORY_SIZE);
+	size_t lengths[TUI_MAX_PANES];
+	int changed[TUI_MAX_PANES];
+	unsigned long long written[TUI_MAX_PANES];
+	Pane panes[TUI_MAX_PANES];
+	int paneCount = 0, relayout = 1;
+	int activePorts[ITM_PORTS];
+	unsigned long long lastTime = GetTimeNs(), lastBytes = 0;
+	double rate = 0;
+	int selected = 0;
+
+	// without the buffer there is no dashboard - stop as if q was pressed
+	if (text == NULL) {
+		printf("Out of memory for the terminal UI\n");
+		tui->quit = 1;
+		return NULL;
+	}
+
+	while (tui->running) {
+		int key = getch();
+		if ((key == 'q') || (key == 'Q')) tui->quit = 1;
+		if (key == KEY_RESIZE) relayout = 1;
+		if (key == KEY_LEFT) selected = (selected + ITM_PORTS - 1) % ITM_PORTS;
+		if (key == KEY_RIGHT) selected = (selected + 1) % ITM_PORTS;
+		if (key == ' ') PortControlToggle(tui->ports, selected);
+		if (key == 'p') PortControlTogglePrivileged(tui->ports, selected / 8);
+
+		// take a snapshot under the lock - drawing happens after it is released
+		pthread_mutex_lock(&tui->lock);
+		TuiCounters counters = tui->counters;
+		int portCount = 0, port, index;
+		for (port = 0; port < ITM_PORTS; port++) {
+			if (tui->written[port] > 0) activePorts[portCount++] = port;
+		}
+		if ((portCount != paneCount) && (paneCount < TUI_MAX_PANES)) relayout = 1;
+		if (relayout) {
+			paneCount = Layout(panes, activePorts, portCount);
+			for (index = 0; index < paneCount; index++) tui->dirty[panes[index].port] = 1;
+		}
+		for (index = 0; index < paneCount; index++) {
+			port = panes[index].port;
+			changed[index] = tui->dirty[port];
+			written[index] = tui->written[port];
+			if (changed[index]) lengths[index] = CopyHistory(tui, port, &text[index * TUI_HISTORY_SIZE]);
+			tui->dirty[port] = 0;
+		}
+		pthread_mutex_unlock(&tui->lock);
+
+		// rates over about a second
+		unsigned long long now = GetTimeNs();
+		double elapsed = (now - lastTime) / 1e9;
+		if (elapsed >= 1.0) {
+			rate = (counters.traceBytes - lastBytes) / elapsed;
+			for (index = 0; index < paneCount; index++) {
+				panes[index].rate = (written[index] - panes[index].lastWritten) / elapsed;
+				panes[index].lastWritten = written[index];
+				changed[index] = 1;
+			}
+			lastBytes = counters.traceBytes;
+			lastTime = now;
+		}
+
+		if (relayout) erase();
+		relayout = 0;
+
+		// status line - always redrawn, it is short
+		move(0, 0);
+		clrtoeol();
+		attron(A_REVERSE);
+		printw(" SWO %7.1f KB/s  backlog %4u  overflows %llu  junk %llu  bad reads %llu  core %s ",
+				rate / 1024, counters.backlog, counters.overflows, counters.junk, counters.badPackets,
+				counters.dhcsrValid ? CoreState(counters.dhcsr) : "?");
+		attroff(A_REVERSE);
+
+		if (paneCount == 0) mvaddstr(2, 0, "Waiting for trace data... (q to quit)");
+		for (index = 0; index < paneCount; index++) {
+			if (!changed[index]) continue;
+			move(panes[index].top - 1, 0);
+			clrtoeol();
+			attron(A_BOLD);
+			printw("-- port %d  %.1f B/s  %llu bytes ", panes[index].port, panes[index].rate, written[index]);
+			attroff(A_BOLD);
+			if (lengths[index] > 0) DrawPane(&panes[index], &text[index * TUI_HISTORY_SIZE], lengths[index], COLS);
+			lengths[index] = 0;
+		}
+		DrawPorts(tui->ports, selected);
+		refresh();
+
+		usleep(1000000 / TUI_FPS);
+	}
+
+	free(text);
+	return NULL;
+}
+
+/*
+ * Start the dashboard - stdout goes to TUI_LOG_FILE until TuiClose()
+ */
+int TuiOpen(Tui* tui)
+{
+	int log = open(TUI_LOG_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (log < 0) {
+		printf("Unable to open %s\n", TUI_LOG_FILE);
+		return -1;
+	}
+
+	fflush(stdout);
+	savedStdout = dup(STDOUT_FILENO);
+	int terminalFd = (savedStdout >= 0) ? dup(savedStdout) : -1;
+	terminal = (terminalFd >= 0) ? fdopen(terminalFd, "w") : NULL;
+	screen = (terminal != NULL) ? newterm(NULL, terminal, stdin) : NULL;
+	if (screen == NULL) {
+		printf("Unable to start the terminal UI\n");
+		if (terminal != NULL) fclose(terminal);
+		else if (terminalFd >= 0) close(terminalFd);
+		terminal = NULL;
+		if (savedStdout >= 0) close(savedStdout);
+		savedStdout = -1;
+		close(log);
+		return -1;
+	}
+	dup2(log, STDOUT_FILENO);
+	close(log);
+
+	cbreak();
+	noecho();
+	nodelay(stdscr, TRUE);
+	keypad(stdscr, TRUE);
+	curs_set(0);
+
+	pthread_mutex_init(&tui->lock, NULL);
+	tui->running = 1;
+	if (pthread_create(&tui->thread, NULL, RenderThread, tui) != 0) {
+		tui->running = 0;
+		TuiClose(tui);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Demux tap - stages the data, TuiFlush() hands it to the render thread
+ */
+void TuiTap(void* context, int port, const unsigned char* data, size_t length)
+{
+	Tui* tui = context;
+
+	if (tui->stageLength[port] + length > TUI_STAGE_SIZE) {
+		pthread_mutex_lock(&tui->lock);
+		AddHistory(tui, port, tui->stage[port], tui->stageLength[port]);
+		AddHistory(tui, port, data, length);
+		pthread_mutex_unlock(&tui->lock);
+		tui->stageLength[port] = 0;
+		return;
+	}
+	memcpy(&tui->stage[port][tui->stageLength[port]], data, length);
+	tui->stageLength[port] += length;
+}
+
+/*
+ * Called once per poll - one lock for all the data staged since the last call
+ */
+void TuiFlush(Tui* tui, const TuiCounters* counters)
+{
+	int port;
+
+	pthread_mutex_lock(&tui->lock);
+	for (port = 0; port < ITM_PORTS; port++) {
+		if (tui->stageLength[port] == 0) continue;
+		AddHistory(tui, port, tui->stage[port], tui->stageLength[port]);
+		tui->stageLength[port] = 0;
+	}
+	tui->counters = *counters;
+	pthread_mutex_unlock(&tui->lock);
+}
+
+void TuiClose(Tui* tui)
+{
+	if (screen == NULL) return;
+
+	if (tui->running) {
+		tui->running = 0;
+		pthread_join(tui->thread, NULL);
+	}
+	pthread_mutex_destroy(&tui->lock);
+
+	endwin();
+	delscreen(screen);
+	screen = NULL;
+	fclose(terminal);
+
+	// back to the terminal
+	fflush(stdout);
+	dup2(savedStdout, STDOUT_FILENO);
+	close(savedStdout);
+	printf("Trace messages were written to %s\n", TUI_LOG_FILE);
+}
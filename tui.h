@@ -0,0 +1,66 @@
+/*
+ * tui.h
+ *
+ * ncurses dashboard (--tui): a scrolling pane per active stimulus port, rate and loss
+ * counters and the core state from DHCSR.
+ *
+ * The capture loop never draws. TuiTap() copies stimulus data into a per-port stage and
+ * TuiFlush() moves it into the port histories under the lock once per trace read. The
+ * render thread wakes TUI_FPS times a second, copies the history of the ports that changed,
+ * releases the lock and only then draws - so a slow terminal cannot hold up USB reads.
+ * Ports that did not change are not redrawn.
+ *
+ * The bottom line shows the stimulus ports: '#' enabled with traffic, '+' enabled, '-'
+ * disabled, and the selected port's SWO bandwidth. Left/right select a port, space enables
+ * or disables it and p makes its group of 8 ports privileged-only or not (port-control.h).
+ *
+ * stdout is redirected to TUI_LOG_FILE while the dashboard is shown.
+ */
+
+#ifndef TUI_H_
+#define TUI_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "itm-decode.h"
+#include "port-control.h"
+
+#define TUI_FPS             15
+#define TUI_HISTORY_SIZE    16384	// bytes of text kept per port, a power of 2
+#define TUI_STAGE_SIZE      4096
+#define TUI_MAX_PANES       8
+#define TUI_LOG_FILE        "stlink-trace.log"
+
+typedef struct {
+	unsigned long long traceBytes;		// raw SWO bytes
+	unsigned long long overflows;		// ITM overflow packets
+	unsigned long long junk;			// bytes that were not a valid header
+	unsigned long long badPackets;		// trace reads with an invalid byte count
+	unsigned int backlog;				// bytes waiting in the probe
+	uint32_t dhcsr;
+	int dhcsrValid;
+} TuiCounters;
+
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	volatile int running;
+	volatile int quit;					// 'q' pressed
+	PortControl* ports;					// set before TuiOpen()
+	// shared with the render thread, under lock
+	unsigned char history[ITM_PORTS][TUI_HISTORY_SIZE];
+	unsigned long long written[ITM_PORTS];	// total bytes per port, history holds the last TUI_HISTORY_SIZE
+	int dirty[ITM_PORTS];
+	TuiCounters counters;
+	// capture thread only
+	unsigned char stage[ITM_PORTS][TUI_STAGE_SIZE];
+	size_t stageLength[ITM_PORTS];
+} Tui;
+
+int TuiOpen(Tui* tui);
+void TuiTap(void* context, int port, const unsigned char* data, size_t length);
+void TuiFlush(Tui* tui, const TuiCounters* counters);
+void TuiClose(Tui* tui);
+
+#endif /* TUI_H_ */
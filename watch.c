@@ -0,0 +1,275 @@
+/*
+ * watch.c
+ *
+ * Live-watch sampler (see watch.h).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stlink-trace.h"
+#include "watch.h"
+
+static unsigned long long GetTimeNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Add variables from "address:size[:name][:s]" or "symbol[:size][:s]", comma separated -
+ * :s marks a signed value
+ */
+int WatchAdd(Watch* watch, const char* spec, ElfFile* elf)
+{
+	char entry[128];
+	const char* pos = spec;
+
+	while (*pos != '\0') {
+		const char* end = strchr(pos, ',');
+		size_t length = (end != NULL) ? (size_t)(end - pos) : strlen(pos);
+		if (length >= sizeof(entry)) length = sizeof(entry) - 1;
+		memcpy(entry, pos, length);
+		entry[length] = '\0';
+		pos = (end != NULL) ? end + 1 : pos + strlen(pos);
+
+		if (watch->variableCount >= WATCH_MAX_VARIABLES) {
+			printf("Too many watch variables (max %d)\n", WATCH_MAX_VARIABLES);
+			return -1;
+		}
+
+		WatchVariable* variable = &watch->variables[watch->variableCount];
+		length = strlen(entry);
+		variable->isSigned = (length > 2) && (strcmp(&entry[length - 2], ":s") == 0);
+		if (variable->isSigned) entry[length - 2] = '\0';
+		char* field = strchr(entry, ':');
+		if (field != NULL) *field++ = '\0';
+
+		if ((entry[0] >= '0') && (entry[0] <= '9')) {
+			variable->address = strtoul(entry, NULL, 0);
+			variable->size = (field != NULL) ? strtoul(field, &field, 0) : 4;
+			if ((field != NULL) && (*field == ':')) {
+				snprintf(variable->name, WATCH_NAME_LENGTH, "%.47s", field + 1);
+			}
+			else {
+				snprintf(variable->name, WATCH_NAME_LENGTH, "0x%08x", variable->address);
+			}
+		}
+		else {
+			if ((elf == NULL) || (elf->data == NULL)) {
+				printf("Watch symbol %s needs the firmware ELF file (--elf)\n", entry);
+				return -1;
+			}
+			if (ElfFindSymbol(elf, entry, ELF_STT_OBJECT, &variable->address, &variable->size) != 0) {
+				printf("Watch symbol %s not found\n", entry);
+				return -1;
+			}
+			if (field != NULL) variable->size = strtoul(field, NULL, 0);
+			snprintf(variable->name, WATCH_NAME_LENGTH, "%.47s", entry);
+		}
+
+		if ((variable->size == 0) || (variable->size > STLINK_MAX_RW32)) {
+			printf("Invalid size for watch variable %s\n", variable->name);
+			return -1;
+		}
+		watch->variableCount++;
+	}
+
+	return 0;
+}
+
+static int CompareVariables(const void* a, const void* b)
+{
+	const WatchVariable* va = a;
+	const WatchVariable* vb = b;
+
+	if (va->address != vb->address) return (va->address < vb->address) ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Merge the sorted variables into word aligned reads
+ */
+static void WatchPlanReads(Watch* watch)
+{
+	int i;
+
+	qsort(&watch->variables[0], watch->variableCount, sizeof(WatchVariable), CompareVariables);
+
+	watch->readCount = 0;
+	watch->bufferSize = 0;
+	for (i = 0; i < watch->variableCount; i++) {
+		WatchVariable* variable = &watch->variables[i];
+		uint32_t start = variable->address & ~0x03;
+		uint32_t end = (variable->address + variable->size + 3) & ~0x03;
+		WatchRead* read = (watch->readCount > 0) ? &watch->reads[watch->readCount - 1] : NULL;
+
+		if ((read == NULL) || (start > read->address + read->length + WATCH_MERGE_GAP)) {
+			read = &watch->reads[watch->readCount++];
+			read->address = start;
+			read->length = 0;
+		}
+		if (end > read->address + read->length) read->length = end - read->address;
+
+		variable->read = watch->readCount - 1;
+	}
+
+	for (i = 0; i < watch->readCount; i++) {
+		watch->reads[i].bufferOffset = watch->bufferSize;
+		watch->bufferSize += watch->reads[i].length;
+	}
+	for (i = 0; i < watch->variableCount; i++) {
+		WatchRead* read = &watch->reads[watch->variables[i].read];
+		watch->variables[i].offset = read->bufferOffset + (watch->variables[i].address - read->address);
+	}
+}
+
+static void WriteUint32(FILE* file, uint32_t value)
+{
+	unsigned char data[4] = {value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, (value >> 24) & 0xFF};
+	fwrite(&data[0], 1, 4, file);
+}
+
+int WatchOpen(Watch* watch, const char* filename, double rate)
+{
+	int i;
+
+	if (watch->variableCount == 0) return -1;
+	// the sample period is whole nanoseconds
+	if (!(rate > 0) || (rate > 1e9)) {
+		printf("Invalid watch rate %g - needs 0 < rate <= 1e9 Hz\n", rate);
+		return -1;
+	}
+
+	WatchPlanReads(watch);
+	watch->buffer = malloc(watch->bufferSize);
+	if (watch->buffer == NULL) return -1;
+
+	watch->output = fopen(filename, "wb");	// create or overwrite
+	if (watch->output == NULL) {
+		printf("Unable to open watch output %s\n", filename);
+		return -1;
+	}
+
+	size_t length = strlen(filename);
+	watch->csv = (length > 4) && (strcmp(&filename[length - 4], ".csv") == 0);
+
+	if (watch->csv) {
+		fprintf(watch->output, "time_ns");
+		for (i = 0; i < watch->variableCount; i++) fprintf(watch->output, ",%s", watch->variables[i].name);
+		fprintf(watch->output, "\n");
+	}
+	else {
+		fwrite("STWV", 1, 4, watch->output);
+		WriteUint32(watch->output, watch->variableCount);
+		for (i = 0; i < watch->variableCount; i++) {
+			unsigned char nameLength = strlen(watch->variables[i].name);
+			WriteUint32(watch->output, watch->variables[i].address);
+			WriteUint32(watch->output, watch->variables[i].size);
+			fwrite(&nameLength, 1, 1, watch->output);
+			fwrite(watch->variables[i].name, 1, nameLength, watch->output);
+		}
+	}
+
+	watch->requestedRate = rate;
+	watch->periodNs = (unsigned long long)(1000000000.0 / rate);
+	watch->nextSampleNs = GetTimeNs();
+	watch->reportNs = watch->nextSampleNs + WATCH_REPORT_INTERVAL * 1000000000ULL;
+
+	printf("Watching %d variables with %d reads (%u bytes) at %.1f Hz\n", watch->variableCount, watch->readCount, watch->bufferSize, rate);
+	return 0;
+}
+
+static void WatchWriteSample(Watch* watch, unsigned long long time)
+{
+	int i;
+	uint32_t j;
+
+	if (watch->csv) {
+		fprintf(watch->output, "%llu", time);
+		for (i = 0; i < watch->variableCount; i++) {
+			WatchVariable* variable = &watch->variables[i];
+			const unsigned char* value = &watch->buffer[variable->offset];
+			if ((variable->size == 1) || (variable->size == 2) || (variable->size == 4)) {
+				uint32_t number = 0;
+				for (j = 0; j < variable->size; j++) number |= (uint32_t)value[j] << (8 * j);
+				if (variable->isSigned) {
+					// sign extend from the top bit of the value
+					uint32_t sign = 1U << (8 * variable->size - 1);
+					fprintf(watch->output, ",%d", (int32_t)((number ^ sign) - sign));
+				}
+				else {
+					fprintf(watch->output, ",%u", number);
+				}
+			}
+			else {
+				fprintf(watch->output, ",");
+				for (j = 0; j < variable->size; j++) fprintf(watch->output, "%02x", value[j]);
+			}
+		}
+		fprintf(watch->output, "\n");
+	}
+	else {
+		WriteUint32(watch->output, time & 0xFFFFFFFF);
+		WriteUint32(watch->output, time >> 32);
+		for (i = 0; i < watch->variableCount; i++) {
+			fwrite(&watch->buffer[watch->variables[i].offset], 1, watch->variables[i].size, watch->output);
+		}
+	}
+}
+
+/*
+ * Take a sample if one is due. Returns 1 if a sample was taken.
+ */
+int WatchService(Watch* watch)
+{
+	int i;
+
+	if (watch->output == NULL) return 0;
+
+	unsigned long long now = GetTimeNs();
+	if (now >= watch->reportNs) {
+		double seconds = (now - watch->reportNs) / 1e9 + WATCH_REPORT_INTERVAL;
+		printf("Watch: requested %.1f Hz, achieved %.1f Hz, %lu samples late, %lu failed reads\n", watch->requestedRate, watch->samples / seconds,
+				watch->missed, watch->failed);
+		fflush(watch->output);
+		watch->samples = 0;
+		watch->missed = 0;
+		watch->failed = 0;
+		watch->reportNs = now + WATCH_REPORT_INTERVAL * 1000000000ULL;
+	}
+
+	if (now < watch->nextSampleNs) return 0;
+
+	for (i = 0; i < watch->readCount; i++) {
+		if (ReadMemory(watch->reads[i].address, &watch->buffer[watch->reads[i].bufferOffset], watch->reads[i].length) != 0) break;
+	}
+	// the buffer holds old values where a read failed
+	if (i < watch->readCount) {
+		watch->failed++;
+	}
+	else {
+		WatchWriteSample(watch, now);
+		watch->samples++;
+	}
+
+	// keep to the sample grid, but do not try to catch up on samples that were missed
+	watch->nextSampleNs += watch->periodNs;
+	if (watch->nextSampleNs <= now) {
+		watch->missed += (now - watch->nextSampleNs) / watch->periodNs + 1;
+		watch->nextSampleNs = now + watch->periodNs;
+	}
+
+	return 1;
+}
+
+void WatchClose(Watch* watch)
+{
+	if (watch->output != NULL) fclose(watch->output);
+	watch->output = NULL;
+	free(watch->buffer);
+	watch->buffer = NULL;
+}
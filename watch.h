@@ -0,0 +1,68 @@
+/*
+ * watch.h
+ *
+ * Live-watch sampler: reads a list of target variables at a fixed rate while the trace
+ * is captured. Nearby variables are merged into as few memory reads as possible.
+ *
+ * Binary output (little endian):
+ *   header:      "STWV", u32 variable count,
+ *                per variable: u32 address, u32 size, u8 name length, name
+ *   per sample:  u64 time (ns, CLOCK_MONOTONIC), the variable values in header order
+ * CSV output is used when the output file name ends in .csv; a variable spec ending in :s is
+ * printed there as a signed number. A sample with a failed memory
+ * read is not written.
+ */
+
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include "elf-symbols.h"
+
+#define WATCH_MAX_VARIABLES     256
+#define WATCH_NAME_LENGTH       48
+// variables closer than this are read together
+#define WATCH_MERGE_GAP         64
+// seconds between rate reports
+#define WATCH_REPORT_INTERVAL   5
+
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	int isSigned;		// 1, 2 and 4 byte values are written to CSV as signed numbers
+	char name[WATCH_NAME_LENGTH];
+	int read;			// merged read the value comes from
+	uint32_t offset;	// offset of the value in the read buffer
+} WatchVariable;
+
+typedef struct {
+	uint32_t address;
+	uint32_t length;
+	uint32_t bufferOffset;
+} WatchRead;
+
+typedef struct {
+	WatchVariable variables[WATCH_MAX_VARIABLES];
+	int variableCount;
+	WatchRead reads[WATCH_MAX_VARIABLES];
+	int readCount;
+	unsigned char* buffer;
+	uint32_t bufferSize;
+	FILE* output;
+	int csv;
+	unsigned long long periodNs;
+	unsigned long long nextSampleNs;
+	unsigned long long reportNs;
+	double requestedRate;
+	unsigned long samples;		// since the last report
+	unsigned long missed;
+	unsigned long failed;		// samples not written as a read failed
+} Watch;
+
+int WatchAdd(Watch* watch, const char* spec, ElfFile* elf);
+int WatchOpen(Watch* watch, const char* filename, double rate);
+int WatchService(Watch* watch);
+void WatchClose(Watch* watch);
+
+#endif /* WATCH_H_ */